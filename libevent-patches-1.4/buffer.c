@@ -34,8 +34,9 @@
 #include <windows.h>
 #endif
 
-#ifdef HAVE_VASPRINTF
-/* If we have vasprintf, we need to define this before we include stdio.h. */
+#if defined(HAVE_VASPRINTF) || defined(HAVE_SPLICE)
+/* If we have vasprintf, we need to define this before we include stdio.h.
+ * splice() needs it as well. */
 #define _GNU_SOURCE
 #endif
 
@@ -44,13 +45,26 @@
 #ifdef HAVE_SYS_TIME_H
 #include <sys/time.h>
 #endif
+#include <sys/queue.h>
 
 #ifdef HAVE_SYS_IOCTL_H
 #include <sys/ioctl.h>
 #endif
 
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -64,14 +78,419 @@
 #include "event.h"
 #include "config.h"
 #include "evutil.h"
+#include "event-internal.h"
+#include "evbuffer-internal.h"
 #include "./log.h"
 
+#ifndef SIZE_MAX
+#define SIZE_MAX ((size_t)-1)
+#endif
+
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H) && \
+    defined(HAVE_PREAD)
+#define USE_SENDFILE
+#endif
+
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+#define USE_MMAP
+#endif
+
+/*
+ * Storage for evbuffers and their segments comes from per-thread caches of
+ * free blocks, one list for each power of two from 64 bytes to 32K.  Larger
+ * blocks go straight to malloc.
+ */
+#define EVBUFFER_POOL_MIN_SHIFT	6
+#define EVBUFFER_POOL_MAX_SHIFT	15
+#define EVBUFFER_POOL_CLASSES \
+	(EVBUFFER_POOL_MAX_SHIFT - EVBUFFER_POOL_MIN_SHIFT + 1)
+#define EVBUFFER_POOL_SIZE(idx)	((size_t)1 << ((idx) + EVBUFFER_POOL_MIN_SHIFT))
+#define EVBUFFER_POOL_LARGEST	EVBUFFER_POOL_SIZE(EVBUFFER_POOL_CLASSES - 1)
+
+struct evbuffer_pool {
+	void *free_list[EVBUFFER_POOL_CLASSES];
+	struct evbuffer_pool_stats stats;
+};
+
+/* the largest block that is cached, and how much each thread may keep */
+static size_t evbuffer_pool_max_size = EVBUFFER_POOL_LARGEST;
+static size_t evbuffer_pool_max_cached = 1024 * 1024;
+
+static void
+evbuffer_pool_release(struct evbuffer_pool *pool)
+{
+	void *p;
+	int idx;
+
+	for (idx = 0; idx < EVBUFFER_POOL_CLASSES; ++idx) {
+		while ((p = pool->free_list[idx]) != NULL) {
+			pool->free_list[idx] = *(void **)p;
+			free(p);
+		}
+	}
+	pool->stats.cached = 0;
+	pool->stats.cached_bytes = 0;
+}
+
+#ifdef HAVE_PTHREADS
+static pthread_key_t evbuffer_pool_key;
+static pthread_once_t evbuffer_pool_once = PTHREAD_ONCE_INIT;
+static int evbuffer_pool_key_ok;
+
+/* gives back the cache of a thread that exits */
+static void
+evbuffer_pool_destroy(void *arg)
+{
+	evbuffer_pool_release(arg);
+	free(arg);
+}
+
+static void
+evbuffer_pool_key_init(void)
+{
+	if (pthread_key_create(&evbuffer_pool_key, evbuffer_pool_destroy) == 0)
+		evbuffer_pool_key_ok = 1;
+}
+
+static struct evbuffer_pool *
+evbuffer_pool_get(void)
+{
+	struct evbuffer_pool *pool;
+
+	pthread_once(&evbuffer_pool_once, evbuffer_pool_key_init);
+	if (!evbuffer_pool_key_ok)
+		return (NULL);
+	if ((pool = pthread_getspecific(evbuffer_pool_key)) == NULL) {
+		if ((pool = calloc(1, sizeof(*pool))) == NULL)
+			return (NULL);
+		if (pthread_setspecific(evbuffer_pool_key, pool) != 0) {
+			free(pool);
+			return (NULL);
+		}
+	}
+
+	return (pool);
+}
+#else
+static struct evbuffer_pool evbuffer_pool_global;
+#define evbuffer_pool_get()	(&evbuffer_pool_global)
+#endif
+
+static int
+evbuffer_pool_class(size_t size)
+{
+	int idx = 0;
+
+	while (EVBUFFER_POOL_SIZE(idx) < size)
+		++idx;
+	return (idx);
+}
+
+static void *
+evbuffer_pool_alloc(size_t size)
+{
+	struct evbuffer_pool *pool;
+	void *p;
+	int idx;
+
+	if (size > EVBUFFER_POOL_LARGEST)
+		return (malloc(size));
+
+	/* blocks are always of their class size, cached or not */
+	idx = evbuffer_pool_class(size);
+	if ((pool = evbuffer_pool_get()) == NULL)
+		return (malloc(EVBUFFER_POOL_SIZE(idx)));
+
+	pool->stats.allocs++;
+	if ((p = pool->free_list[idx]) != NULL) {
+		pool->free_list[idx] = *(void **)p;
+		pool->stats.hits++;
+		pool->stats.cached--;
+		pool->stats.cached_bytes -= EVBUFFER_POOL_SIZE(idx);
+		return (p);
+	}
+
+	return (malloc(EVBUFFER_POOL_SIZE(idx)));
+}
+
+/* size must be what was passed to evbuffer_pool_alloc() */
+static void
+evbuffer_pool_free(void *p, size_t size)
+{
+	struct evbuffer_pool *pool;
+	int idx;
+
+	if (size > EVBUFFER_POOL_LARGEST ||
+	    (pool = evbuffer_pool_get()) == NULL) {
+		free(p);
+		return;
+	}
+
+	idx = evbuffer_pool_class(size);
+	pool->stats.frees++;
+	if (EVBUFFER_POOL_SIZE(idx) > evbuffer_pool_max_size ||
+	    pool->stats.cached_bytes + EVBUFFER_POOL_SIZE(idx) >
+	    evbuffer_pool_max_cached) {
+		free(p);
+		return;
+	}
+
+	*(void **)p = pool->free_list[idx];
+	pool->free_list[idx] = p;
+	pool->stats.cached++;
+	pool->stats.cached_bytes += EVBUFFER_POOL_SIZE(idx);
+}
+
+void
+evbuffer_pool_set_limits(size_t max_size, size_t max_cached)
+{
+	evbuffer_pool_max_size = max_size;
+	evbuffer_pool_max_cached = max_cached;
+}
+
+void
+evbuffer_pool_get_stats(struct evbuffer_pool_stats *stats)
+{
+	struct evbuffer_pool *pool = evbuffer_pool_get();
+
+	if (pool != NULL)
+		*stats = pool->stats;
+	else
+		memset(stats, 0, sizeof(*stats));
+}
+
+void
+evbuffer_pool_flush(void)
+{
+	struct evbuffer_pool *pool = evbuffer_pool_get();
+
+	if (pool != NULL)
+		evbuffer_pool_release(pool);
+}
+
+/* How much was allocated for a segment, for giving it back. */
+static size_t
+evbuffer_chain_alloc_size(struct evbuffer_chain *chain)
+{
+	if (chain->flags & EVBUFFER_CHAIN_REFERENCE)
+		return (EVBUFFER_CHAIN_SIZE +
+		    sizeof(struct evbuffer_chain_reference));
+	if (chain->flags & EVBUFFER_CHAIN_SENDFILE)
+		return (EVBUFFER_CHAIN_SIZE + sizeof(struct evbuffer_chain_fd));
+	if (chain->flags & EVBUFFER_CHAIN_MMAP)
+		return (EVBUFFER_CHAIN_SIZE +
+		    sizeof(struct evbuffer_chain_mmap));
+	return (EVBUFFER_CHAIN_SIZE + chain->buffer_len);
+}
+
+/* A segment without data of its own, followed by extra bytes. */
+static struct evbuffer_chain *
+evbuffer_chain_new_extra(size_t extra)
+{
+	struct evbuffer_chain *chain;
+
+	if ((chain = evbuffer_pool_alloc(EVBUFFER_CHAIN_SIZE + extra)) == NULL)
+		return (NULL);
+	memset(chain, 0, EVBUFFER_CHAIN_SIZE + extra);
+
+	return (chain);
+}
+
+static struct evbuffer_chain *
+evbuffer_chain_new(size_t size)
+{
+	struct evbuffer_chain *chain;
+	size_t to_alloc;
+
+	if (size > SIZE_MAX - EVBUFFER_CHAIN_SIZE)
+		return (NULL);
+	size += EVBUFFER_CHAIN_SIZE;
+
+	/* rounding up keeps the number of different block sizes small */
+	to_alloc = EVBUFFER_CHAIN_MIN;
+	if (size < SIZE_MAX / 2) {
+		while (to_alloc < size)
+			to_alloc <<= 1;
+	} else {
+		to_alloc = size;
+	}
+
+	if ((chain = evbuffer_pool_alloc(to_alloc)) == NULL)
+		return (NULL);
+
+	memset(chain, 0, EVBUFFER_CHAIN_SIZE);
+	chain->buffer_len = to_alloc - EVBUFFER_CHAIN_SIZE;
+	chain->buffer = (u_char *)(chain + 1);
+
+	return (chain);
+}
+
+/* Gives a segment and whatever it points at back. */
+static void
+evbuffer_chain_release(struct evbuffer_chain *chain)
+{
+	struct evbuffer_chain_reference *ref;
+	size_t size = evbuffer_chain_alloc_size(chain);
+
+	if (chain->flags & EVBUFFER_CHAIN_REFERENCE) {
+		ref = EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_reference,
+		    chain);
+		if (ref->cleanupfn != NULL)
+			(*ref->cleanupfn)(chain->buffer, chain->buffer_len,
+			    ref->extra);
+	}
+#ifdef USE_SENDFILE
+	if (chain->flags & EVBUFFER_CHAIN_SENDFILE)
+		close(EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_fd, chain)->fd);
+#endif
+#ifdef USE_MMAP
+	if (chain->flags & EVBUFFER_CHAIN_MMAP) {
+		struct evbuffer_chain_mmap *map =
+		    EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_mmap, chain);
+		munmap(map->addr, map->len);
+	}
+#endif
+	evbuffer_pool_free(chain, size);
+}
+
+static void
+evbuffer_chain_free(struct evbuffer *buf, struct evbuffer_chain *chain)
+{
+	buf->totallen -= chain->buffer_len;
+	/* the kernel still points into it */
+	if (chain->pinned) {
+		chain->flags |= EVBUFFER_CHAIN_DANGLING;
+		return;
+	}
+	evbuffer_chain_release(chain);
+}
+
+/* Copies the first len bytes of a segment, which may be in a file. */
+static int
+evbuffer_chain_copyout(struct evbuffer_chain *chain, void *data, size_t len)
+{
+#ifdef USE_SENDFILE
+	struct evbuffer_chain_fd *info;
+	off_t pos;
+	ssize_t n;
+
+	if (chain->flags & EVBUFFER_CHAIN_SENDFILE) {
+		info = EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_fd, chain);
+		pos = info->offset + chain->misalign;
+		while (len) {
+			n = pread(info->fd, data, len, pos);
+			if (n == -1 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return (-1);
+			data = (u_char *)data + n;
+			pos += n;
+			len -= n;
+		}
+		return (0);
+	}
+#endif
+	memcpy(data, EVBUFFER_CHAIN_DATA(chain), len);
+	return (0);
+}
+
+/* Appends a segment; an empty buffer gives up the segment it kept. */
+static void
+evbuffer_chain_insert(struct evbuffer *buf, struct evbuffer_chain *chain)
+{
+	if (buf->first != NULL && buf->off == 0 && buf->first == buf->last) {
+		evbuffer_chain_free(buf, buf->first);
+		buf->first = buf->last = NULL;
+	}
+
+	if (buf->first == NULL)
+		buf->first = chain;
+	else
+		buf->last->next = chain;
+	buf->last = chain;
+	buf->totallen += chain->buffer_len;
+}
+
+/* The size of the next segment for datlen bytes of new data. */
+static size_t
+evbuffer_chain_grow(struct evbuffer *buf, size_t datlen)
+{
+	size_t size = 0;
+
+	if (buf->last != NULL) {
+		size = buf->last->buffer_len << 1;
+		if (size > EVBUFFER_CHAIN_MAX_AUTO)
+			size = EVBUFFER_CHAIN_MAX_AUTO;
+	}
+
+	return (datlen > size ? datlen : size);
+}
+
+/* Accounts for a change in the length of a buffer and tells its owner. */
+static void
+evbuffer_changed(struct evbuffer *buf, size_t oldoff)
+{
+	if (buf->off == oldoff)
+		return;
+	if (buf->budget != NULL)
+		evbuffer_budget_charge(buf->budget, oldoff, buf->off);
+	if (buf->cb != NULL)
+		(*buf->cb)(buf, oldoff, buf->off, buf->cbarg);
+}
+
+void
+evbuffer_chain_pin(struct evbuffer_chain *chain)
+{
+	++chain->pinned;
+}
+
+void
+evbuffer_chain_unpin(struct evbuffer_chain *chain)
+{
+	if (--chain->pinned == 0 && (chain->flags & EVBUFFER_CHAIN_DANGLING))
+		evbuffer_chain_release(chain);
+}
+
+/* A segment that belongs to no buffer: the last unpin frees it. */
+struct evbuffer_chain *
+evbuffer_chain_reserve(size_t size)
+{
+	struct evbuffer_chain *chain;
+
+	if ((chain = evbuffer_chain_new(size)) != NULL) {
+		chain->flags |= EVBUFFER_CHAIN_DANGLING;
+		chain->pinned = 1;
+	}
+
+	return (chain);
+}
+
+/* Appends a reserved segment with len bytes of data, or frees it. */
+void
+evbuffer_chain_commit(struct evbuffer *buf, struct evbuffer_chain *chain,
+    size_t len)
+{
+	size_t oldoff = buf->off;
+
+	if (len != 0) {
+		chain->flags &= ~EVBUFFER_CHAIN_DANGLING;
+		chain->off = len;
+		evbuffer_chain_insert(buf, chain);
+		buf->off += len;
+	}
+	evbuffer_chain_unpin(chain);
+
+	evbuffer_changed(buf, oldoff);
+}
+
 struct evbuffer *
 evbuffer_new(void)
 {
 	struct evbuffer *buffer;
 	
-	buffer = calloc(1, sizeof(struct evbuffer));
+	buffer = evbuffer_pool_alloc(sizeof(struct evbuffer));
+	if (buffer != NULL)
+		memset(buffer, 0, sizeof(struct evbuffer));
 
 	return (buffer);
 }
@@ -79,64 +498,150 @@ evbuffer_new(void)
 void
 evbuffer_free(struct evbuffer *buffer)
 {
-	if (buffer->orig_buffer != NULL)
-		free(buffer->orig_buffer);
-	free(buffer);
+	struct evbuffer_chain *chain, *next;
+
+	/* requests in flight let go of the buffer; their callbacks do not run */
+	if (buffer->io_pending)
+		event_base_buffer_cancel(buffer->io_base, buffer, 1);
+	if (buffer->budget != NULL)
+		evbuffer_budget_charge(buffer->budget, buffer->off, 0);
+	for (chain = buffer->first; chain != NULL; chain = next) {
+		next = chain->next;
+		evbuffer_chain_free(buffer, chain);
+	}
+	evbuffer_pool_free(buffer, sizeof(struct evbuffer));
 }
 
 /* 
  * This is a destructive add.  The data from one buffer moves into
- * the other buffer.
+ * the other buffer.  Only the segments move; the data is not copied.
  */
 
-#define SWAP(x,y) do { \
-	(x)->buffer = (y)->buffer; \
-	(x)->orig_buffer = (y)->orig_buffer; \
-	(x)->misalign = (y)->misalign; \
-	(x)->totallen = (y)->totallen; \
-	(x)->off = (y)->off; \
-} while (0)
-
 int
 evbuffer_add_buffer(struct evbuffer *outbuf, struct evbuffer *inbuf)
 {
-	int res;
+	struct evbuffer_chain *chain, *next;
+	size_t in_total = inbuf->off, out_total = outbuf->off;
 
-	/* Short cut for better performance */
-	if (outbuf->off == 0) {
-		struct evbuffer tmp;
-		size_t oldoff = inbuf->off;
+	if (in_total == 0)
+		return (0);
 
-		/* Swap them directly */
-		SWAP(&tmp, outbuf);
-		SWAP(outbuf, inbuf);
-		SWAP(inbuf, &tmp);
+	if (out_total == 0) {
+		/* outbuf only holds empty segments; drop them */
+		for (chain = outbuf->first; chain != NULL; chain = next) {
+			next = chain->next;
+			evbuffer_chain_free(outbuf, chain);
+		}
+		outbuf->first = inbuf->first;
+	} else {
+		outbuf->last->next = inbuf->first;
+	}
+	outbuf->last = inbuf->last;
+	outbuf->totallen += inbuf->totallen;
+	outbuf->off += in_total;
 
-		/* 
-		 * Optimization comes with a price; we need to notify the
-		 * buffer if necessary of the changes. oldoff is the amount
-		 * of data that we transfered from inbuf to outbuf
-		 */
-		if (inbuf->off != oldoff && inbuf->cb != NULL)
-			(*inbuf->cb)(inbuf, oldoff, inbuf->off, inbuf->cbarg);
-		if (oldoff && outbuf->cb != NULL)
-			(*outbuf->cb)(outbuf, 0, oldoff, outbuf->cbarg);
-		
+	inbuf->first = inbuf->last = NULL;
+	inbuf->totallen = 0;
+	inbuf->off = 0;
+	inbuf->eol_scanned = 0;
+
+	evbuffer_changed(inbuf, in_total);
+	evbuffer_changed(outbuf, out_total);
+
+	return (0);
+}
+
+int
+evbuffer_remove_buffer(struct evbuffer *src, struct evbuffer *dst,
+    size_t datlen)
+{
+	struct evbuffer_chain *chain, *tmp, *previous = NULL, *tail = NULL;
+	size_t nread = 0, moved_len = 0, rest;
+	size_t src_old = src->off, dst_old = dst->off;
+
+	if (datlen >= src->off) {
+		datlen = src->off;
+		if (evbuffer_add_buffer(dst, src) == -1)
+			return (-1);
+		return (datlen);
+	}
+	if (datlen == 0)
 		return (0);
+
+	/* hand over the segments that fit completely */
+	for (chain = src->first; chain->off <= datlen - nread;
+	     chain = chain->next) {
+		nread += chain->off;
+		moved_len += chain->buffer_len;
+		previous = chain;
 	}
 
-	res = evbuffer_add(outbuf, inbuf->buffer, inbuf->off);
-	if (res == 0) {
-		/* We drain the input buffer on success */
-		evbuffer_drain(inbuf, inbuf->off);
+	/*
+	 * Copy what we need from the next one before anything moves, so that
+	 * a failed allocation or file read leaves both buffers alone.
+	 */
+	rest = datlen - nread;
+	if (rest && previous == NULL) {
+		/* no segment moves; the bytes go at the end of dst */
+		if (evbuffer_expand(dst, rest) == -1 ||
+		    evbuffer_chain_copyout(chain, EVBUFFER_CHAIN_DATA(dst->last) +
+			dst->last->off, rest) == -1)
+			return (-1);
+		dst->last->off += rest;
+	} else if (rest) {
+		/* they follow the segments that move */
+		if ((tail = evbuffer_chain_new(rest)) == NULL)
+			return (-1);
+		if (evbuffer_chain_copyout(chain, tail->buffer, rest) == -1) {
+			evbuffer_chain_release(tail);
+			return (-1);
+		}
+		tail->off = rest;
 	}
 
-	return (res);
+	if (previous != NULL) {
+		if (dst->off == 0) {
+			/* dst only holds empty segments; drop them */
+			while ((tmp = dst->first) != NULL) {
+				dst->first = tmp->next;
+				evbuffer_chain_free(dst, tmp);
+			}
+			dst->first = src->first;
+		} else {
+			dst->last->next = src->first;
+		}
+		dst->last = previous;
+		src->first = previous->next;
+		previous->next = NULL;
+
+		src->totallen -= moved_len;
+		dst->totallen += moved_len;
+		src->off -= nread;
+		dst->off += nread;
+	}
+
+	if (tail != NULL)
+		evbuffer_chain_insert(dst, tail);
+	if (rest) {
+		dst->off += rest;
+		chain->misalign += rest;
+		chain->off -= rest;
+		src->off -= rest;
+	}
+
+	src->eol_scanned = src->eol_scanned > src_old - src->off ?
+	    src->eol_scanned - (src_old - src->off) : 0;
+
+	evbuffer_changed(src, src_old);
+	evbuffer_changed(dst, dst_old);
+
+	return (datlen);
 }
 
 int
 evbuffer_add_vprintf(struct evbuffer *buf, const char *fmt, va_list ap)
 {
+	struct evbuffer_chain *chain;
 	char *buffer;
 	size_t space;
 	size_t oldoff = buf->off;
@@ -147,10 +652,9 @@ evbuffer_add_vprintf(struct evbuffer *buf, const char *fmt, va_list ap)
 	if (evbuffer_expand(buf, 64) < 0)
 		return (-1);
 	for (;;) {
-		size_t used = buf->misalign + buf->off;
-		buffer = (char *)buf->buffer + buf->off;
-		assert(buf->totallen >= used);
-		space = buf->totallen - used;
+		chain = buf->last;
+		buffer = (char *)EVBUFFER_CHAIN_DATA(chain) + chain->off;
+		space = EVBUFFER_CHAIN_SPACE(chain);
 
 #ifndef va_copy
 #define	va_copy(dst, src)	memcpy(&(dst), &(src), sizeof(va_list))
@@ -164,9 +668,9 @@ evbuffer_add_vprintf(struct evbuffer *buf, const char *fmt, va_list ap)
 		if (sz < 0)
 			return (-1);
 		if ((size_t)sz < space) {
+			chain->off += sz;
 			buf->off += sz;
-			if (buf->cb != NULL)
-				(*buf->cb)(buf, oldoff, buf->off, buf->cbarg);
+			evbuffer_changed(buf, oldoff);
 			return (sz);
 		}
 		if (evbuffer_expand(buf, sz + 1) == -1)
@@ -189,6 +693,25 @@ evbuffer_add_printf(struct evbuffer *buf, const char *fmt, ...)
 	return (res);
 }
 
+/* Copies the first datlen bytes out of the segments without draining. */
+static int
+evbuffer_copyout(struct evbuffer *buf, void *data, size_t datlen)
+{
+	struct evbuffer_chain *chain;
+	u_char *p = data;
+	size_t n;
+
+	for (chain = buf->first; datlen; chain = chain->next) {
+		n = chain->off < datlen ? chain->off : datlen;
+		if (evbuffer_chain_copyout(chain, p, n) == -1)
+			return (-1);
+		p += n;
+		datlen -= n;
+	}
+
+	return (0);
+}
+
 /* Reads data from an event buffer and drains the bytes read */
 
 int
@@ -198,12 +721,241 @@ evbuffer_remove(struct evbuffer *buf, void *data, size_t datlen)
 	if (nread >= buf->off)
 		nread = buf->off;
 
-	memcpy(data, buf->buffer, nread);
+	if (evbuffer_copyout(buf, data, nread) == -1)
+		return (-1);
 	evbuffer_drain(buf, nread);
 	
 	return (nread);
 }
 
+u_char *
+evbuffer_pullup(struct evbuffer *buf, int size)
+{
+	struct evbuffer_chain *chain, *next, *tmp;
+	size_t len = size < 0 ? buf->off : (size_t)size;
+	size_t remaining, n;
+
+	if ((chain = buf->first) == NULL || len > buf->off)
+		return (NULL);
+	if (chain->off >= len && !(chain->flags & EVBUFFER_CHAIN_SENDFILE))
+		return (EVBUFFER_CHAIN_DATA(chain));
+
+	if (!(chain->flags & EVBUFFER_CHAIN_IMMUTABLE) &&
+	    chain->buffer_len - chain->misalign >= len) {
+		/* the first segment has room for the rest */
+		tmp = chain;
+		chain = chain->next;
+	} else {
+		if ((tmp = evbuffer_chain_new(len)) == NULL)
+			return (NULL);
+		buf->totallen += tmp->buffer_len;
+	}
+
+	for (remaining = len - tmp->off; remaining; chain = next) {
+		next = chain->next;
+		n = chain->off > remaining ? remaining : chain->off;
+		if (evbuffer_chain_copyout(chain,
+			EVBUFFER_CHAIN_DATA(tmp) + tmp->off, n) == -1)
+			break;
+		tmp->off += n;
+		remaining -= n;
+		if (n < chain->off) {
+			chain->misalign += n;
+			chain->off -= n;
+			break;
+		}
+		evbuffer_chain_free(buf, chain);
+	}
+
+	buf->first = tmp;
+	tmp->next = chain;
+	if (chain == NULL)
+		buf->last = tmp;
+
+	/* a file that could not be read; what we copied stays in front */
+	if (remaining)
+		return (NULL);
+
+	return (EVBUFFER_CHAIN_DATA(tmp));
+}
+
+/*
+ * Walks the data of a buffer one contiguous piece at a time, so that
+ * searches need not pull it up.  The bytes of a file are read into tmp.
+ */
+struct evbuffer_scan {
+	struct evbuffer_chain *chain;
+	size_t pos;			/* of the piece in the segment */
+	size_t off;			/* of the piece in the buffer */
+	const u_char *data;
+	size_t len;
+#ifdef USE_SENDFILE
+	u_char tmp[4096];
+#endif
+};
+
+/* Loads the piece at pos, skipping the segments that pos is past. */
+static int
+evbuffer_scan_load(struct evbuffer_scan *scan)
+{
+	struct evbuffer_chain *chain;
+
+	while ((chain = scan->chain) != NULL && scan->pos >= chain->off) {
+		scan->pos -= chain->off;
+		scan->chain = chain->next;
+	}
+	if (chain == NULL)
+		return (-1);
+
+	scan->len = chain->off - scan->pos;
+#ifdef USE_SENDFILE
+	if (chain->flags & EVBUFFER_CHAIN_SENDFILE) {
+		struct evbuffer_chain_fd *info =
+		    EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_fd, chain);
+		ssize_t n;
+
+		if (scan->len > sizeof(scan->tmp))
+			scan->len = sizeof(scan->tmp);
+		do {
+			n = pread(info->fd, scan->tmp, scan->len,
+			    info->offset + chain->misalign + scan->pos);
+		} while (n == -1 && errno == EINTR);
+		if (n <= 0)
+			return (-1);
+		scan->len = n;
+		scan->data = scan->tmp;
+		return (0);
+	}
+#endif
+	scan->data = EVBUFFER_CHAIN_DATA(chain) + scan->pos;
+	return (0);
+}
+
+/* Starts at byte pos of chain, which is byte off of the buffer. */
+static int
+evbuffer_scan_start(struct evbuffer_scan *scan, struct evbuffer_chain *chain,
+    size_t pos, size_t off)
+{
+	scan->chain = chain;
+	scan->pos = pos;
+	scan->off = off;
+	return (evbuffer_scan_load(scan));
+}
+
+static int
+evbuffer_scan_next(struct evbuffer_scan *scan)
+{
+	scan->pos += scan->len;
+	scan->off += scan->len;
+	return (evbuffer_scan_load(scan));
+}
+
+/*
+ * Finds the first EOL at or after start, and sets *eol_len to its length.
+ * If there is none, sets *resume to where a later search has to start
+ * again once more data has arrived.  An EOL may be split between pieces.
+ */
+static ssize_t
+evbuffer_find_eol(struct evbuffer *buffer, size_t start,
+    enum evbuffer_eol_style eol_style, size_t *eol_len, size_t *resume)
+{
+	struct evbuffer_scan scan;
+	const u_char *p, *q, *eol;
+	size_t n, pos;
+	int prev = -1;
+
+	*resume = start;
+	if (start >= buffer->off)
+		return (-1);
+	/* the CR of a CRLF may be before start */
+	if (eol_style == EVBUFFER_EOL_CRLF && start > 0 &&
+	    evbuffer_scan_start(&scan, buffer->first, start - 1,
+		start - 1) == 0)
+		prev = *scan.data;
+	if (evbuffer_scan_start(&scan, buffer->first, start, start) == -1)
+		return (-1);
+
+	do {
+		p = scan.data;
+		switch (eol_style) {
+		case EVBUFFER_EOL_ANY:
+			if ((eol = evsearch_chr2(p, scan.len, '\r', '\n')) == NULL)
+				break;
+			/* the run of CRs and LFs may go on in the next pieces */
+			*eol_len = 0;
+			n = eol - p;
+			pos = scan.off + n;
+			do {
+				for (q = scan.data + n; q < scan.data + scan.len;
+				     q++) {
+					if (*q != '\r' && *q != '\n')
+						break;
+				}
+				*eol_len += q - (scan.data + n);
+				n = 0;
+			} while (q == scan.data + scan.len &&
+			    evbuffer_scan_next(&scan) == 0);
+			return (pos);
+		case EVBUFFER_EOL_CRLF:
+			if ((eol = memchr(p, '\n', scan.len)) == NULL)
+				break;
+			if ((eol > p ? eol[-1] : prev) == '\r') {
+				*eol_len = 2;
+				return (scan.off + (eol - p) - 1);
+			}
+			*eol_len = 1;
+			return (scan.off + (eol - p));
+		case EVBUFFER_EOL_CRLF_STRICT:
+			if (prev == '\r' && *p == '\n') {
+				*eol_len = 2;
+				return (scan.off - 1);
+			}
+			if ((eol = evsearch_pair(p, scan.len, '\r', '\n')) == NULL)
+				break;
+			*eol_len = 2;
+			return (scan.off + (eol - p));
+		case EVBUFFER_EOL_LF:
+			if ((eol = memchr(p, '\n', scan.len)) == NULL)
+				break;
+			*eol_len = 1;
+			return (scan.off + (eol - p));
+		default:
+			return (-1);
+		}
+		prev = p[scan.len - 1];
+		*resume = scan.off + scan.len;
+	} while (evbuffer_scan_next(&scan) == 0);
+
+	/* the last byte may be the CR of a CRLF */
+	if (eol_style == EVBUFFER_EOL_CRLF_STRICT && *resume > start)
+		--*resume;
+	return (-1);
+}
+
+/*
+ * Looks for an EOL, starting where the last unsuccessful search with the
+ * same style stopped, so that a line that arrives in many pieces is only
+ * scanned once.  Returns its offset, or -1.
+ */
+static ssize_t
+evbuffer_next_eol(struct evbuffer *buffer, enum evbuffer_eol_style eol_style,
+    size_t *eol_len)
+{
+	size_t start = 0, resume;
+	ssize_t eol;
+
+	if (buffer->eol_style == (int)eol_style)
+		start = buffer->eol_scanned;
+
+	eol = evbuffer_find_eol(buffer, start, eol_style, eol_len, &resume);
+	if (eol == -1) {
+		buffer->eol_style = eol_style;
+		buffer->eol_scanned = resume;
+	}
+
+	return (eol);
+}
+
 /*
  * Reads a line terminated by either '\r\n', '\n\r' or '\r' or '\n'.
  * The returned buffer needs to be freed by the called.
@@ -212,38 +964,35 @@ evbuffer_remove(struct evbuffer *buf, void *data, size_t datlen)
 char *
 evbuffer_readline(struct evbuffer *buffer)
 {
-	u_char *data = EVBUFFER_DATA(buffer);
-	size_t len = EVBUFFER_LENGTH(buffer);
+	ssize_t eol;
+	size_t eol_len, n;
 	char *line;
 	unsigned int i;
 
-	for (i = 0; i < len; i++) {
-		if (data[i] == '\r' || data[i] == '\n')
-			break;
-	}
-
-	if (i == len)
+	/* the same search as EVBUFFER_EOL_ANY */
+	if ((eol = evbuffer_next_eol(buffer, EVBUFFER_EOL_ANY, &eol_len)) == -1)
 		return (NULL);
+	i = eol;
 
-	if ((line = malloc(i + 1)) == NULL) {
+	if ((line = malloc(i + 2)) == NULL) {
 		fprintf(stderr, "%s: out of memory\n", __func__);
 		return (NULL);
 	}
 
-	memcpy(line, data, i);
-	line[i] = '\0';
+	/* the line and the one or two characters that end it */
+	n = eol_len > 1 ? 2 : 1;
+	if (evbuffer_copyout(buffer, line, i + n) == -1) {
+		free(line);
+		return (NULL);
+	}
 
 	/*
 	 * Some protocols terminate a line with '\r\n', so check for
 	 * that, too.
 	 */
-	if ( i < len - 1 ) {
-		char fch = data[i], sch = data[i+1];
-
-		/* Drain one more character if needed */
-		if ( (sch == '\r' || sch == '\n') && sch != fch )
-			i += 1;
-	}
+	if (n == 2 && line[i + 1] != line[i])
+		i += 1;
+	line[eol] = '\0';
 
 	evbuffer_drain(buffer, i + 1);
 
@@ -255,78 +1004,30 @@ char *
 evbuffer_readln(struct evbuffer *buffer, size_t *n_read_out,
 		enum evbuffer_eol_style eol_style)
 {
-	u_char *data = EVBUFFER_DATA(buffer);
-	u_char *start_of_eol, *end_of_eol;
-	size_t len = EVBUFFER_LENGTH(buffer);
+	ssize_t eol;
+	size_t eol_len;
 	char *line;
-	unsigned int i, n_to_copy, n_to_drain;
+	unsigned int n_to_copy, n_to_drain;
 
 	if (n_read_out)
 		*n_read_out = 0;
 
-	/* depending on eol_style, set start_of_eol to the first character
-	 * in the newline, and end_of_eol to one after the last character. */
-	switch (eol_style) {
-	case EVBUFFER_EOL_ANY:
-		for (i = 0; i < len; i++) {
-			if (data[i] == '\r' || data[i] == '\n')
-				break;
-		}
-		if (i == len)
-			return (NULL);
-		start_of_eol = data+i;
-		++i;
-		for ( ; i < len; i++) {
-			if (data[i] != '\r' && data[i] != '\n')
-				break;
-		}
-		end_of_eol = data+i;
-		break;
-	case EVBUFFER_EOL_CRLF:
-		end_of_eol = memchr(data, '\n', len);
-		if (!end_of_eol)
-			return (NULL);
-		if (end_of_eol > data && *(end_of_eol-1) == '\r')
-			start_of_eol = end_of_eol - 1;
-		else
-			start_of_eol = end_of_eol;
-		end_of_eol++; /*point to one after the LF. */
-		break;
-	case EVBUFFER_EOL_CRLF_STRICT: {
-		u_char *cp = data;
-		while ((cp = memchr(cp, '\r', len-(cp-data)))) {
-			if (cp < data+len-1 && *(cp+1) == '\n')
-				break;
-			if (++cp >= data+len) {
-				cp = NULL;
-				break;
-			}
-		}
-		if (!cp)
-			return (NULL);
-		start_of_eol = cp;
-		end_of_eol = cp+2;
-		break;
-	}
-	case EVBUFFER_EOL_LF:
-		start_of_eol = memchr(data, '\n', len);
-		if (!start_of_eol)
-			return (NULL);
-		end_of_eol = start_of_eol + 1;
-		break;
-	default:
+	if ((eol = evbuffer_next_eol(buffer, eol_style, &eol_len)) == -1)
 		return (NULL);
-	}
 
-	n_to_copy = start_of_eol - data;
-	n_to_drain = end_of_eol - data;
+	n_to_copy = eol;
+	n_to_drain = n_to_copy + eol_len;
 
 	if ((line = malloc(n_to_copy+1)) == NULL) {
 		event_warn("%s: out of memory\n", __func__);
 		return (NULL);
 	}
 
-	memcpy(line, data, n_to_copy);
+	/* the line is copied from the segments, not pulled up first */
+	if (evbuffer_copyout(buffer, line, n_to_copy) == -1) {
+		free(line);
+		return (NULL);
+	}
 	line[n_to_copy] = '\0';
 
 	evbuffer_drain(buffer, n_to_drain);
@@ -336,66 +1037,102 @@ evbuffer_readln(struct evbuffer *buffer, size_t *n_read_out,
 	return (line);
 }
 
-/* Adds data to an event buffer */
+char *
+evbuffer_peekln(struct evbuffer *buffer, size_t *n_read_out,
+    size_t *eol_len_out, enum evbuffer_eol_style eol_style)
+{
+	ssize_t eol;
+	size_t eol_len;
+	u_char *data;
 
-static void
-evbuffer_align(struct evbuffer *buf)
+	if ((eol = evbuffer_next_eol(buffer, eol_style, &eol_len)) == -1)
+		return (NULL);
+	/* only the line and its EOL have to be contiguous */
+	if ((data = evbuffer_pullup(buffer, eol + eol_len)) == NULL)
+		return (NULL);
+
+	*n_read_out = eol;
+	if (eol_len_out != NULL)
+		*eol_len_out = eol_len;
+	return ((char *)data);
+}
+
+int
+evbuffer_search_eol(struct evbuffer *buffer, size_t *start,
+    size_t *eol_len_out, enum evbuffer_eol_style eol_style)
 {
-	memmove(buf->orig_buffer, buf->buffer, buf->off);
-	buf->buffer = buf->orig_buffer;
-	buf->misalign = 0;
+	size_t eol_len, resume;
+	ssize_t eol;
+
+	eol = evbuffer_find_eol(buffer, *start, eol_style, &eol_len, &resume);
+	if (eol == -1) {
+		*start = resume;
+		return (-1);
+	}
+	if (eol_len_out != NULL)
+		*eol_len_out = eol_len;
+
+	return (eol);
 }
 
-#ifndef SIZE_MAX
-#define SIZE_MAX ((size_t)-1)
-#endif
+/* Adds data to an event buffer */
 
-/* Expands the available space in the event buffer to at least datlen */
+/* Expands the available space at the end of the last segment to at least
+ * datlen contiguous bytes */
 
 int
 evbuffer_expand(struct evbuffer *buf, size_t datlen)
 {
-	size_t used = buf->misalign + buf->off;
-
-	assert(buf->totallen >= used);
+	struct evbuffer_chain *chain = buf->last;
 
 	/* If we can fit all the data, then we don't have to do anything */
-	if (buf->totallen - used >= datlen)
+	if (chain != NULL && EVBUFFER_CHAIN_SPACE(chain) >= datlen)
 		return (0);
 	/* If we would need to overflow to fit this much data, we can't
 	 * do anything. */
 	if (datlen > SIZE_MAX - buf->off)
 		return (-1);
 
-	/*
-	 * If the misalignment fulfills our data needs, we just force an
-	 * alignment to happen.  Afterwards, we have enough space.
-	 */
-	if (buf->totallen - buf->off >= datlen) {
-		evbuffer_align(buf);
-	} else {
-		void *newbuf;
-		size_t length = buf->totallen;
-		size_t need = buf->off + datlen;
-
-		if (length < 256)
-			length = 256;
-		if (need < SIZE_MAX / 2) {
-			while (length < need) {
-				length <<= 1;
-			}
-		} else {
-			length = need;
-		}
+	if ((chain = evbuffer_chain_new(evbuffer_chain_grow(buf, datlen)))
+	    == NULL)
+		return (-1);
+	evbuffer_chain_insert(buf, chain);
 
-		if (buf->orig_buffer != buf->buffer)
-			evbuffer_align(buf);
-		if ((newbuf = realloc(buf->buffer, length)) == NULL)
-			return (-1);
+	return (0);
+}
+
+/* Like evbuffer_add, but without telling anyone. */
+static int
+evbuffer_append(struct evbuffer *buf, const void *data, size_t datlen)
+{
+	struct evbuffer_chain *chain = buf->last, *tmp;
+	size_t space = 0;
+
+	if (chain != NULL) {
+		space = EVBUFFER_CHAIN_SPACE(chain);
+		if (space >= datlen) {
+			memcpy(EVBUFFER_CHAIN_DATA(chain) + chain->off,
+			    data, datlen);
+			chain->off += datlen;
+			buf->off += datlen;
+			return (0);
+		}
+	}
+	if (datlen > SIZE_MAX - buf->off)
+		return (-1);
 
-		buf->orig_buffer = buf->buffer = newbuf;
-		buf->totallen = length;
+	/* fill up the last segment and start a new one with the rest */
+	tmp = evbuffer_chain_new(evbuffer_chain_grow(buf, datlen - space));
+	if (tmp == NULL)
+		return (-1);
+	if (space) {
+		memcpy(EVBUFFER_CHAIN_DATA(chain) + chain->off, data, space);
+		chain->off += space;
 	}
+	memcpy(tmp->buffer, (const u_char *)data + space, datlen - space);
+	tmp->off = datlen - space;
+	buf->off += datlen;
+	evbuffer_chain_insert(buf, tmp);
 
 	return (0);
 }
@@ -403,19 +1140,43 @@ evbuffer_expand(struct evbuffer *buf, size_t datlen)
 int
 evbuffer_add(struct evbuffer *buf, const void *data, size_t datlen)
 {
-	size_t used = buf->misalign + buf->off;
 	size_t oldoff = buf->off;
 
-	if (buf->totallen - used < datlen) {
-		if (evbuffer_expand(buf, datlen) == -1)
-			return (-1);
-	}
+	if (evbuffer_append(buf, data, datlen) == -1)
+		return (-1);
 
-	memcpy(buf->buffer + buf->off, data, datlen);
-	buf->off += datlen;
+	evbuffer_changed(buf, oldoff);
 
-	if (datlen && buf->cb != NULL)
-		(*buf->cb)(buf, oldoff, buf->off, buf->cbarg);
+	return (0);
+}
+
+int
+evbuffer_add_reference(struct evbuffer *outbuf, const void *data,
+    size_t datlen, evbuffer_ref_cleanup_cb cleanupfn, void *extra)
+{
+	struct evbuffer_chain *chain;
+	struct evbuffer_chain_reference *ref;
+	size_t oldoff = outbuf->off;
+
+	if (datlen > SIZE_MAX - outbuf->off)
+		return (-1);
+
+	/* only the header; the data stays where it is */
+	chain = evbuffer_chain_new_extra(sizeof(*ref));
+	if (chain == NULL)
+		return (-1);
+	chain->flags = EVBUFFER_CHAIN_REFERENCE | EVBUFFER_CHAIN_IMMUTABLE;
+	chain->buffer = (u_char *)data;
+	chain->buffer_len = datlen;
+	chain->off = datlen;
+	ref = EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_reference, chain);
+	ref->cleanupfn = cleanupfn;
+	ref->extra = extra;
+
+	evbuffer_chain_insert(outbuf, chain);
+	outbuf->off += datlen;
+
+	evbuffer_changed(outbuf, oldoff);
 
 	return (0);
 }
@@ -423,24 +1184,46 @@ evbuffer_add(struct evbuffer *buf, const void *data, size_t datlen)
 void
 evbuffer_drain(struct evbuffer *buf, size_t len)
 {
+	struct evbuffer_chain *chain, *next;
 	size_t oldoff = buf->off;
 
+	/* the offsets of earlier EOL searches move with the data */
+	buf->eol_scanned = buf->eol_scanned > len ? buf->eol_scanned - len : 0;
+
 	if (len >= buf->off) {
+		for (chain = buf->first; chain != buf->last; chain = next) {
+			next = chain->next;
+			evbuffer_chain_free(buf, chain);
+		}
+		/* keep a small last segment around for the next data, unless
+		 * a write in flight still sends from it */
+		if (chain != NULL &&
+		    (chain->buffer_len > EVBUFFER_CHAIN_MAX_AUTO ||
+		    (chain->flags & EVBUFFER_CHAIN_IMMUTABLE) ||
+		    chain->pinned)) {
+			evbuffer_chain_free(buf, chain);
+			chain = NULL;
+		}
+		buf->first = buf->last = chain;
+		if (chain != NULL)
+			chain->misalign = chain->off = 0;
 		buf->off = 0;
-		buf->buffer = buf->orig_buffer;
-		buf->misalign = 0;
 		goto done;
 	}
 
-	buf->buffer += len;
-	buf->misalign += len;
-
 	buf->off -= len;
+	for (chain = buf->first; len >= chain->off; chain = next) {
+		next = chain->next;
+		len -= chain->off;
+		evbuffer_chain_free(buf, chain);
+	}
+	buf->first = chain;
+	chain->misalign += len;
+	chain->off -= len;
 
  done:
 	/* Tell someone about changes in this buffer */
-	if (buf->off != oldoff && buf->cb != NULL)
-		(*buf->cb)(buf, oldoff, buf->off, buf->cbarg);
+	evbuffer_changed(buf, oldoff);
 
 }
 
@@ -453,6 +1236,7 @@ evbuffer_drain(struct evbuffer *buf, size_t len)
 int
 evbuffer_read(struct evbuffer *buf, int fd, int howmuch)
 {
+	struct evbuffer_chain *chain;
 	u_char *p;
 	size_t oldoff = buf->off;
 	int n = EVBUFFER_MAX_READ;
@@ -487,7 +1271,8 @@ evbuffer_read(struct evbuffer *buf, int fd, int howmuch)
 		return (-1);
 
 	/* We can append new data at this point */
-	p = buf->buffer + buf->off;
+	chain = buf->last;
+	p = EVBUFFER_CHAIN_DATA(chain) + chain->off;
 
 #ifndef WIN32
 	n = read(fd, p, howmuch);
@@ -499,25 +1284,225 @@ evbuffer_read(struct evbuffer *buf, int fd, int howmuch)
 	if (n == 0)
 		return (0);
 
+	chain->off += n;
 	buf->off += n;
 
 	/* Tell someone about changes in this buffer */
-	if (buf->off != oldoff && buf->cb != NULL)
-		(*buf->cb)(buf, oldoff, buf->off, buf->cbarg);
+	evbuffer_changed(buf, oldoff);
 
 	return (n);
 }
 
+/* the most segments that one evbuffer_write hands to the kernel */
+#define EVBUFFER_MAX_IOVEC	128
+
+#ifdef USE_SENDFILE
+/* the most bytes that one evbuffer_write sends from a file */
+#define EVBUFFER_MAX_SENDFILE	(1 << 30)
+
+static int
+evbuffer_write_file(struct evbuffer_chain *chain, int fd, size_t howmuch)
+{
+	struct evbuffer_chain_fd *info =
+	    EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_fd, chain);
+	size_t len = chain->off;
+	off_t offset = info->offset + chain->misalign;
+	ssize_t n;
+#ifdef HAVE_SPLICE
+	loff_t loffset = offset;
+#endif
+
+	if (len > howmuch)
+		len = howmuch;
+	if (len > EVBUFFER_MAX_SENDFILE)
+		len = EVBUFFER_MAX_SENDFILE;
+
+	n = sendfile(fd, info->fd, &offset, len);
+#ifdef HAVE_SPLICE
+	/* old kernels only sendfile to sockets; splice also feeds pipes */
+	if (n == -1 && errno == EINVAL)
+		n = splice(info->fd, &loffset, fd, NULL, len,
+		    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+#endif
+
+	return (n);
+}
+#endif
+
+int
+evbuffer_add_file(struct evbuffer *outbuf, int fd, off_t offset,
+    off_t length)
+{
+#ifdef USE_SENDFILE
+	struct evbuffer_chain *chain;
+	struct evbuffer_chain_fd *info;
+	size_t oldoff = outbuf->off;
+
+	if (offset < 0 || length < 0 || (off_t)(size_t)length != length ||
+	    (size_t)length > SIZE_MAX - outbuf->off)
+		return (-1);
+
+	chain = evbuffer_chain_new_extra(sizeof(*info));
+	if (chain == NULL)
+		return (-1);
+	chain->flags = EVBUFFER_CHAIN_SENDFILE | EVBUFFER_CHAIN_IMMUTABLE;
+	chain->buffer_len = length;
+	chain->off = length;
+	info = EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_fd, chain);
+	info->fd = fd;
+	info->offset = offset;
+
+	evbuffer_chain_insert(outbuf, chain);
+	outbuf->off += length;
+
+	evbuffer_changed(outbuf, oldoff);
+
+	return (0);
+#else
+	struct evbuffer *tmp;
+	struct evbuffer_chain *chain;
+	int n;
+
+	/* no sendfile; read the file into the buffer instead */
+	if (offset < 0 || length < 0 ||
+	    lseek(fd, offset, SEEK_SET) == (off_t)-1)
+		return (-1);
+	if ((tmp = evbuffer_new()) == NULL)
+		return (-1);
+
+	while (length) {
+		n = length > EVBUFFER_MAX_READ ? EVBUFFER_MAX_READ : length;
+		if (evbuffer_expand(tmp, n) == -1)
+			break;
+		chain = tmp->last;
+		n = read(fd, EVBUFFER_CHAIN_DATA(chain) + chain->off, n);
+		if (n <= 0)
+			break;
+		chain->off += n;
+		tmp->off += n;
+		length -= n;
+	}
+	if (length) {
+		evbuffer_free(tmp);
+		return (-1);
+	}
+
+	close(fd);
+	evbuffer_add_buffer(outbuf, tmp);
+	evbuffer_free(tmp);
+
+	return (0);
+#endif
+}
+
+int
+evbuffer_add_mmap(struct evbuffer *outbuf, int fd, off_t offset,
+    off_t length)
+{
+#ifdef USE_MMAP
+	struct evbuffer_chain *chain;
+	struct evbuffer_chain_mmap *map;
+	size_t oldoff = outbuf->off;
+	long pagesize = sysconf(_SC_PAGESIZE);
+	off_t start;
+	void *addr;
+
+	if (offset < 0 || length < 0 || pagesize <= 0 ||
+	    (off_t)(size_t)length != length ||
+	    (size_t)length > SIZE_MAX - outbuf->off - pagesize)
+		return (-1);
+	if (length == 0) {
+		close(fd);
+		return (0);
+	}
+
+	/* mappings start on a page boundary */
+	start = offset - offset % pagesize;
+	if ((chain = evbuffer_chain_new_extra(sizeof(*map))) == NULL)
+		return (-1);
+	map = EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_mmap, chain);
+	map->len = length + (offset - start);
+	addr = mmap(NULL, map->len, PROT_READ, MAP_PRIVATE, fd, start);
+	if (addr == MAP_FAILED) {
+		evbuffer_pool_free(chain, EVBUFFER_CHAIN_SIZE + sizeof(*map));
+		return (-1);
+	}
+	map->addr = addr;
+	chain->flags = EVBUFFER_CHAIN_MMAP | EVBUFFER_CHAIN_IMMUTABLE;
+	chain->buffer = (u_char *)addr + (offset - start);
+	chain->buffer_len = length;
+	chain->off = length;
+
+	/* the mapping does not need the descriptor */
+	close(fd);
+
+	evbuffer_chain_insert(outbuf, chain);
+	outbuf->off += length;
+
+	evbuffer_changed(outbuf, oldoff);
+
+	return (0);
+#else
+	return (evbuffer_add_file(outbuf, fd, offset, length));
+#endif
+}
+
 int
 evbuffer_write(struct evbuffer *buffer, int fd)
 {
+	return (evbuffer_write_atmost(buffer, fd, -1));
+}
+
+int
+evbuffer_write_atmost(struct evbuffer *buffer, int fd, int howmuch)
+{
+	struct evbuffer_chain *chain;
+	size_t len;
 	int n;
+#if defined(HAVE_WRITEV) && !defined(WIN32)
+	struct iovec iov[EVBUFFER_MAX_IOVEC];
+	int i = 0;
+#endif
+
+	/* a failed read may have left empty segments in front */
+	for (chain = buffer->first; chain != NULL && chain->off == 0;
+	     chain = chain->next)
+		;
+	if (chain == NULL || howmuch == 0)
+		return (0);
+	len = howmuch < 0 ? buffer->off : (size_t)howmuch;
 
+#ifdef USE_SENDFILE
+	if (chain->flags & EVBUFFER_CHAIN_SENDFILE)
+		n = evbuffer_write_file(chain, fd, len);
+	else
+#endif
+	{
+#if defined(HAVE_WRITEV) && !defined(WIN32)
+		/* gather the segments up to the next one in a file */
+		for (; chain != NULL && i < EVBUFFER_MAX_IOVEC && len != 0;
+		     chain = chain->next) {
+			if (chain->flags & EVBUFFER_CHAIN_SENDFILE)
+				break;
+			if (chain->off == 0)
+				continue;
+			iov[i].iov_base = EVBUFFER_CHAIN_DATA(chain);
+			iov[i].iov_len = chain->off < len ? chain->off : len;
+			len -= iov[i].iov_len;
+			++i;
+		}
+
+		n = writev(fd, iov, i);
+#else
+		if (len > chain->off)
+			len = chain->off;
 #ifndef WIN32
-	n = write(fd, buffer->buffer, buffer->off);
+		n = write(fd, EVBUFFER_CHAIN_DATA(chain), len);
 #else
-	n = send(fd, buffer->buffer, buffer->off, 0);
+		n = send(fd, EVBUFFER_CHAIN_DATA(chain), len, 0);
 #endif
+#endif
+	}
 	if (n == -1)
 		return (-1);
 	if (n == 0)
@@ -527,22 +1512,131 @@ evbuffer_write(struct evbuffer *buffer, int fd)
 	return (n);
 }
 
+int
+evbuffer_read_async(struct event_base *base, struct evbuffer *buf, int fd,
+    int howmuch, evbuffer_iocb cb, void *arg)
+{
+	return (event_base_buffer_io(base, EV_READ, buf, fd, howmuch,
+		cb, arg));
+}
+
+int
+evbuffer_write_async(struct event_base *base, struct evbuffer *buffer, int fd,
+    evbuffer_iocb cb, void *arg)
+{
+	if (buffer->off == 0)
+		return (-1);
+	return (event_base_buffer_io(base, EV_WRITE, buffer, fd, -1,
+		cb, arg));
+}
+
+void
+evbuffer_cancel_async(struct event_base *base, struct evbuffer *buffer)
+{
+	if (buffer->io_pending)
+		event_base_buffer_cancel(base, buffer, 0);
+}
+
+/* Whether the len bytes at byte i of the piece of from are what. */
+static int
+evbuffer_scan_match(const struct evbuffer_scan *from, size_t i,
+    const u_char *what, size_t len)
+{
+	struct evbuffer_scan scan;
+	size_t n;
+
+	if (evbuffer_scan_start(&scan, from->chain, from->pos + i,
+		from->off + i) == -1)
+		return (0);
+	for (;;) {
+		n = scan.len < len ? scan.len : len;
+		if (memcmp(scan.data, what, n) != 0)
+			return (0);
+		what += n;
+		len -= n;
+		if (len == 0)
+			return (1);
+		if (evbuffer_scan_next(&scan) == -1)
+			return (0);
+	}
+}
+
+/*
+ * Finds the first len bytes at or after start that are what; a match may
+ * be split between pieces.  Returns its offset, or -1.
+ */
+static ssize_t
+evbuffer_find_mem(struct evbuffer *buffer, size_t start, const u_char *what,
+    size_t len)
+{
+	struct evbuffer_scan scan;
+	const u_char *p;
+	size_t i;
+
+	if (len == 0)
+		return (start);
+	if (evbuffer_scan_start(&scan, buffer->first, start, start) == -1)
+		return (-1);
+
+	do {
+		if ((p = evsearch_mem(scan.data, scan.len, what, len)) != NULL)
+			return (scan.off + (p - scan.data));
+		/* a match that begins in the last len - 1 bytes goes on */
+		i = scan.len >= len ? scan.len - len + 1 : 0;
+		while ((p = memchr(scan.data + i, what[0], scan.len - i))
+		    != NULL) {
+			i = p - scan.data;
+			if (evbuffer_scan_match(&scan, i, what, len))
+				return (scan.off + i);
+			++i;
+		}
+	} while (evbuffer_scan_next(&scan) == 0);
+
+	return (-1);
+}
+
 u_char *
 evbuffer_find(struct evbuffer *buffer, const u_char *what, size_t len)
 {
-	u_char *search = buffer->buffer, *end = search + buffer->off;
-	u_char *p;
+	ssize_t pos;
+	u_char *data;
 
-	while (search < end &&
-	    (p = memchr(search, *what, end - search)) != NULL) {
-		if (p + len > end)
-			break;
-		if (memcmp(p, what, len) == 0)
-			return (p);
-		search = p + 1;
+	if (buffer->off == 0 ||
+	    (pos = evbuffer_find_mem(buffer, 0, what, len)) == -1)
+		return (NULL);
+	/* the buffer is pulled up through the match, no further */
+	if ((data = evbuffer_pullup(buffer, pos + len)) == NULL)
+		return (NULL);
+
+	return (data + pos);
+}
+
+int
+evbuffer_search(struct evbuffer *buffer, const u_char *what, size_t len,
+    size_t *start)
+{
+	ssize_t pos;
+
+	if (*start >= buffer->off || buffer->off - *start < len)
+		return (-1);
+	pos = evbuffer_find_mem(buffer, *start, what, len);
+	if (pos == -1) {
+		/* a match may still begin in the last len - 1 bytes */
+		*start = len ? buffer->off - len + 1 : buffer->off;
+		return (-1);
 	}
 
-	return (NULL);
+	return (pos);
+}
+
+void
+evbuffer_set_budget(struct evbuffer *buffer, struct evbuffer_budget *budget)
+{
+	if (buffer->budget != NULL)
+		evbuffer_budget_charge(buffer->budget, buffer->off, 0);
+	buffer->budget = budget;
+	if (budget != NULL)
+		evbuffer_budget_charge(budget, 0, buffer->off);
 }
 
 void evbuffer_setcb(struct evbuffer *buffer,
@@ -47,10 +47,14 @@
 #ifdef HAVE_FCNTL_H
 #include <fcntl.h>
 #endif
+#ifdef HAVE_SYS_TIMERFD_H
+#include <sys/timerfd.h>
+#endif
 
 #include "event.h"
 #include "event-internal.h"
 #include "evsignal.h"
+#include "evutil.h"
 #include "log.h"
 
 /* due to limitations in the epoll interface, we need to keep track of
@@ -59,14 +63,30 @@
 struct evepoll {
 	struct event *evread;
 	struct event *evwrite;
+	int registered;		/* epoll events the kernel has for this fd */
+	int queued;		/* the fd is on the changelist */
 };
 
+/*
+ * epoll_add and epoll_del only record what the fd should look like and
+ * put it on the changelist.  The kernel is updated once per fd right
+ * before epoll_wait, so changes that cancel each other out cost nothing.
+ * The one exception is an fd losing its last event: that is removed from
+ * the kernel right away, since callers close the fd after event_del and
+ * a dup'ed or inherited file would keep a late EPOLL_CTL_DEL from ever
+ * finding it.
+ */
 struct epollop {
 	struct evepoll *fds;
 	int nfds;
 	struct epoll_event *events;
 	int nevents;
 	int epfd;
+	int *changelist;
+	int nchanges;
+	int changes_size;
+	int timerfd;		/* -1 unless EVENT_BASE_FLAG_PRECISE_TIMER */
+	int timerfd_armed;
 };
 
 static void *epoll_init	(struct event_base *);
@@ -85,7 +105,8 @@ const struct eventop epollops = {
 	epoll_del,
 	epoll_dispatch,
 	epoll_dealloc,
-	1 /* need reinit */
+	1, /* need reinit */
+	EVENTOP_FEATURE_THREADS|EVENTOP_FEATURE_ET
 };
 
 #ifdef HAVE_SETFD
@@ -107,6 +128,7 @@ const struct eventop epollops = {
 
 #define INITIAL_NFILES 32
 #define INITIAL_NEVENTS 32
+#define INITIAL_NCHANGES 32
 #define MAX_NEVENTS 4096
 
 static void *
@@ -149,6 +171,29 @@ epoll_init(struct event_base *base)
 	}
 	epollop->nfds = INITIAL_NFILES;
 
+	epollop->timerfd = -1;
+#if defined(HAVE_TIMERFD_CREATE) && defined(TFD_NONBLOCK)
+	if (base->flags & EVENT_BASE_FLAG_PRECISE_TIMER) {
+		/*
+		 * epoll_wait only takes milliseconds; the timerfd carries
+		 * the real deadline and we wait on it like on any other fd.
+		 */
+		int fd = timerfd_create(CLOCK_MONOTONIC,
+		    TFD_NONBLOCK|TFD_CLOEXEC);
+		if (fd != -1) {
+			struct epoll_event epev = {0, {0}};
+
+			epev.data.fd = fd;
+			epev.events = EPOLLIN;
+			if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &epev) == -1) {
+				event_warn("epoll_ctl(timerfd)");
+				close(fd);
+			} else
+				epollop->timerfd = fd;
+		}
+	}
+#endif
+
 	evsignal_init(base);
 
 	return (epollop);
@@ -182,6 +227,98 @@ epoll_recalc(struct event_base *base, void *arg, int max)
 }
 
 
+static int
+epoll_queue_change(struct epollop *epollop, int fd)
+{
+	struct evepoll *evep = &epollop->fds[fd];
+
+	if (evep->queued)
+		return (0);
+
+	if (epollop->nchanges == epollop->changes_size) {
+		int size = epollop->changes_size ?
+		    epollop->changes_size * 2 : INITIAL_NCHANGES;
+		int *changelist;
+
+		changelist = realloc(epollop->changelist, size * sizeof(int));
+		if (changelist == NULL) {
+			event_warn("realloc");
+			return (-1);
+		}
+		epollop->changelist = changelist;
+		epollop->changes_size = size;
+	}
+
+	epollop->changelist[epollop->nchanges++] = fd;
+	evep->queued = 1;
+	return (0);
+}
+
+/* Bring the kernel in line with the events we want for each changed fd. */
+static void
+epoll_apply_changes(struct epollop *epollop)
+{
+	struct epoll_event epev = {0, {0}};
+	struct evepoll *evep;
+	int i, fd, events, op;
+
+	for (i = 0; i < epollop->nchanges; ++i) {
+		fd = epollop->changelist[i];
+		evep = &epollop->fds[fd];
+
+		events = 0;
+		if (evep->evread != NULL)
+			events |= EPOLLIN;
+		if (evep->evwrite != NULL)
+			events |= EPOLLOUT;
+		/* epoll keeps a single trigger mode per fd */
+		if ((evep->evread != NULL &&
+			(evep->evread->ev_events & EV_ET)) ||
+		    (evep->evwrite != NULL &&
+			(evep->evwrite->ev_events & EV_ET)))
+			events |= EPOLLET;
+
+		evep->queued = 0;
+		/* an fd that lost all its events was removed by epoll_del */
+		if (events == evep->registered || events == 0)
+			continue;
+
+		if (evep->registered == 0)
+			op = EPOLL_CTL_ADD;
+		else
+			op = EPOLL_CTL_MOD;
+
+		epev.data.fd = fd;
+		epev.events = events;
+		if (epoll_ctl(epollop->epfd, op, fd, &epev) == 0) {
+			evep->registered = events;
+			continue;
+		}
+
+		switch (op) {
+		case EPOLL_CTL_MOD:
+			/* the fd was closed and a new one got its number */
+			if (errno == ENOENT && epoll_ctl(epollop->epfd,
+				EPOLL_CTL_ADD, fd, &epev) == 0) {
+				evep->registered = events;
+				continue;
+			}
+			break;
+		case EPOLL_CTL_ADD:
+			/* an fd we deleted survived through a dup */
+			if (errno == EEXIST && epoll_ctl(epollop->epfd,
+				EPOLL_CTL_MOD, fd, &epev) == 0) {
+				evep->registered = events;
+				continue;
+			}
+			break;
+		}
+		event_warn("%s: epoll_ctl(%d, %d)", __func__, op, fd);
+	}
+
+	epollop->nchanges = 0;
+}
+
 static int
 epoll_dispatch(struct event_base *base, void *arg, struct timeval *tv)
 {
@@ -190,6 +327,29 @@ epoll_dispatch(struct event_base *base, void *arg, struct timeval *tv)
 	struct evepoll *evep;
 	int i, res, timeout = -1;
 
+#if defined(HAVE_TIMERFD_CREATE) && defined(TFD_NONBLOCK)
+	if (epollop->timerfd != -1 && (tv == NULL || evutil_timerisset(tv))) {
+		struct itimerspec is;
+
+		/* an all-zero it_value disarms the timer */
+		memset(&is, 0, sizeof(is));
+		if (tv != NULL) {
+			is.it_value.tv_sec = tv->tv_sec;
+			is.it_value.tv_nsec = tv->tv_usec * 1000;
+		}
+		if (tv != NULL || epollop->timerfd_armed) {
+			if (timerfd_settime(epollop->timerfd, 0, &is, NULL)
+			    == -1) {
+				event_warn("timerfd_settime");
+				return (-1);
+			}
+			epollop->timerfd_armed = tv != NULL;
+		}
+		/* the timerfd wakes us up */
+		tv = NULL;
+	}
+#endif
+
 	if (tv != NULL)
 		timeout = tv->tv_sec * 1000 + (tv->tv_usec + 999) / 1000;
 
@@ -199,7 +359,11 @@ epoll_dispatch(struct event_base *base, void *arg, struct timeval *tv)
 		timeout = MAX_EPOLL_TIMEOUT_MSEC;
 	}
 
+	epoll_apply_changes(epollop);
+
+	EVBASE_RELEASE_LOCK(base);
 	res = epoll_wait(epollop->epfd, events, epollop->nevents, timeout);
+	EVBASE_ACQUIRE_LOCK(base);
 
 	if (res == -1) {
 		if (errno != EINTR) {
@@ -220,6 +384,13 @@ epoll_dispatch(struct event_base *base, void *arg, struct timeval *tv)
 		struct event *evread = NULL, *evwrite = NULL;
 		int fd = events[i].data.fd;
 
+		if (fd == epollop->timerfd) {
+			/* timeout_process takes care of the rest */
+			ev_uint64_t expirations;
+			read(fd, &expirations, sizeof(expirations));
+			epollop->timerfd_armed = 0;
+			continue;
+		}
 		if (fd < 0 || fd >= epollop->nfds)
 			continue;
 		evep = &epollop->fds[fd];
@@ -268,9 +439,8 @@ static int
 epoll_add(void *arg, struct event *ev)
 {
 	struct epollop *epollop = arg;
-	struct epoll_event epev = {0, {0}};
 	struct evepoll *evep;
-	int fd, op, events;
+	int fd;
 
 	if (ev->ev_events & EV_SIGNAL)
 		return (evsignal_add(ev));
@@ -281,29 +451,11 @@ epoll_add(void *arg, struct event *ev)
 		if (epoll_recalc(ev->ev_base, epollop, fd) == -1)
 			return (-1);
 	}
-	evep = &epollop->fds[fd];
-	op = EPOLL_CTL_ADD;
-	events = 0;
-	if (evep->evread != NULL) {
-		events |= EPOLLIN;
-		op = EPOLL_CTL_MOD;
-	}
-	if (evep->evwrite != NULL) {
-		events |= EPOLLOUT;
-		op = EPOLL_CTL_MOD;
-	}
-
-	if (ev->ev_events & EV_READ)
-		events |= EPOLLIN;
-	if (ev->ev_events & EV_WRITE)
-		events |= EPOLLOUT;
-
-	epev.data.fd = fd;
-	epev.events = events;
-	if (epoll_ctl(epollop->epfd, op, ev->ev_fd, &epev) == -1)
-			return (-1);
+	if (epoll_queue_change(epollop, fd) == -1)
+		return (-1);
 
 	/* Update events responsible */
+	evep = &epollop->fds[fd];
 	if (ev->ev_events & EV_READ)
 		evep->evread = ev;
 	if (ev->ev_events & EV_WRITE)
@@ -318,8 +470,7 @@ epoll_del(void *arg, struct event *ev)
 	struct epollop *epollop = arg;
 	struct epoll_event epev = {0, {0}};
 	struct evepoll *evep;
-	int fd, events, op;
-	int needwritedelete = 1, needreaddelete = 1;
+	int fd;
 
 	if (ev->ev_events & EV_SIGNAL)
 		return (evsignal_del(ev));
@@ -327,38 +478,26 @@ epoll_del(void *arg, struct event *ev)
 	fd = ev->ev_fd;
 	if (fd >= epollop->nfds)
 		return (0);
-	evep = &epollop->fds[fd];
-
-	op = EPOLL_CTL_DEL;
-	events = 0;
 
+	evep = &epollop->fds[fd];
 	if (ev->ev_events & EV_READ)
-		events |= EPOLLIN;
-	if (ev->ev_events & EV_WRITE)
-		events |= EPOLLOUT;
-
-	if ((events & (EPOLLIN|EPOLLOUT)) != (EPOLLIN|EPOLLOUT)) {
-		if ((events & EPOLLIN) && evep->evwrite != NULL) {
-			needwritedelete = 0;
-			events = EPOLLOUT;
-			op = EPOLL_CTL_MOD;
-		} else if ((events & EPOLLOUT) && evep->evread != NULL) {
-			needreaddelete = 0;
-			events = EPOLLIN;
-			op = EPOLL_CTL_MOD;
-		}
-	}
-
-	epev.events = events;
-	epev.data.fd = fd;
-
-	if (needreaddelete)
 		evep->evread = NULL;
-	if (needwritedelete)
+	if (ev->ev_events & EV_WRITE)
 		evep->evwrite = NULL;
 
-	if (epoll_ctl(epollop->epfd, op, fd, &epev) == -1)
+	if (evep->evread != NULL || evep->evwrite != NULL)
+		return (epoll_queue_change(epollop, fd));
+	if (evep->registered == 0)
+		return (0);
+
+	/* the caller may close the fd as soon as we return */
+	evep->registered = 0;
+	if (epoll_ctl(epollop->epfd, EPOLL_CTL_DEL, fd, &epev) == -1) {
+		/* closing the fd already removed it */
+		if (errno == ENOENT || errno == EBADF || errno == EPERM)
+			return (0);
 		return (-1);
+	}
 
 	return (0);
 }
@@ -373,8 +512,12 @@ epoll_dealloc(struct event_base *base, void *arg)
 		free(epollop->fds);
 	if (epollop->events)
 		free(epollop->events);
+	if (epollop->changelist)
+		free(epollop->changelist);
 	if (epollop->epfd >= 0)
 		close(epollop->epfd);
+	if (epollop->timerfd >= 0)
+		close(epollop->timerfd);
 
 	memset(epollop, 0, sizeof(struct epollop));
 	free(epollop);
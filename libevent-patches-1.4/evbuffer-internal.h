@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) 2010 Niels Provos <provos@citi.umich.edu>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+// evbuffer-internal.h：evbuffer内部的分段链表结构，对外不可见；
+#ifndef _EVBUFFER_INTERNAL_H_
+#define _EVBUFFER_INTERNAL_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * An evbuffer is a list of segments.  Data is appended at the end of the
+ * last segment and drained from the front of the first, so the bytes that
+ * are already in the buffer never move unless someone asks for them to be
+ * contiguous with evbuffer_pullup().
+ *
+ * Only the last segment is written to, and only if it is not immutable.
+ * Segments before it may be empty (left behind by a read that failed);
+ * drain frees them like any other.
+ */
+struct evbuffer_chain {
+	struct evbuffer_chain *next;	// 下一个分段
+
+	size_t buffer_len;		// 数据区的总长度
+	size_t misalign;		// 数据区头部已被取走的字节数
+	size_t off;			// 数据区中有效数据的字节数
+
+	unsigned flags;			// EVBUFFER_CHAIN_*标志
+#define EVBUFFER_CHAIN_REFERENCE	0x0001	/* buffer belongs to the caller */
+#define EVBUFFER_CHAIN_IMMUTABLE	0x0002	/* never append to this one */
+#define EVBUFFER_CHAIN_SENDFILE		0x0004	/* the data is in a file */
+#define EVBUFFER_CHAIN_MMAP		0x0008	/* buffer is a mapped file */
+#define EVBUFFER_CHAIN_DANGLING		0x0010	/* freed while pinned */
+	unsigned pinned;		// 指向本分段的、尚未完成的内核请求数
+
+	u_char *buffer;			// 数据区，通常紧跟在本结构之后分配
+};
+
+/*
+ * Completion-based I/O hands the kernel pointers into segments.  While a
+ * segment is pinned its data does not move, and freeing it only marks it
+ * dangling; the last evbuffer_chain_unpin() frees it for real.  A read
+ * goes into a pinned segment that no buffer has yet, from
+ * evbuffer_chain_reserve(); evbuffer_chain_commit() appends it once the
+ * data is in, and unpinning it instead throws it away.
+ */
+void evbuffer_chain_pin(struct evbuffer_chain *chain);
+void evbuffer_chain_unpin(struct evbuffer_chain *chain);
+struct evbuffer_chain *evbuffer_chain_reserve(size_t size);
+void evbuffer_chain_commit(struct evbuffer *buf, struct evbuffer_chain *chain,
+    size_t len);
+
+/*
+ * A segment added with evbuffer_add_reference() points at memory owned by
+ * the caller.  This follows the segment header, in place of the data.
+ */
+struct evbuffer_chain_reference {
+	evbuffer_ref_cleanup_cb cleanupfn;	// 分段释放时调用的回调
+	void *extra;				// 传给回调的参数
+};
+
+/*
+ * A segment added with evbuffer_add_file() has no buffer; its bytes are
+ * at offset + misalign in the file and are sent with sendfile().
+ */
+struct evbuffer_chain_fd {
+	int fd;				// 文件描述符，分段释放时关闭
+	off_t offset;			// 分段数据在文件中的起始位置
+};
+
+/*
+ * A segment added with evbuffer_add_mmap() points into a read-only mapping
+ * of a file, which is unmapped once the segment has been drained.
+ */
+struct evbuffer_chain_mmap {
+	void *addr;			// 映射的起始地址，按页对齐
+	size_t len;			// 映射的长度
+};
+
+/* the smallest allocation for a segment, header included */
+#define EVBUFFER_CHAIN_MIN	1024
+/* new segments double in size as a buffer fills, up to this size */
+#define EVBUFFER_CHAIN_MAX_AUTO	16384
+
+#define EVBUFFER_CHAIN_SIZE	sizeof(struct evbuffer_chain)
+#define EVBUFFER_CHAIN_DATA(ch)	((ch)->buffer + (ch)->misalign)
+#define EVBUFFER_CHAIN_SPACE(ch) \
+	(((ch)->flags & EVBUFFER_CHAIN_IMMUTABLE) ? 0 : \
+	    (ch)->buffer_len - (ch)->misalign - (ch)->off)
+/* the structure that follows a segment header */
+#define EVBUFFER_CHAIN_EXTRA(t, ch) ((t *)((struct evbuffer_chain *)(ch) + 1))
+
+/*
+ * A memory budget shared by a group of evbuffers.  Every change in the
+ * length of a member is charged to it; bufferevents whose reads were
+ * suspended because the budget ran out wait on the blocked list.
+ */
+struct evbuffer_budget {
+	size_t limit;			// 预算上限，单位为字节
+	size_t used;			// 成员evbuffer中数据的总字节数
+
+	struct bufferevent *blocked;	// 因超出预算而暂停读取的bufferevent
+};
+
+void evbuffer_budget_charge(struct evbuffer_budget *, size_t old, size_t now);
+
+/*
+ * Token bucket rate limits.  A bucket gains rate bytes per tick, up to
+ * burst; the bytes that are read or written are taken out of it.  Buckets
+ * are refilled lazily from the current tick whenever they are looked at,
+ * so a timer is only needed to wake up a bufferevent that found one empty.
+ * Those timers use a common timeout of the base for the tick length, so
+ * all of them are served by a single timer per tick length.
+ */
+struct ev_token_bucket_cfg {
+	long read_rate;			// 每个tick可读取的字节数，0表示不限速
+	long read_burst;		// 读桶的容量
+	long write_rate;		// 每个tick可写入的字节数，0表示不限速
+	long write_burst;		// 写桶的容量
+	struct timeval tick_timeout;	// tick的长度
+	unsigned msec_per_tick;		// tick的长度，单位为毫秒
+};
+
+struct ev_token_bucket {
+	long read_limit;		// 读桶中剩余的字节数，可以为负
+	long write_limit;		// 写桶中剩余的字节数，可以为负
+	unsigned last_updated;		// 上次补充令牌时的tick
+};
+
+/* why reading or writing of a rate limited bufferevent is suspended */
+#define BEV_SUSPEND_BW		0x01	/* its own bucket is empty */
+#define BEV_SUSPEND_BW_GROUP	0x02	/* the bucket of its group is empty */
+
+struct bufferevent_rate_limit {
+	struct bufferevent *bufev;	// 所属的bufferevent
+
+	int limited;			// 是否设置了自身的限速
+	struct ev_token_bucket_cfg cfg;	// 自身的限速配置
+	struct ev_token_bucket limit;	// 自身的令牌桶
+	const struct timeval *tick;	// tick对应的common timeout
+	struct event refill_event;	// 自身的桶耗尽后等待补充
+
+	struct bufferevent_rate_limit_group *group;	// 所属的限速组，或NULL
+	struct bufferevent_rate_limit *group_next;	// 组内成员链表
+	struct bufferevent_rate_limit **group_prev;
+
+	short read_suspended;		// 暂停读取的原因，BEV_SUSPEND_*
+	short write_suspended;		// 暂停写入的原因，BEV_SUSPEND_*
+};
+
+struct bufferevent_rate_limit_group {
+	struct ev_token_bucket_cfg cfg;	// 组的限速配置
+	struct ev_token_bucket limit;	// 组内成员共享的令牌桶
+	const struct timeval *tick;	// tick对应的common timeout
+	struct event refill_event;	// 组的桶耗尽后等待补充
+
+	struct bufferevent_rate_limit *members;	// 组内成员
+	int n_members;			// 组内成员的个数
+	long min_share;			// 每个成员一次至少可读写的字节数
+
+	int read_suspended;		// 组内成员是否因读桶耗尽而暂停读取
+	int write_suspended;		// 组内成员是否因写桶耗尽而暂停写入
+};
+
+/*
+ * Search kernels in memsearch.c.  Each returns the first match in the len
+ * bytes at p, or NULL.
+ */
+/* the first byte that is a or b */
+const u_char *evsearch_chr2(const u_char *p, size_t len, u_char a, u_char b);
+/* the first a that is followed by b */
+const u_char *evsearch_pair(const u_char *p, size_t len, u_char a, u_char b);
+/* the first occurrence of the wlen bytes at what */
+const u_char *evsearch_mem(const u_char *p, size_t len,
+    const u_char *what, size_t wlen);
+/* the name of the kernels in use: "avx2", "sse2" or "scalar" */
+const char *evsearch_method(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _EVBUFFER_INTERNAL_H_ */
@@ -38,6 +38,7 @@
 #endif
 
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -51,10 +52,31 @@
 
 #include "evutil.h"
 #include "event.h"
+#include "evbuffer-internal.h"
 
 /* prototypes */
 
 void bufferevent_read_pressure_cb(struct evbuffer *, size_t, size_t, void *);
+static void bufferevent_pair_schedule(struct bufferevent *);
+static void bufferevent_pair_readcb(int, short, void *);
+static int bufferevent_schedule_read(struct bufferevent *);
+static int bufferevent_schedule_write(struct bufferevent *);
+
+#define BUDGET_BLOCKED(bufev)	((bufev)->budget_prev != NULL)
+#define BEV_IS_PAIR(bufev)						\
+	((bufev)->ev_read.ev_callback == bufferevent_pair_readcb)
+#define RATELIM_READ_SUSPENDED(bufev)					\
+	((bufev)->rate_limiting != NULL && (bufev)->rate_limiting->read_suspended)
+#define RATELIM_WRITE_SUSPENDED(bufev)					\
+	((bufev)->rate_limiting != NULL && (bufev)->rate_limiting->write_suspended)
+/* only plain reads and writes are left to the kernel to complete */
+#define BEV_ASYNC_READ(bufev)						\
+	((bufev)->timeout_read == 0 && (bufev)->budget == NULL &&	\
+	 (bufev)->rate_limiting == NULL && !BEV_IS_PAIR(bufev) &&	\
+	 (bufev)->ev_read.ev_base != NULL)
+#define BEV_ASYNC_WRITE(bufev)						\
+	((bufev)->timeout_write == 0 && (bufev)->rate_limiting == NULL &&	\
+	 !BEV_IS_PAIR(bufev) && (bufev)->ev_write.ev_base != NULL)
 
 static int
 bufferevent_add(struct event *ev, int timeout)
@@ -70,6 +92,23 @@ bufferevent_add(struct event *ev, int timeout)
 	return (event_add(ev, ptv));
 }
 
+/*
+ * Reading is held back by the high watermark, the memory budget and the
+ * rate limits, on top of being enabled.
+ */
+
+static int
+bufferevent_read_wanted(struct bufferevent *bufev)
+{
+	if (!(bufev->enabled & EV_READ) || BUDGET_BLOCKED(bufev) ||
+	    RATELIM_READ_SUSPENDED(bufev))
+		return (0);
+	if (bufev->wm_read.high != 0 &&
+	    EVBUFFER_LENGTH(bufev->input) >= bufev->wm_read.high)
+		return (0);
+	return (1);
+}
+
 /* 
  * This callback is executed when the size of the input buffer changes.
  * We use it to apply back pressure on the reading side.
@@ -79,6 +118,13 @@ void
 bufferevent_read_pressure_cb(struct evbuffer *buf, size_t old, size_t now,
     void *arg) {
 	struct bufferevent *bufev = arg;
+
+	/* a pair keeps its own buffer callbacks; its partner sends more */
+	if (bufev->partner != NULL) {
+		bufferevent_pair_schedule(bufev->partner);
+		return;
+	}
+
 	/* 
 	 * If we are below the watermark then reschedule reading if it's
 	 * still enabled.
@@ -86,18 +132,564 @@ bufferevent_read_pressure_cb(struct evbuffer *buf, size_t old, size_t now,
 	if (bufev->wm_read.high == 0 || now < bufev->wm_read.high) {
 		evbuffer_setcb(buf, NULL, NULL);
 
-		if (bufev->enabled & EV_READ)
+		if ((bufev->enabled & EV_READ) && !BUDGET_BLOCKED(bufev) &&
+		    !RATELIM_READ_SUSPENDED(bufev))
+			bufferevent_schedule_read(bufev);
+	}
+}
+
+/*
+ * A bufferevent whose budget is used up stops reading and waits on the
+ * blocked list of the budget until its members have drained enough.
+ */
+
+static void
+bufferevent_budget_block(struct bufferevent *bufev)
+{
+	struct evbuffer_budget *budget = bufev->budget;
+
+	event_del(&bufev->ev_read);
+	if (BUDGET_BLOCKED(bufev))
+		return;
+	if ((bufev->budget_next = budget->blocked) != NULL)
+		budget->blocked->budget_prev = &bufev->budget_next;
+	budget->blocked = bufev;
+	bufev->budget_prev = &budget->blocked;
+}
+
+static void
+bufferevent_budget_unblock(struct bufferevent *bufev)
+{
+	if (!BUDGET_BLOCKED(bufev))
+		return;
+	if (bufev->budget_next != NULL)
+		bufev->budget_next->budget_prev = bufev->budget_prev;
+	*bufev->budget_prev = bufev->budget_next;
+	bufev->budget_next = NULL;
+	bufev->budget_prev = NULL;
+}
+
+struct evbuffer_budget *
+evbuffer_budget_new(size_t limit)
+{
+	struct evbuffer_budget *budget;
+
+	if ((budget = calloc(1, sizeof(struct evbuffer_budget))) == NULL)
+		return (NULL);
+	budget->limit = limit;
+
+	return (budget);
+}
+
+void
+evbuffer_budget_free(struct evbuffer_budget *budget)
+{
+	free(budget);
+}
+
+size_t
+evbuffer_budget_get_used(struct evbuffer_budget *budget)
+{
+	return (budget->used);
+}
+
+void
+evbuffer_budget_charge(struct evbuffer_budget *budget, size_t old, size_t now)
+{
+	struct bufferevent *bufev;
+
+	budget->used = budget->used - old + now;
+
+	/* let the waiting readers go again */
+	while (budget->used < budget->limit &&
+	    (bufev = budget->blocked) != NULL) {
+		bufferevent_budget_unblock(bufev);
+		/* the watermark or the rate limits may still hold it back */
+		if (bufferevent_read_wanted(bufev))
 			bufferevent_add(&bufev->ev_read, bufev->timeout_read);
 	}
 }
 
+void
+bufferevent_set_budget(struct bufferevent *bufev,
+    struct evbuffer_budget *budget)
+{
+	int blocked = BUDGET_BLOCKED(bufev);
+
+	bufferevent_budget_unblock(bufev);
+	bufev->budget = budget;
+	evbuffer_set_budget(bufev->input, budget);
+	evbuffer_set_budget(bufev->output, budget);
+	/* a read in flight was not limited by it */
+	if (budget != NULL)
+		evbuffer_cancel_async(bufev->ev_read.ev_base, bufev->input);
+
+	/* the read callback checks the new budget */
+	if (blocked && (bufev->enabled & EV_READ) &&
+	    !RATELIM_READ_SUSPENDED(bufev))
+		bufferevent_add(&bufev->ev_read, bufev->timeout_read);
+}
+
+/*
+ * Token bucket rate limiting.  The buckets are refilled from the clock when
+ * they are looked at; a bufferevent that finds one empty is suspended and
+ * the refill timer of the bucket wakes it up on the next tick.  The timers
+ * are added with a common timeout for the tick length, so the base keeps a
+ * single timer for all of them.
+ */
+
+/* each member of a group may move at least this much at a time */
+#define BEV_RATE_LIMIT_MIN_SHARE	64
+
+#define TB_RATE(cfg, what)						\
+	((what) == EV_READ ? (cfg)->read_rate : (cfg)->write_rate)
+#define TB_LIMIT(bucket, what)						\
+	((what) == EV_READ ? &(bucket)->read_limit : &(bucket)->write_limit)
+
+static unsigned
+ev_token_bucket_get_tick(const struct ev_token_bucket_cfg *cfg)
+{
+	struct timeval now;
+	ev_uint64_t msec;
+
+	evutil_gettimeofday(&now, NULL);
+	msec = (ev_uint64_t)now.tv_sec * 1000 + now.tv_usec / 1000;
+	return ((unsigned)(msec / cfg->msec_per_tick));
+}
+
+static long
+ev_token_bucket_refill(long limit, long rate, long burst, unsigned n_ticks)
+{
+	if (rate == 0 || limit >= burst)
+		return (limit);
+	if ((unsigned long)(burst - limit) / rate < n_ticks)
+		return (burst);
+	return (limit + (long)n_ticks * rate);
+}
+
+static void
+ev_token_bucket_init(struct ev_token_bucket *bucket,
+    const struct ev_token_bucket_cfg *cfg)
+{
+	bucket->read_limit = cfg->read_rate;
+	bucket->write_limit = cfg->write_rate;
+	bucket->last_updated = ev_token_bucket_get_tick(cfg);
+}
+
+static void
+ev_token_bucket_update(struct ev_token_bucket *bucket,
+    const struct ev_token_bucket_cfg *cfg)
+{
+	unsigned tick = ev_token_bucket_get_tick(cfg);
+	unsigned n_ticks = tick - bucket->last_updated;
+
+	if (n_ticks == 0)
+		return;
+	bucket->read_limit = ev_token_bucket_refill(bucket->read_limit,
+	    cfg->read_rate, cfg->read_burst, n_ticks);
+	bucket->write_limit = ev_token_bucket_refill(bucket->write_limit,
+	    cfg->write_rate, cfg->write_burst, n_ticks);
+	bucket->last_updated = tick;
+}
+
+struct ev_token_bucket_cfg *
+ev_token_bucket_cfg_new(size_t read_rate, size_t read_burst,
+    size_t write_rate, size_t write_burst, const struct timeval *tick_len)
+{
+	struct ev_token_bucket_cfg *cfg;
+	struct timeval one_second = { 1, 0 };
+	long msec;
+
+	if (tick_len == NULL)
+		tick_len = &one_second;
+	if (read_rate > read_burst || write_rate > write_burst ||
+	    read_burst > LONG_MAX || write_burst > LONG_MAX)
+		return (NULL);
+	if (tick_len->tv_sec < 0 || tick_len->tv_sec > INT_MAX / 1000 ||
+	    tick_len->tv_usec < 0 || tick_len->tv_usec >= 1000000)
+		return (NULL);
+	msec = tick_len->tv_sec * 1000 + tick_len->tv_usec / 1000;
+	if (msec == 0)
+		return (NULL);
+
+	if ((cfg = calloc(1, sizeof(struct ev_token_bucket_cfg))) == NULL)
+		return (NULL);
+	cfg->read_rate = read_rate;
+	cfg->read_burst = read_burst;
+	cfg->write_rate = write_rate;
+	cfg->write_burst = write_burst;
+	cfg->tick_timeout = *tick_len;
+	cfg->msec_per_tick = msec;
+
+	return (cfg);
+}
+
+void
+ev_token_bucket_cfg_free(struct ev_token_bucket_cfg *cfg)
+{
+	free(cfg);
+}
+
+static const struct timeval *
+bufferevent_rate_limit_tick(struct event_base *base,
+    const struct ev_token_bucket_cfg *cfg)
+{
+	const struct timeval *tv = NULL;
+
+	if (base != NULL)
+		tv = event_base_init_common_timeout(base, &cfg->tick_timeout);
+	return (tv != NULL ? tv : &cfg->tick_timeout);
+}
+
+static void
+bufferevent_rate_limit_suspend(struct bufferevent *bufev, short what,
+    short why)
+{
+	struct bufferevent_rate_limit *rl = bufev->rate_limiting;
+
+	if (what & EV_READ) {
+		rl->read_suspended |= why;
+		event_del(&bufev->ev_read);
+	}
+	if (what & EV_WRITE) {
+		rl->write_suspended |= why;
+		event_del(&bufev->ev_write);
+	}
+}
+
+static void
+bufferevent_rate_limit_unsuspend(struct bufferevent *bufev, short what,
+    short why)
+{
+	struct bufferevent_rate_limit *rl = bufev->rate_limiting;
+
+	if ((what & EV_READ) && (rl->read_suspended & why)) {
+		rl->read_suspended &= ~why;
+		if (bufferevent_read_wanted(bufev))
+			bufferevent_add(&bufev->ev_read, bufev->timeout_read);
+	}
+	if ((what & EV_WRITE) && (rl->write_suspended & why)) {
+		rl->write_suspended &= ~why;
+		if (!rl->write_suspended && (bufev->enabled & EV_WRITE) &&
+		    EVBUFFER_LENGTH(bufev->output) != 0)
+			bufferevent_add(&bufev->ev_write, bufev->timeout_write);
+	}
+}
+
+static void
+bufferevent_rate_limit_group_suspend(struct bufferevent_rate_limit_group *g,
+    short what)
+{
+	struct bufferevent_rate_limit *rl;
+	int *suspended = what == EV_READ ?
+	    &g->read_suspended : &g->write_suspended;
+
+	if (*suspended)
+		return;
+	*suspended = 1;
+	for (rl = g->members; rl != NULL; rl = rl->group_next)
+		bufferevent_rate_limit_suspend(rl->bufev, what,
+		    BEV_SUSPEND_BW_GROUP);
+	if (!event_pending(&g->refill_event, EV_TIMEOUT, NULL))
+		event_add(&g->refill_event, g->tick);
+}
+
+/*
+ * How much a bufferevent may read or write now: what is left in its own
+ * bucket, and no more than its share of the bucket of its group.
+ */
+
+static long
+bufferevent_rate_limit_max(struct bufferevent *bufev, short what)
+{
+	struct bufferevent_rate_limit *rl = bufev->rate_limiting;
+	struct bufferevent_rate_limit_group *g = rl->group;
+	long max = LONG_MAX, share, limit;
+
+	if (rl->limited && TB_RATE(&rl->cfg, what) != 0) {
+		ev_token_bucket_update(&rl->limit, &rl->cfg);
+		max = *TB_LIMIT(&rl->limit, what);
+	}
+	if (g != NULL && TB_RATE(&g->cfg, what) != 0) {
+		ev_token_bucket_update(&g->limit, &g->cfg);
+		limit = *TB_LIMIT(&g->limit, what);
+		share = limit / g->n_members;
+		if (share < g->min_share)
+			share = g->min_share;
+		if (share > limit)
+			share = limit;
+		if (share < max)
+			max = share;
+	}
+
+	return (max < 0 ? 0 : max);
+}
+
+/* Takes what was moved out of the buckets; an empty one suspends us */
+static void
+bufferevent_rate_limit_charge(struct bufferevent *bufev, short what, long n)
+{
+	struct bufferevent_rate_limit *rl = bufev->rate_limiting;
+	struct bufferevent_rate_limit_group *g = rl->group;
+	long *limit;
+
+	if (rl->limited && TB_RATE(&rl->cfg, what) != 0) {
+		limit = TB_LIMIT(&rl->limit, what);
+		*limit -= n;
+		if (*limit <= 0) {
+			bufferevent_rate_limit_suspend(bufev, what,
+			    BEV_SUSPEND_BW);
+			if (!event_pending(&rl->refill_event, EV_TIMEOUT, NULL))
+				event_add(&rl->refill_event, rl->tick);
+		}
+	}
+	if (g != NULL && TB_RATE(&g->cfg, what) != 0) {
+		limit = TB_LIMIT(&g->limit, what);
+		*limit -= n;
+		if (*limit <= 0)
+			bufferevent_rate_limit_group_suspend(g, what);
+	}
+}
+
+static void
+bufferevent_refill_cb(int fd, short event, void *arg)
+{
+	struct bufferevent *bufev = arg;
+	struct bufferevent_rate_limit *rl = bufev->rate_limiting;
+	int again = 0;
+
+	ev_token_bucket_update(&rl->limit, &rl->cfg);
+	if (rl->read_suspended & BEV_SUSPEND_BW) {
+		if (rl->limit.read_limit > 0)
+			bufferevent_rate_limit_unsuspend(bufev, EV_READ,
+			    BEV_SUSPEND_BW);
+		else
+			again = 1;
+	}
+	if (rl->write_suspended & BEV_SUSPEND_BW) {
+		if (rl->limit.write_limit > 0)
+			bufferevent_rate_limit_unsuspend(bufev, EV_WRITE,
+			    BEV_SUSPEND_BW);
+		else
+			again = 1;
+	}
+
+	if (again)
+		event_add(&rl->refill_event, rl->tick);
+}
+
+static void
+bufferevent_group_refill_cb(int fd, short event, void *arg)
+{
+	struct bufferevent_rate_limit_group *g = arg;
+	struct bufferevent_rate_limit *rl;
+	int again = 0;
+
+	ev_token_bucket_update(&g->limit, &g->cfg);
+	if (g->read_suspended) {
+		if (g->limit.read_limit > 0) {
+			g->read_suspended = 0;
+			for (rl = g->members; rl != NULL; rl = rl->group_next)
+				bufferevent_rate_limit_unsuspend(rl->bufev,
+				    EV_READ, BEV_SUSPEND_BW_GROUP);
+		} else
+			again = 1;
+	}
+	if (g->write_suspended) {
+		if (g->limit.write_limit > 0) {
+			g->write_suspended = 0;
+			for (rl = g->members; rl != NULL; rl = rl->group_next)
+				bufferevent_rate_limit_unsuspend(rl->bufev,
+				    EV_WRITE, BEV_SUSPEND_BW_GROUP);
+		} else
+			again = 1;
+	}
+
+	if (again)
+		event_add(&g->refill_event, g->tick);
+}
+
+static struct bufferevent_rate_limit *
+bufferevent_rate_limit_get(struct bufferevent *bufev)
+{
+	struct bufferevent_rate_limit *rl = bufev->rate_limiting;
+
+	if (rl != NULL)
+		return (rl);
+	if ((rl = calloc(1, sizeof(struct bufferevent_rate_limit))) == NULL)
+		return (NULL);
+	rl->bufev = bufev;
+	event_set(&rl->refill_event, -1, 0, bufferevent_refill_cb, bufev);
+	if (bufev->ev_base != NULL)
+		event_base_set(bufev->ev_base, &rl->refill_event);
+	bufev->rate_limiting = rl;
+
+	/* reads in flight were not limited; writes go out one at a time */
+	evbuffer_cancel_async(bufev->ev_read.ev_base, bufev->input);
+
+	return (rl);
+}
+
+static void
+bufferevent_rate_limit_group_unlink(struct bufferevent_rate_limit *rl)
+{
+	if (rl->group_next != NULL)
+		rl->group_next->group_prev = rl->group_prev;
+	*rl->group_prev = rl->group_next;
+	rl->group->n_members--;
+	rl->group = NULL;
+	rl->group_next = NULL;
+	rl->group_prev = NULL;
+}
+
+int
+bufferevent_set_rate_limit(struct bufferevent *bufev,
+    struct ev_token_bucket_cfg *cfg)
+{
+	struct bufferevent_rate_limit *rl;
+
+	if (cfg == NULL) {
+		if ((rl = bufev->rate_limiting) == NULL)
+			return (0);
+		rl->limited = 0;
+		event_del(&rl->refill_event);
+		bufferevent_rate_limit_unsuspend(bufev, EV_READ|EV_WRITE,
+		    BEV_SUSPEND_BW);
+		if (rl->group == NULL) {
+			bufev->rate_limiting = NULL;
+			free(rl);
+		}
+		return (0);
+	}
+
+	if ((rl = bufferevent_rate_limit_get(bufev)) == NULL)
+		return (-1);
+	rl->cfg = *cfg;
+	rl->limited = 1;
+	rl->tick = bufferevent_rate_limit_tick(rl->refill_event.ev_base,
+	    &rl->cfg);
+	ev_token_bucket_init(&rl->limit, &rl->cfg);
+
+	/* the new bucket is not empty */
+	event_del(&rl->refill_event);
+	bufferevent_rate_limit_unsuspend(bufev, EV_READ|EV_WRITE,
+	    BEV_SUSPEND_BW);
+
+	return (0);
+}
+
+struct bufferevent_rate_limit_group *
+bufferevent_rate_limit_group_new(struct event_base *base,
+    const struct ev_token_bucket_cfg *cfg)
+{
+	struct bufferevent_rate_limit_group *g;
+
+	if ((g = calloc(1, sizeof(struct bufferevent_rate_limit_group))) == NULL)
+		return (NULL);
+	g->cfg = *cfg;
+	ev_token_bucket_init(&g->limit, &g->cfg);
+	g->tick = bufferevent_rate_limit_tick(base, &g->cfg);
+	g->min_share = BEV_RATE_LIMIT_MIN_SHARE;
+
+	event_set(&g->refill_event, -1, 0, bufferevent_group_refill_cb, g);
+	event_base_set(base, &g->refill_event);
+
+	return (g);
+}
+
+void
+bufferevent_rate_limit_group_free(struct bufferevent_rate_limit_group *g)
+{
+	while (g->members != NULL)
+		bufferevent_remove_from_rate_limit_group(g->members->bufev);
+	event_del(&g->refill_event);
+	free(g);
+}
+
+int
+bufferevent_add_to_rate_limit_group(struct bufferevent *bufev,
+    struct bufferevent_rate_limit_group *g)
+{
+	struct bufferevent_rate_limit *rl;
+
+	if ((rl = bufferevent_rate_limit_get(bufev)) == NULL)
+		return (-1);
+	if (rl->group == g)
+		return (0);
+	if (rl->group != NULL) {
+		bufferevent_rate_limit_group_unlink(rl);
+		bufferevent_rate_limit_unsuspend(bufev, EV_READ|EV_WRITE,
+		    BEV_SUSPEND_BW_GROUP);
+	}
+
+	if ((rl->group_next = g->members) != NULL)
+		g->members->group_prev = &rl->group_next;
+	g->members = rl;
+	rl->group_prev = &g->members;
+	rl->group = g;
+	g->n_members++;
+
+	if (g->read_suspended)
+		bufferevent_rate_limit_suspend(bufev, EV_READ,
+		    BEV_SUSPEND_BW_GROUP);
+	if (g->write_suspended)
+		bufferevent_rate_limit_suspend(bufev, EV_WRITE,
+		    BEV_SUSPEND_BW_GROUP);
+
+	return (0);
+}
+
+int
+bufferevent_remove_from_rate_limit_group(struct bufferevent *bufev)
+{
+	struct bufferevent_rate_limit *rl = bufev->rate_limiting;
+
+	if (rl == NULL || rl->group == NULL)
+		return (0);
+	bufferevent_rate_limit_group_unlink(rl);
+	bufferevent_rate_limit_unsuspend(bufev, EV_READ|EV_WRITE,
+	    BEV_SUSPEND_BW_GROUP);
+	if (!rl->limited) {
+		bufev->rate_limiting = NULL;
+		free(rl);
+	}
+
+	return (0);
+}
+
+/* Applies the water marks and the budget to what was just read */
+
+static void
+bufferevent_read_done(struct bufferevent *bufev)
+{
+	size_t len;
+
+	/* See if this callbacks meets the water marks */
+	len = EVBUFFER_LENGTH(bufev->input);
+	if (bufev->wm_read.low != 0 && len < bufev->wm_read.low)
+		return;
+	if (bufev->wm_read.high != 0 && len >= bufev->wm_read.high) {
+		struct evbuffer *buf = bufev->input;
+		event_del(&bufev->ev_read);
+
+		/* Now schedule a callback for us when the buffer changes */
+		evbuffer_setcb(buf, bufferevent_read_pressure_cb, bufev);
+	}
+	if (bufev->budget != NULL &&
+	    bufev->budget->used >= bufev->budget->limit)
+		bufferevent_budget_block(bufev);
+
+	/* Invoke the user callback - must always be called last */
+	if (bufev->readcb != NULL)
+		(*bufev->readcb)(bufev, bufev->cbarg);
+}
+
 static void
 bufferevent_readcb(int fd, short event, void *arg)
 {
 	struct bufferevent *bufev = arg;
 	int res = 0;
 	short what = EVBUFFER_READ;
-	size_t len;
 	int howmuch = -1;
 
 	if (event == EV_TIMEOUT) {
@@ -105,6 +697,10 @@ bufferevent_readcb(int fd, short event, void *arg)
 		goto error;
 	}
 
+	/* a read handed to the kernel is still on its way */
+	if (bufev->input->io_pending & EV_READ)
+		return;
+
 	/*
 	 * If we have a high watermark configured then we don't want to
 	 * read more data than would make us reach the watermark.
@@ -121,6 +717,33 @@ bufferevent_readcb(int fd, short event, void *arg)
 		}
 	}
 
+	/* Nor more than the memory budget has left */
+	if (bufev->budget != NULL) {
+		struct evbuffer_budget *budget = bufev->budget;
+		size_t room;
+
+		if (budget->used >= budget->limit) {
+			bufferevent_budget_block(bufev);
+			return;
+		}
+		room = budget->limit - budget->used;
+		if (howmuch < 0 || (size_t)howmuch > room)
+			howmuch = room > INT_MAX ? INT_MAX : (int)room;
+	}
+
+	/* Nor more than the rate limits allow */
+	if (bufev->rate_limiting != NULL) {
+		long max = bufferevent_rate_limit_max(bufev, EV_READ);
+
+		if (max == 0) {
+			/* an empty bucket suspends reading until its refill */
+			bufferevent_rate_limit_charge(bufev, EV_READ, 0);
+			return;
+		}
+		if (howmuch < 0 || howmuch > max)
+			howmuch = max > INT_MAX ? INT_MAX : (int)max;
+	}
+
 	res = evbuffer_read(bufev->input, fd, howmuch);
 	if (res == -1) {
 		if (errno == EAGAIN || errno == EINTR)
@@ -135,33 +758,93 @@ bufferevent_readcb(int fd, short event, void *arg)
 	if (res <= 0)
 		goto error;
 
-	bufferevent_add(&bufev->ev_read, bufev->timeout_read);
+	bufferevent_schedule_read(bufev);
+	if (bufev->rate_limiting != NULL)
+		bufferevent_rate_limit_charge(bufev, EV_READ, res);
+	bufferevent_read_done(bufev);
+	return;
 
-	/* See if this callbacks meets the water marks */
-	len = EVBUFFER_LENGTH(bufev->input);
-	if (bufev->wm_read.low != 0 && len < bufev->wm_read.low)
-		return;
-	if (bufev->wm_read.high != 0 && len >= bufev->wm_read.high) {
-		struct evbuffer *buf = bufev->input;
-		event_del(&bufev->ev_read);
+ reschedule:
+	bufferevent_schedule_read(bufev);
+	return;
 
-		/* Now schedule a callback for us when the buffer changes */
-		evbuffer_setcb(buf, bufferevent_read_pressure_cb, bufev);
+ error:
+	(*bufev->errorcb)(bufev, what, bufev->cbarg);
+}
+
+/*
+ * Completion of a read that the kernel did for us; the data already is in
+ * the input buffer.
+ */
+
+static void
+bufferevent_async_readcb(struct evbuffer *buf, int res, void *arg)
+{
+	struct bufferevent *bufev = arg;
+	short what = EVBUFFER_READ;
+
+	if (res == -1 && (errno == EAGAIN || errno == EINTR ||
+		errno == ECANCELED))
+		goto reschedule;
+	/* what turns up after bufferevent_disable() is still handed on */
+	if (res <= 0 && !(bufev->enabled & EV_READ))
+		return;
+	if (res == -1) {
+		what |= EVBUFFER_ERROR;
+		goto error;
+	} else if (res == 0) {
+		what |= EVBUFFER_EOF;
+		goto error;
 	}
 
-	/* Invoke the user callback - must always be called last */
-	if (bufev->readcb != NULL)
-		(*bufev->readcb)(bufev, bufev->cbarg);
+	if (bufferevent_read_wanted(bufev))
+		bufferevent_schedule_read(bufev);
+	if (bufev->rate_limiting != NULL)
+		bufferevent_rate_limit_charge(bufev, EV_READ, res);
+	bufferevent_read_done(bufev);
 	return;
 
  reschedule:
-	bufferevent_add(&bufev->ev_read, bufev->timeout_read);
+	if (bufferevent_read_wanted(bufev))
+		bufferevent_schedule_read(bufev);
 	return;
 
  error:
 	(*bufev->errorcb)(bufev, what, bufev->cbarg);
 }
 
+/*
+ * Without timeouts and limits, the kernel does the read itself if the
+ * base can do completion-based I/O.
+ */
+
+static int
+bufferevent_schedule_read(struct bufferevent *bufev)
+{
+	struct evbuffer *input = bufev->input;
+	int howmuch = -1;
+
+	if (!BEV_ASYNC_READ(bufev))
+		return (bufferevent_add(&bufev->ev_read, bufev->timeout_read));
+	if (input->io_pending & EV_READ)
+		return (0);
+
+	if (bufev->wm_read.high != 0) {
+		if (EVBUFFER_LENGTH(input) >= bufev->wm_read.high) {
+			evbuffer_setcb(input, bufferevent_read_pressure_cb, bufev);
+			return (0);
+		}
+		howmuch = bufev->wm_read.high - EVBUFFER_LENGTH(input);
+	}
+	if (evbuffer_read_async(bufev->ev_read.ev_base, input,
+		bufev->ev_read.ev_fd, howmuch,
+		bufferevent_async_readcb, bufev) == -1)
+		return (bufferevent_add(&bufev->ev_read, bufev->timeout_read));
+
+	event_del(&bufev->ev_read);
+	return (0);
+}
+
 static void
 bufferevent_writecb(int fd, short event, void *arg)
 {
@@ -174,8 +857,23 @@ bufferevent_writecb(int fd, short event, void *arg)
 		goto error;
 	}
 
+	/* the kernel still sends from the output buffer */
+	if (bufev->output->io_pending & EV_WRITE)
+		return;
+
 	if (EVBUFFER_LENGTH(bufev->output)) {
-	    res = evbuffer_write(bufev->output, fd);
+	    int howmuch = -1;
+
+	    if (bufev->rate_limiting != NULL) {
+		    long max = bufferevent_rate_limit_max(bufev, EV_WRITE);
+
+		    if (max == 0) {
+			    bufferevent_rate_limit_charge(bufev, EV_WRITE, 0);
+			    return;
+		    }
+		    howmuch = max > INT_MAX ? INT_MAX : (int)max;
+	    }
+	    res = evbuffer_write_atmost(bufev->output, fd, howmuch);
 	    if (res == -1) {
 #ifndef WIN32
 /*todo. evbuffer uses WriteFile when WIN32 is set. WIN32 system calls do not
@@ -200,7 +898,9 @@ bufferevent_writecb(int fd, short event, void *arg)
 	}
 
 	if (EVBUFFER_LENGTH(bufev->output) != 0)
-		bufferevent_add(&bufev->ev_write, bufev->timeout_write);
+		bufferevent_schedule_write(bufev);
+	if (bufev->rate_limiting != NULL && res > 0)
+		bufferevent_rate_limit_charge(bufev, EV_WRITE, res);
 
 	/*
 	 * Invoke the user callback if our buffer is drained or below the
@@ -214,13 +914,80 @@ bufferevent_writecb(int fd, short event, void *arg)
 
  reschedule:
 	if (EVBUFFER_LENGTH(bufev->output) != 0)
-		bufferevent_add(&bufev->ev_write, bufev->timeout_write);
+		bufferevent_schedule_write(bufev);
+	return;
+
+ error:
+	(*bufev->errorcb)(bufev, what, bufev->cbarg);
+}
+
+/*
+ * Completion of a write that the kernel did for us; what was sent has
+ * been drained from the output buffer.
+ */
+
+static void
+bufferevent_async_writecb(struct evbuffer *buf, int res, void *arg)
+{
+	struct bufferevent *bufev = arg;
+	short what = EVBUFFER_WRITE;
+
+	if (res == -1) {
+		if (errno == EAGAIN || errno == EINTR || errno == ECANCELED)
+			goto reschedule;
+		/* error case */
+		what |= EVBUFFER_ERROR;
+		goto error;
+	} else if (res == 0) {
+		/* eof case */
+		what |= EVBUFFER_EOF;
+		goto error;
+	}
+
+	if (bufev->rate_limiting != NULL)
+		bufferevent_rate_limit_charge(bufev, EV_WRITE, res);
+	if (!(bufev->enabled & EV_WRITE))
+		return;
+	if (EVBUFFER_LENGTH(bufev->output) != 0)
+		bufferevent_schedule_write(bufev);
+
+	if (bufev->writecb != NULL &&
+	    EVBUFFER_LENGTH(bufev->output) <= bufev->wm_write.low)
+		(*bufev->writecb)(bufev, bufev->cbarg);
+	return;
+
+ reschedule:
+	if ((bufev->enabled & EV_WRITE) && !RATELIM_WRITE_SUSPENDED(bufev) &&
+	    EVBUFFER_LENGTH(bufev->output) != 0)
+		bufferevent_schedule_write(bufev);
 	return;
 
  error:
 	(*bufev->errorcb)(bufev, what, bufev->cbarg);
 }
 
+/*
+ * The data stays in the output buffer while the kernel sends it, so only
+ * one write is in flight at a time; its completion sends the rest.
+ */
+
+static int
+bufferevent_schedule_write(struct bufferevent *bufev)
+{
+	if (!BEV_ASYNC_WRITE(bufev))
+		return (bufferevent_add(&bufev->ev_write, bufev->timeout_write));
+	if (bufev->output->io_pending & EV_WRITE)
+		return (0);
+
+	/* an empty buffer still gets the write callback through the event */
+	if (evbuffer_write_async(bufev->ev_write.ev_base, bufev->output,
+		bufev->ev_write.ev_fd, bufferevent_async_writecb, bufev) == -1)
+		return (bufferevent_add(&bufev->ev_write, bufev->timeout_write));
+
+	event_del(&bufev->ev_write);
+	return (0);
+}
+
 /*
  * Create a new buffered event object.
  *
@@ -283,6 +1050,9 @@ bufferevent_setfd(struct bufferevent *bufev, int fd)
 {
 	event_del(&bufev->ev_read);
 	event_del(&bufev->ev_write);
+	/* their completions reschedule on the new descriptor */
+	evbuffer_cancel_async(bufev->ev_read.ev_base, bufev->input);
+	evbuffer_cancel_async(bufev->ev_write.ev_base, bufev->output);
 
 	event_set(&bufev->ev_read, fd, EV_READ, bufferevent_readcb, bufev);
 	event_set(&bufev->ev_write, fd, EV_WRITE, bufferevent_writecb, bufev);
@@ -312,6 +1082,24 @@ bufferevent_free(struct bufferevent *bufev)
 {
 	event_del(&bufev->ev_read);
 	event_del(&bufev->ev_write);
+	bufferevent_budget_unblock(bufev);
+	if (bufev->partner != NULL) {
+		struct bufferevent *other = bufev->partner;
+
+		/* what we did not get to send is still delivered */
+		evbuffer_setcb(bufev->output, NULL, NULL);
+		evbuffer_add_buffer(other->input, bufev->output);
+		other->partner = NULL;
+		if (other->enabled & EV_READ)
+			event_active(&other->ev_read, EV_READ, 1);
+		/* otherwise bufferevent_enable() delivers the EOF */
+	}
+	if (bufev->rate_limiting != NULL) {
+		if (bufev->rate_limiting->group != NULL)
+			bufferevent_rate_limit_group_unlink(bufev->rate_limiting);
+		event_del(&bufev->rate_limiting->refill_event);
+		free(bufev->rate_limiting);
+	}
 
 	evbuffer_free(bufev->input);
 	evbuffer_free(bufev->output);
@@ -335,8 +1123,9 @@ bufferevent_write(struct bufferevent *bufev, const void *data, size_t size)
 		return (res);
 
 	/* If everything is okay, we need to schedule a write */
-	if (size > 0 && (bufev->enabled & EV_WRITE))
-		bufferevent_add(&bufev->ev_write, bufev->timeout_write);
+	if (size > 0 && (bufev->enabled & EV_WRITE) &&
+	    !RATELIM_WRITE_SUSPENDED(bufev))
+		bufferevent_schedule_write(bufev);
 
 	return (res);
 }
@@ -344,11 +1133,18 @@ bufferevent_write(struct bufferevent *bufev, const void *data, size_t size)
 int
 bufferevent_write_buffer(struct bufferevent *bufev, struct evbuffer *buf)
 {
+	size_t size = EVBUFFER_LENGTH(buf);
 	int res;
 
-	res = bufferevent_write(bufev, buf->buffer, buf->off);
-	if (res != -1)
-		evbuffer_drain(buf, buf->off);
+	/* the segments move over, the data is not copied */
+	res = evbuffer_add_buffer(bufev->output, buf);
+
+	if (res == -1)
+		return (res);
+
+	if (size > 0 && (bufev->enabled & EV_WRITE) &&
+	    !RATELIM_WRITE_SUSPENDED(bufev))
+		bufferevent_schedule_write(bufev);
 
 	return (res);
 }
@@ -356,33 +1152,33 @@ bufferevent_write_buffer(struct bufferevent *bufev, struct evbuffer *buf)
 size_t
 bufferevent_read(struct bufferevent *bufev, void *data, size_t size)
 {
-	struct evbuffer *buf = bufev->input;
-
-	if (buf->off < size)
-		size = buf->off;
-
 	/* Copy the available data to the user buffer */
-	memcpy(data, buf->buffer, size);
-
-	if (size)
-		evbuffer_drain(buf, size);
-
-	return (size);
+	return (evbuffer_remove(bufev->input, data, size));
 }
 
 int
 bufferevent_enable(struct bufferevent *bufev, short event)
 {
-	if (event & EV_READ) {
-		if (bufferevent_add(&bufev->ev_read, bufev->timeout_read) == -1)
+	/* a reader that waits for its budget is woken up by it */
+	if ((event & EV_READ) && !BUDGET_BLOCKED(bufev) &&
+	    !RATELIM_READ_SUSPENDED(bufev)) {
+		if (bufferevent_schedule_read(bufev) == -1)
 			return (-1);
 	}
-	if (event & EV_WRITE) {
-		if (bufferevent_add(&bufev->ev_write, bufev->timeout_write) == -1)
+	/* and a writer whose bucket is empty by its refill */
+	if ((event & EV_WRITE) && !RATELIM_WRITE_SUSPENDED(bufev)) {
+		if (bufferevent_schedule_write(bufev) == -1)
 			return (-1);
 	}
 
 	bufev->enabled |= event;
+
+	/* data may have been waiting for either side of a pair */
+	if (bufev->partner != NULL) {
+		bufferevent_pair_schedule(bufev);
+		bufferevent_pair_schedule(bufev->partner);
+	} else if (BEV_IS_PAIR(bufev) && (event & EV_READ))
+		event_active(&bufev->ev_read, EV_READ, 1);
 	return (0);
 }
 
@@ -392,6 +1188,8 @@ bufferevent_disable(struct bufferevent *bufev, short event)
 	if (event & EV_READ) {
 		if (event_del(&bufev->ev_read) == -1)
 			return (-1);
+		/* a read left to the kernel could wait forever */
+		evbuffer_cancel_async(bufev->ev_read.ev_base, bufev->input);
 	}
 	if (event & EV_WRITE) {
 		if (event_del(&bufev->ev_write) == -1)
@@ -429,6 +1227,10 @@ bufferevent_setwatermark(struct bufferevent *bufev, short events,
 	if (events & EV_READ) {
 		bufev->wm_read.low = lowmark;
 		bufev->wm_read.high = highmark;
+		/* a read in flight was not limited by the new high mark */
+		if (highmark != 0)
+			evbuffer_cancel_async(bufev->ev_read.ev_base,
+			    bufev->input);
 	}
 
 	if (events & EV_WRITE) {
@@ -453,5 +1255,169 @@ bufferevent_base_set(struct event_base *base, struct bufferevent *bufev)
 		return (res);
 
 	res = event_base_set(base, &bufev->ev_write);
+	if (res == -1)
+		return (res);
+
+	if (bufev->rate_limiting != NULL) {
+		struct bufferevent_rate_limit *rl = bufev->rate_limiting;
+
+		res = event_base_set(base, &rl->refill_event);
+		if (rl->limited)
+			rl->tick = bufferevent_rate_limit_tick(base, &rl->cfg);
+	}
 	return (res);
 }
+
+/*
+ * Bufferevent pairs.  The two sides have no file descriptor; their events
+ * are only ever made active by hand.  Data added to the output of one side
+ * makes its write event active, and the write callback moves the segments
+ * over to the input of the other side and makes its read event active, so
+ * the user callbacks run from the event loop as they would for a socket.
+ */
+
+static void
+bufferevent_pair_schedule(struct bufferevent *src)
+{
+	struct bufferevent *dst = src->partner;
+
+	if (dst != NULL && (src->enabled & EV_WRITE) &&
+	    (dst->enabled & EV_READ) && EVBUFFER_LENGTH(src->output) != 0)
+		event_active(&src->ev_write, EV_WRITE, 1);
+}
+
+static void
+bufferevent_pair_output_cb(struct evbuffer *buf, size_t old, size_t now,
+    void *arg)
+{
+	if (now > old)
+		bufferevent_pair_schedule(arg);
+}
+
+static void
+bufferevent_pair_input_cb(struct evbuffer *buf, size_t old, size_t now,
+    void *arg)
+{
+	struct bufferevent *bufev = arg;
+
+	/* the partner may have held back for our high watermark */
+	if (now < old && bufev->partner != NULL)
+		bufferevent_pair_schedule(bufev->partner);
+}
+
+static void
+bufferevent_pair_readcb(int fd, short event, void *arg)
+{
+	struct bufferevent *bufev = arg;
+	size_t len;
+
+	if (event == EV_TIMEOUT) {
+		(*bufev->errorcb)(bufev, EVBUFFER_READ | EVBUFFER_TIMEOUT,
+		    bufev->cbarg);
+		return;
+	}
+	if (!(bufev->enabled & EV_READ))
+		return;
+	bufferevent_add(&bufev->ev_read, bufev->timeout_read);
+
+	/* the other side was freed; its data is in our input */
+	if (bufev->partner == NULL) {
+		(*bufev->errorcb)(bufev, EVBUFFER_READ | EVBUFFER_EOF,
+		    bufev->cbarg);
+		return;
+	}
+
+	len = EVBUFFER_LENGTH(bufev->input);
+	if (len == 0 || (bufev->wm_read.low != 0 && len < bufev->wm_read.low))
+		return;
+
+	if (bufev->readcb != NULL)
+		(*bufev->readcb)(bufev, bufev->cbarg);
+}
+
+static void
+bufferevent_pair_writecb(int fd, short event, void *arg)
+{
+	struct bufferevent *bufev = arg;
+	struct bufferevent *dst = bufev->partner;
+	size_t len, room;
+
+	if (event == EV_TIMEOUT) {
+		(*bufev->errorcb)(bufev, EVBUFFER_WRITE | EVBUFFER_TIMEOUT,
+		    bufev->cbarg);
+		return;
+	}
+	if (dst == NULL) {
+		(*bufev->errorcb)(bufev, EVBUFFER_WRITE | EVBUFFER_EOF,
+		    bufev->cbarg);
+		return;
+	}
+
+	/* move the segments over, up to the high watermark of the reader */
+	len = EVBUFFER_LENGTH(bufev->output);
+	if (len != 0 && (dst->enabled & EV_READ)) {
+		if (dst->wm_read.high != 0) {
+			room = EVBUFFER_LENGTH(dst->input) < dst->wm_read.high ?
+			    dst->wm_read.high - EVBUFFER_LENGTH(dst->input) : 0;
+			if (len > room)
+				len = room;
+		}
+		if (len == EVBUFFER_LENGTH(bufev->output))
+			evbuffer_add_buffer(dst->input, bufev->output);
+		else if (len != 0)
+			evbuffer_remove_buffer(bufev->output, dst->input, len);
+		if (len != 0)
+			event_active(&dst->ev_read, EV_READ, 1);
+	}
+
+	if (EVBUFFER_LENGTH(bufev->output) != 0)
+		bufferevent_add(&bufev->ev_write, bufev->timeout_write);
+
+	if (bufev->writecb != NULL &&
+	    EVBUFFER_LENGTH(bufev->output) <= bufev->wm_write.low)
+		(*bufev->writecb)(bufev, bufev->cbarg);
+}
+
+static void
+bufferevent_pair_errorcb(struct bufferevent *bufev, short what, void *arg)
+{
+}
+
+int
+bufferevent_pair_new(struct event_base *base, struct bufferevent *pair[2])
+{
+	int i;
+
+	pair[0] = bufferevent_new(-1, NULL, NULL, bufferevent_pair_errorcb,
+	    NULL);
+	if (pair[0] == NULL)
+		return (-1);
+	pair[1] = bufferevent_new(-1, NULL, NULL, bufferevent_pair_errorcb,
+	    NULL);
+	if (pair[1] == NULL) {
+		bufferevent_free(pair[0]);
+		return (-1);
+	}
+
+	for (i = 0; i < 2; ++i) {
+		struct bufferevent *bufev = pair[i];
+
+		event_set(&bufev->ev_read, -1, 0,
+		    bufferevent_pair_readcb, bufev);
+		event_set(&bufev->ev_write, -1, 0,
+		    bufferevent_pair_writecb, bufev);
+		if (base != NULL)
+			bufferevent_base_set(base, bufev);
+		evbuffer_setcb(bufev->input, bufferevent_pair_input_cb, bufev);
+		evbuffer_setcb(bufev->output, bufferevent_pair_output_cb, bufev);
+		bufev->partner = pair[1 - i];
+	}
+
+	return (0);
+}
+
+struct bufferevent *
+bufferevent_pair_get_partner(struct bufferevent *bufev)
+{
+	return (bufev->partner);
+}
@@ -33,7 +33,9 @@ extern "C" {
 #endif
 
 #include "config.h"
-#include "min_heap.h"
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
 #include "evsignal.h"
 
 // libevent将系统提供的I/O demultiplex机制统一封装成了eventop结构；
@@ -56,7 +58,48 @@ struct eventop {
 
 	/* set if we need to reinitialize the event base */
 	int need_reinit;
-	
+
+	/* EVENTOP_FEATURE_* flags supported by this backend */
+	int features;
+
+	/* completion-based evbuffer I/O; NULL unless the backend has it */
+	int (*buffer_io)(struct event_base *, void *, short,
+	    struct evbuffer *, int, int, evbuffer_iocb, void *);
+	/* cancels the buffer I/O of an evbuffer; with detach set, its
+	 * callbacks do not run and the evbuffer may go away */
+	void (*buffer_cancel)(struct event_base *, void *,
+	    struct evbuffer *, int);
+};
+
+/* dispatch releases the base lock while it waits for events, and add/del
+ * may be called while another thread is blocked in dispatch */
+#define EVENTOP_FEATURE_THREADS	0x01
+/* add honours EV_ET */
+#define EVENTOP_FEATURE_ET	0x02
+
+/*
+ * A timer store keeps every event that has a pending timeout, ordered by
+ * ev_timeout.  Like eventop, each implementation provides a table of these
+ * functions and event.c only calls through base->timersel, so the min-heap
+ * and the timing wheel can be swapped per event_base.
+ */
+struct timerop {
+	const char *name;
+
+	void *(*init)(struct event_base *);
+	/* make room for n more events so that add cannot fail */
+	int (*reserve)(void *, unsigned);
+	int (*add)(void *, struct event *);
+	int (*del)(void *, struct event *);
+	/* no later than the earliest timeout; -1 if nothing is pending */
+	int (*next)(void *, struct timeval *);
+	/* an event whose timeout is not after now, or NULL */
+	struct event *(*expired)(void *, const struct timeval *);
+	/* any pending event, or NULL if the store is empty */
+	struct event *(*first)(void *);
+	/* the clock jumped backwards: subtract off from every timeout */
+	void (*adjust)(void *, const struct timeval *);
+	void (*dealloc)(struct event_base *, void *);
 };
 
 // 回想Reactor模式的几个基本组件，本节讲解的部分对应于Reactor框架组件。
@@ -77,6 +120,9 @@ struct event_base {
 	const struct eventop *evsel;
 	void *evbase;
 
+	// 创建时传入的EVENT_BASE_FLAG_*标志
+	int flags;
+
     // 事件数量
 	int event_count;		/* counts number of total events */
 
@@ -104,14 +150,69 @@ struct event_base {
 	// event_tv和tv_cache是libevent用于时间管理的变量，将在后面讲到；
 	struct timeval event_tv;
 
-	// timeheap是管理定时事件的小根堆，将在后面定时事件处理时专门讲解；
-	struct min_heap timeheap;
+	// timersel和timerbase管理定时事件，关系与evsel和evbase相同；
+	// 缺省是小根堆，也可以通过EVENT_BASE_FLAG_TIMERWHEEL选择时间轮；
+	const struct timerop *timersel;
+	void *timerbase;
 
     // event_tv和tv_cache是libevent用于时间管理的变量，将在后面讲到；
 	struct timeval tv_cache;
 
+	// common_timeout_queues是相同超时时长的事件队列，每个队列只有队首
+	// 通过内部事件放入定时器存储中；
+	struct common_timeout_list **common_timeout_queues;
+	int n_common_timeouts;
+	int n_common_timeouts_allocated;
+
+	// th_base_lock只在EVENT_BASE_FLAG_THREADSAFE时存在，事件循环只在执行
+	// 回调和阻塞等待I/O时释放它；其他线程修改事件后通过th_notify_fd唤醒
+	// 阻塞中的事件循环；
+	void *th_base_lock;
+#ifdef HAVE_PTHREADS
+	pthread_t th_owner_id;		/* thread running the loop */
+#endif
+	int running_loop;
+	int th_notify_fd[2];
+	struct event th_notify;
+	int is_notify_pending;
+
+};
+
+/*
+ * Events whose timeout was registered with event_base_init_common_timeout()
+ * are kept on a FIFO per duration instead of in the timer store; their
+ * ev_timeout carries the queue index in the high bits of tv_usec.
+ */
+struct common_timeout_list {
+	struct event_list events;	/* sorted by ev_timeout */
+	struct timeval duration;	/* tv_usec includes the magic bits */
+	struct event timeout_event;	/* fires when the head times out */
+	struct event_base *base;
 };
 
+/*
+ * Locking for bases created with EVENT_BASE_FLAG_THREADSAFE.  The lock is
+ * recursive, so code that already holds it may call the public API.
+ */
+#ifdef HAVE_PTHREADS
+#define EVBASE_ACQUIRE_LOCK(base) do {					\
+	if ((base)->th_base_lock != NULL)				\
+		pthread_mutex_lock((base)->th_base_lock);		\
+} while (0)
+#define EVBASE_RELEASE_LOCK(base) do {					\
+	if ((base)->th_base_lock != NULL)				\
+		pthread_mutex_unlock((base)->th_base_lock);		\
+} while (0)
+/* true if another thread has to wake the loop after changing the base */
+#define EVBASE_NEED_NOTIFY(base)					\
+	((base)->th_base_lock != NULL && (base)->running_loop &&	\
+	    !pthread_equal((base)->th_owner_id, pthread_self()))
+#else
+#define EVBASE_ACQUIRE_LOCK(base) do {} while (0)
+#define EVBASE_RELEASE_LOCK(base) do {} while (0)
+#define EVBASE_NEED_NOTIFY(base) 0
+#endif
+
 /* Internal use only: Functions that might be missing from <sys/queue.h> */
 #ifndef HAVE_TAILQFOREACH
 #define	TAILQ_FIRST(head)		((head)->tqh_first)
@@ -133,6 +234,13 @@ int _evsignal_set_handler(struct event_base *base, int evsignal,
 			  void (*fn)(int));
 int _evsignal_restore_handler(struct event_base *base, int evsignal);
 
+/* hands an evbuffer read or write to the backend's buffer_io */
+int event_base_buffer_io(struct event_base *base, short what,
+    struct evbuffer *buf, int fd, int howmuch, evbuffer_iocb cb, void *arg);
+/* and cancels those of an evbuffer */
+void event_base_buffer_cancel(struct event_base *base, struct evbuffer *buf,
+    int detach);
+
 /* defined in evutil.c */
 const char *evutil_getenv(const char *varname);
 
@@ -52,10 +52,17 @@
 #include <string.h>
 #include <assert.h>
 #include <time.h>
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
 
 #include "event.h"
 #include "event-internal.h"
 #include "evutil.h"
+#include "min_heap.h"
 #include "log.h"
 
 #ifdef HAVE_EVENT_PORTS
@@ -67,6 +74,9 @@ extern const struct eventop selectops;
 #ifdef HAVE_POLL
 extern const struct eventop pollops;
 #endif
+#ifdef HAVE_IO_URING
+extern const struct eventop uringops;
+#endif
 #ifdef HAVE_EPOLL
 extern const struct eventop epollops;
 #endif
@@ -80,6 +90,9 @@ extern const struct eventop devpollops;
 extern const struct eventop win32ops;
 #endif
 
+extern const struct timerop heaptimerops;
+extern const struct timerop wheeltimerops;
+
 // Libevent把所有支持的I/O demultiplex机制存储在
 // 一个全局静态数组eventops中，并在初始化时选择使用
 // 何种机制
@@ -91,6 +104,9 @@ static const struct eventop *eventops[] = {
 #ifdef HAVE_WORKING_KQUEUE
 	&kqops,
 #endif
+#ifdef HAVE_IO_URING
+	&uringops,
+#endif
 #ifdef HAVE_EPOLL
 	&epollops,
 #endif
@@ -125,10 +141,35 @@ static int	event_haveevents(struct event_base *);
 
 static void	event_process_active(struct event_base *);
 
+static int	event_add_internal(struct event *, const struct timeval *);
+static int	event_del_internal(struct event *);
+static void	event_active_internal(struct event *, int, short);
+static int	evthread_make_base_notifiable(struct event_base *);
+static int	evthread_notify_base(struct event_base *);
+
 static int	timeout_next(struct event_base *, struct timeval **);
 static void	timeout_process(struct event_base *);
 static void	timeout_correct(struct event_base *, struct timeval *);
 
+/*
+ * A common timeout is a timeval whose tv_usec has COMMON_TIMEOUT_MAGIC in
+ * its top bits and the index of its queue below that.  Real microsecond
+ * values never exceed 999999, so the two cannot be confused.
+ */
+#define MICROSECONDS_MASK	0x000fffff
+#define COMMON_TIMEOUT_IDX_MASK	0x0ff00000
+#define COMMON_TIMEOUT_IDX_SHIFT 20
+#define COMMON_TIMEOUT_MASK	0xf0000000
+#define COMMON_TIMEOUT_MAGIC	0x50000000
+#define MAX_COMMON_TIMEOUTS	256
+
+#define COMMON_TIMEOUT_IDX(tv) \
+	(((tv)->tv_usec & COMMON_TIMEOUT_IDX_MASK) >> COMMON_TIMEOUT_IDX_SHIFT)
+
+static int	is_common_timeout(const struct timeval *,
+		    const struct event_base *);
+static void	common_timeout_schedule(struct common_timeout_list *);
+
 // 检测是否支持monotonic时间
 static void
 detect_monotonic(void)
@@ -199,9 +240,23 @@ event_init(void)
 // 理打下基础。
 struct event_base *
 event_base_new(void)
+{
+	return (event_base_new_with_flags(0));
+}
+
+struct event_base *
+event_base_new_with_flags(int flags)
 {
 	int i;
 	struct event_base *base;
+
+#ifndef HAVE_PTHREADS
+	if (flags & EVENT_BASE_FLAG_THREADSAFE) {
+		event_warnx("%s: libevent was built without thread support",
+		    __func__);
+		return (NULL);
+	}
+#endif
 	
 	// 分配内存空间
 	if ((base = calloc(1, sizeof(struct event_base))) == NULL)
@@ -214,15 +269,33 @@ event_base_new(void)
 	detect_monotonic();
 	gettime(base, &base->event_tv);
 	
-	min_heap_ctor(&base->timeheap);
+	// 选择定时器存储，缺省使用小根堆
+	if (flags & EVENT_BASE_FLAG_TIMERWHEEL)
+		base->timersel = &wheeltimerops;
+	else
+		base->timersel = &heaptimerops;
+	if ((base->timerbase = base->timersel->init(base)) == NULL)
+		event_err(1, "%s: %s init", __func__, base->timersel->name);
+
 	TAILQ_INIT(&base->eventqueue);
 	base->sig.ev_signal_pair[0] = -1;
 	base->sig.ev_signal_pair[1] = -1;
+#ifdef HAVE_SIGNALFD
+	base->sig.ev_signalfd = -1;
+#endif
+	base->th_notify_fd[0] = -1;
+	base->th_notify_fd[1] = -1;
+
+	base->flags = flags;
 
 	// 然后libevent根据系统配置和编译选项决定使用哪一种
 	// I/O demultiplex机制
 	base->evbase = NULL;
 	for (i = 0; eventops[i] && !base->evbase; i++) { // I/O 多路复机制存在
+		// 多线程模式下跳过无法在等待时释放锁的机制
+		if ((flags & EVENT_BASE_FLAG_THREADSAFE) &&
+		    !(eventops[i]->features & EVENTOP_FEATURE_THREADS))
+			continue;
 		base->evsel = eventops[i]; // 设置I/O多路复用机制
 		base->evbase = base->evsel->init(base); // 初始化I/O多路复用机制
 	}
@@ -237,9 +310,114 @@ event_base_new(void)
 	/* allocate a single active event queue */
 	event_base_priority_init(base, 1);
 
+	if ((flags & EVENT_BASE_FLAG_THREADSAFE) &&
+	    evthread_make_base_notifiable(base) == -1) {
+		event_base_free(base);
+		return (NULL);
+	}
+
 	return (base);
 }
 
+#ifdef HAVE_PTHREADS
+/* Runs in the loop thread once another thread has woken it up. */
+static void
+evthread_notify_drain(int fd, short what, void *arg)
+{
+	struct event_base *base = arg;
+	char buf[128];
+
+	EVBASE_ACQUIRE_LOCK(base);
+	base->is_notify_pending = 0;
+	EVBASE_RELEASE_LOCK(base);
+
+	/* an eventfd counter is read in one go, a pipe may hold several
+	 * wakeups */
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+}
+#endif
+
+static int
+evthread_make_base_notifiable(struct event_base *base)
+{
+#ifdef HAVE_PTHREADS
+	pthread_mutexattr_t attr;
+	pthread_mutex_t *lock;
+	int fd;
+
+	if ((lock = malloc(sizeof(pthread_mutex_t))) == NULL) {
+		event_warn("%s: malloc", __func__);
+		return (-1);
+	}
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	if (pthread_mutex_init(lock, &attr) != 0) {
+		pthread_mutexattr_destroy(&attr);
+		free(lock);
+		event_warnx("%s: pthread_mutex_init failed", __func__);
+		return (-1);
+	}
+	pthread_mutexattr_destroy(&attr);
+	base->th_base_lock = lock;
+
+#if defined(HAVE_EVENTFD) && defined(EFD_NONBLOCK)
+	/* one eventfd serves as both ends; th_notify_fd[1] stays -1 */
+	base->th_notify_fd[0] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+#endif
+	if (base->th_notify_fd[0] == -1) {
+		if (pipe(base->th_notify_fd) == -1) {
+			event_warn("%s: pipe", __func__);
+			return (-1);
+		}
+		evutil_make_socket_nonblocking(base->th_notify_fd[0]);
+		evutil_make_socket_nonblocking(base->th_notify_fd[1]);
+#ifdef HAVE_SETFD
+		fcntl(base->th_notify_fd[0], F_SETFD, 1);
+		fcntl(base->th_notify_fd[1], F_SETFD, 1);
+#endif
+	}
+	fd = base->th_notify_fd[0];
+
+	event_set(&base->th_notify, fd, EV_READ|EV_PERSIST,
+	    evthread_notify_drain, base);
+	event_base_set(base, &base->th_notify);
+	event_priority_set(&base->th_notify, 0);
+	base->th_notify.ev_flags |= EVLIST_INTERNAL;
+
+	return (event_add(&base->th_notify, NULL));
+#else
+	return (-1);
+#endif
+}
+
+/* Wake up the loop thread; the caller holds the base lock. */
+static int
+evthread_notify_base(struct event_base *base)
+{
+#ifdef HAVE_PTHREADS
+	int res;
+
+	if (base->is_notify_pending)
+		return (0);
+	base->is_notify_pending = 1;
+
+	if (base->th_notify_fd[1] == -1) {
+		ev_uint64_t msg = 1;
+		res = write(base->th_notify_fd[0], &msg, sizeof(msg));
+	} else {
+		char msg = 0;
+		res = write(base->th_notify_fd[1], &msg, 1);
+	}
+	/* a full pipe means a wakeup is already on its way */
+	if (res == -1 && errno != EAGAIN) {
+		base->is_notify_pending = 0;
+		return (-1);
+	}
+#endif
+	return (0);
+}
+
 void
 event_base_free(struct event_base *base)
 {
@@ -262,9 +440,19 @@ event_base_free(struct event_base *base)
 		}
 		ev = next;
 	}
-	while ((ev = min_heap_top(&base->timeheap)) != NULL) {
+	while ((ev = base->timersel->first(base->timerbase)) != NULL) {
+		if (!(ev->ev_flags & EVLIST_INTERNAL))
+			++n_deleted;
 		event_del(ev);
-		++n_deleted;
+	}
+	for (i = 0; i < base->n_common_timeouts; ++i) {
+		struct common_timeout_list *ctl =
+		    base->common_timeout_queues[i];
+		event_del(&ctl->timeout_event);
+		while ((ev = TAILQ_FIRST(&ctl->events)) != NULL) {
+			event_del(ev);
+			++n_deleted;
+		}
 	}
 
 	for (i = 0; i < base->nactivequeues; ++i) {
@@ -282,14 +470,25 @@ event_base_free(struct event_base *base)
 		event_debug(("%s: %d events were still set in base",
 			__func__, n_deleted));
 
+	if (base->th_notify.ev_flags & EVLIST_INSERTED)
+		event_del(&base->th_notify);
+	if (base->th_notify_fd[0] != -1)
+		EVUTIL_CLOSESOCKET(base->th_notify_fd[0]);
+	if (base->th_notify_fd[1] != -1)
+		EVUTIL_CLOSESOCKET(base->th_notify_fd[1]);
+
 	if (base->evsel->dealloc != NULL)
 		base->evsel->dealloc(base, base->evbase);
 
 	for (i = 0; i < base->nactivequeues; ++i)
 		assert(TAILQ_EMPTY(base->activequeues[i]));
 
-	assert(min_heap_empty(&base->timeheap));
-	min_heap_dtor(&base->timeheap);
+	assert(base->timersel->first(base->timerbase) == NULL);
+	base->timersel->dealloc(base, base->timerbase);
+
+	for (i = 0; i < base->n_common_timeouts; ++i)
+		free(base->common_timeout_queues[i]);
+	free(base->common_timeout_queues);
 
 	for (i = 0; i < base->nactivequeues; ++i)
 		free(base->activequeues[i]);
@@ -297,6 +496,13 @@ event_base_free(struct event_base *base)
 
 	assert(TAILQ_EMPTY(&base->eventqueue));
 
+#ifdef HAVE_PTHREADS
+	if (base->th_base_lock != NULL) {
+		pthread_mutex_destroy(base->th_base_lock);
+		free(base->th_base_lock);
+	}
+#endif
+
 	free(base);
 }
 
@@ -420,7 +626,7 @@ event_process_active(struct event_base *base)
 		if (ev->ev_events & EV_PERSIST)
 			event_queue_remove(base, ev, EVLIST_ACTIVE);
 		else
-			event_del(ev);
+			event_del_internal(ev);
 		
 		/* Allows deletes to work */
 		ncalls = ev->ev_ncalls;
@@ -428,7 +634,10 @@ event_process_active(struct event_base *base)
 		while (ncalls) {
 			ncalls--;
 			ev->ev_ncalls = ncalls;
+			// 回调期间释放锁，其他线程可以继续修改事件
+			EVBASE_RELEASE_LOCK(base);
 			(*ev->ev_callback)((int)ev->ev_fd, ev->ev_res, ev->ev_arg);
+			EVBASE_ACQUIRE_LOCK(base);
 			if (event_gotsig || base->event_break)
 				return;
 		}
@@ -458,6 +667,13 @@ event_base_get_method(struct event_base *base)
 	return (base->evsel->name);
 }
 
+const char *
+event_base_get_timer_method(struct event_base *base)
+{
+	assert(base);
+	return (base->timersel->name);
+}
+
 static void
 event_loopexit_cb(int fd, short what, void *arg)
 {
@@ -493,7 +709,11 @@ event_base_loopbreak(struct event_base *event_base)
 	if (event_base == NULL)
 		return (-1);
 
+	EVBASE_ACQUIRE_LOCK(event_base);
 	event_base->event_break = 1;
+	if (EVBASE_NEED_NOTIFY(event_base))
+		evthread_notify_base(event_base);
+	EVBASE_RELEASE_LOCK(event_base);
 	return (0);
 }
 
@@ -518,7 +738,14 @@ event_base_loop(struct event_base *base, int flags)
 	
 	struct timeval tv;
 	struct timeval *tv_p;
-	int res, done;
+	int res, done, retval = 0;
+
+	// 除了执行回调和阻塞等待I/O，事件循环始终持有base的锁
+	EVBASE_ACQUIRE_LOCK(base);
+	base->running_loop = 1;
+#ifdef HAVE_PTHREADS
+	base->th_owner_id = pthread_self();
+#endif
 	
 	/* clear time cache */
 	// 清空时间缓存
@@ -554,7 +781,8 @@ event_base_loop(struct event_base *base, int flags)
 				res = (*event_sigcb)();
 				if (res == -1) {
 					errno = EINTR;
-					return (-1);
+					retval = -1;
+					goto done;
 				}
 			}
 		}
@@ -585,7 +813,8 @@ event_base_loop(struct event_base *base, int flags)
 		// 如果当前没有注册事件，就退出
 		if (!event_haveevents(base)) {
 			event_debug(("%s: no events registered.", __func__));
-			return (1);
+			retval = 1;
+			goto done;
 		}
 		
 		/* update last old time */
@@ -598,8 +827,10 @@ event_base_loop(struct event_base *base, int flags)
 		// 调用系统I/O demultiplexer等待就绪I/O events，可能是epoll_wait，或者select等；
 		// 在evsel->dispatch()中，会把就绪signal event、I/O event插入到激活链表中
 		res = evsel->dispatch(base, evbase, tv_p);
-		if (res == -1)
-			return (-1);
+		if (res == -1) {
+			retval = -1;
+			goto done;
+		}
 			
 		// 将time cache赋值为当前系统时间
 		gettime(base, &base->tv_cache);
@@ -617,13 +848,16 @@ event_base_loop(struct event_base *base, int flags)
 			done = 1;  // 设置标志
 	}
 	
+	event_debug(("%s: asked to terminate loop.", __func__));
+
+done:
 	/* clear time cache */
 	// 循环结束，清空时间缓存
 	base->tv_cache.tv_sec = 0;
-	
-	event_debug(("%s: asked to terminate loop.", __func__));
-	
-	return (0);
+	base->running_loop = 0;
+	EVBASE_RELEASE_LOCK(base);
+
+	return (retval);
 }
 
 /* Sets up an event for processing once */
@@ -818,8 +1052,10 @@ event_pending(struct event *ev, short event, struct timeval *tv)
 
 	/* See if there is a timeout that we should report */
 	if (tv != NULL && (flags & event & EV_TIMEOUT)) {
+		struct timeval tmp = ev->ev_timeout;
+		tmp.tv_usec &= MICROSECONDS_MASK;
 		gettime(ev->ev_base, &now);
-		evutil_timersub(&ev->ev_timeout, &now, &res);
+		evutil_timersub(&tmp, &now, &res);
 		/* correctly remap to real time */
 		evutil_gettimeofday(&now, NULL);
 		evutil_timeradd(&now, &res, tv);
@@ -844,6 +1080,22 @@ event_pending(struct event *ev, short event, struct timeval *tv)
  */
 
 
+int
+event_add(struct event *ev, const struct timeval *tv)
+{
+	struct event_base *base = ev->ev_base;
+	int res;
+
+	EVBASE_ACQUIRE_LOCK(base);
+	res = event_add_internal(ev, tv);
+	// 事件循环可能正阻塞在旧的超时时间上，唤醒它重新计算
+	if (res != -1 && EVBASE_NEED_NOTIFY(base))
+		evthread_notify_base(base);
+	EVBASE_RELEASE_LOCK(base);
+
+	return (res);
+}
+
 // 注册事件
 // ev：指向要注册的事件；
 // tv：超时时间；
@@ -851,8 +1103,8 @@ event_pending(struct event *ev, short event, struct timeval *tv)
 // 到已注册链表中；如果tv不是NULL，则会同时注册定时事件，将ev添加到timer堆上；如果其中有
 // 一步操作失败，那么函数保证没有事件会被注册，可以讲这相当于一个原子操作。这个函数也体现了
 // libevent细节之处的巧妙设计，且仔细看程序代码，部分有省略，注释直接附在代码中。
-int
-event_add(struct event *ev, const struct timeval *tv)
+static int
+event_add_internal(struct event *ev, const struct timeval *tv)
 {
 
 	// 要注册到的event_base
@@ -874,6 +1126,13 @@ event_add(struct event *ev, const struct timeval *tv)
 		 
 	// 标志中存在其他异常状态
 	assert(!(ev->ev_flags & ~EVLIST_ALL));
+
+	// 当前I/O机制不支持边沿触发
+	if ((ev->ev_events & EV_ET) &&
+	    !(evsel->features & EVENTOP_FEATURE_ET)) {
+		event_debug(("%s: %s cannot do EV_ET", __func__, evsel->name));
+		return (-1);
+	}
 	
 	//
     // 新的timer事件，调用timer heap接口在堆上预留一个位置
@@ -888,9 +1147,8 @@ event_add(struct event *ev, const struct timeval *tv)
 	 */
 	// 如果时间信息存在，并且事件状态处于非激活状态
 	if (tv != NULL && !(ev->ev_flags & EVLIST_TIMEOUT)) {
-		// 在堆上预留一个位置
-		if (min_heap_reserve(&base->timeheap,
-			1 + min_heap_size(&base->timeheap)) == -1)
+		// 在定时器存储中预留一个位置
+		if (base->timersel->reserve(base->timerbase, 1) == -1)
 			return (-1);  /* ENOMEM == errno */
 	}
 	
@@ -939,17 +1197,43 @@ event_add(struct event *ev, const struct timeval *tv)
 			event_queue_remove(base, ev, EVLIST_ACTIVE);
 		}
 		
-		// 计算时间，并插入到timer小根堆中
+		// 计算时间，并插入到定时器存储或者相同时长的超时队列中
 		gettime(base, &now);
-		evutil_timeradd(&now, tv, &ev->ev_timeout);
+		if (is_common_timeout(tv, base)) {
+			struct timeval duration = *tv;
+			duration.tv_usec &= MICROSECONDS_MASK;
+			evutil_timeradd(&now, &duration, &ev->ev_timeout);
+			ev->ev_timeout.tv_usec |=
+			    (tv->tv_usec & ~MICROSECONDS_MASK);
+		} else {
+			evutil_timeradd(&now, tv, &ev->ev_timeout);
+		}
 		
 		event_debug((
 			 "event_add: timeout in %ld seconds, call %p",
 			 tv->tv_sec, ev->ev_callback));
 
-		// 将事件插入到timer小根堆中
-		event_queue_insert(base, ev, EVLIST_TIMEOUT)
-		
+		// 将事件插入到定时器存储中
+		event_queue_insert(base, ev, EVLIST_TIMEOUT);
+	}
+
+	return (res);
+}
+
+int
+event_del(struct event *ev)
+{
+	struct event_base *base = ev->ev_base;
+	int res;
+
+	/* An event without a base has not been added */
+	if (base == NULL)
+		return (-1);
+
+	EVBASE_ACQUIRE_LOCK(base);
+	res = event_del_internal(ev);
+	EVBASE_RELEASE_LOCK(base);
+
 	return (res);
 }
 
@@ -957,8 +1241,8 @@ event_add(struct event *ev, const struct timeval *tv)
 // 对于Signal事件，将从Signal事件链表中删除；对于定时事件，将从堆上删除；
 // 同样删除事件的操作则不一定是原子的，比如删除时间事件之后，有可能从系统
 // I/O机制中注销会失败。
-int
-event_del(struct event *ev)
+static int
+event_del_internal(struct event *ev)
 {
 	struct event_base *base;
 	const struct eventop *evsel;
@@ -1003,6 +1287,52 @@ event_del(struct event *ev)
 
 void
 event_active(struct event *ev, int res, short ncalls)
+{
+	struct event_base *base = ev->ev_base;
+
+	EVBASE_ACQUIRE_LOCK(base);
+	event_active_internal(ev, res, ncalls);
+	if (EVBASE_NEED_NOTIFY(base))
+		evthread_notify_base(base);
+	EVBASE_RELEASE_LOCK(base);
+}
+
+int
+event_base_buffer_io(struct event_base *base, short what,
+    struct evbuffer *buf, int fd, int howmuch, evbuffer_iocb cb, void *arg)
+{
+	int res;
+
+	if (base->evsel->buffer_io == NULL)
+		return (-1);
+
+	EVBASE_ACQUIRE_LOCK(base);
+	res = base->evsel->buffer_io(base, base->evbase, what, buf, fd,
+	    howmuch, cb, arg);
+	/* the request is only submitted when the loop enters the kernel */
+	if (res != -1 && EVBASE_NEED_NOTIFY(base))
+		evthread_notify_base(base);
+	EVBASE_RELEASE_LOCK(base);
+
+	return (res);
+}
+
+void
+event_base_buffer_cancel(struct event_base *base, struct evbuffer *buf,
+    int detach)
+{
+	if (base->evsel->buffer_cancel == NULL)
+		return;
+
+	EVBASE_ACQUIRE_LOCK(base);
+	base->evsel->buffer_cancel(base, base->evbase, buf, detach);
+	if (EVBASE_NEED_NOTIFY(base))
+		evthread_notify_base(base);
+	EVBASE_RELEASE_LOCK(base);
+}
+
+static void
+event_active_internal(struct event *ev, int res, short ncalls)
 {
 	/* We get different kinds of events, add them together */
 	if (ev->ev_flags & EVLIST_ACTIVE) {
@@ -1016,16 +1346,15 @@ event_active(struct event *ev, int res, short ncalls)
 	event_queue_insert(ev->ev_base, ev, EVLIST_ACTIVE);
 }
 
-// 获取最小时间堆中，等待的最小时间
+// 获取定时器存储中，等待的最小时间
 static int
 timeout_next(struct event_base *base, struct timeval **tv_p)
 {
-	struct timeval now;
-	struct event *ev;
+	struct timeval now, next;
 	struct timeval *tv = *tv_p;
 
-	// 如果最小堆为空
-	if ((ev = min_heap_top(&base->timeheap)) == NULL) {
+	// 如果定时器存储为空
+	if (base->timersel->next(base->timerbase, &next) == -1) {
 		/* if no time-based events are active wait for I/O */
 		*tv_p = NULL;
 		return (0);
@@ -1036,13 +1365,13 @@ timeout_next(struct event_base *base, struct timeval **tv_p)
 		return (-1);
 
 	//如果当前时间大于定时的时间，说明已过时，tv清零返回  
-	if (evutil_timercmp(&ev->ev_timeout, &now, <=)) {
+	if (evutil_timercmp(&next, &now, <=)) {
 		evutil_timerclear(tv);
 		return (0);
 	}
 
 	//定时时间减去当前时间获得tv要等待的时间
-	evutil_timersub(&ev->ev_timeout, &now, tv);
+	evutil_timersub(&next, &now, tv);
 
 	assert(tv->tv_sec >= 0);
 	assert(tv->tv_usec >= 0);
@@ -1069,9 +1398,8 @@ timeout_next(struct event_base *base, struct timeval **tv_p)
 static void
 timeout_correct(struct event_base *base, struct timeval *tv)
 {
-	struct event **pev;
-	unsigned int size;
 	struct timeval off;
+	int i;
 
 	// 如果当前系统使用monotonic，则直接返回
 	if (use_monotonic)
@@ -1093,18 +1421,22 @@ timeout_correct(struct event_base *base, struct timeval *tv)
 	//计算时间差  
 	evutil_timersub(&base->event_tv, tv, &off);
 
-	/*
-	 * We can modify the key element of the node without destroying
-	 * the key, beause we apply it to all in the right order.
-	 */
-	// 获取指向时间堆的数组
-	pev = base->timeheap.p;
-	// 获取时间堆保存的元素个数
-	size = base->timeheap.n;
-	// 将时间堆中的时间减去上面计算出的时间差  
-	for (; size-- > 0; ++pev) {
-		struct timeval *ev_tv = &(**pev).ev_timeout;
-		evutil_timersub(ev_tv, &off, ev_tv);
+	// 将定时器存储中的时间减去上面计算出的时间差
+	base->timersel->adjust(base->timerbase, &off);
+	// 相同时长的超时队列整体平移，队列内的顺序不变
+	for (i = 0; i < base->n_common_timeouts; ++i) {
+		struct common_timeout_list *ctl =
+		    base->common_timeout_queues[i];
+		struct event *ev;
+
+		TAILQ_FOREACH(ev, &ctl->events, ev_timeout_next) {
+			struct timeval *ev_tv = &ev->ev_timeout;
+			int bits = ev_tv->tv_usec & ~MICROSECONDS_MASK;
+
+			ev_tv->tv_usec &= MICROSECONDS_MASK;
+			evutil_timersub(ev_tv, &off, ev_tv);
+			ev_tv->tv_usec |= bits;
+		}
 	}
 	/* Now remember what the new time turned out to be. */
 	// 保存时间
@@ -1117,22 +1449,128 @@ timeout_process(struct event_base *base)
 	struct timeval now;
 	struct event *ev;
 
-	if (min_heap_empty(&base->timeheap))
-		return;
-
 	gettime(base, &now);
 
-	while ((ev = min_heap_top(&base->timeheap))) {
-		if (evutil_timercmp(&ev->ev_timeout, &now, >))
-			break;
-
+	while ((ev = base->timersel->expired(base->timerbase, &now))) {
 		/* delete this event from the I/O queues */
-		event_del(ev);
+		event_del_internal(ev);
 
 		event_debug(("timeout_process: call %p",
 			 ev->ev_callback));
-		event_active(ev, EV_TIMEOUT, 1);
+		event_active_internal(ev, EV_TIMEOUT, 1);
+	}
+}
+
+static int
+is_common_timeout(const struct timeval *tv, const struct event_base *base)
+{
+	int idx;
+
+	if ((tv->tv_usec & COMMON_TIMEOUT_MASK) != COMMON_TIMEOUT_MAGIC)
+		return (0);
+	idx = COMMON_TIMEOUT_IDX(tv);
+	return (idx < base->n_common_timeouts);
+}
+
+/* Arm the queue's internal event for the timeout of its first event. */
+static void
+common_timeout_schedule(struct common_timeout_list *ctl)
+{
+	struct event *head = TAILQ_FIRST(&ctl->events);
+	struct event *ev = &ctl->timeout_event;
+
+	if (ev->ev_flags & EVLIST_TIMEOUT)
+		event_queue_remove(ctl->base, ev, EVLIST_TIMEOUT);
+	ev->ev_timeout = head->ev_timeout;
+	ev->ev_timeout.tv_usec &= MICROSECONDS_MASK;
+	event_queue_insert(ctl->base, ev, EVLIST_TIMEOUT);
+}
+
+/* Activate every event at the front of the queue that has timed out. */
+static void
+common_timeout_callback(int fd, short what, void *arg)
+{
+	struct common_timeout_list *ctl = arg;
+	struct event_base *base = ctl->base;
+	struct timeval now;
+	struct event *ev;
+
+	EVBASE_ACQUIRE_LOCK(base);
+	gettime(base, &now);
+	while ((ev = TAILQ_FIRST(&ctl->events)) != NULL) {
+		if (ev->ev_timeout.tv_sec > now.tv_sec ||
+		    (ev->ev_timeout.tv_sec == now.tv_sec &&
+		     (ev->ev_timeout.tv_usec & MICROSECONDS_MASK) >
+		     now.tv_usec))
+			break;
+		event_del_internal(ev);
+		event_active_internal(ev, EV_TIMEOUT, 1);
 	}
+	if (ev != NULL)
+		common_timeout_schedule(ctl);
+	EVBASE_RELEASE_LOCK(base);
+}
+
+const struct timeval *
+event_base_init_common_timeout(struct event_base *base,
+    const struct timeval *duration)
+{
+	struct timeval tv;
+	struct common_timeout_list *ctl;
+	int i;
+
+	if (is_common_timeout(duration, base))
+		return (duration);
+
+	tv = *duration;
+	if (tv.tv_usec >= 1000000) {
+		tv.tv_sec += tv.tv_usec / 1000000;
+		tv.tv_usec %= 1000000;
+	}
+
+	for (i = 0; i < base->n_common_timeouts; ++i) {
+		ctl = base->common_timeout_queues[i];
+		if (ctl->duration.tv_sec == tv.tv_sec &&
+		    (ctl->duration.tv_usec & MICROSECONDS_MASK) == tv.tv_usec)
+			return (&ctl->duration);
+	}
+
+	if (base->n_common_timeouts == MAX_COMMON_TIMEOUTS) {
+		event_warnx("%s: Too many common timeouts already in use; "
+		    "we only support %d per event_base", __func__,
+		    MAX_COMMON_TIMEOUTS);
+		return (NULL);
+	}
+	if (base->n_common_timeouts == base->n_common_timeouts_allocated) {
+		int n = base->n_common_timeouts < 16 ? 16 :
+		    base->n_common_timeouts * 2;
+		struct common_timeout_list **newqueues =
+		    realloc(base->common_timeout_queues,
+			n * sizeof(struct common_timeout_list *));
+		if (newqueues == NULL) {
+			event_warn("%s: realloc", __func__);
+			return (NULL);
+		}
+		base->n_common_timeouts_allocated = n;
+		base->common_timeout_queues = newqueues;
+	}
+	if ((ctl = calloc(1, sizeof(struct common_timeout_list))) == NULL) {
+		event_warn("%s: calloc", __func__);
+		return (NULL);
+	}
+
+	TAILQ_INIT(&ctl->events);
+	ctl->duration.tv_sec = tv.tv_sec;
+	ctl->duration.tv_usec = tv.tv_usec | COMMON_TIMEOUT_MAGIC |
+	    (base->n_common_timeouts << COMMON_TIMEOUT_IDX_SHIFT);
+	evtimer_set(&ctl->timeout_event, common_timeout_callback, ctl);
+	event_base_set(base, &ctl->timeout_event);
+	event_priority_set(&ctl->timeout_event, 0);
+	ctl->timeout_event.ev_flags |= EVLIST_INTERNAL;
+	ctl->base = base;
+	base->common_timeout_queues[base->n_common_timeouts++] = ctl;
+
+	return (&ctl->duration);
 }
 
 // 函数将删除事件ev，对于I/O事件，从I/O 的demultiplexer上将事件注销；
@@ -1173,8 +1611,20 @@ event_queue_remove(struct event_base *base, struct event *ev, int queue)
 		break;
 	// 超时事件
 	case EVLIST_TIMEOUT:
-		// 从最小堆中删除
-		min_heap_erase(&base->timeheap, ev);
+		if (is_common_timeout(&ev->ev_timeout, base)) {
+			struct common_timeout_list *ctl =
+			    base->common_timeout_queues[
+				COMMON_TIMEOUT_IDX(&ev->ev_timeout)];
+			TAILQ_REMOVE(&ctl->events, ev, ev_timeout_next);
+			// 队列已空，内部的超时事件也不再需要了
+			if (TAILQ_EMPTY(&ctl->events) &&
+			    (ctl->timeout_event.ev_flags & EVLIST_TIMEOUT))
+				event_queue_remove(base, &ctl->timeout_event,
+				    EVLIST_TIMEOUT);
+		} else {
+			// 从定时器存储中删除
+			base->timersel->del(base->timerbase, ev);
+		}
 		// 跳出
 		break;
 	// 默认
@@ -1220,9 +1670,19 @@ event_queue_insert(struct event_base *base, struct event *ev, int queue)
 		    ev,ev_active_next);
 		break;
 	// 超时事件，加入到最小堆
-	case EVLIST_TIMEOUT: { // 定时事件，加入堆
-		// 插入到最小堆
-		min_heap_push(&base->timeheap, ev);
+	case EVLIST_TIMEOUT: { // 定时事件，加入定时器存储
+		if (is_common_timeout(&ev->ev_timeout, base)) {
+			struct common_timeout_list *ctl =
+			    base->common_timeout_queues[
+				COMMON_TIMEOUT_IDX(&ev->ev_timeout)];
+			// 时长相同，追加到队尾即保持有序
+			TAILQ_INSERT_TAIL(&ctl->events, ev, ev_timeout_next);
+			if (TAILQ_FIRST(&ctl->events) == ev)
+				common_timeout_schedule(ctl);
+			break;
+		}
+		// 插入到定时器存储
+		base->timersel->add(base->timerbase, ev);
 		break;
 	}
 	// 其他
@@ -198,6 +198,7 @@ typedef unsigned short u_short;
 #define EV_WRITE	0x04
 #define EV_SIGNAL	0x08
 #define EV_PERSIST	0x10	/* Persistant event */
+#define EV_ET		0x20	/* Edge-triggered, if the backend supports it */
 
 /* Fix so that ppl dont have to run with <sys/queue.h> */
 #ifndef TAILQ_ENTRY
@@ -235,6 +236,8 @@ struct event{
   // 用小根堆来管理定时事件，这将在后面定时事件处理时专
   // 门讲解
 	unsigned int min_heap_idx;	/* for managing timeouts */ // 最小堆中的索引 // 所属最小堆
+  // ev_timeout_next：定时事件在时间轮槽链表或相同时长超时队列中的位置；
+	TAILQ_ENTRY(event) ev_timeout_next;	/* for list-based timer stores */
   
   // ev_base该事件所属的反应堆实例，这是一个event_base
   // 结构体，下一节将会详细讲解；
@@ -251,12 +254,14 @@ struct event{
    * 定时事件： EV_TIMEOUT
    * 信号：    EV_SIGNAL
    * 辅助选项： EV_PERSIST，表明是一个永久事件
+   *           EV_ET，边沿触发（仅epoll支持）
    * 
    * #define EV_TIMEOUT 0x01
    * #define EV_READ  0x02
    * #define EV_WRITE 0x04
    * #define EV_SIGNAL 0x08
    * #define EV_PERSIST 0x10
+   * #define EV_ET 0x20
    * 
    * 可以看出事件类型可以使用“|”运算符进行组合，需要
    * 说明的是，信号和I/O事件不能同时设置；还可以看出
@@ -346,6 +351,34 @@ TAILQ_HEAD (evkeyvalq, evkeyval);
  */
 struct event_base *event_base_new(void);
 
+/** Keep pending timeouts in a hierarchical timing wheel instead of the
+    default min-heap.  Adding and removing a timeout becomes O(1) at the
+    cost of millisecond granularity. */
+#define EVENT_BASE_FLAG_TIMERWHEEL	0x01
+/** Allow event_add(), event_del(), event_active() and
+    event_base_loopbreak() to be called from threads other than the one
+    running the loop; the loop is woken up when they change anything.
+    Only backends that can release the lock while they wait are used. */
+#define EVENT_BASE_FLAG_THREADSAFE	0x02
+/** Wait for the next timeout with microsecond precision instead of
+    rounding it up to the next millisecond.  The epoll backend arms a
+    timerfd for this at the cost of one extra system call per loop
+    iteration that has a pending timeout; other backends ignore it. */
+#define EVENT_BASE_FLAG_PRECISE_TIMER	0x04
+
+/**
+  Initialize the event API with a non-default configuration.
+
+  Behaves like event_base_new(), but lets the caller choose among the
+  alternative implementations that libevent provides.
+
+  @param flags any combination of EVENT_BASE_FLAG_* values
+  @return the new event_base, or NULL if a flag is not supported on this
+          platform
+  @see event_base_new(), event_base_get_timer_method()
+ */
+struct event_base *event_base_new_with_flags(int flags);
+
 /**
   Initialize the event API.
 
@@ -397,6 +430,15 @@ int event_base_dispatch(struct event_base *);
  @return a string identifying the kernel event mechanism (kqueue, epoll, etc.)
  */
 const char *event_base_get_method(struct event_base *);
+
+
+/**
+ Get the data structure used by libevent to keep pending timeouts.
+
+ @param eb the event_base structure returned by event_base_new()
+ @return a string identifying the timer store ("minheap" or "timerwheel")
+ */
+const char *event_base_get_timer_method(struct event_base *);
         
         
 /**
@@ -584,6 +626,13 @@ int event_base_loopbreak(struct event_base *);
 #define timeout_pending(ev, tv)		event_pending(ev, EV_TIMEOUT, tv)
 #define timeout_initialized(ev)		((ev)->ev_flags & EVLIST_INIT)
 
+/*
+ * Where signalfd is available, adding a signal event blocks the signal in
+ * the calling thread and reads it from a signalfd instead of installing a
+ * signal handler.  Threads created afterwards inherit the blocked mask;
+ * threads that already exist must block the signal themselves.  Set
+ * EVENT_NOSIGNALFD in the environment to use a signal handler instead.
+ */
 #define signal_add(ev, tv)		event_add(ev, tv)
 #define signal_set(ev, x, cb, arg)	\
 	event_set(ev, x, EV_SIGNAL|EV_PERSIST, cb, arg)
@@ -606,7 +655,11 @@ int event_base_loopbreak(struct event_base *);
   The function fn will be called with the file descriptor that triggered the
   event and the type of event which will be either EV_TIMEOUT, EV_SIGNAL,
   EV_READ, or EV_WRITE.  The additional flag EV_PERSIST makes an event_add()
-  persistent until event_del() has been called.
+  persistent until event_del() has been called.  The flag EV_ET asks for
+  edge-triggered notification: the callback is only invoked again once more
+  data arrives or more space becomes available, so it has to read or write
+  until the operation would block.  event_add() fails for EV_ET events if
+  the backend in use cannot support it (only epoll can).
 
   @param ev an event struct to be modified
   @param fd the file descriptor to be monitored
@@ -684,6 +737,27 @@ int event_base_once(struct event_base *base, int fd, short events,
   */
 int event_add(struct event *ev, const struct timeval *timeout);
 
+/**
+  Prepare an event_base to use a large number of identical timeouts.
+
+  Events added with the same timeout are normally each kept in the timer
+  store, which costs O(log n) per event_add() with the default min-heap.
+  When most timeouts share a few durations, register each duration once;
+  events added with the returned timeval are appended to a FIFO queue for
+  that duration, and only the head of each queue is kept in the timer
+  store.  event_add() with such a timeout is O(1).
+
+  The returned timeval is only meaningful for the base that created it,
+  and should be passed to event_add() as is.
+
+  @param base the event_base that the events will be added to
+  @param duration the timeout that will be shared by many events
+  @return a timeval to pass to event_add(), or NULL on error
+  @see event_add()
+ */
+const struct timeval *event_base_init_common_timeout(struct event_base *base,
+    const struct timeval *duration);
+
 
 /**
   Remove an event from the set of monitored events.
@@ -797,16 +871,33 @@ int	event_priority_set(struct event *, int);
 
 /* These functions deal with buffering input and output */
 
+struct evbuffer_chain;
+struct evbuffer_budget;
+struct ev_token_bucket_cfg;
+struct bufferevent_rate_limit;
+struct bufferevent_rate_limit_group;
+
+/*
+ * The data lives in a list of segments; see evbuffer_pullup() for
+ * getting at it as one contiguous region.
+ */
 struct evbuffer {
-	u_char *buffer;
-	u_char *orig_buffer;
+	struct evbuffer_chain *first;
+	struct evbuffer_chain *last;
 
-	size_t misalign;
-	size_t totallen;
-	size_t off;
+	size_t totallen;	/* bytes allocated in all segments */
+	size_t off;		/* bytes of data in all segments */
 
 	void (*cb)(struct evbuffer *, size_t, size_t, void *);
 	void *cbarg;
+
+	size_t eol_scanned;	/* bytes known not to start an EOL */
+	int eol_style;		/* the EOL style eol_scanned is for */
+
+	struct evbuffer_budget *budget;	/* charged for our data, or NULL */
+
+	struct event_base *io_base;	/* runs our completion-based I/O */
+	short io_pending;	/* EV_READ|EV_WRITE requests in flight there */
 };
 
 /* Just for error reporting - use other constants otherwise */
@@ -847,6 +938,14 @@ struct bufferevent {
 	int timeout_write;	/* in seconds */
 
 	short enabled;	/* events that are currently enabled */
+
+	struct evbuffer_budget *budget;	/* shared with other bufferevents */
+	struct bufferevent *budget_next;	/* on the budget's blocked list */
+	struct bufferevent **budget_prev;	/* NULL unless blocked */
+
+	struct bufferevent_rate_limit *rate_limiting;	/* or NULL */
+
+	struct bufferevent *partner;	/* the other side of a pair, or NULL */
 };
 #endif
 
@@ -1016,6 +1115,139 @@ void bufferevent_settimeout(struct bufferevent *bufev,
     int timeout_read, int timeout_write);
 
 
+/**
+  Make a bufferevent share a memory budget with other bufferevents.
+
+  Both buffers of the bufferevent are charged to the budget, and reading
+  is suspended while the budget is used up.
+
+  @param bufev the bufferevent
+  @param budget the budget, or NULL to leave the current budget
+  @see evbuffer_budget_new()
+ */
+void bufferevent_set_budget(struct bufferevent *bufev,
+    struct evbuffer_budget *budget);
+
+
+/**
+  Create a token bucket configuration for rate limiting.
+
+  A token bucket gains rate bytes every tick, and holds no more than burst
+  bytes.  Reading or writing takes the bytes out of the bucket, and stops
+  while the bucket is empty.  A rate of 0 leaves that direction unlimited.
+
+  @param read_rate the bytes that may be read per tick
+  @param read_burst the most bytes that may be read in one go
+  @param write_rate the bytes that may be written per tick
+  @param write_burst the most bytes that may be written in one go
+  @param tick_len the length of a tick, or NULL for one second
+  @return a new configuration, or NULL if an error occurred
+  @see bufferevent_set_rate_limit(), bufferevent_rate_limit_group_new()
+ */
+struct ev_token_bucket_cfg *ev_token_bucket_cfg_new(size_t read_rate,
+    size_t read_burst, size_t write_rate, size_t write_burst,
+    const struct timeval *tick_len);
+
+/**
+  Free a token bucket configuration.
+
+  The bufferevents and groups that were configured with it keep a copy.
+
+  @param cfg the configuration to be freed
+ */
+void ev_token_bucket_cfg_free(struct ev_token_bucket_cfg *cfg);
+
+/**
+  Limit the rate at which a bufferevent reads and writes.
+
+  The read and write callbacks of the bufferevent never move more data
+  than its bucket holds, and wait for the next tick when it is empty.
+
+  @param bufev the bufferevent
+  @param cfg the limits, or NULL to remove them
+  @return 0 if successful, or -1 if an error occurred
+  @see ev_token_bucket_cfg_new()
+ */
+int bufferevent_set_rate_limit(struct bufferevent *bufev,
+    struct ev_token_bucket_cfg *cfg);
+
+/**
+  Create a group of bufferevents that share one rate limit.
+
+  The members of a group draw from the same bucket.  Each read or write of
+  a member takes no more than an even share of it, so that one busy
+  connection cannot starve the others.  Members may have their own limits
+  as well.
+
+  @param base the event_base of the members
+  @param cfg the limits of the whole group
+  @return a new group, or NULL if an error occurred
+  @see bufferevent_add_to_rate_limit_group()
+ */
+struct bufferevent_rate_limit_group *bufferevent_rate_limit_group_new(
+    struct event_base *base, const struct ev_token_bucket_cfg *cfg);
+
+/**
+  Free a rate limit group.
+
+  The members are removed from the group first.
+
+  @param group the group to be freed
+ */
+void bufferevent_rate_limit_group_free(
+    struct bufferevent_rate_limit_group *group);
+
+/**
+  Add a bufferevent to a rate limit group.
+
+  A bufferevent belongs to one group at most; it leaves its old group.
+
+  @param bufev the bufferevent
+  @param group the group
+  @return 0 if successful, or -1 if an error occurred
+ */
+int bufferevent_add_to_rate_limit_group(struct bufferevent *bufev,
+    struct bufferevent_rate_limit_group *group);
+
+/**
+  Remove a bufferevent from its rate limit group.
+
+  @param bufev the bufferevent
+  @return 0 if successful, or -1 if an error occurred
+ */
+int bufferevent_remove_from_rate_limit_group(struct bufferevent *bufev);
+
+
+/**
+  Create two bufferevents that are connected to each other.
+
+  Data written to one side shows up in the input buffer of the other side
+  without going through the kernel: the segments of the output buffer are
+  moved over as they are, and the callbacks are invoked from the event loop
+  as for a socket.  Both sides start out with a no-op error callback; use
+  bufferevent_setcb() and bufferevent_enable() as usual.
+
+  When one side is freed, the data it had not sent yet is still moved over
+  and the error callback of the other side is invoked with EVBUFFER_EOF.
+
+  Rate limits do not apply to the sides of a pair.
+
+  @param base the event_base to use, or NULL for the current base
+  @param pair filled in with the two sides
+  @return 0 if successful, or -1 if an error occurred
+  @see bufferevent_pair_get_partner(), bufferevent_free()
+ */
+int bufferevent_pair_new(struct event_base *base, struct bufferevent *pair[2]);
+
+/**
+  Get the other side of a bufferevent pair.
+
+  @param bufev one side of a pair
+  @return the other side, or NULL if it was freed or bufev is not a pair
+ */
+struct bufferevent *bufferevent_pair_get_partner(struct bufferevent *bufev);
+
+
 /**
   Sets the watermarks for read and write events.
 
@@ -1036,7 +1268,7 @@ void bufferevent_setwatermark(struct bufferevent *bufev, short events,
     size_t lowmark, size_t highmark);
 
 #define EVBUFFER_LENGTH(x)	(x)->off
-#define EVBUFFER_DATA(x)	(x)->buffer
+#define EVBUFFER_DATA(x)	evbuffer_pullup((x), -1)
 #define EVBUFFER_INPUT(x)	(x)->input
 #define EVBUFFER_OUTPUT(x)	(x)->output
 
@@ -1058,10 +1290,102 @@ struct evbuffer *evbuffer_new(void);
 void evbuffer_free(struct evbuffer *);
 
 
+/**
+  Statistics of the storage cache of the calling thread.
+
+  Evbuffers and their segments are allocated from per-thread caches of
+  free blocks, so that buffers of connections that come and go are reused
+  instead of going through malloc() and free() each time.
+
+  @see evbuffer_pool_get_stats()
+ */
+struct evbuffer_pool_stats {
+	size_t allocs;		/**< blocks handed out */
+	size_t hits;		/**< blocks handed out from the cache */
+	size_t frees;		/**< blocks given back */
+	size_t cached;		/**< blocks in the cache now */
+	size_t cached_bytes;	/**< bytes in the cache now */
+};
+
+/**
+  Configure the evbuffer storage caches.
+
+  Should be called before other threads use evbuffers.  Lowering the
+  limits does not release blocks that are already cached; see
+  evbuffer_pool_flush().
+
+  @param max_size the largest block that is cached, up to 32K; 0 turns
+    caching off.  The default caches every size.
+  @param max_cached how many bytes each thread may keep in its cache; the
+    default is 1M.
+ */
+void evbuffer_pool_set_limits(size_t max_size, size_t max_cached);
+
+/**
+  Get the statistics of the storage cache of the calling thread.
+
+  @param stats filled in with the statistics
+ */
+void evbuffer_pool_get_stats(struct evbuffer_pool_stats *stats);
+
+/**
+  Release the blocks in the storage cache of the calling thread.
+
+  The cache of a thread is released when the thread exits.
+ */
+void evbuffer_pool_flush(void);
+
+
+/**
+  Create a memory budget for a group of evbuffers.
+
+  The data held in the evbuffers that are charged to a budget is counted
+  against its limit.  A bufferevent that uses the budget stops reading
+  from its socket while the budget is used up, as if its read high
+  watermark had been reached, and resumes once other members have drained
+  enough data.  Reads are also made small enough not to overrun the
+  budget by much.  This bounds the memory a server spends on clients that
+  send faster than it can process.
+
+  @param limit the number of bytes the members may hold together
+  @return a new budget, or NULL if an error occurred
+  @see bufferevent_set_budget(), evbuffer_set_budget()
+ */
+struct evbuffer_budget *evbuffer_budget_new(size_t limit);
+
+/**
+  Free a memory budget.
+
+  All evbuffers and bufferevents that use the budget must have been freed
+  or detached from it first.
+
+  @param budget the budget to be freed
+ */
+void evbuffer_budget_free(struct evbuffer_budget *budget);
+
+/**
+  Get the number of bytes that are charged to a memory budget.
+
+  @param budget the budget
+  @return the bytes held by its members
+ */
+size_t evbuffer_budget_get_used(struct evbuffer_budget *budget);
+
+/**
+  Charge the data of an evbuffer to a memory budget.
+
+  @param buffer the evbuffer
+  @param budget the budget, or NULL to detach the evbuffer from its budget
+ */
+void evbuffer_set_budget(struct evbuffer *buffer,
+    struct evbuffer_budget *budget);
+
+
 /**
   Expands the available space in an event buffer.
 
-  Expands the available space in the event buffer to at least datlen
+  Makes sure that at least datlen bytes can be added to the event buffer
+  without allocating memory, in one contiguous region at its end.
 
   @param buf the event buffer to be expanded
   @param datlen the new minimum length requirement
@@ -1081,6 +1405,79 @@ int evbuffer_add(struct evbuffer *, const void *, size_t);
 
 
 
+/**
+  A cleanup function for memory added with evbuffer_add_reference().
+
+  @param data the pointer that was passed to evbuffer_add_reference()
+  @param datalen the length that was passed to evbuffer_add_reference()
+  @param extra the argument that was passed to evbuffer_add_reference()
+ */
+typedef void (*evbuffer_ref_cleanup_cb)(const void *data, size_t datalen,
+    void *extra);
+
+/**
+  Append memory owned by the caller to an evbuffer without copying it.
+
+  The memory must stay valid and unchanged until cleanupfn is called,
+  which happens once all of its bytes have been drained or the evbuffer
+  is freed.  Moving the data to another evbuffer, e.g. when
+  evhttp_send_reply() takes the body, moves the reference along with it.
+
+  @param outbuf the evbuffer to append to
+  @param data the memory to append
+  @param datlen the number of bytes at data
+  @param cleanupfn called when the evbuffer is done with data; may be NULL
+  @param extra an argument for cleanupfn
+  @return 0 if successful, or -1 if an error occurred
+ */
+int evbuffer_add_reference(struct evbuffer *outbuf, const void *data,
+    size_t datlen, evbuffer_ref_cleanup_cb cleanupfn, void *extra);
+
+
+/**
+  Append part of a file to an evbuffer without reading it into memory.
+
+  The evbuffer takes over fd and closes it when the data has been drained
+  or the evbuffer is freed.  evbuffer_write() sends the segment with
+  sendfile(), or splice() where sendfile() cannot write to fd, so
+  evhttp_send_reply() can serve static files without copying them through
+  userspace.  Functions that need the bytes themselves, such as
+  evbuffer_remove() or evbuffer_pullup(), read them from the file.  Where
+  sendfile() is not available, the file is read in right away.
+
+  @param outbuf the evbuffer to append to
+  @param fd a file descriptor opened for reading
+  @param offset where the data starts in the file
+  @param length how many bytes to append
+  @return 0 if successful, or -1 if an error occurred; fd is only taken
+    over if successful
+ */
+int evbuffer_add_file(struct evbuffer *outbuf, int fd, off_t offset,
+    off_t length);
+
+
+/**
+  Append part of a file to an evbuffer by mapping it into memory.
+
+  The data is read by the kernel as it is touched, not copied into the
+  heap.  When the mapped segment is at the front of the evbuffer,
+  evbuffer_pullup() and thus evbuffer_find(), evbuffer_readln() and the
+  evtag decoding functions work on the mapping directly.  The mapping is
+  removed once all of its bytes have been drained.  Where mmap() is not
+  available this is evbuffer_add_file().
+
+  @param outbuf the evbuffer to append to
+  @param fd a file descriptor opened for reading; it is closed if the call
+    succeeds
+  @param offset where the data starts in the file
+  @param length how many bytes to append
+  @return 0 if successful, or -1 if an error occurred
+  @see evbuffer_add_file()
+ */
+int evbuffer_add_mmap(struct evbuffer *outbuf, int fd, off_t offset,
+    off_t length);
+
+
 /**
   Read data from an event buffer and drain the bytes read.
 
@@ -1135,6 +1532,46 @@ enum evbuffer_eol_style {
 char *evbuffer_readln(struct evbuffer *buffer, size_t *n_read_out,
     enum evbuffer_eol_style eol_style);
 
+/**
+ * Look at the first line of an event buffer without copying it.
+ *
+ * Finds a line like evbuffer_readln(), but leaves it in the buffer.  The
+ * line starts at the returned pointer and is not nul-terminated; it stays
+ * valid until the buffer is changed.  Only the line and its EOL are made
+ * contiguous, not the data after them.  Drain the line and its EOL when done
+ * with it.  A search that finds no line is resumed where it stopped.
+ *
+ * @param buffer the evbuffer to look at
+ * @param n_read_out set to the length of the line, without the EOL
+ * @param eol_len_out if non-NULL, set to the length of the EOL
+ * @param eol_style the style of line-ending to use.
+ * @return pointer to the line in the buffer, or NULL if there is none yet
+ * @see evbuffer_readln(), evbuffer_drain()
+ */
+char *evbuffer_peekln(struct evbuffer *buffer, size_t *n_read_out,
+    size_t *eol_len_out, enum evbuffer_eol_style eol_style);
+
+
+/**
+  Find an EOL in an evbuffer, starting at an offset.
+
+  evbuffer_readln() and evbuffer_readline() remember where an unsuccessful
+  search stopped by themselves.  This is for callers that look at the
+  buffer without draining it: if no EOL is found, *start is set to where
+  the next search can begin once more data has arrived, so that no byte
+  is scanned twice.  *start counts from the front of the buffer, so it
+  has to be lowered by anything drained from the buffer in between.
+
+  @param buffer the evbuffer to search
+  @param start the offset to start at; updated if no EOL is found
+  @param eol_len_out if non-NULL, set to the length of the EOL found
+  @param eol_style the style of line-ending to look for
+  @return the offset of the EOL, or -1 if there is none
+  @see evbuffer_search()
+ */
+int evbuffer_search_eol(struct evbuffer *buffer, size_t *start,
+    size_t *eol_len_out, enum evbuffer_eol_style eol_style);
+
 
 /**
   Move data from one evbuffer into another evbuffer.
@@ -1149,6 +1586,41 @@ char *evbuffer_readln(struct evbuffer *buffer, size_t *n_read_out,
 int evbuffer_add_buffer(struct evbuffer *, struct evbuffer *);
 
 
+/**
+  Move up to datlen bytes from the front of one evbuffer to the end of
+  another.
+
+  Whole segments are moved without copying; only a partial segment at the
+  end is copied.
+
+  @param src the evbuffer to take the data from
+  @param dst the evbuffer to add the data to
+  @param datlen the maximum number of bytes to move
+  @return the number of bytes moved, or -1 if an error occurred; neither
+    evbuffer is changed then
+  @see evbuffer_add_buffer()
+ */
+int evbuffer_remove_buffer(struct evbuffer *src, struct evbuffer *dst,
+    size_t datlen);
+
+
+/**
+  Make the first bytes of an evbuffer contiguous.
+
+  The data of an evbuffer is kept in segments.  This copies the first size
+  bytes into a single segment if they are not already in one, so that they
+  can be accessed through the returned pointer.  EVBUFFER_DATA() is
+  evbuffer_pullup() for the whole buffer; code that walks large buffers
+  should only pull up as much as it needs.
+
+  @param buf the evbuffer to linearize
+  @param size the number of bytes to make contiguous, or -1 for all of them
+  @return a pointer to the first byte of the evbuffer, or NULL if size is
+    larger than the evbuffer or memory ran out
+ */
+u_char *evbuffer_pullup(struct evbuffer *buf, int size);
+
+
 /**
   Append a formatted string to the end of an evbuffer.
 
@@ -1188,6 +1660,9 @@ void evbuffer_drain(struct evbuffer *, size_t);
   Write the contents of an evbuffer to a file descriptor.
 
   The evbuffer will be drained after the bytes have been successfully written.
+  Where writev() is available, the segments of the evbuffer are written with
+  a single system call, so data that was assembled from several buffers
+  (such as HTTP headers and a body) goes out without being copied together.
 
   @param buffer the evbuffer to be written and drained
   @param fd the file descriptor to be written to
@@ -1197,6 +1672,21 @@ void evbuffer_drain(struct evbuffer *, size_t);
 int evbuffer_write(struct evbuffer *, int);
 
 
+/**
+  Write at most a given number of bytes of an evbuffer to a file descriptor.
+
+  This is evbuffer_write() with a cap on the amount of data that is handed
+  to the kernel, as needed by rate limiting.
+
+  @param buffer the evbuffer to be written and drained
+  @param fd the file descriptor to be written to
+  @param howmuch the most bytes to write, or -1 to write as much as possible
+  @return the number of bytes written, or -1 if an error occurred
+  @see evbuffer_write()
+ */
+int evbuffer_write_atmost(struct evbuffer *buffer, int fd, int howmuch);
+
+
 /**
   Read from a file descriptor and store the result in an evbuffer.
 
@@ -1209,6 +1699,82 @@ int evbuffer_write(struct evbuffer *, int);
 int evbuffer_read(struct evbuffer *, int, int);
 
 
+/**
+  Callback for evbuffer_read_async() and evbuffer_write_async().
+
+  The second argument is the number of bytes transferred, 0 on end of
+  file, or -1 with errno set if an error occurred.
+ */
+typedef void (*evbuffer_iocb)(struct evbuffer *, int, void *);
+
+/**
+  Read from a file descriptor through the completion queue of an event base.
+
+  Instead of waiting for the descriptor to become readable, the read itself
+  is handed to the kernel.  The kernel reads into a new segment, which is
+  appended to the evbuffer before the callback runs from the event loop;
+  the data is not copied.  Only backends with completion-based I/O
+  (io_uring) support this; callers should fall back to events and
+  evbuffer_read() if it fails.
+
+  Freeing the evbuffer cancels the read, and its callback does not run.
+
+  @param base the event base that performs the read
+  @param buf the evbuffer to store the result
+  @param fd the file descriptor to read from
+  @param howmuch the maximum number of bytes to read, or -1 for as many as
+    one segment can carry
+  @param cb the callback to invoke when the read completes
+  @param arg an argument to be provided to the callback function
+  @return 0 if the read was submitted, or -1 if the base cannot do
+    completion-based I/O or a read on the evbuffer is already in flight
+  @see evbuffer_write_async(), evbuffer_cancel_async()
+ */
+int evbuffer_read_async(struct event_base *, struct evbuffer *, int, int,
+    evbuffer_iocb, void *);
+
+/**
+  Write an evbuffer to a file descriptor through the completion queue of an
+  event base.
+
+  The kernel sends straight from the segments at the front of the
+  evbuffer, and large writes to sockets use zero-copy sends where the
+  kernel supports them.  The data stays in the evbuffer until the callback
+  runs from the event loop; by then, the bytes that were written have been
+  drained, and a failed write leaves all of them in place.  Until then the
+  caller may add to the evbuffer, but must not drain it or move its data
+  elsewhere.  A segment added with evbuffer_add_file() ends the write, and
+  the write fails if one is first.
+
+  Freeing the evbuffer cancels the write, and its callback does not run.
+
+  @param base the event base that performs the write
+  @param buf the evbuffer to be written and drained
+  @param fd the file descriptor to be written to
+  @param cb the callback to invoke when the write completes
+  @param arg an argument to be provided to the callback function
+  @return 0 if the write was submitted, or -1 if the buffer is empty, the
+    base cannot do completion-based I/O or a write on the evbuffer is
+    already in flight
+  @see evbuffer_read_async(), evbuffer_cancel_async()
+ */
+int evbuffer_write_async(struct event_base *, struct evbuffer *, int,
+    evbuffer_iocb, void *);
+
+/**
+  Cancel the completion-based reads and writes of an evbuffer.
+
+  Their callbacks still run, with -1 and errno set to ECANCELED, unless a
+  request finished before the kernel saw the cancellation; the callback
+  then reports what was transferred as usual.
+
+  @param base the event base that performs the requests
+  @param buf the evbuffer whose requests are cancelled
+  @see evbuffer_read_async(), evbuffer_write_async()
+ */
+void evbuffer_cancel_async(struct event_base *, struct evbuffer *);
+
+
 /**
   Find a string within an evbuffer.
 
@@ -1219,6 +1785,25 @@ int evbuffer_read(struct evbuffer *, int, int);
  */
 u_char *evbuffer_find(struct evbuffer *, const u_char *, size_t);
 
+/**
+  Find a string within an evbuffer, starting at an offset.
+
+  If the string is not found, *start is set to where the next search can
+  begin once more data has arrived, so that a caller that waits for a
+  pattern does not scan the same bytes again.  *start counts from the
+  front of the buffer, so it has to be lowered by anything drained from
+  the buffer in between.
+
+  @param buffer the evbuffer to be searched
+  @param what the string to be searched for
+  @param len the length of the search string
+  @param start the offset to start at; updated if the string is not found
+  @return the offset of the string, or -1 if the search failed
+  @see evbuffer_search_eol()
+ */
+int evbuffer_search(struct evbuffer *buffer, const u_char *what,
+    size_t len, size_t *start);
+
 /**
   Set a callback to invoke when the evbuffer is modified.
 
@@ -141,14 +141,24 @@ evtag_encode_tag(struct evbuffer *evbuf, ev_uint32_t tag)
 	return (bytes);
 }
 
+/* a tag or an integer takes up at most this many bytes */
+#define EVTAG_MAX_ENCODED	5
+
 static int
 decode_tag_internal(ev_uint32_t *ptag, struct evbuffer *evbuf, int dodrain)
 {
 	ev_uint32_t number = 0;
-	ev_uint8_t *data = EVBUFFER_DATA(evbuf);
+	ev_uint8_t *data;
 	int len = EVBUFFER_LENGTH(evbuf);
 	int count = 0, shift = 0, done = 0;
 
+	/* only the bytes of the tag need to be contiguous */
+	if (len > EVTAG_MAX_ENCODED)
+		len = EVTAG_MAX_ENCODED;
+	/* the pullup allocates, and reads file-backed segments */
+	if ((data = evbuffer_pullup(evbuf, len)) == NULL)
+		return (-1);
+
 	while (count++ < len) {
 		ev_uint8_t lower = *data++;
 		number |= (lower & 0x7f) << shift;
@@ -223,16 +233,23 @@ evtag_marshal_timeval(struct evbuffer *evbuf, ev_uint32_t tag, struct timeval *t
 	    EVBUFFER_LENGTH(_buf));
 }
 
+/* decodes the integer that starts offset bytes into evbuf */
 static int
-decode_int_internal(ev_uint32_t *pnumber, struct evbuffer *evbuf, int dodrain)
+decode_int_internal(ev_uint32_t *pnumber, struct evbuffer *evbuf, int offset,
+    int dodrain)
 {
 	ev_uint32_t number = 0;
-	ev_uint8_t *data = EVBUFFER_DATA(evbuf);
-	int len = EVBUFFER_LENGTH(evbuf);
+	ev_uint8_t *data;
+	int len = EVBUFFER_LENGTH(evbuf) - offset;
 	int nibbles = 0;
 
-	if (!len)
+	if (len <= 0)
+		return (-1);
+	if (len > EVTAG_MAX_ENCODED)
+		len = EVTAG_MAX_ENCODED;
+	if ((data = evbuffer_pullup(evbuf, offset + len)) == NULL)
 		return (-1);
+	data += offset;
 
 	nibbles = ((data[0] & 0xf0) >> 4) + 1;
 	if (nibbles > 8 || (nibbles >> 1) + 1 > len)
@@ -259,7 +276,7 @@ decode_int_internal(ev_uint32_t *pnumber, struct evbuffer *evbuf, int dodrain)
 int
 evtag_decode_int(ev_uint32_t *pnumber, struct evbuffer *evbuf)
 {
-	return (decode_int_internal(pnumber, evbuf, 1) == -1 ? -1 : 0);
+	return (decode_int_internal(pnumber, evbuf, 0, 1) == -1 ? -1 : 0);
 }
 
 int
@@ -271,18 +288,13 @@ evtag_peek(struct evbuffer *evbuf, ev_uint32_t *ptag)
 int
 evtag_peek_length(struct evbuffer *evbuf, ev_uint32_t *plength)
 {
-	struct evbuffer tmp;
 	int res, len;
 
 	len = decode_tag_internal(NULL, evbuf, 0 /* dodrain */);
 	if (len == -1)
 		return (-1);
 
-	tmp = *evbuf;
-	tmp.buffer += len;
-	tmp.off -= len;
-
-	res = decode_int_internal(plength, &tmp, 0);
+	res = decode_int_internal(plength, evbuf, len, 0);
 	if (res == -1)
 		return (-1);
 
@@ -294,18 +306,13 @@ evtag_peek_length(struct evbuffer *evbuf, ev_uint32_t *plength)
 int
 evtag_payload_length(struct evbuffer *evbuf, ev_uint32_t *plength)
 {
-	struct evbuffer tmp;
 	int res, len;
 
 	len = decode_tag_internal(NULL, evbuf, 0 /* dodrain */);
 	if (len == -1)
 		return (-1);
 
-	tmp = *evbuf;
-	tmp.buffer += len;
-	tmp.off -= len;
-
-	res = decode_int_internal(plength, &tmp, 0);
+	res = decode_int_internal(plength, evbuf, len, 0);
 	if (res == -1)
 		return (-1);
 
@@ -342,11 +349,9 @@ evtag_unmarshal(struct evbuffer *src, ev_uint32_t *ptag, struct evbuffer *dst)
 	if (EVBUFFER_LENGTH(src) < len)
 		return (-1);
 
-	if (evbuffer_add(dst, EVBUFFER_DATA(src), len) == -1)
+	if (evbuffer_remove_buffer(src, dst, len) == -1)
 		return (-1);
 
-	evbuffer_drain(src, len);
-
 	return (len);
 }
 
@@ -372,11 +377,9 @@ evtag_unmarshal_int(struct evbuffer *evbuf, ev_uint32_t need_tag,
 		return (-1);
 	
 	evbuffer_drain(_buf, EVBUFFER_LENGTH(_buf));
-	if (evbuffer_add(_buf, EVBUFFER_DATA(evbuf), len) == -1)
+	if (evbuffer_remove_buffer(evbuf, _buf, len) == -1)
 		return (-1);
 
-	evbuffer_drain(evbuf, len);
-
 	return (evtag_decode_int(pinteger, _buf));
 }
 
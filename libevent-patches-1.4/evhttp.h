@@ -114,7 +114,15 @@ int evhttp_accept_socket(struct evhttp *http, int fd);
  */
 void evhttp_free(struct evhttp* http);
 
-/** Set a callback for a specified URI */
+/**
+ * Set a callback for a specified URI.
+ *
+ * The callback handles the requests whose path, without the query, is the
+ * given URI.  A URI that ends in '*' is a prefix instead: the callback
+ * handles every path that starts with the part before the '*', unless an
+ * exact URI or a longer prefix matches as well.  Looking up the callback
+ * takes the same time no matter how many are set.
+ */
 void evhttp_set_cb(struct evhttp *, const char *,
     void (*)(struct evhttp_request *, void *), void *);
 
@@ -134,6 +142,20 @@ void evhttp_set_gencb(struct evhttp *,
  */
 void evhttp_set_timeout(struct evhttp *, int timeout_in_secs);
 
+/**
+ * Set how many pipelined requests of a connection are handled at once.
+ *
+ * The server reads and dispatches up to max requests of a connection
+ * before it has replied to the first of them.  Replies are still sent in
+ * the order of the requests; a reply that is ready early waits for the
+ * ones before it.  The default of 1 dispatches a request only after the
+ * reply to the previous one was sent.
+ *
+ * @param http an evhttp object
+ * @param max the number of requests, at least 1
+ */
+void evhttp_set_max_pipeline(struct evhttp *, int max);
+
 /* Request/Response functionality */
 
 /**
@@ -201,6 +223,12 @@ struct {
 #define EVHTTP_REQ_OWN_CONNECTION	0x0001
 #define EVHTTP_PROXY_REQUEST		0x0002
 
+	/*
+	 * the library owns these lists and the memory of the headers it
+	 * added; the pointers must not be replaced.  Nodes linked in by
+	 * hand, and their key and value, must come from malloc() and are
+	 * freed with the request
+	 */
 	struct evkeyvalq *input_headers;
 	struct evkeyvalq *output_headers;
 
@@ -222,7 +250,8 @@ struct {
 	struct evbuffer *input_buffer;	/* read data */
 	ev_int64_t ntoread;
 	int chunked:1,                  /* a chunked request */
-	    userdone:1;                 /* the user has sent all data */
+	    userdone:1,                 /* the user has sent all data */
+	    queued:1;                   /* reply waits for earlier replies */
 
 	struct evbuffer *output_buffer;	/* outgoing post or data */
 
@@ -283,6 +312,19 @@ void evhttp_connection_set_timeout(struct evhttp_connection *evcon,
 void evhttp_connection_set_retries(struct evhttp_connection *evcon,
     int retry_max);
 
+/**
+ * Set how many requests are written to the server ahead of responses.
+ *
+ * A request made on the connection is written as soon as fewer than max
+ * requests wait for their responses, and responses are matched to the
+ * requests in order.  If the connection closes or fails, the requests
+ * that were written but not answered fail; those that were not written
+ * yet go out on a new connection.  The default of 1 writes a request only
+ * after the response to the previous one was read.
+ */
+void evhttp_connection_set_max_pipeline(struct evhttp_connection *evcon,
+    int max);
+
 /** Set a callback for connection close. */
 void evhttp_connection_set_closecb(struct evhttp_connection *evcon,
     void (*)(struct evhttp_connection *, void *), void *);
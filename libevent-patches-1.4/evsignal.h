@@ -67,6 +67,14 @@ struct evsignal_info {
     // 表示数字sh_old的大小。而，sh_old 为
 	// sigaction类型数组。
 	int sh_old_max; // 原信号 数组大小
+#ifdef HAVE_SIGNALFD
+	// 使用signalfd时，ev_signalfd为注册到event_base的signalfd，否则为-1；
+	// ev_signalfd_mask为通过signalfd接收的信号，这些信号都处于阻塞状态；
+	// ev_signalfd_blocked记录添加之前就已被阻塞的信号，删除时不解除阻塞；
+	int ev_signalfd;
+	sigset_t ev_signalfd_mask;
+	sigset_t ev_signalfd_blocked;
+#endif
 	/**
 	 * evsignal_info的初始化包括，创建socket pair，
 	 * 设置ev_signal事件（但并没有注册，而是等到有信号
@@ -59,6 +59,7 @@ struct evhttp_connection {
 	int fd;
 	struct event ev;
 	struct event close_ev;
+	struct event read_more_ev;	/* parses input that was read ahead */
 	struct evbuffer *input_buffer;
 	struct evbuffer *output_buffer;
 	
@@ -69,13 +70,14 @@ struct evhttp_connection {
 	u_short port;
 
 	int flags;
-#define EVHTTP_CON_INCOMING	0x0001	/* only one request on it ever */
+#define EVHTTP_CON_INCOMING	0x0001	/* requests from a client */
 #define EVHTTP_CON_OUTGOING	0x0002  /* multiple requests possible */
 #define EVHTTP_CON_CLOSEDETECT  0x0004  /* detecting if persistent close */
 
 	int timeout;			/* timeout in seconds for events */
 	int retry_cnt;			/* retry count */
 	int retry_max;			/* maximum number of retries */
+	int max_pipeline;		/* requests in flight at once */
 	
 	enum evhttp_connection_state state;
 
@@ -100,8 +102,65 @@ struct evhttp_cb {
 
 	void (*cb)(struct evhttp_request *req, void *);
 	void *cbarg;
+
+	struct evhttp_cb *hash_next;	/* same bucket of the path table */
+	unsigned hash;			/* hash of what */
+	int prefix;			/* what ends in '*' */
+};
+
+/* a prefix trie of the callbacks whose path ends in '*' */
+struct evhttp_cb_trie {
+	struct evhttp_cb_trie *child;	/* first node one byte further */
+	struct evhttp_cb_trie *sibling;	/* next node at the same depth */
+	struct evhttp_cb *cb;		/* for the prefix ending here, or NULL */
+	char c;				/* the byte of this node */
 };
 
+/*
+ * The headers of a request.  The nodes and their strings are carved out
+ * of an arena that is allocated with the table, and the nodes are hashed
+ * by key for lookups.  The evkeyvalq comes first, so a pointer to it is a
+ * pointer to the table; it is what req->input_headers points to.
+ */
+#define EVKEYVAL_BUCKETS	64
+
+/* the table behind req->input_headers or req->output_headers */
+#define EVKEYVAL_TABLE(headers)	((struct evkeyval_table *)(headers))
+
+/* arena sizes that hold the headers of most requests and responses */
+#define EVHTTP_INPUT_HEADERS_SIZE	2048
+#define EVHTTP_OUTPUT_HEADERS_SIZE	512
+
+struct evkeyval_chunk {
+	struct evkeyval_chunk *next;	/* the chunk that filled up before */
+	size_t size;			/* bytes at data */
+	size_t off;			/* bytes handed out */
+	u_char *data;
+};
+
+/* a node of a table; the list links the evkeyval in it */
+struct evkeyval_node {
+	struct evkeyval kv;		/* must come first */
+	struct evkeyval_node *hash_next;	/* same bucket of the table */
+};
+
+struct evkeyval_table {
+	struct evkeyvalq headers;	/* the list view; must come first */
+	int hashed;			/* lookups may use the buckets */
+
+	struct evkeyval_node *buckets[EVKEYVAL_BUCKETS];
+	struct evkeyval_chunk *arena;	/* the chunk being carved */
+	struct evkeyval_chunk first;	/* its data follows the table */
+};
+
+struct evkeyval_table *evkeyval_table_new(size_t arena_size);
+void evkeyval_table_free(struct evkeyval_table *);
+void evkeyval_table_clear(struct evkeyval_table *);
+const char *evkeyval_table_find(struct evkeyval_table *, const char *);
+int evkeyval_table_add(struct evkeyval_table *, const char *, const char *);
+int evkeyval_table_addn(struct evkeyval_table *,
+    const char *, size_t, const char *, size_t);
+
 /* both the http server as well as the rpc system need to queue connections */
 TAILQ_HEAD(evconq, evhttp_connection);
 
@@ -116,9 +175,14 @@ struct evhttp {
 	TAILQ_HEAD(boundq, evhttp_bound_socket) sockets;
 
 	TAILQ_HEAD(httpcbq, evhttp_cb) callbacks;
+	struct evhttp_cb **cb_table;	/* exact paths, hashed */
+	size_t cb_table_size;		/* a power of two */
+	size_t n_exact;			/* callbacks in cb_table */
+	struct evhttp_cb_trie *cb_trie;	/* prefix paths */
         struct evconq connections;
 
         int timeout;
+	int max_pipeline;		/* requests dispatched per connection */
 
 	void (*gencb)(struct evhttp_request *req, void *);
 	void *gencbarg;
@@ -138,6 +202,9 @@ void evhttp_connection_fail(struct evhttp_connection *,
 
 void evhttp_get_request(struct evhttp *, int, struct sockaddr *, socklen_t);
 
+/* the callback that handles a request for uri, or NULL */
+struct evhttp_cb *evhttp_dispatch_callback(struct evhttp *, const char *uri);
+
 int evhttp_hostportfile(char *, char **, u_short *, char **);
 
 int evhttp_parse_firstline(struct evhttp_request *, struct evbuffer*);
@@ -217,10 +217,20 @@ static void evhttp_connection_start_detectclose(
 static void evhttp_connection_stop_detectclose(
 	struct evhttp_connection *evcon);
 static void evhttp_request_dispatch(struct evhttp_connection* evcon);
+static void evhttp_connection_take_written(struct evhttp_connection *evcon,
+    struct evcon_requestq *failed);
+static void evhttp_fail_requests(struct evcon_requestq *failed);
 static void evhttp_read_firstline(struct evhttp_connection *evcon,
 				  struct evhttp_request *req);
 static void evhttp_read_header(struct evhttp_connection *evcon,
     struct evhttp_request *req);
+static void evhttp_read_input(struct evhttp_connection *evcon,
+    struct evhttp_request *req);
+static void evhttp_resume_read(struct evhttp_connection *evcon);
+static int evhttp_connection_read_next(struct evhttp_connection *evcon);
+static int evhttp_connection_stop_read_ahead(struct evhttp_connection *evcon,
+    struct evhttp_request *req, enum evhttp_connection_state state);
+static void evhttp_send_done(struct evhttp_connection *evcon, void *arg);
 static int evhttp_add_header_internal(struct evkeyvalq *headers,
     const char *key, const char *value);
 static int evhttp_decode_uri_internal(const char *uri, size_t length,
@@ -354,8 +364,8 @@ evhttp_write_buffer(struct evhttp_connection *evcon,
 	evcon->cb = cb;
 	evcon->cb_arg = arg;
 
-	/* check if the event is already pending */
-	if (event_pending(&evcon->ev, EV_WRITE|EV_TIMEOUT, NULL))
+	/* check if the event is already pending; a read waits for the write */
+	if (event_pending(&evcon->ev, EV_READ|EV_WRITE|EV_TIMEOUT, NULL))
 		event_del(&evcon->ev);
 
 	event_set(&evcon->ev, evcon->fd, EV_WRITE, evhttp_write, evcon);
@@ -381,11 +391,38 @@ evhttp_connected(struct evhttp_connection *evcon)
 	}
 }
 
+static int
+evhttp_connection_reading(struct evhttp_connection *evcon)
+{
+	switch (evcon->state) {
+	case EVCON_READING_FIRSTLINE:
+	case EVCON_READING_HEADERS:
+	case EVCON_READING_BODY:
+	case EVCON_READING_TRAILER:
+		return (1);
+	default:
+		return (0);
+	}
+}
+
+/*
+ * The request that the connection reads.  Pipelined requests queue on an
+ * incoming connection behind the ones waiting for replies, so it is the
+ * last one there.
+ */
+static struct evhttp_request *
+evhttp_request_being_read(struct evhttp_connection *evcon)
+{
+	if (evcon->flags & EVHTTP_CON_INCOMING)
+		return (TAILQ_LAST(&evcon->requests, evcon_requestq));
+	return (TAILQ_FIRST(&evcon->requests));
+}
+
 /*
  * Create the headers needed for an HTTP request
  */
 static void
-evhttp_make_header_request(struct evhttp_connection *evcon,
+evhttp_make_header_request(struct evbuffer *output,
     struct evhttp_request *req)
 {
 	const char *method;
@@ -394,7 +431,7 @@ evhttp_make_header_request(struct evhttp_connection *evcon,
 
 	/* Generate request line */
 	method = evhttp_method(req->type);
-	evbuffer_add_printf(evcon->output_buffer, "%s %s HTTP/%d.%d\r\n",
+	evbuffer_add_printf(output, "%s %s HTTP/%d.%d\r\n",
 	    method, req->uri, req->major, req->minor);
 
 	/* Add the content length on a post request if missing */
@@ -403,7 +440,8 @@ evhttp_make_header_request(struct evhttp_connection *evcon,
 		char size[22];
 		evutil_snprintf(size, sizeof(size), "%ld",
 		    (long)EVBUFFER_LENGTH(req->output_buffer));
-		evhttp_add_header(req->output_headers, "Content-Length", size);
+		evkeyval_table_add(EVKEYVAL_TABLE(req->output_headers),
+		    "Content-Length", size);
 	}
 }
 
@@ -429,9 +467,9 @@ evhttp_is_connection_keepalive(struct evkeyvalq* headers)
 }
 
 static void
-evhttp_maybe_add_date_header(struct evkeyvalq *headers)
+evhttp_maybe_add_date_header(struct evkeyval_table *table)
 {
-	if (evhttp_find_header(headers, "Date") == NULL) {
+	if (evhttp_find_header(&table->headers, "Date") == NULL) {
 		char date[50];
 #ifndef WIN32
 		struct tm cur;
@@ -446,20 +484,20 @@ evhttp_maybe_add_date_header(struct evkeyvalq *headers)
 #endif
 		if (strftime(date, sizeof(date),
 			"%a, %d %b %Y %H:%M:%S GMT", cur_p) != 0) {
-			evhttp_add_header(headers, "Date", date);
+			evkeyval_table_add(table, "Date", date);
 		}
 	}
 }
 
 static void
-evhttp_maybe_add_content_length_header(struct evkeyvalq *headers,
+evhttp_maybe_add_content_length_header(struct evkeyval_table *table,
     long content_length)
 {
-	if (evhttp_find_header(headers, "Transfer-Encoding") == NULL &&
-	    evhttp_find_header(headers,	"Content-Length") == NULL) {
+	if (evhttp_find_header(&table->headers, "Transfer-Encoding") == NULL &&
+	    evhttp_find_header(&table->headers, "Content-Length") == NULL) {
 		char len[22];
 		evutil_snprintf(len, sizeof(len), "%ld", content_length);
-		evhttp_add_header(headers, "Content-Length", len);
+		evkeyval_table_add(table, "Content-Length", len);
 	}
 }
 
@@ -468,24 +506,25 @@ evhttp_maybe_add_content_length_header(struct evkeyvalq *headers,
  */
 
 static void
-evhttp_make_header_response(struct evhttp_connection *evcon,
+evhttp_make_header_response(struct evbuffer *output,
     struct evhttp_request *req)
 {
 	int is_keepalive = evhttp_is_connection_keepalive(req->input_headers);
-	evbuffer_add_printf(evcon->output_buffer, "HTTP/%d.%d %d %s\r\n",
+	evbuffer_add_printf(output, "HTTP/%d.%d %d %s\r\n",
 	    req->major, req->minor, req->response_code,
 	    req->response_code_line);
 
 	if (req->major == 1) {
 		if (req->minor == 1)
-			evhttp_maybe_add_date_header(req->output_headers);
+			evhttp_maybe_add_date_header(
+				EVKEYVAL_TABLE(req->output_headers));
 
 		/*
 		 * if the protocol is 1.0; and the connection was keep-alive
 		 * we need to add a keep-alive header, too.
 		 */
 		if (req->minor == 0 && is_keepalive)
-			evhttp_add_header(req->output_headers,
+			evkeyval_table_add(EVKEYVAL_TABLE(req->output_headers),
 			    "Connection", "keep-alive");
 
 		if (req->minor == 1 || is_keepalive) {
@@ -495,7 +534,7 @@ evhttp_make_header_response(struct evhttp_connection *evcon,
 			 * persistent connections to work.
 			 */
 			evhttp_maybe_add_content_length_header(
-				req->output_headers,
+				EVKEYVAL_TABLE(req->output_headers),
 				(long)EVBUFFER_LENGTH(req->output_buffer));
 		}
 	}
@@ -504,7 +543,7 @@ evhttp_make_header_response(struct evhttp_connection *evcon,
 	if (EVBUFFER_LENGTH(req->output_buffer)) {
 		if (evhttp_find_header(req->output_headers,
 			"Content-Type") == NULL) {
-			evhttp_add_header(req->output_headers,
+			evkeyval_table_add(EVKEYVAL_TABLE(req->output_headers),
 			    "Content-Type", "text/html; charset=ISO-8859-1");
 		}
 	}
@@ -513,13 +552,14 @@ evhttp_make_header_response(struct evhttp_connection *evcon,
 	if (evhttp_is_connection_close(req->flags, req->input_headers)) {
 		evhttp_remove_header(req->output_headers, "Connection");
 		if (!(req->flags & EVHTTP_PROXY_REQUEST))
-		    evhttp_add_header(req->output_headers, "Connection", "close");
+		    evkeyval_table_add(EVKEYVAL_TABLE(req->output_headers),
+			"Connection", "close");
 		evhttp_remove_header(req->output_headers, "Proxy-Connection");
 	}
 }
 
-void
-evhttp_make_header(struct evhttp_connection *evcon, struct evhttp_request *req)
+static void
+evhttp_make_header_buffer(struct evbuffer *output, struct evhttp_request *req)
 {
 	struct evkeyval *header;
 
@@ -528,26 +568,51 @@ evhttp_make_header(struct evhttp_connection *evcon, struct evhttp_request *req)
 	 * add some new headers or remove existing headers.
 	 */
 	if (req->kind == EVHTTP_REQUEST) {
-		evhttp_make_header_request(evcon, req);
+		evhttp_make_header_request(output, req);
 	} else {
-		evhttp_make_header_response(evcon, req);
+		evhttp_make_header_response(output, req);
 	}
 
 	TAILQ_FOREACH(header, req->output_headers, next) {
-		evbuffer_add_printf(evcon->output_buffer, "%s: %s\r\n",
+		evbuffer_add_printf(output, "%s: %s\r\n",
 		    header->key, header->value);
 	}
-	evbuffer_add(evcon->output_buffer, "\r\n", 2);
+	evbuffer_add(output, "\r\n", 2);
 
 	if (EVBUFFER_LENGTH(req->output_buffer) > 0) {
 		/*
 		 * For a request, we add the POST data, for a reply, this
-		 * is the regular data.
+		 * is the regular data.  Its segments are moved behind the
+		 * headers, and evhttp_write sends both with one writev.
 		 */
-		evbuffer_add_buffer(evcon->output_buffer, req->output_buffer);
+		evbuffer_add_buffer(output, req->output_buffer);
 	}
 }
 
+void
+evhttp_make_header(struct evhttp_connection *evcon, struct evhttp_request *req)
+{
+	evhttp_make_header_buffer(evcon->output_buffer, req);
+}
+
+/*
+ * Replies to pipelined requests go out in the order of the requests.  The
+ * reply to a request that is not the first on its connection is built in
+ * its output buffer, headers and all, until the replies before it are sent.
+ */
+static void
+evhttp_queue_reply(struct evhttp_request *req)
+{
+	struct evbuffer *buf;
+
+	if ((buf = evbuffer_new()) == NULL)
+		event_err(1, "%s: evbuffer_new", __func__);
+	evhttp_make_header_buffer(buf, req);
+	evbuffer_free(req->output_buffer);
+	req->output_buffer = buf;
+	req->queued = 1;
+}
+
 /* Separated host, port and file from URI */
 
 int
@@ -606,9 +671,11 @@ evhttp_hostportfile(char *url, char **phost, u_short *pport, char **pfile)
 }
 
 static int
-evhttp_connection_incoming_fail(struct evhttp_request *req,
+evhttp_connection_incoming_fail(struct evhttp_connection *evcon,
     enum evhttp_connection_error error)
 {
+	struct evhttp_request *req, *next;
+
 	switch (error) {
 	case EVCON_HTTP_TIMEOUT:
 	case EVCON_HTTP_EOF:
@@ -617,12 +684,17 @@ evhttp_connection_incoming_fail(struct evhttp_request *req,
 		 * close the connection and not send a reply.  this
 		 * case may happen when a browser keeps a persistent
 		 * connection open and we timeout on the read.  when
-		 * the request is still being used for sending, we
-		 * need to disassociated it from the connection here.
+		 * a request is still being used for sending, we
+		 * need to disassociated it from the connection here;
+		 * with pipelining, there may be several of them.
 		 */
-		if (!req->userdone) {
+		for (req = TAILQ_FIRST(&evcon->requests); req != NULL;
+		     req = next) {
+			next = TAILQ_NEXT(req, next);
+			if (req->userdone)
+				continue;
 			/* remove it so that it will not be freed */
-			TAILQ_REMOVE(&req->evcon->requests, req, next);
+			TAILQ_REMOVE(&evcon->requests, req, next);
 			/* indicate that this request no longer has a
 			 * connection object
 			 */
@@ -631,6 +703,10 @@ evhttp_connection_incoming_fail(struct evhttp_request *req,
 		return (-1);
 	case EVCON_HTTP_INVALID_HEADER:
 	default:	/* xxx: probably should just error on default */
+		/* the request being read is bad; nothing more is read */
+		req = TAILQ_LAST(&evcon->requests, evcon_requestq);
+		evcon->state = EVCON_WRITING;
+
 		/* the callback looks at the uri to determine errors */
 		if (req->uri) {
 			free(req->uri);
@@ -652,8 +728,7 @@ evhttp_connection_fail(struct evhttp_connection *evcon,
     enum evhttp_connection_error error)
 {
 	struct evhttp_request* req = TAILQ_FIRST(&evcon->requests);
-	void (*cb)(struct evhttp_request *, void *);
-	void *cb_arg;
+	struct evcon_requestq failed;
 	assert(req != NULL);
 	
 	if (evcon->flags & EVHTTP_CON_INCOMING) {
@@ -665,21 +740,20 @@ evhttp_connection_fail(struct evhttp_connection *evcon,
 		 * For HTTP problems, we might have to send back a
 		 * reply before the connection can be freed.
 		 */
-		if (evhttp_connection_incoming_fail(req, error) == -1)
+		if (evhttp_connection_incoming_fail(evcon, error) == -1)
 			evhttp_connection_free(evcon);
 		return;
 	}
 
-	/* save the callback for later; the cb might free our object */
-	cb = req->cb;
-	cb_arg = req->cb_arg;
-
 	/* do not fail all requests; the next request is going to get
 	 * send over a new connection.   when a user cancels a request,
-	 * all other pending requests should be processed as normal
+	 * all other pending requests should be processed as normal.
+	 * requests that were pipelined behind it are lost with it.
 	 */
+	TAILQ_INIT(&failed);
 	TAILQ_REMOVE(&evcon->requests, req, next);
-	evhttp_request_free(req);
+	TAILQ_INSERT_TAIL(&failed, req, next);
+	evhttp_connection_take_written(evcon, &failed);
 
 	/* reset the connection */
 	evhttp_connection_reset(evcon);
@@ -688,9 +762,47 @@ evhttp_connection_fail(struct evhttp_connection *evcon,
 	if (TAILQ_FIRST(&evcon->requests) != NULL)
 		evhttp_connection_connect(evcon);
 
-	/* inform the user */
-	if (cb != NULL)
-		(*cb)(NULL, cb_arg);
+	/* inform the user; the cb might free our object */
+	evhttp_fail_requests(&failed);
+}
+
+/*
+ * Moves the requests that were written to the server ahead of the
+ * connection closing onto the failed queue.  They are not sent again on
+ * a new connection; the server may have acted on them already.
+ */
+
+static void
+evhttp_connection_take_written(struct evhttp_connection *evcon,
+    struct evcon_requestq *failed)
+{
+	struct evhttp_request *req;
+
+	while ((req = TAILQ_FIRST(&evcon->requests)) != NULL &&
+	    req->kind == EVHTTP_RESPONSE) {
+		TAILQ_REMOVE(&evcon->requests, req, next);
+		TAILQ_INSERT_TAIL(failed, req, next);
+	}
+}
+
+static void
+evhttp_fail_requests(struct evcon_requestq *failed)
+{
+	struct evhttp_request *req;
+	void (*cb)(struct evhttp_request *, void *);
+	void *cb_arg;
+
+	while ((req = TAILQ_FIRST(failed)) != NULL) {
+		/* save the callback for later; the cb might free our object */
+		cb = req->cb;
+		cb_arg = req->cb_arg;
+
+		TAILQ_REMOVE(failed, req, next);
+		evhttp_request_free(req);
+
+		if (cb != NULL)
+			(*cb)(NULL, cb_arg);
+	}
 }
 
 void
@@ -727,6 +839,10 @@ evhttp_write(int fd, short what, void *arg)
 		return;
 	}
 
+	/* a pipelined request was being read before the write */
+	if (evhttp_connection_reading(evcon))
+		evhttp_resume_read(evcon);
+
 	/* Activate our call back */
 	if (evcon->cb != NULL)
 		(*evcon->cb)(evcon, evcon->cb_arg);
@@ -742,8 +858,11 @@ evhttp_write(int fd, short what, void *arg)
 static void
 evhttp_connection_done(struct evhttp_connection *evcon)
 {
-	struct evhttp_request *req = TAILQ_FIRST(&evcon->requests);
+	struct evhttp_request *req = evhttp_request_being_read(evcon);
 	int con_outgoing = evcon->flags & EVHTTP_CON_OUTGOING;
+	struct evcon_requestq failed;
+
+	TAILQ_INIT(&failed);
 
 	if (con_outgoing) {
 		/* idle or close the connection */
@@ -751,15 +870,18 @@ evhttp_connection_done(struct evhttp_connection *evcon)
 		TAILQ_REMOVE(&evcon->requests, req, next);
 		req->evcon = NULL;
 
-		evcon->state = EVCON_IDLE;
-
-		need_close = 
+		need_close = evcon->state == EVCON_DISCONNECTED ||
 		    evhttp_is_connection_close(req->flags, req->input_headers)||
 		    evhttp_is_connection_close(req->flags, req->output_headers);
 
+		evcon->state = EVCON_IDLE;
+
 		/* check if we got asked to close the connection */
-		if (need_close)
+		if (need_close) {
+			/* pipelined requests get no response either */
+			evhttp_connection_take_written(evcon, &failed);
 			evhttp_connection_reset(evcon);
+		}
 
 		if (TAILQ_FIRST(&evcon->requests) != NULL) {
 			/*
@@ -780,9 +902,11 @@ evhttp_connection_done(struct evhttp_connection *evcon)
 	} else if (evcon->state != EVCON_DISCONNECTED) {
 		/*
 		 * incoming connection - we need to leave the request on the
-		 * connection so that we can reply to it.
+		 * connection so that we can reply to it.  the next request
+		 * may be read in the meantime.
 		 */
 		evcon->state = EVCON_WRITING;
+		evhttp_connection_read_next(evcon);
 	}
 
 	/* notify the user of the request */
@@ -791,6 +915,7 @@ evhttp_connection_done(struct evhttp_connection *evcon)
 	/* if this was an outgoing request, we own and it's done. so free it */
 	if (con_outgoing) {
 		evhttp_request_free(req);
+		evhttp_fail_requests(&failed);
 	}
 }
 
@@ -847,9 +972,8 @@ evhttp_handle_chunked_read(struct evhttp_request *req, struct evbuffer *buf)
 			return (MORE_DATA_EXPECTED);
 
 		/* Completed chunk */
-		evbuffer_add(req->input_buffer,
-		    EVBUFFER_DATA(buf), (size_t)req->ntoread);
-		evbuffer_drain(buf, (size_t)req->ntoread);
+		evbuffer_remove_buffer(buf, req->input_buffer,
+		    (size_t)req->ntoread);
 		req->ntoread = -1;
 		if (req->chunk_cb != NULL) {
 			(*req->chunk_cb)(req, req->cb_arg);
@@ -912,9 +1036,8 @@ evhttp_read_body(struct evhttp_connection *evcon, struct evhttp_request *req)
 		evbuffer_add_buffer(req->input_buffer, buf);
 	} else if (EVBUFFER_LENGTH(buf) >= req->ntoread) {
 		/* Completed content length */
-		evbuffer_add(req->input_buffer, EVBUFFER_DATA(buf),
+		evbuffer_remove_buffer(buf, req->input_buffer,
 		    (size_t)req->ntoread);
-		evbuffer_drain(buf, (size_t)req->ntoread);
 		req->ntoread = 0;
 		evhttp_connection_done(evcon);
 		return;
@@ -936,11 +1059,15 @@ void
 evhttp_read(int fd, short what, void *arg)
 {
 	struct evhttp_connection *evcon = arg;
-	struct evhttp_request *req = TAILQ_FIRST(&evcon->requests);
+	struct evhttp_request *req = evhttp_request_being_read(evcon);
 	struct evbuffer *buf = evcon->input_buffer;
 	int n, len;
 
 	if (what == EV_TIMEOUT) {
+		/* the client waits for replies before it sends more */
+		if (evhttp_connection_stop_read_ahead(evcon, req,
+			EVCON_WRITING))
+			return;
 		req->userdone = 1;
 		evhttp_connection_fail(evcon, EVCON_HTTP_TIMEOUT);
 		return;
@@ -959,12 +1086,23 @@ evhttp_read(int fd, short what, void *arg)
 		}
 		return;
 	} else if (n == 0) {
-		/* Connection closed */
+		/* Connection closed; earlier requests still get replies */
+		if (evhttp_connection_stop_read_ahead(evcon, req,
+			EVCON_DISCONNECTED))
+			return;
 		evcon->state = EVCON_DISCONNECTED;
 		evhttp_connection_done(evcon);
 		return;
 	}
 
+	evhttp_read_input(evcon, req);
+}
+
+/* Parses what the input buffer holds for the request being read */
+
+static void
+evhttp_read_input(struct evhttp_connection *evcon, struct evhttp_request *req)
+{
 	switch (evcon->state) {
 	case EVCON_READING_FIRSTLINE:
 		evhttp_read_firstline(evcon, req);
@@ -988,18 +1126,58 @@ evhttp_read(int fd, short what, void *arg)
 	}
 }
 
+/*
+ * Parses input that was read together with an earlier request or
+ * response, from the event loop rather than from deep inside a callback.
+ */
+
+static void
+evhttp_read_more(int fd, short what, void *arg)
+{
+	struct evhttp_connection *evcon = arg;
+
+	/* a write in progress resumes the read when it is done */
+	if (!evhttp_connection_reading(evcon) ||
+	    event_pending(&evcon->ev, EV_WRITE, NULL))
+		return;
+
+	event_del(&evcon->ev);
+	evhttp_read_input(evcon, evhttp_request_being_read(evcon));
+}
+
+/*
+ * A request that is read ahead of replies still to be sent is given up if
+ * the client goes quiet or closes before it sent any of it; the replies go
+ * out all the same.  Returns 1 if the request was given up.
+ */
+
+static int
+evhttp_connection_stop_read_ahead(struct evhttp_connection *evcon,
+    struct evhttp_request *req, enum evhttp_connection_state state)
+{
+	if (!(evcon->flags & EVHTTP_CON_INCOMING) ||
+	    req == TAILQ_FIRST(&evcon->requests) ||
+	    evcon->state != EVCON_READING_FIRSTLINE ||
+	    EVBUFFER_LENGTH(evcon->input_buffer) != 0)
+		return (0);
+
+	TAILQ_REMOVE(&evcon->requests, req, next);
+	evhttp_request_free(req);
+	evcon->state = state;
+	return (1);
+}
+
 static void
 evhttp_write_connectioncb(struct evhttp_connection *evcon, void *arg)
 {
 	/* This is after writing the request to the server */
-	struct evhttp_request *req = TAILQ_FIRST(&evcon->requests);
-	assert(req != NULL);
+	assert(TAILQ_FIRST(&evcon->requests) != NULL);
 
-	assert(evcon->state == EVCON_WRITING);
+	/* a response to an earlier request may be read already */
+	if (evcon->state != EVCON_WRITING)
+		return;
 
 	/* We are done writing our header and are now expecting the response */
-	req->kind = EVHTTP_RESPONSE;
-
 	evhttp_start_read(evcon);
 }
 
@@ -1036,6 +1214,9 @@ evhttp_connection_free(struct evhttp_connection *evcon)
 	if (event_initialized(&evcon->close_ev))
 		event_del(&evcon->close_ev);
 
+	if (event_initialized(&evcon->read_more_ev))
+		event_del(&evcon->read_more_ev);
+
 	if (event_initialized(&evcon->ev))
 		event_del(&evcon->ev);
 	
@@ -1076,10 +1257,17 @@ evhttp_connection_set_local_port(struct evhttp_connection *evcon,
 	evcon->bind_port = port;
 }
 
+/*
+ * Writes the requests that fit into the pipeline of the connection and
+ * were not written yet.  A request that was written while the response to
+ * an earlier one was read is waiting for its own response now.
+ */
+
 static void
 evhttp_request_dispatch(struct evhttp_connection* evcon)
 {
 	struct evhttp_request *req = TAILQ_FIRST(&evcon->requests);
+	int n = 0, written = 0;
 	
 	/* this should not usually happy but it's possible */
 	if (req == NULL)
@@ -1089,12 +1277,30 @@ evhttp_request_dispatch(struct evhttp_connection* evcon)
 	evhttp_connection_stop_detectclose(evcon);
 	
 	/* we assume that the connection is connected already */
-	assert(evcon->state == EVCON_IDLE);
+	assert(evhttp_connected(evcon));
 
-	evcon->state = EVCON_WRITING;
+	if (evcon->state == EVCON_IDLE && req->kind == EVHTTP_RESPONSE)
+		evhttp_start_read(evcon);
 
-	/* Create the header from the store arguments */
-	evhttp_make_header(evcon, req);
+	TAILQ_FOREACH(req, &evcon->requests, next) {
+		if (n++ >= evcon->max_pipeline)
+			break;
+		if (req->kind != EVHTTP_REQUEST)
+			continue;
+
+		/* Create the header from the store arguments */
+		evhttp_make_header(evcon, req);
+
+		/* the response is what we are expecting from now on */
+		req->kind = EVHTTP_RESPONSE;
+		written = 1;
+	}
+
+	if (!written)
+		return;
+
+	if (evcon->state == EVCON_IDLE)
+		evcon->state = EVCON_WRITING;
 
 	evhttp_write_buffer(evcon, evhttp_write_connectioncb, NULL);
 }
@@ -1105,6 +1311,8 @@ evhttp_connection_reset(struct evhttp_connection *evcon)
 {
 	if (event_initialized(&evcon->ev))
 		event_del(&evcon->ev);
+	if (event_initialized(&evcon->read_more_ev))
+		event_del(&evcon->read_more_ev);
 
 	if (evcon->fd != -1) {
 		/* inform interested parties about connection close */
@@ -1238,104 +1446,360 @@ evhttp_valid_response_code(int code)
 	return (1);
 }
 
-/* Parses the status line of a web server */
-
+/* returns 1 if the len bytes at p are the string token */
 static int
-evhttp_parse_response_line(struct evhttp_request *req, char *line)
+evhttp_token_is(const char *p, size_t len, const char *token)
 {
-	char *protocol;
-	char *number;
-	const char *readable = "";
+	return (strlen(token) == len && memcmp(p, token, len) == 0);
+}
 
-	protocol = strsep(&line, " ");
-	if (line == NULL)
-		return (-1);
-	number = strsep(&line, " ");
-	if (line != NULL)
-		readable = line;
+/* Parses the protocol version of the first line */
 
-	if (strcmp(protocol, "HTTP/1.0") == 0) {
+static int
+evhttp_parse_http_version(struct evhttp_request *req,
+    const char *version, size_t len)
+{
+	if (evhttp_token_is(version, len, "HTTP/1.0")) {
 		req->major = 1;
 		req->minor = 0;
-	} else if (strcmp(protocol, "HTTP/1.1") == 0) {
+	} else if (evhttp_token_is(version, len, "HTTP/1.1")) {
 		req->major = 1;
 		req->minor = 1;
 	} else {
-		event_debug(("%s: bad protocol \"%s\"",
-			__func__, protocol));
 		return (-1);
 	}
 
-	req->response_code = atoi(number);
+	return (0);
+}
+
+/*
+ * Copies a string out of the first line.  It gets its own allocation, as
+ * applications may free or replace req->uri and req->response_code_line.
+ */
+static char *
+evhttp_strndup(const char *s, size_t len)
+{
+	char *p;
+
+	if ((p = malloc(len + 1)) != NULL) {
+		memcpy(p, s, len);
+		p[len] = '\0';
+	}
+	return (p);
+}
+
+/*
+ * Parses the status line of a web server.  The line is not nul-terminated;
+ * it is len bytes in the input buffer.
+ */
+
+static int
+evhttp_parse_response_line(struct evhttp_request *req,
+    const char *line, size_t len)
+{
+	const char *end = line + len;
+	const char *number, *readable = end;
+	int code = 0;
+
+	if ((number = memchr(line, ' ', len)) == NULL)
+		return (-1);
+	if (evhttp_parse_http_version(req, line, number - line) == -1) {
+		event_debug(("%s: bad protocol \"%.*s\"",
+			__func__, (int)(number - line), line));
+		return (-1);
+	}
+
+	for (++number; number < end && *number != ' '; ++number) {
+		if (!isdigit((u_char)*number) || code > 999)
+			return (-1);
+		code = code * 10 + (*number - '0');
+	}
+	if (number < end)
+		readable = number + 1;
+
+	req->response_code = code;
 	if (!evhttp_valid_response_code(req->response_code)) {
-		event_debug(("%s: bad response code \"%s\"",
-			__func__, number));
+		event_debug(("%s: bad response code %d",
+			__func__, req->response_code));
 		return (-1);
 	}
 
-	if ((req->response_code_line = strdup(readable)) == NULL)
-		event_err(1, "%s: strdup", __func__);
+	req->response_code_line =
+	    evhttp_strndup(readable, end - readable);
+	if (req->response_code_line == NULL)
+		event_err(1, "%s: malloc", __func__);
 
 	return (0);
 }
 
-/* Parse the first line of a HTTP request */
+/* Parse the first line of a HTTP request; it is len bytes at line */
 
 static int
-evhttp_parse_request_line(struct evhttp_request *req, char *line)
+evhttp_parse_request_line(struct evhttp_request *req,
+    const char *line, size_t len)
 {
-	char *method;
-	char *uri;
-	char *version;
+	const char *end = line + len;
+	const char *uri, *version;
 
 	/* Parse the request line */
-	method = strsep(&line, " ");
-	if (line == NULL)
+	if ((uri = memchr(line, ' ', len)) == NULL)
 		return (-1);
-	uri = strsep(&line, " ");
-	if (line == NULL)
+	++uri;
+	if ((version = memchr(uri, ' ', end - uri)) == NULL)
 		return (-1);
-	version = strsep(&line, " ");
-	if (line != NULL)
+	++version;
+	if (memchr(version, ' ', end - version) != NULL)
 		return (-1);
 
 	/* First line */
-	if (strcmp(method, "GET") == 0) {
+	if (evhttp_token_is(line, uri - line - 1, "GET")) {
 		req->type = EVHTTP_REQ_GET;
-	} else if (strcmp(method, "POST") == 0) {
+	} else if (evhttp_token_is(line, uri - line - 1, "POST")) {
 		req->type = EVHTTP_REQ_POST;
-	} else if (strcmp(method, "HEAD") == 0) {
+	} else if (evhttp_token_is(line, uri - line - 1, "HEAD")) {
 		req->type = EVHTTP_REQ_HEAD;
 	} else {
-		event_debug(("%s: bad method %s on request %p from %s",
-			__func__, method, req, req->remote_host));
+		event_debug(("%s: bad method %.*s on request %p from %s",
+			__func__, (int)(uri - line - 1), line,
+			req, req->remote_host));
 		return (-1);
 	}
 
-	if (strcmp(version, "HTTP/1.0") == 0) {
-		req->major = 1;
-		req->minor = 0;
-	} else if (strcmp(version, "HTTP/1.1") == 0) {
-		req->major = 1;
-		req->minor = 1;
-	} else {
-		event_debug(("%s: bad version %s on request %p from %s",
-			__func__, version, req, req->remote_host));
+	if (evhttp_parse_http_version(req, version, end - version) == -1) {
+		event_debug(("%s: bad version %.*s on request %p from %s",
+			__func__, (int)(end - version), version,
+			req, req->remote_host));
 		return (-1);
 	}
 
-	if ((req->uri = strdup(uri)) == NULL) {
-		event_debug(("%s: strdup", __func__));
+	if ((req->uri = evhttp_strndup(uri, version - uri - 1))
+	    == NULL) {
+		event_debug(("%s: malloc", __func__));
 		return (-1);
 	}
 
 	/* determine if it's a proxy request */
-	if (strlen(req->uri) > 0 && req->uri[0] != '/')
+	if (req->uri[0] != '\0' && req->uri[0] != '/')
 		req->flags |= EVHTTP_PROXY_REQUEST;
 
 	return (0);
 }
 
+/*
+ * Header tables.  A request keeps each set of headers in one allocation:
+ * the nodes and their strings come out of the arena of the table and are
+ * only given back when the table is cleared.  The names of well-known
+ * headers are not copied at all.  The library reaches a table through its
+ * request, and looks headers up by hash until it hands the request to the
+ * application.  The evkeyvalq functions treat every queue as a plain list,
+ * so they stay right however the application edits it with the TAILQ
+ * macros.  They tell the nodes of a table, which they must not free, by
+ * their values: those are kept at odd addresses, which malloc() never
+ * returns.
+ */
+
+#define EVKEYVAL_IN_TABLE(header)	((size_t)(header)->value & 1)
+
+#define EVKEYVAL_ALIGN(n)						\
+	(((n) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+static const char *evkeyval_known_keys[] = {
+	"Host", "Connection", "Content-Length", "Content-Type",
+	"Transfer-Encoding", "Keep-Alive", "Proxy-Connection", "Date",
+	"Accept", "Accept-Encoding", "Accept-Language", "Accept-Charset",
+	"User-Agent", "Referer", "Cookie", "Set-Cookie", "Cache-Control",
+	"If-Modified-Since", "If-None-Match", "Last-Modified", "Expires",
+	"Server", "Location", "Expect", NULL
+};
+
+/* folds case like strcasecmp does for letters */
+static unsigned
+evkeyval_hash(const char *key, size_t len)
+{
+	unsigned hash = 2166136261U;
+
+	for (; len > 0; ++key, --len) {
+		hash ^= (u_char)*key | 0x20;
+		hash *= 16777619U;
+	}
+	return (hash % EVKEYVAL_BUCKETS);
+}
+
+/* frees a header unless it belongs to a table */
+static void
+evkeyval_free(struct evkeyval *header)
+{
+	if (EVKEYVAL_IN_TABLE(header))
+		return;
+	free(header->key);
+	free(header->value);
+	free(header);
+}
+
+struct evkeyval_table *
+evkeyval_table_new(size_t arena_size)
+{
+	struct evkeyval_table *table;
+
+	arena_size = EVKEYVAL_ALIGN(arena_size);
+	if ((table = calloc(1, sizeof(struct evkeyval_table) + arena_size))
+	    == NULL)
+		return (NULL);
+	TAILQ_INIT(&table->headers);
+	table->first.size = arena_size;
+	table->first.data = (u_char *)(table + 1);
+	table->arena = &table->first;
+
+	return (table);
+}
+
+void
+evkeyval_table_clear(struct evkeyval_table *table)
+{
+	struct evkeyval_chunk *chunk;
+	struct evkeyval *header;
+
+	/* frees only the nodes that were linked in by the application */
+	while ((header = TAILQ_FIRST(&table->headers)) != NULL) {
+		TAILQ_REMOVE(&table->headers, header, next);
+		evkeyval_free(header);
+	}
+
+	while ((chunk = table->arena) != &table->first) {
+		table->arena = chunk->next;
+		free(chunk);
+	}
+	table->first.off = 0;
+	memset(table->buckets, 0, sizeof(table->buckets));
+}
+
+void
+evkeyval_table_free(struct evkeyval_table *table)
+{
+	evkeyval_table_clear(table);
+	free(table);
+}
+
+static void *
+evkeyval_table_alloc(struct evkeyval_table *table, size_t size)
+{
+	struct evkeyval_chunk *chunk = table->arena;
+	void *p;
+
+	size = EVKEYVAL_ALIGN(size);
+	if (chunk->size - chunk->off < size) {
+		size_t n = chunk->size ? chunk->size * 2 : 256;
+
+		while (n < size)
+			n *= 2;
+		if ((chunk = malloc(sizeof(struct evkeyval_chunk) + n)) == NULL)
+			return (NULL);
+		chunk->next = table->arena;
+		chunk->size = n;
+		chunk->off = 0;
+		chunk->data = (u_char *)(chunk + 1);
+		table->arena = chunk;
+	}
+
+	p = chunk->data + chunk->off;
+	chunk->off += size;
+	return (p);
+}
+
+static char *
+evkeyval_table_strndup(struct evkeyval_table *table, const char *s,
+    size_t len)
+{
+	char *p;
+
+	if ((p = evkeyval_table_alloc(table, len + 1)) != NULL) {
+		memcpy(p, s, len);
+		p[len] = '\0';
+	}
+	return (p);
+}
+
+/* like evkeyval_table_strndup but at an odd address; see above */
+static char *
+evkeyval_table_value(struct evkeyval_table *table, const char *s,
+    size_t len)
+{
+	char *p;
+
+	if ((p = evkeyval_table_alloc(table, len + 2)) != NULL) {
+		*p++ = '\0';
+		memcpy(p, s, len);
+		p[len] = '\0';
+	}
+	return (p);
+}
+
+int
+evkeyval_table_add(struct evkeyval_table *table,
+    const char *key, const char *value)
+{
+	return (evkeyval_table_addn(table,
+		key, strlen(key), value, strlen(value)));
+}
+
+/* like evkeyval_table_add but the strings need not be nul-terminated */
+int
+evkeyval_table_addn(struct evkeyval_table *table,
+    const char *key, size_t keylen, const char *value, size_t vallen)
+{
+	struct evkeyval_node *node, **tail;
+	const char **known;
+
+	if ((node = evkeyval_table_alloc(table, sizeof(struct evkeyval_node)))
+	    == NULL)
+		goto error;
+	for (known = evkeyval_known_keys; *known != NULL; ++known) {
+		if (**known == *key && strncmp(*known, key, keylen) == 0 &&
+		    (*known)[keylen] == '\0')
+			break;
+	}
+	if (*known != NULL)
+		node->kv.key = (char *)*known;
+	else if ((node->kv.key = evkeyval_table_strndup(table, key, keylen))
+	    == NULL)
+		goto error;
+	if ((node->kv.value = evkeyval_table_value(table, value, vallen))
+	    == NULL)
+		goto error;
+	node->hash_next = NULL;
+
+	/* equal keys stay in the order of the list */
+	if (table->hashed) {
+		for (tail = &table->buckets[evkeyval_hash(key, keylen)];
+		     *tail != NULL; tail = &(*tail)->hash_next)
+			;
+		*tail = node;
+	}
+	TAILQ_INSERT_TAIL(&table->headers, &node->kv, next);
+
+	return (0);
+
+ error:
+	event_warn("%s: malloc", __func__);
+	return (-1);
+}
+
+const char *
+evkeyval_table_find(struct evkeyval_table *table, const char *key)
+{
+	struct evkeyval_node *node;
+
+	if (!table->hashed)
+		return (evhttp_find_header(&table->headers, key));
+
+	for (node = table->buckets[evkeyval_hash(key, strlen(key))];
+	     node != NULL; node = node->hash_next) {
+		if (strcasecmp(node->kv.key, key) == 0)
+			return (node->kv.value);
+	}
+	return (NULL);
+}
+
 const char *
 evhttp_find_header(const struct evkeyvalq *headers, const char *key)
 {
@@ -1358,9 +1822,7 @@ evhttp_clear_headers(struct evkeyvalq *headers)
 	    header != NULL;
 	    header = TAILQ_FIRST(headers)) {
 		TAILQ_REMOVE(headers, header, next);
-		free(header->key);
-		free(header->value);
-		free(header);
+		evkeyval_free(header);
 	}
 }
 
@@ -1384,9 +1846,7 @@ evhttp_remove_header(struct evkeyvalq *headers, const char *key)
 
 	/* Free and remove the header that we found */
 	TAILQ_REMOVE(headers, header, next);
-	free(header->key);
-	free(header->value);
-	free(header);
+	evkeyval_free(header);
 
 	return (0);
 }
@@ -1462,51 +1922,90 @@ evhttp_add_header_internal(struct evkeyvalq *headers,
  *   ALL_DATA_READ       when all headers have been read.
  */
 
+/*
+ * Finds the next line like evbuffer_readline() does, but leaves it in the
+ * buffer: the line is *len bytes at the returned pointer, and draining
+ * *drain bytes also removes its line break.
+ */
+
+static const char *
+evhttp_peek_line(struct evbuffer *buffer, size_t *len, size_t *drain)
+{
+	const char *line;
+	size_t eol_len;
+
+	line = evbuffer_peekln(buffer, len, &eol_len, EVBUFFER_EOL_ANY);
+	if (line == NULL)
+		return (NULL);
+
+	/* the line break is one character or a '\r\n' or '\n\r' pair */
+	*drain = *len + 1;
+	if (*drain == EVBUFFER_LENGTH(buffer) && line[*len] == '\r') {
+		/* wait for the '\n' rather than take it for an empty line */
+		return (NULL);
+	} else if (eol_len > 1 && line[*len + 1] != line[*len]) {
+		*drain += 1;
+	}
+
+	return (line);
+}
+
 enum message_read_status
 evhttp_parse_firstline(struct evhttp_request *req, struct evbuffer *buffer)
 {
-	char *line;
+	const char *line;
+	size_t len, drain;
 	enum message_read_status status = ALL_DATA_READ;
 
-	line = evbuffer_readline(buffer);
+	line = evhttp_peek_line(buffer, &len, &drain);
 	if (line == NULL)
 		return (MORE_DATA_EXPECTED);
 
 	switch (req->kind) {
 	case EVHTTP_REQUEST:
-		if (evhttp_parse_request_line(req, line) == -1)
+		if (evhttp_parse_request_line(req, line, len) == -1)
 			status = DATA_CORRUPTED;
 		break;
 	case EVHTTP_RESPONSE:
-		if (evhttp_parse_response_line(req, line) == -1)
+		if (evhttp_parse_response_line(req, line, len) == -1)
 			status = DATA_CORRUPTED;
 		break;
 	default:
 		status = DATA_CORRUPTED;
 	}
 
-	free(line);
+	evbuffer_drain(buffer, drain);
 	return (status);
 }
 
 static int
-evhttp_append_to_last_header(struct evkeyvalq *headers, const char *line)
+evhttp_append_to_last_header(struct evkeyval_table *table,
+    const char *line, size_t line_len)
 {
-	struct evkeyval *header = TAILQ_LAST(headers, evkeyvalq);
+	struct evkeyval *header = TAILQ_LAST(&table->headers, evkeyvalq);
 	char *newval;
-	size_t old_len, line_len;
+	size_t old_len;
 
 	if (header == NULL)
 		return (-1);
 
 	old_len = strlen(header->value);
-	line_len = strlen(line);
 
-	newval = realloc(header->value, old_len + line_len + 1);
-	if (newval == NULL)
-		return (-1);
+	if (EVKEYVAL_IN_TABLE(header)) {
+		/* keep the value at an odd address like evkeyval_table_value */
+		newval = evkeyval_table_alloc(table, old_len + line_len + 2);
+		if (newval == NULL)
+			return (-1);
+		*newval++ = '\0';
+		memcpy(newval, header->value, old_len);
+	} else {
+		newval = realloc(header->value, old_len + line_len + 1);
+		if (newval == NULL)
+			return (-1);
+	}
 
-	memcpy(newval + old_len, line, line_len + 1);
+	memcpy(newval + old_len, line, line_len);
+	newval[old_len + line_len] = '\0';
 	header->value = newval;
 
 	return (0);
@@ -1515,58 +2014,58 @@ evhttp_append_to_last_header(struct evkeyvalq *headers, const char *line)
 enum message_read_status
 evhttp_parse_headers(struct evhttp_request *req, struct evbuffer* buffer)
 {
-	char *line;
+	const char *line, *colon, *svalue, *end;
+	size_t len, drain;
 	enum message_read_status status = MORE_DATA_EXPECTED;
 
-	struct evkeyvalq* headers = req->input_headers;
-	while ((line = evbuffer_readline(buffer))
-	       != NULL) {
-		char *skey, *svalue;
-
-		if (*line == '\0') { /* Last header - Done */
+	struct evkeyval_table *table = EVKEYVAL_TABLE(req->input_headers);
+	while ((line = evhttp_peek_line(buffer, &len, &drain)) != NULL) {
+		if (len == 0) { /* Last header - Done */
 			status = ALL_DATA_READ;
-			free(line);
+			evbuffer_drain(buffer, drain);
 			break;
 		}
 
 		/* Check if this is a continuation line */
 		if (*line == ' ' || *line == '\t') {
-			if (evhttp_append_to_last_header(headers, line) == -1)
+			if (evhttp_append_to_last_header(table,
+				line, len) == -1)
 				goto error;
-			free(line);
+			evbuffer_drain(buffer, drain);
 			continue;
 		}
 
 		/* Processing of header lines */
-		svalue = line;
-		skey = strsep(&svalue, ":");
-		if (svalue == NULL)
+		end = line + len;
+		if ((colon = memchr(line, ':', len)) == NULL)
 			goto error;
+		for (svalue = colon + 1; svalue < end && *svalue == ' '; ++svalue)
+			;
 
-		svalue += strspn(svalue, " ");
-
-		if (evhttp_add_header(headers, skey, svalue) == -1)
+		/* lines hold no line breaks, so the header is valid */
+		if (evkeyval_table_addn(table, line, colon - line,
+			svalue, end - svalue) == -1)
 			goto error;
 
-		free(line);
+		evbuffer_drain(buffer, drain);
 	}
 
 	return (status);
 
  error:
-	free(line);
+	evbuffer_drain(buffer, drain);
 	return (DATA_CORRUPTED);
 }
 
 static int
 evhttp_get_body_length(struct evhttp_request *req)
 {
-	struct evkeyvalq *headers = req->input_headers;
+	struct evkeyval_table *table = EVKEYVAL_TABLE(req->input_headers);
 	const char *content_length;
 	const char *connection;
 
-	content_length = evhttp_find_header(headers, "Content-Length");
-	connection = evhttp_find_header(headers, "Connection");
+	content_length = evkeyval_table_find(table, "Content-Length");
+	connection = evkeyval_table_find(table, "Connection");
 		
 	if (content_length == NULL && connection == NULL)
 		req->ntoread = -1;
@@ -1608,7 +2107,8 @@ evhttp_get_body(struct evhttp_connection *evcon, struct evhttp_request *req)
 		return;
 	}
 	evcon->state = EVCON_READING_BODY;
-	xfer_enc = evhttp_find_header(req->input_headers, "Transfer-Encoding");
+	xfer_enc = evkeyval_table_find(EVKEYVAL_TABLE(req->input_headers),
+	    "Transfer-Encoding");
 	if (xfer_enc != NULL && strcasecmp(xfer_enc, "chunked") == 0) {
 		req->chunked = 1;
 		req->ntoread = -1;
@@ -1721,6 +2221,7 @@ evhttp_connection_new(const char *address, unsigned short port)
 
 	evcon->timeout = -1;
 	evcon->retry_cnt = evcon->retry_max = 0;
+	evcon->max_pipeline = 1;
 
 	if ((evcon->address = strdup(address)) == NULL) {
 		event_warn("%s: strdup failed", __func__);
@@ -1770,6 +2271,13 @@ evhttp_connection_set_retries(struct evhttp_connection *evcon,
 	evcon->retry_max = retry_max;
 }
 
+void
+evhttp_connection_set_max_pipeline(struct evhttp_connection *evcon,
+    int max)
+{
+	evcon->max_pipeline = max > 1 ? max : 1;
+}
+
 void
 evhttp_connection_set_closecb(struct evhttp_connection *evcon,
     void (*cb)(struct evhttp_connection *, void *), void *cbarg)
@@ -1856,12 +2364,11 @@ evhttp_make_request(struct evhttp_connection *evcon,
 		return (evhttp_connection_connect(evcon));
 
 	/*
-	 * If it's connected already and we are the first in the queue,
+	 * If it's connected already and the pipeline has room for us,
 	 * then we can dispatch this request immediately.  Otherwise, it
 	 * will be dispatched once the pending requests are completed.
 	 */
-	if (TAILQ_FIRST(&evcon->requests) == req)
-		evhttp_request_dispatch(evcon);
+	evhttp_request_dispatch(evcon);
 
 	return (0);
 }
@@ -1875,13 +2382,114 @@ void
 evhttp_start_read(struct evhttp_connection *evcon)
 {
 	/* Set up an event to read the headers */
+	evcon->state = EVCON_READING_FIRSTLINE;
+	evhttp_resume_read(evcon);
+}
+
+/*
+ * Waits for input in the current read state.  While a reply is being
+ * written, the read waits for the write to finish.  Input that was read
+ * ahead already is parsed on the next pass through the loop.
+ */
+
+static void
+evhttp_resume_read(struct evhttp_connection *evcon)
+{
+	if (event_pending(&evcon->ev, EV_WRITE, NULL))
+		return;
+
 	if (event_initialized(&evcon->ev))
 		event_del(&evcon->ev);
 	event_set(&evcon->ev, evcon->fd, EV_READ, evhttp_read, evcon);
 	EVHTTP_BASE_SET(evcon, &evcon->ev);
 	
 	evhttp_add_event(&evcon->ev, evcon->timeout, HTTP_READ_TIMEOUT);
-	evcon->state = EVCON_READING_FIRSTLINE;
+
+	if (EVBUFFER_LENGTH(evcon->input_buffer) != 0) {
+		if (event_initialized(&evcon->read_more_ev))
+			event_del(&evcon->read_more_ev);
+		event_set(&evcon->read_more_ev, -1, 0,
+		    evhttp_read_more, evcon);
+		EVHTTP_BASE_SET(evcon, &evcon->read_more_ev);
+		event_active(&evcon->read_more_ev, EV_READ, 1);
+	}
+}
+
+/* the client sends no more requests after this one */
+
+static int
+evhttp_is_last_request(struct evhttp_request *req)
+{
+	return ((req->minor == 0 &&
+		!evhttp_is_connection_keepalive(req->input_headers)) ||
+	    evhttp_is_connection_close(req->flags, req->input_headers));
+}
+
+/*
+ * Starts to read another request on an incoming connection, unless one is
+ * being read already, the client closed or asked to close the connection,
+ * or the requests before it fill the pipeline of the server.
+ */
+
+static int
+evhttp_connection_read_next(struct evhttp_connection *evcon)
+{
+	struct evhttp_request *req;
+	int n = 0;
+
+	if (evhttp_connection_reading(evcon) ||
+	    evcon->state == EVCON_DISCONNECTED)
+		return (0);
+
+	req = TAILQ_LAST(&evcon->requests, evcon_requestq);
+	if (req != NULL && evhttp_is_last_request(req))
+		return (0);
+
+	TAILQ_FOREACH(req, &evcon->requests, next)
+		++n;
+	if (n >= evcon->http_server->max_pipeline)
+		return (0);
+
+	return (evhttp_associate_new_request_with_connection(evcon));
+}
+
+/* Sends the reply that the first request queued while it waited */
+
+static void
+evhttp_send_queued(struct evhttp_connection *evcon)
+{
+	struct evhttp_request *req = TAILQ_FIRST(&evcon->requests);
+
+	if (req == NULL || !req->queued)
+		return;
+
+	req->queued = 0;
+	evbuffer_add_buffer(evcon->output_buffer, req->output_buffer);
+	evhttp_write_buffer(evcon, req->userdone ? evhttp_send_done : NULL,
+	    NULL);
+}
+
+/*
+ * Lets go of the requests that were handed to the callbacks but are not
+ * answered yet, as the connection is about to close.  Their replies free
+ * them without sending anything.  Queued replies and the request being
+ * read go with the connection.
+ */
+
+static void
+evhttp_connection_detach_pending(struct evhttp_connection *evcon)
+{
+	struct evhttp_request *req, *next, *reading = NULL;
+
+	if (evhttp_connection_reading(evcon))
+		reading = evhttp_request_being_read(evcon);
+	for (req = TAILQ_FIRST(&evcon->requests); req != NULL; req = next) {
+		next = TAILQ_NEXT(req, next);
+		if (req->userdone || req == reading)
+			continue;
+		TAILQ_REMOVE(&evcon->requests, req, next);
+		req->evcon = NULL;
+	}
 }
 
 static void
@@ -1894,22 +2502,31 @@ evhttp_send_done(struct evhttp_connection *evcon, void *arg)
 	/* delete possible close detection events */
 	evhttp_connection_stop_detectclose(evcon);
 	
-	need_close =
-	    (req->minor == 0 &&
-		!evhttp_is_connection_keepalive(req->input_headers))||
-	    evhttp_is_connection_close(req->flags, req->input_headers) ||
+	need_close = evhttp_is_last_request(req) ||
 	    evhttp_is_connection_close(req->flags, req->output_headers);
 
 	assert(req->flags & EVHTTP_REQ_OWN_CONNECTION);
 	evhttp_request_free(req);
 
 	if (need_close) {
+		/* later pipelined requests may still be with the callbacks */
+		evhttp_connection_detach_pending(evcon);
 		evhttp_connection_free(evcon);
 		return;
 	} 
 
+	if (!TAILQ_EMPTY(&evcon->requests)) {
+		/* the reply to the next pipelined request may be ready */
+		evhttp_send_queued(evcon);
+	} else if (evcon->state == EVCON_DISCONNECTED) {
+		/* the client closed after its last request */
+		evhttp_connection_free(evcon);
+		return;
+	}
+
 	/* we have a persistent connection; try to accept another request. */
-	if (evhttp_associate_new_request_with_connection(evcon) == -1)
+	if (evhttp_connection_read_next(evcon) == -1 &&
+	    TAILQ_EMPTY(&evcon->requests))
 		evhttp_connection_free(evcon);
 }
 
@@ -1930,7 +2547,8 @@ evhttp_send_error(struct evhttp_request *req, int error, const char *reason)
 	struct evbuffer *buf = evbuffer_new();
 
 	/* close the connection on error */
-	evhttp_add_header(req->output_headers, "Connection", "close");
+	evkeyval_table_add(EVKEYVAL_TABLE(req->output_headers),
+	    "Connection", "close");
 
 	evhttp_response_code(req, error, reason);
 
@@ -1954,14 +2572,18 @@ evhttp_send(struct evhttp_request *req, struct evbuffer *databuf)
 		return;
 	}
 
-	assert(TAILQ_FIRST(&evcon->requests) == req);
-
 	/* we expect no more calls form the user on this request */
 	req->userdone = 1;
 
 	/* xxx: not sure if we really should expose the data buffer this way */
 	if (databuf != NULL)
 		evbuffer_add_buffer(req->output_buffer, databuf);
+
+	if (req != TAILQ_FIRST(&evcon->requests)) {
+		/* the replies to earlier pipelined requests go first */
+		evhttp_queue_reply(req);
+		return;
+	}
 	
 	/* Adds headers to the response */
 	evhttp_make_header(evcon, req);
@@ -1985,10 +2607,19 @@ evhttp_send_reply_start(struct evhttp_request *req, int code,
 	evhttp_response_code(req, code, reason);
 	if (req->major == 1 && req->minor == 1) {
 		/* use chunked encoding for HTTP/1.1 */
-		evhttp_add_header(req->output_headers, "Transfer-Encoding",
-		    "chunked");
+		evkeyval_table_add(EVKEYVAL_TABLE(req->output_headers),
+		    "Transfer-Encoding", "chunked");
 		req->chunked = 1;
 	}
+	if (req->evcon == NULL) {
+		/* the connection closed; the chunks go nowhere */
+		return;
+	}
+	if (req != TAILQ_FIRST(&req->evcon->requests)) {
+		/* the chunks follow the headers in the queued reply */
+		evhttp_queue_reply(req);
+		return;
+	}
 	evhttp_make_header(req->evcon, req);
 	evhttp_write_buffer(req->evcon, NULL, NULL);
 }
@@ -1997,19 +2628,22 @@ void
 evhttp_send_reply_chunk(struct evhttp_request *req, struct evbuffer *databuf)
 {
 	struct evhttp_connection *evcon = req->evcon;
+	struct evbuffer *output;
 
 	if (evcon == NULL)
 		return;
 
+	output = req->queued ? req->output_buffer : evcon->output_buffer;
 	if (req->chunked) {
-		evbuffer_add_printf(evcon->output_buffer, "%x\r\n",
+		evbuffer_add_printf(output, "%x\r\n",
 				    (unsigned)EVBUFFER_LENGTH(databuf));
 	}
-	evbuffer_add_buffer(evcon->output_buffer, databuf);
+	evbuffer_add_buffer(output, databuf);
 	if (req->chunked) {
-		evbuffer_add(evcon->output_buffer, "\r\n", 2);
+		evbuffer_add(output, "\r\n", 2);
 	}
-	evhttp_write_buffer(evcon, NULL, NULL);
+	if (!req->queued)
+		evhttp_write_buffer(evcon, NULL, NULL);
 }
 
 void
@@ -2025,11 +2659,17 @@ evhttp_send_reply_end(struct evhttp_request *req)
 	/* we expect no more calls form the user on this request */
 	req->userdone = 1;
 
-	if (req->chunked) {
+	if (req->queued) {
+		/* sent with the rest of the queued reply */
+		if (req->chunked) {
+			evbuffer_add(req->output_buffer, "0\r\n\r\n", 5);
+			req->chunked = 0;
+		}
+	} else if (req->chunked) {
 		evbuffer_add(req->evcon->output_buffer, "0\r\n\r\n", 5);
 		evhttp_write_buffer(req->evcon, evhttp_send_done, NULL);
 		req->chunked = 0;
-	} else if (!event_pending(&evcon->ev, EV_WRITE|EV_TIMEOUT, NULL)) {
+	} else if (!event_pending(&evcon->ev, EV_WRITE, NULL)) {
 		/* let the connection know that we are done with the request */
 		evhttp_send_done(evcon, NULL);
 	} else {
@@ -2052,6 +2692,8 @@ evhttp_response_code(struct evhttp_request *req, int code, const char *reason)
 void
 evhttp_send_page(struct evhttp_request *req, struct evbuffer *databuf)
 {
+	struct evkeyval_table *table;
+
 	if (!req->major || !req->minor) {
 		req->major = 1;
 		req->minor = 1;
@@ -2060,9 +2702,10 @@ evhttp_send_page(struct evhttp_request *req, struct evbuffer *databuf)
 	if (req->kind != EVHTTP_RESPONSE)
 		evhttp_response_code(req, 200, "OK");
 
-	evhttp_clear_headers(req->output_headers);
-	evhttp_add_header(req->output_headers, "Content-Type", "text/html");
-	evhttp_add_header(req->output_headers, "Connection", "close");
+	table = EVKEYVAL_TABLE(req->output_headers);
+	evkeyval_table_clear(table);
+	evkeyval_table_add(table, "Content-Type", "text/html");
+	evkeyval_table_add(table, "Connection", "close");
 
 	evhttp_send(req, databuf);
 }
@@ -2209,31 +2852,201 @@ evhttp_parse_query(const char *uri, struct evkeyvalq *headers)
 	free(line);
 }
 
-static struct evhttp_cb *
-evhttp_dispatch_callback(struct httpcbq *callbacks, struct evhttp_request *req)
+/*
+ * The callbacks are indexed for dispatch.  Exact paths are kept in a hash
+ * table; paths that end in '*' are prefixes, kept in a trie, and the
+ * longest prefix that matches wins.  An exact path beats any prefix.  The
+ * TAILQ still holds every callback in the order they were set, and among
+ * equal paths the first one is used, as with the linear scan before.
+ */
+
+#define EVHTTP_CB_TABLE_MIN	64
+
+static unsigned
+evhttp_cb_hash(const char *s, size_t len)
 {
-	struct evhttp_cb *cb;
-	size_t offset = 0;
+	unsigned hash = 2166136261U;
 
-	/* Test for different URLs */
-	char *p = strchr(req->uri, '?');
-	if (p != NULL)
-		offset = (size_t)(p - req->uri);
+	while (len--) {
+		hash ^= (u_char)*s++;
+		hash *= 16777619U;
+	}
+	return (hash);
+}
 
-	TAILQ_FOREACH(cb, callbacks, next) {
-		int res = 0;
-		if (p == NULL) {
-			res = strcmp(cb->what, req->uri) == 0;
-		} else {
-			res = ((strncmp(cb->what, req->uri, offset) == 0) &&
-					(cb->what[offset] == '\0'));
+static void
+evhttp_cb_table_append(struct evhttp_cb **table, size_t size,
+    struct evhttp_cb *cb)
+{
+	struct evhttp_cb **tail = &table[cb->hash & (size - 1)];
+
+	while (*tail != NULL)
+		tail = &(*tail)->hash_next;
+	cb->hash_next = NULL;
+	*tail = cb;
+}
+
+static int
+evhttp_cb_table_grow(struct evhttp *http)
+{
+	size_t size = http->cb_table_size ?
+	    http->cb_table_size * 2 : EVHTTP_CB_TABLE_MIN;
+	struct evhttp_cb **table, *cb, *next;
+	size_t i;
+
+	if ((table = calloc(size, sizeof(struct evhttp_cb *))) == NULL)
+		return (-1);
+	/* equal paths stay in the order they were set */
+	for (i = 0; i < http->cb_table_size; ++i) {
+		for (cb = http->cb_table[i]; cb != NULL; cb = next) {
+			next = cb->hash_next;
+			evhttp_cb_table_append(table, size, cb);
 		}
+	}
+
+	free(http->cb_table);
+	http->cb_table = table;
+	http->cb_table_size = size;
+	return (0);
+}
 
-		if (res)
-			return (cb);
+static struct evhttp_cb_trie *
+evhttp_cb_trie_find(struct evhttp *http, const char *prefix, size_t len,
+    int create)
+{
+	struct evhttp_cb_trie *node, **child;
+
+	if (http->cb_trie == NULL) {
+		if (!create)
+			return (NULL);
+		http->cb_trie = calloc(1, sizeof(struct evhttp_cb_trie));
+		if (http->cb_trie == NULL)
+			return (NULL);
+	}
+
+	node = http->cb_trie;
+	for (; len != 0; ++prefix, --len) {
+		for (child = &node->child;
+		     *child != NULL && (*child)->c != *prefix;
+		     child = &(*child)->sibling)
+			;
+		if (*child == NULL) {
+			if (!create)
+				return (NULL);
+			*child = calloc(1, sizeof(struct evhttp_cb_trie));
+			if (*child == NULL)
+				return (NULL);
+			(*child)->c = *prefix;
+		}
+		node = *child;
 	}
 
-	return (NULL);
+	return (node);
+}
+
+static void
+evhttp_cb_trie_free(struct evhttp_cb_trie *node)
+{
+	struct evhttp_cb_trie *sibling;
+
+	for (; node != NULL; node = sibling) {
+		sibling = node->sibling;
+		evhttp_cb_trie_free(node->child);
+		free(node);
+	}
+}
+
+static int
+evhttp_cb_index_add(struct evhttp *http, struct evhttp_cb *cb)
+{
+	struct evhttp_cb_trie *node;
+	size_t len = strlen(cb->what);
+
+	if (len != 0 && cb->what[len - 1] == '*') {
+		cb->prefix = 1;
+		node = evhttp_cb_trie_find(http, cb->what, len - 1, 1);
+		if (node == NULL)
+			return (-1);
+		if (node->cb == NULL)
+			node->cb = cb;
+		return (0);
+	}
+
+	if (http->n_exact >= http->cb_table_size &&
+	    evhttp_cb_table_grow(http) == -1)
+		return (-1);
+	cb->hash = evhttp_cb_hash(cb->what, len);
+	evhttp_cb_table_append(http->cb_table, http->cb_table_size, cb);
+	http->n_exact++;
+
+	return (0);
+}
+
+static void
+evhttp_cb_index_del(struct evhttp *http, struct evhttp_cb *cb)
+{
+	struct evhttp_cb **pcb, *other;
+	struct evhttp_cb_trie *node;
+
+	if (cb->prefix) {
+		node = evhttp_cb_trie_find(http, cb->what,
+		    strlen(cb->what) - 1, 0);
+		if (node == NULL || node->cb != cb)
+			return;
+		/* a later callback for the same prefix takes over */
+		node->cb = NULL;
+		TAILQ_FOREACH(other, &http->callbacks, next) {
+			if (other != cb && other->prefix &&
+			    strcmp(other->what, cb->what) == 0) {
+				node->cb = other;
+				break;
+			}
+		}
+		return;
+	}
+
+	pcb = &http->cb_table[cb->hash & (http->cb_table_size - 1)];
+	while (*pcb != cb)
+		pcb = &(*pcb)->hash_next;
+	*pcb = cb->hash_next;
+	http->n_exact--;
+}
+
+struct evhttp_cb *
+evhttp_dispatch_callback(struct evhttp *http, const char *uri)
+{
+	struct evhttp_cb *cb, *match = NULL;
+	struct evhttp_cb_trie *node;
+	size_t len, i;
+	unsigned hash;
+
+	/* Test for different URLs; the query does not count */
+	len = strcspn(uri, "?");
+
+	if (http->n_exact != 0) {
+		hash = evhttp_cb_hash(uri, len);
+		for (cb = http->cb_table[hash & (http->cb_table_size - 1)];
+		     cb != NULL; cb = cb->hash_next) {
+			if (cb->hash == hash &&
+			    strncmp(cb->what, uri, len) == 0 &&
+			    cb->what[len] == '\0')
+				return (cb);
+		}
+	}
+
+	/* Otherwise the longest prefix that matches */
+	for (node = http->cb_trie, i = 0; node != NULL; ++i) {
+		if (node->cb != NULL)
+			match = node->cb;
+		if (i == len)
+			break;
+		for (node = node->child;
+		     node != NULL && node->c != uri[i];
+		     node = node->sibling)
+			;
+	}
+
+	return (match);
 }
 
 static void
@@ -2242,6 +3055,9 @@ evhttp_handle_request(struct evhttp_request *req, void *arg)
 	struct evhttp *http = arg;
 	struct evhttp_cb *cb = NULL;
 
+	/* the callbacks may edit the headers with the TAILQ macros */
+	EVKEYVAL_TABLE(req->input_headers)->hashed = 0;
+
 	event_debug(("%s: req->uri=%s", __func__, req->uri));
 	if (req->uri == NULL) {
 		event_debug(("%s: bad request", __func__));
@@ -2255,7 +3071,7 @@ evhttp_handle_request(struct evhttp_request *req, void *arg)
 		return;
 	}
 
-	if ((cb = evhttp_dispatch_callback(&http->callbacks, req)) != NULL) {
+	if ((cb = evhttp_dispatch_callback(http, req->uri)) != NULL) {
 		(*cb->cb)(req, cb->cbarg);
 		return;
 	}
@@ -2372,6 +3188,7 @@ evhttp_new_object(void)
 	}
 
 	http->timeout = -1;
+	http->max_pipeline = 1;
 
 	TAILQ_INIT(&http->sockets);
 	TAILQ_INIT(&http->callbacks);
@@ -2436,6 +3253,8 @@ evhttp_free(struct evhttp* http)
 		free(http_cb->what);
 		free(http_cb);
 	}
+	free(http->cb_table);
+	evhttp_cb_trie_free(http->cb_trie);
 	
 	free(http);
 }
@@ -2446,6 +3265,12 @@ evhttp_set_timeout(struct evhttp* http, int timeout_in_secs)
 	http->timeout = timeout_in_secs;
 }
 
+void
+evhttp_set_max_pipeline(struct evhttp* http, int max)
+{
+	http->max_pipeline = max > 1 ? max : 1;
+}
+
 void
 evhttp_set_cb(struct evhttp *http, const char *uri,
     void (*cb)(struct evhttp_request *, void *), void *cbarg)
@@ -2459,6 +3284,8 @@ evhttp_set_cb(struct evhttp *http, const char *uri,
 	http_cb->cb = cb;
 	http_cb->cbarg = cbarg;
 
+	if (http_cb->what == NULL || evhttp_cb_index_add(http, http_cb) == -1)
+		event_err(1, "%s: malloc", __func__);
 	TAILQ_INSERT_TAIL(&http->callbacks, http_cb, next);
 }
 
@@ -2474,6 +3301,7 @@ evhttp_del_cb(struct evhttp *http, const char *uri)
 	if (http_cb == NULL)
 		return (-1);
 
+	evhttp_cb_index_del(http, http_cb);
 	TAILQ_REMOVE(&http->callbacks, http_cb, next);
 	free(http_cb->what);
 	free(http_cb);
@@ -2497,6 +3325,7 @@ struct evhttp_request *
 evhttp_request_new(void (*cb)(struct evhttp_request *, void *), void *arg)
 {
 	struct evhttp_request *req = NULL;
+	struct evkeyval_table *table;
 
 	/* Allocate request structure */
 	if ((req = calloc(1, sizeof(struct evhttp_request))) == NULL) {
@@ -2505,19 +3334,17 @@ evhttp_request_new(void (*cb)(struct evhttp_request *, void *), void *arg)
 	}
 
 	req->kind = EVHTTP_RESPONSE;
-	req->input_headers = calloc(1, sizeof(struct evkeyvalq));
-	if (req->input_headers == NULL) {
+	if ((table = evkeyval_table_new(EVHTTP_INPUT_HEADERS_SIZE)) == NULL) {
 		event_warn("%s: calloc", __func__);
 		goto error;
 	}
-	TAILQ_INIT(req->input_headers);
+	req->input_headers = &table->headers;
 
-	req->output_headers = calloc(1, sizeof(struct evkeyvalq));
-	if (req->output_headers == NULL) {
+	if ((table = evkeyval_table_new(EVHTTP_OUTPUT_HEADERS_SIZE)) == NULL) {
 		event_warn("%s: calloc", __func__);
 		goto error;
 	}
-	TAILQ_INIT(req->output_headers);
+	req->output_headers = &table->headers;
 
 	if ((req->input_buffer = evbuffer_new()) == NULL) {
 		event_warn("%s: evbuffer_new", __func__);
@@ -2550,11 +3377,10 @@ evhttp_request_free(struct evhttp_request *req)
 	if (req->response_code_line != NULL)
 		free(req->response_code_line);
 
-	evhttp_clear_headers(req->input_headers);
-	free(req->input_headers);
-
-	evhttp_clear_headers(req->output_headers);
-	free(req->output_headers);
+	if (req->input_headers != NULL)
+		evkeyval_table_free(EVKEYVAL_TABLE(req->input_headers));
+	if (req->output_headers != NULL)
+		evkeyval_table_free(EVKEYVAL_TABLE(req->output_headers));
 
 	if (req->input_buffer != NULL)
 		evbuffer_free(req->input_buffer);
@@ -2639,6 +3465,9 @@ evhttp_associate_new_request_with_connection(struct evhttp_connection *evcon)
 	if ((req = evhttp_request_new(evhttp_handle_request, http)) == NULL)
 		return (-1);
 
+	/* nobody else sees the headers until the request is dispatched */
+	EVKEYVAL_TABLE(req->input_headers)->hashed = 1;
+
 	req->evcon = evcon;	/* the request ends up owning the connection */
 	req->flags |= EVHTTP_REQ_OWN_CONNECTION;
 	
@@ -0,0 +1,323 @@
+/*
+ * Copyright (c) 2010 Niels Provos <provos@citi.umich.edu>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// memsearch.c：evbuffer查找行尾和子串所用的查找函数，运行时选择SIMD实现；
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#include <sys/queue.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__) && defined(__GNUC__)
+#define USE_SSE2
+#include <emmintrin.h>
+#endif
+#ifdef HAVE_AVX2_TARGET
+#include <immintrin.h>
+#endif
+
+#include "event.h"
+#include "event-internal.h"
+#include "evbuffer-internal.h"
+
+/*
+ * Each kernel exists in a scalar version and, where the compiler can
+ * build them, in SSE2 and AVX2 versions that compare 16 or 32 bytes at a
+ * time.  The best version the CPU supports is picked on first use, unless
+ * EVENT_NOSIMD is set in the environment.
+ *
+ * Substrings are found by comparing their first and last bytes at every
+ * position of a block at once; only positions where both match are
+ * checked with memcmp.
+ */
+struct evsearch_ops {
+	const char *name;
+	const u_char *(*chr2)(const u_char *, size_t, u_char, u_char);
+	const u_char *(*pair)(const u_char *, size_t, u_char, u_char);
+	const u_char *(*mem)(const u_char *, size_t, const u_char *, size_t);
+};
+
+static const u_char *
+chr2_scalar(const u_char *p, size_t len, u_char a, u_char b)
+{
+	const u_char *end = p + len;
+
+	for (; p < end; ++p) {
+		if (*p == a || *p == b)
+			return (p);
+	}
+
+	return (NULL);
+}
+
+static const u_char *
+pair_scalar(const u_char *p, size_t len, u_char a, u_char b)
+{
+	const u_char *end = p + len;
+
+	while (len >= 2 && (p = memchr(p, a, len - 1)) != NULL) {
+		if (p[1] == b)
+			return (p);
+		++p;
+		len = end - p;
+	}
+
+	return (NULL);
+}
+
+static const u_char *
+mem_scalar(const u_char *p, size_t len, const u_char *what, size_t wlen)
+{
+	const u_char *end = p + len;
+
+	if (wlen == 0)
+		return (p);
+	while (p < end && (p = memchr(p, *what, end - p)) != NULL) {
+		if ((size_t)(end - p) < wlen)
+			break;
+		if (memcmp(p, what, wlen) == 0)
+			return (p);
+		++p;
+	}
+
+	return (NULL);
+}
+
+static const struct evsearch_ops scalar_ops = {
+	"scalar",
+	chr2_scalar,
+	pair_scalar,
+	mem_scalar
+};
+
+#ifdef USE_SSE2
+static const u_char *
+chr2_sse2(const u_char *p, size_t len, u_char a, u_char b)
+{
+	const __m128i va = _mm_set1_epi8((char)a), vb = _mm_set1_epi8((char)b);
+	__m128i x;
+	int mask;
+
+	for (; len >= 16; p += 16, len -= 16) {
+		x = _mm_loadu_si128((const __m128i *)p);
+		mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(x, va),
+			_mm_cmpeq_epi8(x, vb)));
+		if (mask)
+			return (p + __builtin_ctz(mask));
+	}
+
+	return (chr2_scalar(p, len, a, b));
+}
+
+static const u_char *
+pair_sse2(const u_char *p, size_t len, u_char a, u_char b)
+{
+	const __m128i va = _mm_set1_epi8((char)a), vb = _mm_set1_epi8((char)b);
+	__m128i x, y;
+	int mask;
+
+	/* the second load reaches one byte further */
+	for (; len >= 17; p += 16, len -= 16) {
+		x = _mm_loadu_si128((const __m128i *)p);
+		y = _mm_loadu_si128((const __m128i *)(p + 1));
+		mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(x, va),
+			_mm_cmpeq_epi8(y, vb)));
+		if (mask)
+			return (p + __builtin_ctz(mask));
+	}
+
+	return (pair_scalar(p, len, a, b));
+}
+
+static const u_char *
+mem_sse2(const u_char *p, size_t len, const u_char *what, size_t wlen)
+{
+	__m128i first, last, x, y;
+	int mask, bit;
+
+	if (wlen < 2)
+		return (mem_scalar(p, len, what, wlen));
+
+	first = _mm_set1_epi8((char)what[0]);
+	last = _mm_set1_epi8((char)what[wlen - 1]);
+	for (; len >= wlen - 1 + 16; p += 16, len -= 16) {
+		x = _mm_loadu_si128((const __m128i *)p);
+		y = _mm_loadu_si128((const __m128i *)(p + wlen - 1));
+		mask = _mm_movemask_epi8(_mm_and_si128(
+			_mm_cmpeq_epi8(x, first), _mm_cmpeq_epi8(y, last)));
+		while (mask) {
+			bit = __builtin_ctz(mask);
+			if (memcmp(p + bit + 1, what + 1, wlen - 2) == 0)
+				return (p + bit);
+			mask &= mask - 1;
+		}
+	}
+
+	return (mem_scalar(p, len, what, wlen));
+}
+
+static const struct evsearch_ops sse2_ops = {
+	"sse2",
+	chr2_sse2,
+	pair_sse2,
+	mem_sse2
+};
+#endif
+
+#ifdef HAVE_AVX2_TARGET
+#define AVX2	__attribute__((target("avx2")))
+
+static AVX2 const u_char *
+chr2_avx2(const u_char *p, size_t len, u_char a, u_char b)
+{
+	const __m256i va = _mm256_set1_epi8((char)a);
+	const __m256i vb = _mm256_set1_epi8((char)b);
+	__m256i x;
+	unsigned mask;
+
+	for (; len >= 32; p += 32, len -= 32) {
+		x = _mm256_loadu_si256((const __m256i *)p);
+		mask = _mm256_movemask_epi8(_mm256_or_si256(
+			_mm256_cmpeq_epi8(x, va), _mm256_cmpeq_epi8(x, vb)));
+		if (mask)
+			return (p + __builtin_ctz(mask));
+	}
+
+	return (chr2_scalar(p, len, a, b));
+}
+
+static AVX2 const u_char *
+pair_avx2(const u_char *p, size_t len, u_char a, u_char b)
+{
+	const __m256i va = _mm256_set1_epi8((char)a);
+	const __m256i vb = _mm256_set1_epi8((char)b);
+	__m256i x, y;
+	unsigned mask;
+
+	for (; len >= 33; p += 32, len -= 32) {
+		x = _mm256_loadu_si256((const __m256i *)p);
+		y = _mm256_loadu_si256((const __m256i *)(p + 1));
+		mask = _mm256_movemask_epi8(_mm256_and_si256(
+			_mm256_cmpeq_epi8(x, va), _mm256_cmpeq_epi8(y, vb)));
+		if (mask)
+			return (p + __builtin_ctz(mask));
+	}
+
+	return (pair_scalar(p, len, a, b));
+}
+
+static AVX2 const u_char *
+mem_avx2(const u_char *p, size_t len, const u_char *what, size_t wlen)
+{
+	__m256i first, last, x, y;
+	unsigned mask;
+	int bit;
+
+	if (wlen < 2)
+		return (mem_scalar(p, len, what, wlen));
+
+	first = _mm256_set1_epi8((char)what[0]);
+	last = _mm256_set1_epi8((char)what[wlen - 1]);
+	for (; len >= wlen - 1 + 32; p += 32, len -= 32) {
+		x = _mm256_loadu_si256((const __m256i *)p);
+		y = _mm256_loadu_si256((const __m256i *)(p + wlen - 1));
+		mask = _mm256_movemask_epi8(_mm256_and_si256(
+			_mm256_cmpeq_epi8(x, first), _mm256_cmpeq_epi8(y, last)));
+		while (mask) {
+			bit = __builtin_ctz(mask);
+			if (memcmp(p + bit + 1, what + 1, wlen - 2) == 0)
+				return (p + bit);
+			mask &= mask - 1;
+		}
+	}
+
+	return (mem_scalar(p, len, what, wlen));
+}
+
+static const struct evsearch_ops avx2_ops = {
+	"avx2",
+	chr2_avx2,
+	pair_avx2,
+	mem_avx2
+};
+#endif
+
+static const struct evsearch_ops *evsearch_ops;
+
+static const struct evsearch_ops *
+evsearch_select(void)
+{
+	const struct evsearch_ops *ops = &scalar_ops;
+
+	if (evsearch_ops != NULL)
+		return (evsearch_ops);
+
+	if (!evutil_getenv("EVENT_NOSIMD")) {
+#ifdef USE_SSE2
+		ops = &sse2_ops;
+#endif
+#ifdef HAVE_AVX2_TARGET
+		if (__builtin_cpu_supports("avx2"))
+			ops = &avx2_ops;
+#endif
+	}
+
+	/* every thread picks the same, so a race does no harm */
+	evsearch_ops = ops;
+	return (ops);
+}
+
+const u_char *
+evsearch_chr2(const u_char *p, size_t len, u_char a, u_char b)
+{
+	return (evsearch_select()->chr2(p, len, a, b));
+}
+
+const u_char *
+evsearch_pair(const u_char *p, size_t len, u_char a, u_char b)
+{
+	return (evsearch_select()->pair(p, len, a, b));
+}
+
+const u_char *
+evsearch_mem(const u_char *p, size_t len, const u_char *what, size_t wlen)
+{
+	return (evsearch_select()->mem(p, len, what, wlen));
+}
+
+const char *
+evsearch_method(void)
+{
+	return (evsearch_select()->name);
+}
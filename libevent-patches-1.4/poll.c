@@ -64,6 +64,9 @@ struct pollop {
 	int *idxplus1_by_fd; /* Index into event_set by fd; we add 1 so
 			      * that 0 (which is easy to memset) can mean
 			      * "no entry." */
+	struct pollfd *event_set_copy;	/* What we poll on when other
+					 * threads may change event_set */
+	int event_count_copy;		/* Size of event_set_copy */
 };
 
 static void *poll_init	(struct event_base *);
@@ -79,7 +82,8 @@ const struct eventop pollops = {
 	poll_del,
 	poll_dispatch,
 	poll_dealloc,
-    0
+	0,
+	EVENTOP_FEATURE_THREADS
 };
 
 static void *
@@ -138,6 +142,7 @@ poll_dispatch(struct event_base *base, void *arg, struct timeval *tv)
 {
 	int res, i, j, msec = -1, nfds;
 	struct pollop *pop = arg;
+	struct pollfd *event_set;
 
 	poll_check_ok(pop);
 
@@ -145,7 +150,28 @@ poll_dispatch(struct event_base *base, void *arg, struct timeval *tv)
 		msec = tv->tv_sec * 1000 + (tv->tv_usec + 999) / 1000;
 
 	nfds = pop->nfds;
-	res = poll(pop->event_set, nfds, msec);
+	event_set = pop->event_set;
+	if (base->th_base_lock != NULL && nfds > 0) {
+		/* poll_add and poll_del may reshuffle event_set while we
+		 * wait without the lock, so poll on a private copy. */
+		if (pop->event_count_copy < pop->event_count) {
+			struct pollfd *tmp = realloc(pop->event_set_copy,
+			    pop->event_count * sizeof(struct pollfd));
+			if (tmp == NULL) {
+				event_warn("realloc");
+				return (-1);
+			}
+			pop->event_set_copy = tmp;
+			pop->event_count_copy = pop->event_count;
+		}
+		memcpy(pop->event_set_copy, pop->event_set,
+		    nfds * sizeof(struct pollfd));
+		event_set = pop->event_set_copy;
+	}
+
+	EVBASE_RELEASE_LOCK(base);
+	res = poll(event_set, nfds, msec);
+	EVBASE_ACQUIRE_LOCK(base);
 
 	if (res == -1) {
 		if (errno != EINTR) {
@@ -167,14 +193,20 @@ poll_dispatch(struct event_base *base, void *arg, struct timeval *tv)
 	i = random() % nfds;
 	for (j = 0; j < nfds; j++) {
 		struct event *r_ev = NULL, *w_ev = NULL;
-		int what;
+		int what, fd, idx;
 		if (++i == nfds)
 			i = 0;
-		what = pop->event_set[i].revents;
+		what = event_set[i].revents;
 
 		if (!what)
 			continue;
 
+		/* The fd may have moved or gone away while we polled. */
+		fd = event_set[i].fd;
+		if (fd >= pop->fd_count ||
+		    (idx = pop->idxplus1_by_fd[fd] - 1) < 0)
+			continue;
+
 		res = 0;
 
 		/* If the file gets closed notify */
@@ -182,11 +214,11 @@ poll_dispatch(struct event_base *base, void *arg, struct timeval *tv)
 			what |= POLLIN|POLLOUT;
 		if (what & POLLIN) {
 			res |= EV_READ;
-			r_ev = pop->event_r_back[i];
+			r_ev = pop->event_r_back[idx];
 		}
 		if (what & POLLOUT) {
 			res |= EV_WRITE;
-			w_ev = pop->event_w_back[i];
+			w_ev = pop->event_w_back[idx];
 		}
 		if (res == 0)
 			continue;
@@ -374,6 +406,8 @@ poll_dealloc(struct event_base *base, void *arg)
 		free(pop->event_w_back);
 	if (pop->idxplus1_by_fd)
 		free(pop->idxplus1_by_fd);
+	if (pop->event_set_copy)
+		free(pop->event_set_copy);
 
 	memset(pop, 0, sizeof(struct pollop));
 	free(pop);
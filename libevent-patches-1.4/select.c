@@ -71,6 +71,7 @@ typedef unsigned long fd_mask;
 struct selectop {
 	int event_fds;		/* Highest fd in fd set */
 	int event_fdsz;
+	int resize_out_sets;	/* event_*set_out are smaller than fdsz */
 	fd_set *event_readset_in;
 	fd_set *event_writeset_in;
 	fd_set *event_readset_out;
@@ -92,7 +93,8 @@ const struct eventop selectops = {
 	select_del,
 	select_dispatch,
 	select_dealloc,
-	0
+	0,
+	EVENTOP_FEATURE_THREADS
 };
 
 static int select_resize(struct selectop *sop, int fdsz);
@@ -146,18 +148,37 @@ check_selectop(struct selectop *sop)
 static int
 select_dispatch(struct event_base *base, void *arg, struct timeval *tv)
 {
-	int res, i, j;
+	int res, i, j, nfds;
 	struct selectop *sop = arg;
 
 	check_selectop(sop);
 
+	/* The out sets are only touched here, so that select_add can grow
+	 * the in sets while another thread is waiting in select(). */
+	if (sop->resize_out_sets) {
+		fd_set *readset_out, *writeset_out;
+
+		if ((readset_out = realloc(sop->event_readset_out,
+			 sop->event_fdsz)) == NULL)
+			goto error;
+		sop->event_readset_out = readset_out;
+		if ((writeset_out = realloc(sop->event_writeset_out,
+			 sop->event_fdsz)) == NULL)
+			goto error;
+		sop->event_writeset_out = writeset_out;
+		sop->resize_out_sets = 0;
+	}
+
 	memcpy(sop->event_readset_out, sop->event_readset_in,
 	       sop->event_fdsz);
 	memcpy(sop->event_writeset_out, sop->event_writeset_in,
 	       sop->event_fdsz);
+	nfds = sop->event_fds + 1;
 
-	res = select(sop->event_fds + 1, sop->event_readset_out,
+	EVBASE_RELEASE_LOCK(base);
+	res = select(nfds, sop->event_readset_out,
 	    sop->event_writeset_out, NULL, tv);
+	EVBASE_ACQUIRE_LOCK(base);
 
 	check_selectop(sop);
 
@@ -176,10 +197,10 @@ select_dispatch(struct event_base *base, void *arg, struct timeval *tv)
 	event_debug(("%s: select reports %d", __func__, res));
 
 	check_selectop(sop);
-	i = random() % (sop->event_fds+1);
-	for (j = 0; j <= sop->event_fds; ++j) {
+	i = random() % nfds;
+	for (j = 0; j < nfds; ++j) {
 		struct event *r_ev = NULL, *w_ev = NULL;
-		if (++i >= sop->event_fds+1)
+		if (++i >= nfds)
 			i = 0;
 
 		res = 0;
@@ -201,6 +222,10 @@ select_dispatch(struct event_base *base, void *arg, struct timeval *tv)
 	check_selectop(sop);
 
 	return (0);
+
+ error:
+	event_warn("realloc");
+	return (-1);
 }
 
 
@@ -211,8 +236,6 @@ select_resize(struct selectop *sop, int fdsz)
 
 	fd_set *readset_in = NULL;
 	fd_set *writeset_in = NULL;
-	fd_set *readset_out = NULL;
-	fd_set *writeset_out = NULL;
 	struct event **r_by_fd = NULL;
 	struct event **w_by_fd = NULL;
 
@@ -225,15 +248,9 @@ select_resize(struct selectop *sop, int fdsz)
 	if ((readset_in = realloc(sop->event_readset_in, fdsz)) == NULL)
 		goto error;
 	sop->event_readset_in = readset_in;
-	if ((readset_out = realloc(sop->event_readset_out, fdsz)) == NULL)
-		goto error;
-	sop->event_readset_out = readset_out;
 	if ((writeset_in = realloc(sop->event_writeset_in, fdsz)) == NULL)
 		goto error;
 	sop->event_writeset_in = writeset_in;
-	if ((writeset_out = realloc(sop->event_writeset_out, fdsz)) == NULL)
-		goto error;
-	sop->event_writeset_out = writeset_out;
 	if ((r_by_fd = realloc(sop->event_r_by_fd,
 		 n_events*sizeof(struct event*))) == NULL)
 		goto error;
@@ -253,6 +270,7 @@ select_resize(struct selectop *sop, int fdsz)
 	    (n_events-n_events_old) * sizeof(struct event*));
 
 	sop->event_fdsz = fdsz;
+	sop->resize_out_sets = 1;
 	check_selectop(sop);
 
 	return (0);
@@ -58,6 +58,9 @@
 #ifdef HAVE_FCNTL_H
 #include <fcntl.h>
 #endif
+#ifdef HAVE_SYS_SIGNALFD_H
+#include <sys/signalfd.h>
+#endif
 #include <assert.h>
 
 #include "event.h"
@@ -69,6 +72,15 @@
 struct event_base *evsignal_base = NULL;
 
 static void evsignal_handler(int sig);
+static void evsignal_activate(struct event_base *, int, int);
+
+#if defined(HAVE_SIGNALFD) && defined(HAVE_SYS_SIGNALFD_H) && \
+    defined(SFD_NONBLOCK)
+#define USE_SIGNALFD
+static int evsignalfd_init(struct event_base *);
+static int evsignalfd_update(struct event_base *, int, int);
+static void evsignalfd_unblock(struct event_base *, int);
+#endif
 
 #ifdef WIN32
 #define error_is_eagain(err)			\
@@ -110,6 +122,24 @@ evsignal_init(struct event_base *base)
 {
 	int i;
 
+	base->sig.sh_old = NULL;
+	base->sig.sh_old_max = 0;
+	base->sig.evsignal_caught = 0;
+	memset(&base->sig.evsigcaught, 0, sizeof(sig_atomic_t)*NSIG);
+	/* initialize the queues for all events */
+	for (i = 0; i < NSIG; ++i)
+		TAILQ_INIT(&base->sig.evsigevents[i]);
+
+#ifdef USE_SIGNALFD
+	/*
+	 * With signalfd the signals stay blocked and the kernel queues
+	 * them on a descriptor that the loop watches like any other fd,
+	 * so there is no signal handler and nothing to scan.
+	 */
+	if (!evutil_getenv("EVENT_NOSIGNALFD") && evsignalfd_init(base) == 0)
+		return 0;
+#endif
+
 	/* 
 	 * Our signal handler is going to write to one end of the socket
 	 * pair to wake up our event loop.  The event loop then scans for
@@ -129,13 +159,6 @@ evsignal_init(struct event_base *base)
 
 	FD_CLOSEONEXEC(base->sig.ev_signal_pair[0]);
 	FD_CLOSEONEXEC(base->sig.ev_signal_pair[1]);
-	base->sig.sh_old = NULL;
-	base->sig.sh_old_max = 0;
-	base->sig.evsignal_caught = 0;
-	memset(&base->sig.evsigcaught, 0, sizeof(sig_atomic_t)*NSIG);
-	/* initialize the queues for all events */
-	for (i = 0; i < NSIG; ++i)
-		TAILQ_INIT(&base->sig.evsigevents[i]);
 
         evutil_make_socket_nonblocking(base->sig.ev_signal_pair[0]);
         evutil_make_socket_nonblocking(base->sig.ev_signal_pair[1]);
@@ -148,6 +171,118 @@ evsignal_init(struct event_base *base)
 	return 0;
 }
 
+#ifdef USE_SIGNALFD
+/* Read all queued signals off the signalfd and activate their events. */
+static void
+evsignalfd_cb(int fd, short what, void *arg)
+{
+	struct event_base *base = arg;
+	struct signalfd_siginfo info[16];
+	int ncaught[NSIG];
+	ssize_t n;
+	int i, count;
+
+	memset(ncaught, 0, sizeof(ncaught));
+	EVBASE_ACQUIRE_LOCK(base);
+	while ((n = read(fd, info, sizeof(info))) > 0) {
+		count = n / sizeof(info[0]);
+		for (i = 0; i < count; ++i) {
+			if (info[i].ssi_signo < NSIG)
+				ncaught[info[i].ssi_signo]++;
+		}
+		for (i = 0; i < count; ++i) {
+			int signo = info[i].ssi_signo;
+			if (signo < NSIG && ncaught[signo]) {
+				evsignal_activate(base, signo, ncaught[signo]);
+				ncaught[signo] = 0;
+			}
+		}
+	}
+	if (n == -1 && errno != EAGAIN)
+		event_warn("%s: read", __func__);
+	EVBASE_RELEASE_LOCK(base);
+}
+
+static int
+evsignalfd_init(struct event_base *base)
+{
+	struct evsignal_info *sig = &base->sig;
+	sigset_t mask;
+
+	sigemptyset(&mask);
+	sigemptyset(&sig->ev_signalfd_mask);
+	sigemptyset(&sig->ev_signalfd_blocked);
+	sig->ev_signalfd = signalfd(-1, &mask, SFD_NONBLOCK|SFD_CLOEXEC);
+	if (sig->ev_signalfd == -1)
+		return (-1);
+
+	event_set(&sig->ev_signal, sig->ev_signalfd, EV_READ | EV_PERSIST,
+	    evsignalfd_cb, base);
+	sig->ev_signal.ev_base = base;
+	sig->ev_signal.ev_flags |= EVLIST_INTERNAL;
+
+	return (0);
+}
+
+/* Start (add != 0) or stop receiving evsignal through the signalfd. */
+static int
+evsignalfd_update(struct event_base *base, int evsignal, int add)
+{
+	struct evsignal_info *sig = &base->sig;
+	sigset_t set, old;
+
+	sigemptyset(&set);
+	sigaddset(&set, evsignal);
+
+	if (add) {
+		/* the signal must not reach a handler, or it never gets
+		 * queued on the signalfd */
+		if (sigprocmask(SIG_BLOCK, &set, &old) == -1) {
+			event_warn("sigprocmask");
+			return (-1);
+		}
+		if (sigismember(&old, evsignal))
+			sigaddset(&sig->ev_signalfd_blocked, evsignal);
+		sigaddset(&sig->ev_signalfd_mask, evsignal);
+	} else {
+		sigdelset(&sig->ev_signalfd_mask, evsignal);
+	}
+
+	if (signalfd(sig->ev_signalfd, &sig->ev_signalfd_mask, 0) == -1) {
+		event_warn("signalfd");
+		return (-1);
+	}
+
+	if (!add)
+		evsignalfd_unblock(base, evsignal);
+
+	return (0);
+}
+
+/* Undo the blocking done by evsignalfd_update, unless the signal was
+ * blocked before we got to it. */
+static void
+evsignalfd_unblock(struct event_base *base, int evsignal)
+{
+	struct evsignal_info *sig = &base->sig;
+	sigset_t set, pending;
+	struct timespec ts = { 0, 0 };
+
+	if (sigismember(&sig->ev_signalfd_blocked, evsignal)) {
+		sigdelset(&sig->ev_signalfd_blocked, evsignal);
+		return;
+	}
+
+	sigemptyset(&set);
+	sigaddset(&set, evsignal);
+	/* nobody wants an instance that is still queued; unblocking would
+	 * run the default action on it */
+	if (sigpending(&pending) == 0 && sigismember(&pending, evsignal))
+		sigtimedwait(&set, NULL, &ts);
+	sigprocmask(SIG_UNBLOCK, &set, NULL);
+}
+#endif
+
 /* Helper: set the signal handler for evsignal to handler in base, so that
  * we can restore the original handler when we clear the current one. */
 // 设置信号响应函数
@@ -236,7 +371,7 @@ _evsignal_set_handler(struct event_base *base,
 int
 evsignal_add(struct event *ev)
 {
-	int evsignal;
+	int evsignal, res;
 	// 获取事件中的反应堆
 	struct event_base *base = ev->ev_base;
 	// 获取事件中的信号
@@ -254,9 +389,15 @@ evsignal_add(struct event *ev)
 	if (TAILQ_EMPTY(&sig->evsigevents[evsignal])) {
 		// 输出信息
 		event_debug(("%s: %p: changing signal handler", __func__, ev));
-		// 设置信号响应函数
-		if (_evsignal_set_handler(
-			    base, evsignal, evsignal_handler) == -1)
+		// 设置信号响应函数，使用signalfd时改为阻塞该信号
+#ifdef USE_SIGNALFD
+		if (sig->ev_signalfd != -1)
+			res = evsignalfd_update(base, evsignal, 1);
+		else
+#endif
+			res = _evsignal_set_handler(
+			    base, evsignal, evsignal_handler);
+		if (res == -1)
 			return (-1);
 
 		/* catch signals if they happen quickly */
@@ -325,6 +466,10 @@ evsignal_del(struct event *ev)
 
 	event_debug(("%s: %p: restoring signal handler", __func__, ev));
 
+#ifdef USE_SIGNALFD
+	if (sig->ev_signalfd != -1)
+		return (evsignalfd_update(base, evsignal, 0));
+#endif
 	return (_evsignal_restore_handler(ev->ev_base, EVENT_SIGNAL(ev)));
 }
 
@@ -366,11 +511,25 @@ evsignal_handler(int sig)
 	errno = save_errno;
 }
 
+/* Activate every event waiting for evsignal, which arrived ncalls times. */
+static void
+evsignal_activate(struct event_base *base, int evsignal, int ncalls)
+{
+	struct event *ev, *next_ev;
+
+	for (ev = TAILQ_FIRST(&base->sig.evsigevents[evsignal]);
+	    ev != NULL; ev = next_ev) {
+		next_ev = TAILQ_NEXT(ev, ev_signal_next);
+		if (!(ev->ev_events & EV_PERSIST))
+			event_del(ev);
+		event_active(ev, EV_SIGNAL, ncalls);
+	}
+}
+
 void
 evsignal_process(struct event_base *base)
 {
 	struct evsignal_info *sig = &base->sig;
-	struct event *ev, *next_ev;
 	sig_atomic_t ncalls;
 	int i;
 	
@@ -381,14 +540,7 @@ evsignal_process(struct event_base *base)
 			continue;
 		sig->evsigcaught[i] -= ncalls;
 
-		for (ev = TAILQ_FIRST(&sig->evsigevents[i]);
-		    ev != NULL; ev = next_ev) {
-			next_ev = TAILQ_NEXT(ev, ev_signal_next);
-			if (!(ev->ev_events & EV_PERSIST))
-				event_del(ev);
-			event_active(ev, EV_SIGNAL, ncalls);
-		}
-
+		evsignal_activate(base, i, ncalls);
 	}
 }
 
@@ -400,6 +552,19 @@ evsignal_dealloc(struct event_base *base)
 		event_del(&base->sig.ev_signal);
 		base->sig.ev_signal_added = 0;
 	}
+#ifdef USE_SIGNALFD
+	if (base->sig.ev_signalfd != -1) {
+		/* a forked child shares the signalfd with its parent, so
+		 * leave its mask alone and only undo our blocking */
+		for (i = 1; i < NSIG; ++i) {
+			if (sigismember(&base->sig.ev_signalfd_mask, i))
+				evsignalfd_unblock(base, i);
+		}
+		sigemptyset(&base->sig.ev_signalfd_mask);
+		close(base->sig.ev_signalfd);
+		base->sig.ev_signalfd = -1;
+	}
+#endif
 	for (i = 0; i < NSIG; ++i) {
 		if (i < base->sig.sh_old_max && base->sig.sh_old[i] != NULL)
 			_evsignal_restore_handler(base, i);
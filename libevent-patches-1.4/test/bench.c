@@ -58,24 +58,41 @@
 #include <evutil.h>
 
 
-static int count, writes, fired;
+#define MAX_BURST 64
+
+static int count, writes, fired, dispatches;
 static int *pipes;
-static int num_pipes, num_active, num_writes;
+static int num_pipes, num_active, num_writes, burst = 1;
+static short ev_flags;
 static struct event *events;
+static struct event_base *base;
+static const struct timeval *timeout;
+static const char burstbuf[MAX_BURST];
 
 static void
 read_cb(int fd, short which, void *arg)
 {
 	long idx = (long) arg, widx = idx + 1;
 	u_char ch;
+	int n;
+
+	/*
+	 * Consume one byte per wakeup, like a reader that stops at a
+	 * watermark; edge-triggered readers have to go on until EAGAIN.
+	 */
+	do {
+		if ((n = read(fd, &ch, sizeof(ch))) > 0)
+			count += n;
+	} while (n > 0 && (ev_flags & EV_ET));
 
-	count += read(fd, &ch, sizeof(ch));
+	if (timeout != NULL)
+		event_add(&events[idx], timeout);
 	if (writes) {
 		if (widx >= num_pipes)
 			widx -= num_pipes;
-		write(pipes[2 * widx + 1], "e", 1);
+		write(pipes[2 * widx + 1], burstbuf, burst);
 		writes--;
-		fired++;
+		fired += burst;
 	}
 }
 
@@ -88,29 +105,37 @@ run_once(void)
 
 	for (cp = pipes, i = 0; i < num_pipes; i++, cp += 2) {
 		event_del(&events[i]);
-		event_set(&events[i], cp[0], EV_READ | EV_PERSIST, read_cb, (void *) i);
-		event_add(&events[i], NULL);
+		event_set(&events[i], cp[0], EV_READ | EV_PERSIST | ev_flags,
+		    read_cb, (void *) i);
+		event_base_set(base, &events[i]);
+		if (event_add(&events[i], timeout) == -1) {
+			fprintf(stderr, "event_add failed; %s cannot do "
+			    "edge-triggered events?\n",
+			    event_base_get_method(base));
+			return (NULL);
+		}
 	}
 
-	event_loop(EVLOOP_ONCE | EVLOOP_NONBLOCK);
+	event_base_loop(base, EVLOOP_ONCE | EVLOOP_NONBLOCK);
 
 	fired = 0;
 	space = num_pipes / num_active;
 	space = space * 2;
-	for (i = 0; i < num_active; i++, fired++)
-		write(pipes[i * space + 1], "e", 1);
+	for (i = 0; i < num_active; i++, fired += burst)
+		write(pipes[i * space + 1], burstbuf, burst);
 
 	count = 0;
 	writes = num_writes;
 	{ int xcount = 0;
 	gettimeofday(&ts, NULL);
 	do {
-		event_loop(EVLOOP_ONCE | EVLOOP_NONBLOCK);
+		event_base_loop(base, EVLOOP_ONCE | EVLOOP_NONBLOCK);
 		xcount++;
 	} while (count != fired);
 	gettimeofday(&te, NULL);
 
-	if (xcount != count) fprintf(stderr, "Xcount: %d, Rcount: %d\n", xcount, count);
+	/* every loop iteration is exactly one epoll_wait/poll/select */
+	dispatches += xcount;
 	}
 
 	evutil_timersub(&te, &ts, &te);
@@ -124,14 +149,14 @@ main (int argc, char **argv)
 #ifndef WIN32
 	struct rlimit rl;
 #endif
-	int i, c;
-	struct timeval *tv;
+	int i, c, flags = 0, common = 0;
+	struct timeval *tv, tv_timeout;
 	int *cp;
 
 	num_pipes = 100;
 	num_active = 1;
 	num_writes = num_pipes;
-	while ((c = getopt(argc, argv, "n:a:w:")) != -1) {
+	while ((c = getopt(argc, argv, "n:a:w:tTceb:")) != -1) {
 		switch (c) {
 		case 'n':
 			num_pipes = atoi(optarg);
@@ -142,6 +167,31 @@ main (int argc, char **argv)
 		case 'w':
 			num_writes = atoi(optarg);
 			break;
+		case 't':
+			/* re-arm a timeout on every read, like bufferevents */
+			tv_timeout.tv_sec = 10;
+			tv_timeout.tv_usec = 0;
+			timeout = &tv_timeout;
+			break;
+		case 'T':
+			flags |= EVENT_BASE_FLAG_TIMERWHEEL;
+			break;
+		case 'c':
+			/* share one timeout queue among all events */
+			common = 1;
+			break;
+		case 'e':
+			ev_flags |= EV_ET;
+			break;
+		case 'b':
+			/* bytes per write; readers take one byte per wakeup */
+			burst = atoi(optarg);
+			if (burst < 1 || burst > MAX_BURST) {
+				fprintf(stderr, "burst must be 1..%d\n",
+				    MAX_BURST);
+				exit(1);
+			}
+			break;
 		default:
 			fprintf(stderr, "Illegal argument \"%c\"\n", c);
 			exit(1);
@@ -163,7 +213,9 @@ main (int argc, char **argv)
 		exit(1);
 	}
 
-	event_init();
+	base = event_base_new_with_flags(flags);
+	if (common && timeout != NULL)
+		timeout = event_base_init_common_timeout(base, timeout);
 
 	for (cp = pipes, i = 0; i < num_pipes; i++, cp += 2) {
 #ifdef USE_PIPES
@@ -174,6 +226,8 @@ main (int argc, char **argv)
 			perror("pipe");
 			exit(1);
 		}
+		if (ev_flags & EV_ET)
+			evutil_make_socket_nonblocking(cp[0]);
 	}
 
 	for (i = 0; i < 25; i++) {
@@ -184,5 +238,8 @@ main (int argc, char **argv)
 			tv->tv_sec * 1000000L + tv->tv_usec);
 	}
 
+	fprintf(stderr, "%s: %d dispatch calls per run\n",
+	    event_base_get_method(base), dispatches / 25);
+
 	exit(0);
 }
@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2010 Niels Provos <provos@citi.umich.edu>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// bench_http.c：比较HTTP服务器按URI查找回调的开销与注册的路由数的关系；
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/queue.h>
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <sys/socket.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <event.h>
+#include <evhttp.h>
+#include <evutil.h>
+#include "http-internal.h"
+
+/*
+ * Registers more and more routes with an HTTP server and times how long it
+ * takes to find the callback for a request, next to the scan over all
+ * callbacks that evhttp_dispatch_callback did before they were indexed.
+ */
+
+static int iterations = 1000000;
+static size_t sink;
+
+static void
+route_cb(struct evhttp_request *req, void *arg)
+{
+}
+
+/* the linear scan that the index replaced */
+static struct evhttp_cb *
+dispatch_linear(struct evhttp *http, const char *uri)
+{
+	struct evhttp_cb *cb;
+	size_t offset = 0;
+	char *p = strchr(uri, '?');
+
+	if (p != NULL)
+		offset = (size_t)(p - uri);
+
+	TAILQ_FOREACH(cb, &http->callbacks, next) {
+		int res = 0;
+		if (p == NULL) {
+			res = strcmp(cb->what, uri) == 0;
+		} else {
+			res = ((strncmp(cb->what, uri, offset) == 0) &&
+					(cb->what[offset] == '\0'));
+		}
+
+		if (res)
+			return (cb);
+	}
+
+	return (NULL);
+}
+
+static double
+time_dispatch(struct evhttp_cb *(*dispatch)(struct evhttp *, const char *),
+    struct evhttp *http, const char *uri, int n)
+{
+	struct timeval ts, te;
+	int i;
+
+	gettimeofday(&ts, NULL);
+	for (i = 0; i < n; ++i)
+		sink += (size_t)dispatch(http, uri);
+	gettimeofday(&te, NULL);
+	evutil_timersub(&te, &ts, &te);
+
+	return ((te.tv_sec * 1e9 + te.tv_usec * 1e3) / n);
+}
+
+static void
+bench_routes(int nroutes)
+{
+	struct evhttp *http = evhttp_new(NULL);
+	char uri[64];
+	int i, n;
+
+	for (i = 0; i < nroutes; ++i) {
+		evutil_snprintf(uri, sizeof(uri), "/api/v1/resource%d/items", i);
+		evhttp_set_cb(http, uri, route_cb, NULL);
+	}
+	evhttp_set_cb(http, "/static/*", route_cb, NULL);
+
+	/* the last route is the worst case for the scan */
+	evutil_snprintf(uri, sizeof(uri), "/api/v1/resource%d/items?limit=10",
+	    nroutes - 1);
+	n = iterations / nroutes > 1000 ? iterations / nroutes : 1000;
+
+	fprintf(stdout, "%6d %10.1f %10.1f %10.1f %10.1f\n", nroutes,
+	    time_dispatch(dispatch_linear, http, uri, n),
+	    time_dispatch(evhttp_dispatch_callback, http, uri, iterations),
+	    time_dispatch(evhttp_dispatch_callback, http,
+		"/static/css/site.min.css?v=20101014", iterations),
+	    time_dispatch(evhttp_dispatch_callback, http,
+		"/api/v2/missing", iterations));
+
+	evhttp_free(http);
+}
+
+int
+main(int argc, char **argv)
+{
+	int c, nroutes;
+
+	while ((c = getopt(argc, argv, "n:")) != -1) {
+		switch (c) {
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Illegal argument \"%c\"\n", c);
+			exit(1);
+		}
+	}
+	if (iterations <= 0)
+		iterations = 1;
+
+	fprintf(stdout, "%6s %10s %10s %10s %10s   (ns/dispatch)\n",
+	    "routes", "linear", "exact", "prefix", "miss");
+	for (nroutes = 1; nroutes <= 10000; nroutes *= 10)
+		bench_routes(nroutes);
+
+	return (sink == 0);
+}
@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2010 Niels Provos <provos@citi.umich.edu>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// bench_search.c：比较evbuffer查找函数与逐字节查找在HTTP头部上的速度；
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/time.h>
+#ifdef WIN32
+#include <windows.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <event.h>
+#include <evutil.h>
+#include "evbuffer-internal.h"
+
+/*
+ * Runs each search over a typical browser request header block and prints
+ * the time per block, next to the byte-by-byte loops that evbuffer_find
+ * and evbuffer_readline used before.  Set EVENT_NOSIMD to time the scalar
+ * kernels instead.
+ */
+
+static const char header_block[] =
+    "GET /static/css/site.min.css?v=20101014 HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; U; Linux x86_64; en-US; rv:1.9.2.10) "
+    "Gecko/20100915 Ubuntu/10.04 (lucid) Firefox/3.6.10\r\n"
+    "Accept: text/css,*/*;q=0.1\r\n"
+    "Accept-Language: en-us,en;q=0.5\r\n"
+    "Accept-Encoding: gzip,deflate\r\n"
+    "Accept-Charset: ISO-8859-1,utf-8;q=0.7,*;q=0.7\r\n"
+    "Keep-Alive: 115\r\n"
+    "Connection: keep-alive\r\n"
+    "Referer: http://www.example.com/articles/2010/10/event-loops.html\r\n"
+    "Cookie: __utma=111872281.1791345466.1286800000.1287000000.1287100000.4; "
+    "__utmz=111872281.1286800000.1.1.utmcsr=(direct)|utmccn=(direct)|"
+    "utmcmd=(none); session=0123456789abcdef0123456789abcdef\r\n"
+    "If-Modified-Since: Wed, 13 Oct 2010 18:02:11 GMT\r\n"
+    "If-None-Match: \"5c1f-492b6a3c2f6c0\"\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "\r\n";
+
+static int iterations = 200000;
+static size_t sink;
+
+static const u_char *
+chr2_bytewise(const u_char *p, size_t len, u_char a, u_char b)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (p[i] == a || p[i] == b)
+			return (p + i);
+	}
+	return (NULL);
+}
+
+static const u_char *
+mem_bytewise(const u_char *p, size_t len, const u_char *what, size_t wlen)
+{
+	const u_char *end = p + len, *q;
+
+	while (p < end && (q = memchr(p, *what, end - p)) != NULL) {
+		if (q + wlen > end)
+			break;
+		if (memcmp(q, what, wlen) == 0)
+			return (q);
+		p = q + 1;
+	}
+	return (NULL);
+}
+
+static void
+report(const char *what, struct timeval *ts)
+{
+	struct timeval te;
+
+	gettimeofday(&te, NULL);
+	evutil_timersub(&te, ts, &te);
+	fprintf(stdout, "%-28s %8.1f ns/block\n", what,
+	    (te.tv_sec * 1e9 + te.tv_usec * 1e3) / iterations);
+}
+
+/* finds every line end in the block, the way header parsing does */
+static void
+bench_lines(const u_char *(*chr2)(const u_char *, size_t, u_char, u_char),
+    const char *name)
+{
+	const u_char *data = (const u_char *)header_block, *p, *end;
+	size_t len = sizeof(header_block) - 1;
+	struct timeval ts;
+	int i;
+
+	gettimeofday(&ts, NULL);
+	for (i = 0; i < iterations; ++i) {
+		end = data + len;
+		for (p = data; (p = chr2(p, end - p, '\r', '\n')) != NULL;
+		     p += 2)
+			sink += p - data;
+	}
+	report(name, &ts);
+}
+
+static void
+bench_find(const u_char *(*mem)(const u_char *, size_t, const u_char *,
+	size_t), const char *name)
+{
+	const u_char *data = (const u_char *)header_block;
+	size_t len = sizeof(header_block) - 1;
+	struct timeval ts;
+	int i;
+
+	gettimeofday(&ts, NULL);
+	for (i = 0; i < iterations; ++i)
+		sink += mem(data, len, (const u_char *)"\r\n\r\n", 4) - data;
+	report(name, &ts);
+}
+
+static void
+bench_readline(void)
+{
+	struct evbuffer *buf = evbuffer_new();
+	struct timeval ts;
+	char *line;
+	int i;
+
+	gettimeofday(&ts, NULL);
+	for (i = 0; i < iterations; ++i) {
+		evbuffer_add(buf, header_block, sizeof(header_block) - 1);
+		while ((line = evbuffer_readline(buf)) != NULL) {
+			sink += strlen(line);
+			free(line);
+		}
+	}
+	report("evbuffer_readline", &ts);
+	evbuffer_free(buf);
+}
+
+int
+main(int argc, char **argv)
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "n:")) != -1) {
+		switch (c) {
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Illegal argument \"%c\"\n", c);
+			exit(1);
+		}
+	}
+	if (iterations <= 0)
+		iterations = 1;
+
+	fprintf(stdout, "%u byte header block, %s kernels\n",
+	    (unsigned)sizeof(header_block) - 1, evsearch_method());
+
+	bench_lines(chr2_bytewise, "line ends, bytewise");
+	bench_lines(evsearch_chr2, "line ends, evsearch_chr2");
+	bench_find(mem_bytewise, "end of headers, memchr");
+	bench_find(evsearch_mem, "end of headers, evsearch_mem");
+	bench_readline();
+
+	return (sink == 0);
+}
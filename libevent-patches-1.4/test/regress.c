@@ -397,6 +397,166 @@ test_simplewrite(void)
 	cleanup_test();
 }
 
+static void
+edge_read_cb(int fd, short event, void *arg)
+{
+	char ch;
+
+	/* leave the rest of the data in the socket on purpose */
+	if (read(fd, &ch, 1) != 1)
+		test_ok = 0;
+	++called;
+}
+
+static void
+test_edgetriggered(void)
+{
+	struct event ev;
+	int i;
+
+	setup_test("Edge-triggered: ");
+
+	write(pair[0], TEST1, strlen(TEST1)+1);
+
+	event_set(&ev, pair[1], EV_READ|EV_ET|EV_PERSIST, edge_read_cb, &ev);
+	if (event_add(&ev, NULL) == -1) {
+		/* only epoll and io_uring can do edge-triggered events */
+		test_ok = strcmp(event_get_method(), "epoll") != 0 &&
+		    strcmp(event_get_method(), "io_uring") != 0;
+		cleanup_test();
+		return;
+	}
+
+	test_ok = 1;
+	for (i = 0; i < 5; ++i)
+		event_loop(EVLOOP_NONBLOCK);
+	if (called != 1)
+		test_ok = 0;
+
+	/* new data is a new edge */
+	write(pair[0], TEST1, strlen(TEST1)+1);
+	for (i = 0; i < 5; ++i)
+		event_loop(EVLOOP_NONBLOCK);
+	if (called != 2)
+		test_ok = 0;
+
+	event_del(&ev);
+	cleanup_test();
+}
+
+static void
+reuse_read_cb(int fd, short event, void *arg)
+{
+	char buf[256];
+
+	if (event & EV_TIMEOUT)
+		return;
+	test_ok = read(fd, buf, sizeof(buf)) == strlen(TEST1)+1;
+}
+
+static void
+test_fdreuse(void)
+{
+	struct event ev;
+	struct timeval tv;
+
+	setup_test("Reused fd: ");
+
+	/* let the backend pick up the old fd */
+	event_set(&ev, pair[1], EV_READ, reuse_read_cb, &ev);
+	if (event_add(&ev, NULL) == -1)
+		exit(1);
+	event_loop(EVLOOP_NONBLOCK);
+
+	/* delete, close and add its successor without running the loop */
+	event_del(&ev);
+	close(pair[0]);
+	close(pair[1]);
+	if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1) {
+		fprintf(stderr, "%s: socketpair\n", __func__);
+		exit(1);
+	}
+
+	write(pair[0], TEST1, strlen(TEST1)+1);
+	tv.tv_sec = 2;
+	tv.tv_usec = 0;
+	event_set(&ev, pair[1], EV_READ, reuse_read_cb, &ev);
+	if (event_add(&ev, &tv) == -1)
+		exit(1);
+	event_dispatch();
+
+	cleanup_test();
+}
+
+static void
+test_delclose(void)
+{
+	struct event ev;
+	char buf[256];
+
+	setup_test("Deleted fd closed without running the loop: ");
+
+	event_set(&ev, pair[1], EV_READ, simple_read_cb, &ev);
+	if (event_add(&ev, NULL) == -1)
+		exit(1);
+	event_loop(EVLOOP_NONBLOCK);
+
+	/* the peer has to see the close before the loop runs again */
+	event_del(&ev);
+	close(pair[1]);
+	pair[1] = -1;
+	test_ok = read(pair[0], buf, sizeof(buf)) == 0;
+
+	cleanup_test();
+}
+
+static void
+dupclose_read_cb(int fd, short event, void *arg)
+{
+	/* only the old file behind the dup has data */
+	test_ok = event == EV_TIMEOUT;
+}
+
+static void
+test_dupclose(void)
+{
+	struct event ev;
+	struct timeval tv;
+	int dupfd, newpair[2];
+
+	setup_test("Deleted fd closed with a dup open: ");
+
+	event_set(&ev, pair[1], EV_READ, dupclose_read_cb, &ev);
+	if (event_add(&ev, NULL) == -1)
+		exit(1);
+	event_loop(EVLOOP_NONBLOCK);
+
+	if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, newpair) == -1) {
+		fprintf(stderr, "%s: socketpair\n", __func__);
+		exit(1);
+	}
+
+	/* the dup keeps the file alive after the close */
+	dupfd = dup(pair[1]);
+	event_del(&ev);
+	write(pair[0], TEST1, strlen(TEST1)+1);
+
+	/* close the fd by putting a new, idle socket at its number */
+	dup2(newpair[1], pair[1]);
+	close(newpair[1]);
+
+	tv.tv_sec = 1;
+	tv.tv_usec = 0;
+	event_set(&ev, pair[1], EV_READ, dupclose_read_cb, &ev);
+	if (event_add(&ev, &tv) == -1)
+		exit(1);
+	event_dispatch();
+
+	close(dupfd);
+	close(newpair[0]);
+	cleanup_test();
+}
+
 static void
 test_multiple(void)
 {
@@ -426,6 +586,177 @@ test_multiple(void)
 	cleanup_test();
 }
 
+#define ASYNC_LEN	100000
+
+static int async_failed;
+
+static void
+async_write_cb(struct evbuffer *buf, int res, void *arg)
+{
+	struct event_base *base = arg;
+
+	if (res <= 0 || (EVBUFFER_LENGTH(buf) &&
+		evbuffer_write_async(base, buf, pair[0],
+		    async_write_cb, base) == -1)) {
+		async_failed = 1;
+		event_base_loopbreak(base);
+	}
+}
+
+static void
+async_read_cb(struct evbuffer *buf, int res, void *arg)
+{
+	struct event_base *base = arg;
+
+	if (res <= 0 || (EVBUFFER_LENGTH(buf) < ASYNC_LEN &&
+		evbuffer_read_async(base, buf, pair[1], -1,
+		    async_read_cb, base) == -1)) {
+		async_failed = 1;
+		event_base_loopbreak(base);
+	}
+}
+
+static void
+test_buffer_async(void)
+{
+	struct event_base *base = event_base_new();
+	struct evbuffer *out = evbuffer_new(), *in = evbuffer_new();
+	u_char *data = malloc(ASYNC_LEN);
+	int i;
+
+	setup_test("Completion-based evbuffer I/O: ");
+
+	for (i = 0; i < ASYNC_LEN; ++i)
+		data[i] = i % 251;
+	evbuffer_add(out, data, ASYNC_LEN);
+
+	async_failed = 0;
+	if (evbuffer_write_async(base, out, pair[0],
+		async_write_cb, base) == -1) {
+		/* only io_uring can do completion-based I/O */
+		test_ok = strcmp(event_base_get_method(base), "io_uring") != 0;
+		goto out;
+	}
+	if (evbuffer_read_async(base, in, pair[1], -1,
+		async_read_cb, base) == -1)
+		goto out;
+
+	event_base_dispatch(base);
+
+	test_ok = !async_failed && EVBUFFER_LENGTH(in) == ASYNC_LEN &&
+	    memcmp(EVBUFFER_DATA(in), data, ASYNC_LEN) == 0;
+
+ out:
+	evbuffer_free(out);
+	evbuffer_free(in);
+	free(data);
+	event_base_free(base);
+	cleanup_test();
+}
+
+static void
+async_cancel_cb(struct evbuffer *buf, int res, void *arg)
+{
+	int *called = arg;
+
+	*called = res == -1 && errno == ECANCELED ? 1 : -1;
+}
+
+static void
+test_buffer_async_cancel(void)
+{
+	struct event_base *base = event_base_new();
+	struct evbuffer *in = evbuffer_new(), *gone = evbuffer_new();
+	int called = 0, freed = 0;
+
+	setup_test("Cancelled evbuffer I/O: ");
+
+	/* nothing is written, so the reads only end when cancelled */
+	if (evbuffer_read_async(base, in, pair[1], -1,
+		async_cancel_cb, &called) == -1) {
+		test_ok = strcmp(event_base_get_method(base), "io_uring") != 0;
+		evbuffer_free(gone);
+		goto out;
+	}
+	if (evbuffer_read_async(base, gone, pair[1], -1,
+		async_cancel_cb, &freed) == -1) {
+		evbuffer_free(gone);
+		goto out;
+	}
+	/* let the kernel start both */
+	event_base_loop(base, EVLOOP_NONBLOCK);
+
+	evbuffer_cancel_async(base, in);
+	/* no callback for a buffer that is gone */
+	evbuffer_free(gone);
+
+	/* the loop ends once the kernel has let go of both reads */
+	event_base_dispatch(base);
+
+	test_ok = called == 1 && freed == 0 && EVBUFFER_LENGTH(in) == 0 &&
+	    evbuffer_read_async(base, in, pair[1], -1,
+		async_cancel_cb, &called) == 0;
+	evbuffer_cancel_async(base, in);
+	event_base_dispatch(base);
+
+ out:
+	evbuffer_free(in);
+	event_base_free(base);
+	cleanup_test();
+}
+
+#ifndef WIN32
+static void
+async_fork_cb(struct evbuffer *buf, int res, void *arg)
+{
+	struct event_base *base = arg;
+
+	test_ok = res == strlen(TEST1)+1;
+	event_base_loopbreak(base);
+}
+
+static void
+test_buffer_async_fork(void)
+{
+	struct event_base *base = event_base_new();
+	struct evbuffer *in = evbuffer_new();
+	struct timeval tv;
+	int status;
+	pid_t pid;
+
+	setup_test("Completion-based evbuffer I/O after fork: ");
+
+	if (evbuffer_read_async(base, in, pair[1], -1,
+		async_fork_cb, base) == -1) {
+		test_ok = strcmp(event_base_get_method(base), "io_uring") != 0;
+		goto out;
+	}
+	/* let the kernel start the read */
+	event_base_loop(base, EVLOOP_NONBLOCK);
+
+	if ((pid = fork()) == 0) {
+		/* the read in flight belongs to the parent */
+		if (event_reinit(base) == -1)
+			exit(1);
+		event_base_free(base);
+		exit(76);
+	}
+	if (waitpid(pid, &status, 0) == -1 || WEXITSTATUS(status) != 76)
+		goto out;
+
+	write(pair[0], TEST1, strlen(TEST1)+1);
+	tv.tv_sec = 2;
+	tv.tv_usec = 0;
+	event_base_loopexit(base, &tv);
+	event_base_dispatch(base);
+
+ out:
+	evbuffer_free(in);
+	event_base_free(base);
+	cleanup_test();
+}
+#endif
+
 static void
 test_persistent(void)
 {
@@ -902,120 +1233,912 @@ test_event_base_new(void)
 	event_base_set(base, &ev1);
 	event_add(&ev1, NULL);
 
-	event_base_dispatch(base);
+	event_base_dispatch(base);
+
+	event_base_free(base);
+	test_ok = 1;
+	cleanup_test();
+}
+
+static void
+test_loopexit(void)
+{
+	struct timeval tv, tv_start, tv_end;
+	struct event ev;
+
+	setup_test("Loop exit: ");
+
+	tv.tv_usec = 0;
+	tv.tv_sec = 60*60*24;
+	evtimer_set(&ev, timeout_cb, NULL);
+	evtimer_add(&ev, &tv);
+
+	tv.tv_usec = 0;
+	tv.tv_sec = 1;
+	event_loopexit(&tv);
+
+	evutil_gettimeofday(&tv_start, NULL);
+	event_dispatch();
+	evutil_gettimeofday(&tv_end, NULL);
+	evutil_timersub(&tv_end, &tv_start, &tv_end);
+
+	evtimer_del(&ev);
+
+	if (tv.tv_sec < 2)
+		test_ok = 1;
+
+	cleanup_test();
+}
+
+static void
+test_loopexit_multiple(void)
+{
+	struct timeval tv;
+	struct event_base *base;
+
+	setup_test("Loop Multiple exit: ");
+
+	base = event_base_new();
+	
+	tv.tv_usec = 0;
+	tv.tv_sec = 1;
+	event_base_loopexit(base, &tv);
+
+	tv.tv_usec = 0;
+	tv.tv_sec = 2;
+	event_base_loopexit(base, &tv);
+
+	event_base_dispatch(base);
+
+	event_base_free(base);
+	
+	test_ok = 1;
+
+	cleanup_test();
+}
+
+struct wheel_timer {
+	struct event ev;
+	struct timeval tv;
+	struct timeval start;
+	int fired;
+};
+
+static int wheel_order;
+
+static void
+wheel_timeout_cb(int fd, short event, void *arg)
+{
+	struct wheel_timer *wt = arg;
+	struct timeval now, elapsed;
+
+	evutil_gettimeofday(&now, NULL);
+	evutil_timersub(&now, &wt->start, &elapsed);
+	/* never early, and called in deadline order */
+	if (evutil_timercmp(&elapsed, &wt->tv, <))
+		test_ok = 0;
+	wt->fired = ++wheel_order;
+}
+
+static void
+test_timerwheel(void)
+{
+	struct event_base *base;
+	struct wheel_timer wt[5];
+	long msec[5] = { 0, 5, 40, 300, 600 };
+	int i;
+
+	setup_test("Timer wheel: ");
+
+	base = event_base_new_with_flags(EVENT_BASE_FLAG_TIMERWHEEL);
+	if (strcmp(event_base_get_timer_method(base), "timerwheel"))
+		goto out;
+
+	test_ok = 1;
+	wheel_order = 0;
+	/* add them out of order so the wheel has to sort them */
+	for (i = 4; i >= 0; --i) {
+		wt[i].tv.tv_sec = msec[i] / 1000;
+		wt[i].tv.tv_usec = (msec[i] % 1000) * 1000;
+		wt[i].fired = 0;
+		evtimer_set(&wt[i].ev, wheel_timeout_cb, &wt[i]);
+		event_base_set(base, &wt[i].ev);
+		evutil_gettimeofday(&wt[i].start, NULL);
+		evtimer_add(&wt[i].ev, &wt[i].tv);
+	}
+	/* cancelling a pending timeout must not leave it behind */
+	evtimer_del(&wt[2].ev);
+
+	event_base_dispatch(base);
+
+	if (wt[0].fired != 1 || wt[1].fired != 2 || wt[2].fired != 0 ||
+	    wt[3].fired != 3 || wt[4].fired != 4)
+		test_ok = 0;
+
+out:
+	event_base_free(base);
+	cleanup_test();
+}
+
+static void
+test_common_timeout(void)
+{
+	struct event_base *base;
+	struct wheel_timer wt[20];
+	struct timeval tv;
+	const struct timeval *ct;
+	int i, flags;
+
+	setup_test("Common timeout: ");
+
+	test_ok = 1;
+	for (flags = 0; flags <= EVENT_BASE_FLAG_TIMERWHEEL; ++flags) {
+		base = event_base_new_with_flags(flags);
+
+		tv.tv_sec = 0;
+		tv.tv_usec = 100 * 1000;
+		ct = event_base_init_common_timeout(base, &tv);
+		if (ct == NULL ||
+		    event_base_init_common_timeout(base, &tv) != ct ||
+		    event_base_init_common_timeout(base, ct) != ct) {
+			test_ok = 0;
+			event_base_free(base);
+			break;
+		}
+
+		wheel_order = 0;
+		for (i = 0; i < 20; ++i) {
+			/* every fourth event uses a plain, shorter timeout */
+			wt[i].tv.tv_sec = 0;
+			wt[i].tv.tv_usec = (i % 4 == 3 ? 50 : 100) * 1000;
+			wt[i].fired = 0;
+			evtimer_set(&wt[i].ev, wheel_timeout_cb, &wt[i]);
+			event_base_set(base, &wt[i].ev);
+			evutil_gettimeofday(&wt[i].start, NULL);
+			evtimer_add(&wt[i].ev, i % 4 == 3 ? &wt[i].tv : ct);
+		}
+		/* drop the head and something from the middle of the queue */
+		evtimer_del(&wt[0].ev);
+		evtimer_del(&wt[9].ev);
+
+		event_base_dispatch(base);
+
+		for (i = 0; i < 20; ++i) {
+			int deleted = (i == 0 || i == 9);
+			if ((wt[i].fired != 0) == deleted)
+				test_ok = 0;
+		}
+		/* the plain timeouts expire first */
+		for (i = 3; i < 20; i += 4) {
+			if (wt[i].fired > 5)
+				test_ok = 0;
+		}
+
+		event_base_free(base);
+	}
+
+	cleanup_test();
+}
+
+#define PRECISE_ROUNDS 50
+
+static void
+precise_timer_cb(int fd, short events, void *arg)
+{
+	struct event *ev = arg;
+	struct timeval tv;
+
+	if (++called < PRECISE_ROUNDS) {
+		tv.tv_sec = 0;
+		tv.tv_usec = 200;
+		evtimer_add(ev, &tv);
+	}
+}
+
+static void
+test_precise_timer(void)
+{
+	struct event_base *base;
+	struct event ev;
+	struct timeval tv, start, end;
+
+	setup_test("Precise timer: ");
+
+	base = event_base_new_with_flags(EVENT_BASE_FLAG_PRECISE_TIMER);
+	evtimer_set(&ev, precise_timer_cb, &ev);
+	event_base_set(base, &ev);
+	tv.tv_sec = 0;
+	tv.tv_usec = 200;
+
+	evutil_gettimeofday(&start, NULL);
+	evtimer_add(&ev, &tv);
+	event_base_dispatch(base);
+	evutil_gettimeofday(&end, NULL);
+	evutil_timersub(&end, &start, &tv);
+
+	test_ok = called == PRECISE_ROUNDS &&
+	    tv.tv_sec * 1000000 + tv.tv_usec >= PRECISE_ROUNDS * 200;
+	/* millisecond rounding would take at least PRECISE_ROUNDS ms */
+	if ((strcmp(event_base_get_method(base), "epoll") == 0 ||
+		strcmp(event_base_get_method(base), "io_uring") == 0) &&
+	    tv.tv_sec * 1000 + tv.tv_usec / 1000 >= PRECISE_ROUNDS)
+		test_ok = 0;
+
+	event_base_free(base);
+	cleanup_test();
+}
+
+static void
+break_cb(int fd, short events, void *arg)
+{
+	test_ok = 1;
+	event_loopbreak();
+}
+
+static void
+fail_cb(int fd, short events, void *arg)
+{
+	test_ok = 0;
+}
+
+#ifdef HAVE_PTHREADS
+struct thread_test {
+	struct event_base *base;
+	struct event active_ev;
+	struct event timer_ev;
+	int activated;
+	int timed_out;
+};
+
+static void
+thread_active_cb(int fd, short events, void *arg)
+{
+	struct thread_test *tt = arg;
+	tt->activated++;
+}
+
+static void
+thread_timer_cb(int fd, short events, void *arg)
+{
+	struct thread_test *tt = arg;
+	tt->timed_out++;
+	event_base_loopbreak(tt->base);
+}
+
+static void *
+thread_worker(void *arg)
+{
+	struct thread_test *tt = arg;
+	struct timeval tv;
+
+	/* give the loop time to block on its long timeout */
+	usleep(100 * 1000);
+	event_active(&tt->active_ev, EV_TIMEOUT, 1);
+
+	tv.tv_sec = 0;
+	tv.tv_usec = 50 * 1000;
+	evtimer_add(&tt->timer_ev, &tv);
+
+	return (NULL);
+}
+
+static void
+test_threads(void)
+{
+	struct thread_test tt;
+	struct event keepalive;
+	struct timeval tv, start, end;
+	pthread_t thread;
+
+	setup_test("Threaded base: ");
+
+	test_ok = 0;
+	memset(&tt, 0, sizeof(tt));
+	tt.base = event_base_new_with_flags(EVENT_BASE_FLAG_THREADSAFE);
+	if (tt.base == NULL)
+		goto out;
+
+	evtimer_set(&keepalive, fail_cb, NULL);
+	event_base_set(tt.base, &keepalive);
+	tv.tv_sec = 10;
+	tv.tv_usec = 0;
+	evtimer_add(&keepalive, &tv);
+
+	evtimer_set(&tt.active_ev, thread_active_cb, &tt);
+	event_base_set(tt.base, &tt.active_ev);
+	evtimer_set(&tt.timer_ev, thread_timer_cb, &tt);
+	event_base_set(tt.base, &tt.timer_ev);
+
+	evutil_gettimeofday(&start, NULL);
+	if (pthread_create(&thread, NULL, thread_worker, &tt) != 0) {
+		event_base_free(tt.base);
+		goto out;
+	}
+	event_base_dispatch(tt.base);
+	pthread_join(thread, NULL);
+	evutil_gettimeofday(&end, NULL);
+
+	evutil_timersub(&end, &start, &tv);
+	if (tt.activated == 1 && tt.timed_out == 1 && tv.tv_sec < 2)
+		test_ok = 1;
+
+	event_base_free(tt.base);
+out:
+	cleanup_test();
+}
+#endif
+
+static void
+test_loopbreak(void)
+{
+	struct event ev1, ev2;
+	struct timeval tv;
+
+	setup_test("Loop break: ");
+
+	tv.tv_sec = 0;
+	tv.tv_usec = 0;
+	evtimer_set(&ev1, break_cb, NULL);
+	evtimer_add(&ev1, &tv);
+	evtimer_set(&ev2, fail_cb, NULL);
+	evtimer_add(&ev2, &tv);
+
+	event_dispatch();
+
+	evtimer_del(&ev1);
+	evtimer_del(&ev2);
+
+	cleanup_test();
+}
+
+static void
+test_evbuffer(void) {
+
+	struct evbuffer *evb = evbuffer_new();
+	setup_test("Testing Evbuffer: ");
+
+	evbuffer_add_printf(evb, "%s/%d", "hello", 1);
+
+	if (EVBUFFER_LENGTH(evb) == 7 &&
+	    strcmp((char*)EVBUFFER_DATA(evb), "hello/1") == 0)
+	    test_ok = 1;
+	
+	evbuffer_free(evb);
+
+	cleanup_test();
+}
+
+static void
+test_evbuffer_segments(void)
+{
+	struct evbuffer *a = evbuffer_new(), *b = evbuffer_new();
+	static u_char data[50000], out[50000];
+	size_t i, rest;
+
+	setup_test("Testing evbuffer segments: ");
+
+	for (i = 0; i < sizeof(data); ++i)
+		data[i] = i % 251;
+
+	/* small adds spill over into new segments */
+	for (i = 0; i < sizeof(data); i += 100)
+		evbuffer_add(a, data + i, 100);
+	if (EVBUFFER_LENGTH(a) != sizeof(data) || a->first == a->last)
+		goto out;
+
+	/* moving segments keeps the data and its order */
+	evbuffer_add(b, "x", 1);
+	evbuffer_add_buffer(b, a);
+	if (EVBUFFER_LENGTH(a) != 0 || EVBUFFER_LENGTH(b) != sizeof(data) + 1)
+		goto out;
+	evbuffer_drain(b, 1);
+
+	/* take part of it back, splitting a segment */
+	if (evbuffer_remove_buffer(b, a, 30001) != 30001 ||
+	    memcmp(evbuffer_pullup(a, -1), data, 30001) != 0)
+		goto out;
+
+	rest = sizeof(data) - 30001;
+	if (evbuffer_pullup(b, rest + 1) != NULL ||
+	    memcmp(evbuffer_pullup(b, 100), data + 30001, 100) != 0)
+		goto out;
+	if (evbuffer_remove(b, out, sizeof(out)) != rest ||
+	    memcmp(out, data + 30001, rest) != 0 || EVBUFFER_LENGTH(b) != 0)
+		goto out;
+
+	test_ok = 1;
+
+ out:
+	evbuffer_free(a);
+	evbuffer_free(b);
+	cleanup_test();
+}
+
+static void
+test_evbuffer_write(void)
+{
+	struct evbuffer *evb = evbuffer_new(), *body = evbuffer_new();
+	static u_char data[20000], out[20000 + 64];
+	const char *header = "HTTP/1.1 200 OK\r\n\r\n";
+	size_t i, total;
+	int n;
+
+	setup_test("Testing evbuffer_write with segments: ");
+
+	for (i = 0; i < sizeof(data); ++i)
+		data[i] = i % 251;
+
+	/* headers, a body in its own segments, and chunk framing */
+	evbuffer_add(evb, header, strlen(header));
+	evbuffer_add(body, data, sizeof(data));
+	evbuffer_add_buffer(evb, body);
+	evbuffer_add(evb, "\r\n", 2);
+	total = EVBUFFER_LENGTH(evb);
+
+	n = evbuffer_write(evb, pair[0]);
+#ifdef HAVE_WRITEV
+	/* everything goes out in one call */
+	if (n != (int)total)
+		goto out;
+#endif
+	while (EVBUFFER_LENGTH(evb) && evbuffer_write(evb, pair[0]) > 0)
+		;
+	if (EVBUFFER_LENGTH(evb) != 0)
+		goto out;
+
+	for (i = 0; i < total; i += n) {
+		if ((n = read(pair[1], out + i, total - i)) <= 0)
+			goto out;
+	}
+	test_ok = memcmp(out, header, strlen(header)) == 0 &&
+	    memcmp(out + strlen(header), data, sizeof(data)) == 0 &&
+	    memcmp(out + strlen(header) + sizeof(data), "\r\n", 2) == 0;
+
+ out:
+	evbuffer_free(evb);
+	evbuffer_free(body);
+	cleanup_test();
+}
+
+static int ref_cleanups;
+
+static void
+reference_cleanup_cb(const void *data, size_t len, void *arg)
+{
+	if (arg == (void *)data && len == 10)
+		++ref_cleanups;
+}
+
+static void
+test_evbuffer_reference(void)
+{
+	static const char blob[] = "0123456789";
+	struct evbuffer *evb = evbuffer_new(), *evb_two = evbuffer_new();
+	char tmp[32];
+
+	setup_test("Testing evbuffer_add_reference: ");
+
+	ref_cleanups = 0;
+	evbuffer_add(evb, "<", 1);
+	if (evbuffer_add_reference(evb, blob, 10,
+		reference_cleanup_cb, (void *)blob) == -1)
+		goto out;
+	/* this must not be written into the referenced memory */
+	evbuffer_add(evb, ">", 1);
+	if (EVBUFFER_LENGTH(evb) != 12 ||
+	    memcmp(EVBUFFER_DATA(evb), "<0123456789>", 12) != 0)
+		goto out;
+	if (ref_cleanups != 1)
+		goto out;
+
+	/* a reference that is moved and then drained */
+	evbuffer_drain(evb, 12);
+	evbuffer_add_reference(evb, blob, 10,
+	    reference_cleanup_cb, (void *)blob);
+	evbuffer_add_buffer(evb_two, evb);
+	evbuffer_drain(evb_two, 5);
+	if (ref_cleanups != 1)
+		goto out;
+	if (evbuffer_remove(evb_two, tmp, sizeof(tmp)) != 5 ||
+	    memcmp(tmp, "56789", 5) != 0)
+		goto out;
+	if (ref_cleanups != 2)
+		goto out;
+
+	/* and one that is freed with its buffer */
+	evbuffer_add_reference(evb, blob, 10,
+	    reference_cleanup_cb, (void *)blob);
+	evbuffer_free(evb);
+	evb = NULL;
+	if (ref_cleanups != 3)
+		goto out;
+
+	test_ok = 1;
+
+ out:
+	if (evb != NULL)
+		evbuffer_free(evb);
+	evbuffer_free(evb_two);
+	cleanup_test();
+}
+
+static void
+test_evbuffer_add_file(void)
+{
+	struct evbuffer *evb = evbuffer_new(), *evb_two = evbuffer_new();
+	static char data[20000], out[20000];
+	FILE *file = tmpfile();
+	size_t i, total;
+	ev_uint32_t tag;
+	int n, fd = -1;
+
+	setup_test("Testing evbuffer_add_file: ");
+
+	for (i = 0; i < sizeof(data); ++i)
+		data[i] = 'a' + i % 26;
+	if (file == NULL || fwrite(data, sizeof(data), 1, file) != 1 ||
+	    fflush(file) != 0)
+		goto out;
+
+	/* a header, part of the file, and a trailer */
+	evbuffer_add(evb, "<", 1);
+	if ((fd = dup(fileno(file))) == -1 ||
+	    evbuffer_add_file(evb, fd, 100, 10000) == -1)
+		goto out;
+	evbuffer_add(evb, ">", 1);
+	total = EVBUFFER_LENGTH(evb);
+	if (total != 10002)
+		goto out;
+
+	while (EVBUFFER_LENGTH(evb) && evbuffer_write(evb, pair[0]) > 0)
+		;
+	if (EVBUFFER_LENGTH(evb) != 0)
+		goto out;
+	for (i = 0; i < total; i += n) {
+		if ((n = read(pair[1], out + i, total - i)) <= 0)
+			goto out;
+	}
+	if (out[0] != '<' || memcmp(out + 1, data + 100, 10000) != 0 ||
+	    out[10001] != '>')
+		goto out;
+
+	/* bytes that are taken out of the buffer come from the file */
+	if ((fd = dup(fileno(file))) == -1 ||
+	    evbuffer_add_file(evb, fd, 0, sizeof(data)) == -1)
+		goto out;
+	if (evbuffer_remove_buffer(evb, evb_two, 30) != 30 ||
+	    evbuffer_remove(evb, out, 10) != 10 ||
+	    memcmp(EVBUFFER_DATA(evb_two), data, 30) != 0 ||
+	    memcmp(out, data + 30, 10) != 0 ||
+	    memcmp(evbuffer_pullup(evb, 100), data + 40, 100) != 0 ||
+	    EVBUFFER_LENGTH(evb) != sizeof(data) - 40)
+		goto out;
+
+	/* a file that shrank leaves the buffers as they were */
+	evbuffer_drain(evb, EVBUFFER_LENGTH(evb));
+	evbuffer_drain(evb_two, EVBUFFER_LENGTH(evb_two));
+	evbuffer_add(evb, "<", 1);
+	if ((fd = dup(fileno(file))) == -1 ||
+	    evbuffer_add_file(evb, fd, 0, 100) == -1 ||
+	    ftruncate(fileno(file), 0) == -1)
+		goto out;
+	if ((n = evbuffer_remove_buffer(evb, evb_two, 11)) == -1) {
+		if (EVBUFFER_LENGTH(evb) != 101 ||
+		    EVBUFFER_LENGTH(evb_two) != 0 ||
+		    evtag_peek(evb, &tag) != -1)
+			goto out;
+	} else if (n != 11)
+		goto out;
+
+	test_ok = 1;
+
+ out:
+	if (file != NULL)
+		fclose(file);
+	evbuffer_free(evb);
+	evbuffer_free(evb_two);
+	cleanup_test();
+}
+
+static void
+test_evbuffer_add_mmap(void)
+{
+	struct evbuffer *evb = evbuffer_new();
+	FILE *file = tmpfile();
+	u_char *data, *p;
+	char *line;
+	size_t n;
+	int i, fd;
+
+	setup_test("Testing evbuffer_add_mmap: ");
+
+	/* lines that straddle a page boundary */
+	if (file == NULL)
+		goto out;
+	for (i = 0; i < 1000; ++i)
+		fprintf(file, "line %d\r\n", i);
+	if (fflush(file) != 0)
+		goto out;
+
+	/* skip "line 0\r\nline 1\r\n", an offset that is not aligned */
+	if ((fd = dup(fileno(file))) == -1 ||
+	    evbuffer_add_mmap(evb, fd, 16, 8000) == -1)
+		goto out;
+	if (EVBUFFER_LENGTH(evb) != 8000)
+		goto out;
+
+	data = EVBUFFER_DATA(evb);
+	if (data == NULL || memcmp(data, "line 2\r\n", 8) != 0)
+		goto out;
+	p = evbuffer_find(evb, (u_char *)"line 500\r\n", 10);
+	if (p == NULL || p < data || p >= data + 8000)
+		goto out;
+
+	line = evbuffer_readln(evb, &n, EVBUFFER_EOL_CRLF);
+	if (line == NULL || n != 6 || strcmp(line, "line 2") != 0)
+		goto out;
+	free(line);
+	/* the data was not moved out of the mapping */
+	if (EVBUFFER_DATA(evb) != data + 8)
+		goto out;
+
+	evbuffer_drain(evb, 8000);
+	if (EVBUFFER_LENGTH(evb) != 0)
+		goto out;
 
-	event_base_free(base);
 	test_ok = 1;
+
+ out:
+	if (file != NULL)
+		fclose(file);
+	evbuffer_free(evb);
 	cleanup_test();
 }
 
 static void
-test_loopexit(void)
+test_evbuffer_pool(void)
 {
-	struct timeval tv, tv_start, tv_end;
-	struct event ev;
+	struct evbuffer_pool_stats before, after;
+	struct evbuffer *evb;
+	char data[3000];
+	int i;
 
-	setup_test("Loop exit: ");
+	setup_test("Testing evbuffer storage cache: ");
 
-	tv.tv_usec = 0;
-	tv.tv_sec = 60*60*24;
-	evtimer_set(&ev, timeout_cb, NULL);
-	evtimer_add(&ev, &tv);
+	memset(data, 'x', sizeof(data));
+	evbuffer_pool_flush();
+	evbuffer_pool_get_stats(&before);
+	if (before.cached != 0 || before.cached_bytes != 0)
+		goto out;
 
-	tv.tv_usec = 0;
-	tv.tv_sec = 1;
-	event_loopexit(&tv);
+	/* like connections that come and go */
+	for (i = 0; i < 100; ++i) {
+		if ((evb = evbuffer_new()) == NULL)
+			goto out;
+		evbuffer_add(evb, data, sizeof(data));
+		evbuffer_drain(evb, 100);
+		evbuffer_free(evb);
+	}
 
-	evutil_gettimeofday(&tv_start, NULL);
-	event_dispatch();
-	evutil_gettimeofday(&tv_end, NULL);
-	evutil_timersub(&tv_end, &tv_start, &tv_end);
+	evbuffer_pool_get_stats(&after);
+	if (after.allocs - before.allocs != after.frees - before.frees)
+		goto out;
+	/* everything after the first round came from the cache */
+	if (after.hits - before.hits < (after.allocs - before.allocs) * 9 / 10)
+		goto out;
+	if (after.cached == 0 || after.cached_bytes == 0)
+		goto out;
 
-	evtimer_del(&ev);
+	/* without caching, nothing is kept */
+	evbuffer_pool_flush();
+	evbuffer_pool_set_limits(0, 0);
+	evb = evbuffer_new();
+	evbuffer_add(evb, data, sizeof(data));
+	evbuffer_free(evb);
+	evbuffer_pool_get_stats(&after);
+	evbuffer_pool_set_limits(32768, 1024 * 1024);
+	if (after.cached != 0)
+		goto out;
 
-	if (tv.tv_sec < 2)
-		test_ok = 1;
+	test_ok = 1;
 
+ out:
 	cleanup_test();
 }
 
 static void
-test_loopexit_multiple(void)
+test_evbuffer_search(void)
 {
-	struct timeval tv;
-	struct event_base *base;
-
-	setup_test("Loop Multiple exit: ");
-
-	base = event_base_new();
-	
-	tv.tv_usec = 0;
-	tv.tv_sec = 1;
-	event_base_loopexit(base, &tv);
-
-	tv.tv_usec = 0;
-	tv.tv_sec = 2;
-	event_base_loopexit(base, &tv);
+	struct evbuffer *evb = evbuffer_new();
+	static const char needle[] = "\r\n\r\n";
+	char data[100], *line;
+	u_char *p;
+	size_t n;
+	int i, len;
+
+	setup_test("Testing evbuffer search kernels: ");
+
+	/* matches at every position, with the vector loops and their tails */
+	for (len = 4; len <= (int)sizeof(data); len += 3) {
+		for (i = 0; i + 4 <= len; ++i) {
+			memset(data, 'x', len);
+			/* decoys that only match part of the needle */
+			data[0] = '\r';
+			data[len - 1] = '\n';
+			memcpy(data + i, needle, 4);
+			evbuffer_drain(evb, EVBUFFER_LENGTH(evb));
+			evbuffer_add(evb, data, len);
+
+			p = evbuffer_find(evb, (u_char *)needle, 4);
+			if (p == NULL || p - EVBUFFER_DATA(evb) != i)
+				goto out;
+
+			/* a lone CR in front does not end a strict line */
+			data[0] = 'x';
+			data[1] = '\r';
+			evbuffer_drain(evb, EVBUFFER_LENGTH(evb));
+			evbuffer_add(evb, data, len);
+			line = evbuffer_readln(evb, &n, EVBUFFER_EOL_CRLF_STRICT);
+			if (line == NULL)
+				goto out;
+			free(line);
+			if (i >= 1 && n != (size_t)i)
+				goto out;
+
+			evbuffer_drain(evb, EVBUFFER_LENGTH(evb));
+			memset(data, 'x', len);
+			data[i] = '\n';
+			evbuffer_add(evb, data, len);
+			line = evbuffer_readline(evb);
+			if (line == NULL || strlen(line) != (size_t)i)
+				goto out;
+			free(line);
+		}
 
-	event_base_dispatch(base);
+		memset(data, 'x', len);
+		data[len - 1] = '\r';
+		evbuffer_drain(evb, EVBUFFER_LENGTH(evb));
+		evbuffer_add(evb, data, len);
+		if (evbuffer_find(evb, (u_char *)needle, 4) != NULL ||
+		    evbuffer_readln(evb, NULL, EVBUFFER_EOL_CRLF_STRICT) != NULL)
+			goto out;
+	}
 
-	event_base_free(base);
-	
 	test_ok = 1;
 
+ out:
+	evbuffer_free(evb);
 	cleanup_test();
 }
 
 static void
-break_cb(int fd, short events, void *arg)
+test_evbuffer_search_resume(void)
 {
+	struct evbuffer *evb = evbuffer_new();
+	size_t start = 0, eol_len = 0;
+	char *line;
+	int i;
+
+	setup_test("Testing resumed evbuffer searches: ");
+
+	/* a header line that trickles in, one byte at a time */
+	for (i = 0; i < 2000; ++i) {
+		evbuffer_add(evb, "x", 1);
+		if (evbuffer_readln(evb, NULL, EVBUFFER_EOL_CRLF_STRICT) != NULL)
+			goto out;
+		/* only the trailing byte is looked at again */
+		if (evb->eol_scanned != (size_t)i)
+			goto out;
+	}
+	evbuffer_add(evb, "\r", 1);
+	if (evbuffer_readln(evb, NULL, EVBUFFER_EOL_CRLF_STRICT) != NULL)
+		goto out;
+	evbuffer_add(evb, "\nnext", 5);
+	line = evbuffer_readln(evb, NULL, EVBUFFER_EOL_CRLF_STRICT);
+	if (line == NULL || strlen(line) != 2000)
+		goto out;
+	free(line);
+	if (EVBUFFER_LENGTH(evb) != 4 || evb->eol_scanned != 0)
+		goto out;
+
+	/* another style does not use the old position */
+	if (evbuffer_readln(evb, NULL, EVBUFFER_EOL_LF) != NULL)
+		goto out;
+	evbuffer_add(evb, "\r", 1);
+	line = evbuffer_readline(evb);
+	if (line == NULL || strcmp(line, "next") != 0)
+		goto out;
+	free(line);
+
+	/* explicit positions */
+	evbuffer_add(evb, "GET / HTTP/1.0\r\nHost: a\r", 24);
+	if (evbuffer_search(evb, (u_char *)"\r\n\r\n", 4, &start) != -1 ||
+	    start != 21)
+		goto out;
+	evbuffer_add(evb, "\n\r\nbody", 7);
+	if (evbuffer_search(evb, (u_char *)"\r\n\r\n", 4, &start) != 23)
+		goto out;
+	start = 16;
+	if (evbuffer_search_eol(evb, &start, &eol_len,
+		EVBUFFER_EOL_CRLF) != 23 || eol_len != 2)
+		goto out;
+	evbuffer_drain(evb, 27);
+	start = 0;
+	if (evbuffer_search_eol(evb, &start, NULL, EVBUFFER_EOL_ANY) != -1 ||
+	    start != 4)
+		goto out;
+
 	test_ok = 1;
-	event_loopbreak();
+
+ out:
+	evbuffer_free(evb);
+	cleanup_test();
 }
 
+static int split_cleanups;
+
 static void
-fail_cb(int fd, short events, void *arg)
+split_cleanup_cb(const void *data, size_t len, void *arg)
 {
-	test_ok = 0;
+	++split_cleanups;
 }
 
 static void
-test_loopbreak(void)
+test_evbuffer_search_segments(void)
 {
-	struct event ev1, ev2;
-	struct timeval tv;
-
-	setup_test("Loop break: ");
+	struct evbuffer *evb = evbuffer_new();
+	static const char *parts[] = {
+		"GET / HTTP/1.1\r", "\nHost: a\r", "\n\r", "\nbody"
+	};
+	size_t start = 0, eol_len = 0, n;
+	const char *p;
+	char *line;
+	int i;
 
-	tv.tv_sec = 0;
-	tv.tv_usec = 0;
-	evtimer_set(&ev1, break_cb, NULL);
-	evtimer_add(&ev1, &tv);
-	evtimer_set(&ev2, fail_cb, NULL);
-	evtimer_add(&ev2, &tv);
+	setup_test("Testing searches across segments: ");
 
-	event_dispatch();
+	split_cleanups = 0;
+	for (i = 0; i < 4; ++i)
+		evbuffer_add_reference(evb, parts[i], strlen(parts[i]),
+		    split_cleanup_cb, NULL);
 
-	evtimer_del(&ev1);
-	evtimer_del(&ev2);
+	/* the EOLs and the match are split between segments */
+	if (evbuffer_search_eol(evb, &start, &eol_len,
+		EVBUFFER_EOL_CRLF_STRICT) != 14 || eol_len != 2)
+		goto out;
+	start = 16;
+	if (evbuffer_search_eol(evb, &start, &eol_len,
+		EVBUFFER_EOL_ANY) != 23 || eol_len != 4)
+		goto out;
+	start = 0;
+	if (evbuffer_search(evb, (u_char *)"\r\n\r\n", 4, &start) != 23)
+		goto out;
+	/* nothing was pulled up */
+	if (split_cleanups != 0)
+		goto out;
 
-	cleanup_test();
-}
+	line = evbuffer_readln(evb, &n, EVBUFFER_EOL_CRLF);
+	if (line == NULL || strcmp(line, "GET / HTTP/1.1") != 0 ||
+	    split_cleanups != 1)
+		goto out;
+	free(line);
 
-static void
-test_evbuffer(void) {
+	/* only the line and its EOL are pulled up */
+	p = evbuffer_peekln(evb, &n, &eol_len, EVBUFFER_EOL_CRLF_STRICT);
+	if (p == NULL || n != 7 || eol_len != 2 ||
+	    memcmp(p, "Host: a\r\n", 9) != 0 || split_cleanups != 2)
+		goto out;
+	evbuffer_drain(evb, n + eol_len);
 
-	struct evbuffer *evb = evbuffer_new();
-	setup_test("Testing Evbuffer: ");
+	line = evbuffer_readln(evb, &n, EVBUFFER_EOL_CRLF_STRICT);
+	if (line == NULL || n != 0 || EVBUFFER_LENGTH(evb) != 4)
+		goto out;
+	free(line);
 
-	evbuffer_add_printf(evb, "%s/%d", "hello", 1);
+	test_ok = 1;
 
-	if (EVBUFFER_LENGTH(evb) == 7 &&
-	    strcmp((char*)EVBUFFER_DATA(evb), "hello/1") == 0)
-	    test_ok = 1;
-	
+ out:
 	evbuffer_free(evb);
-
 	cleanup_test();
 }
 
@@ -1364,6 +2487,72 @@ wm_errorcb(struct bufferevent *bev, short what, void *arg)
 	test_ok = -2;
 }
 
+static void
+bev_write_errorcb(struct bufferevent *bev, short what, void *arg)
+{
+	size_t *len = arg;
+
+	/* what failed to go out is still there */
+	test_ok = what == (EVBUFFER_WRITE|EVBUFFER_ERROR) &&
+	    EVBUFFER_LENGTH(bev->output) == *len;
+}
+
+static void
+test_bufferevent_write_error(void)
+{
+	struct bufferevent *bev;
+	char buffer[65000];
+	size_t len = sizeof(buffer);
+
+	setup_test("Bufferevent write error: ");
+
+	memset(buffer, 'x', sizeof(buffer));
+	shutdown(pair[0], SHUT_WR);
+
+	bev = bufferevent_new(pair[0], NULL, NULL, bev_write_errorcb, &len);
+	bufferevent_write(bev, buffer, sizeof(buffer));
+
+	event_dispatch();
+
+	bufferevent_free(bev);
+
+	cleanup_test();
+}
+
+static void
+bev_idle_readcb(struct bufferevent *bev, void *arg)
+{
+	test_ok = 0;
+}
+
+static void
+bev_idle_errorcb(struct bufferevent *bev, short what, void *arg)
+{
+	test_ok = 0;
+}
+
+static void
+test_bufferevent_disable(void)
+{
+	struct bufferevent *bev;
+
+	setup_test("Bufferevent disable: ");
+
+	/* the peer stays quiet, so reading only ends when disabled */
+	bev = bufferevent_new(pair[1], bev_idle_readcb, NULL, bev_idle_errorcb,
+	    NULL);
+	bufferevent_enable(bev, EV_READ);
+	event_loop(EVLOOP_NONBLOCK);
+	bufferevent_disable(bev, EV_READ);
+
+	test_ok = 1;
+	event_dispatch();
+
+	bufferevent_free(bev);
+
+	cleanup_test();
+}
+
 static void
 test_bufferevent_watermarks(void)
 {
@@ -1398,6 +2587,235 @@ test_bufferevent_watermarks(void)
 	cleanup_test();
 }
 
+static void
+budget_readcb(struct bufferevent *bev, void *arg)
+{
+	/* leave the data in the buffer, like a slow consumer */
+}
+
+static void
+test_bufferevent_budget(void)
+{
+	struct evbuffer_budget *budget;
+	struct bufferevent *bev1, *bev2;
+	char buffer[8000];
+	int other[2], i, total = 0;
+
+	setup_test("Bufferevent memory budget: ");
+
+	if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, other) == -1)
+		goto out;
+	memset(buffer, 'b', sizeof(buffer));
+	if (write(pair[0], buffer, sizeof(buffer)) != sizeof(buffer) ||
+	    write(other[0], buffer, sizeof(buffer)) != sizeof(buffer))
+		goto out;
+
+	budget = evbuffer_budget_new(4096);
+	bev1 = bufferevent_new(pair[1], budget_readcb, NULL, wm_errorcb, NULL);
+	bev2 = bufferevent_new(other[1], budget_readcb, NULL, wm_errorcb, NULL);
+	bufferevent_set_budget(bev1, budget);
+	bufferevent_set_budget(bev2, budget);
+	bufferevent_enable(bev1, EV_READ);
+	bufferevent_enable(bev2, EV_READ);
+
+	/* both stop reading once they hold the budget between them */
+	for (i = 0; i < 10; ++i)
+		event_loop(EVLOOP_NONBLOCK);
+	if (evbuffer_budget_get_used(budget) != 4096 ||
+	    EVBUFFER_LENGTH(bev1->input) + EVBUFFER_LENGTH(bev2->input) != 4096)
+		goto done;
+
+	/* and go on as their data is consumed */
+	for (i = 0; i < 100 && total < 2 * (int)sizeof(buffer); ++i) {
+		total += EVBUFFER_LENGTH(bev1->input);
+		evbuffer_drain(bev1->input, EVBUFFER_LENGTH(bev1->input));
+		event_loop(EVLOOP_NONBLOCK);
+		if (evbuffer_budget_get_used(budget) > 4096)
+			goto done;
+		total += EVBUFFER_LENGTH(bev2->input);
+		evbuffer_drain(bev2->input, EVBUFFER_LENGTH(bev2->input));
+		event_loop(EVLOOP_NONBLOCK);
+		if (evbuffer_budget_get_used(budget) > 4096)
+			goto done;
+	}
+	if (total == 2 * (int)sizeof(buffer))
+		test_ok = 1;
+
+ done:
+	bufferevent_free(bev1);
+	bufferevent_free(bev2);
+	if (evbuffer_budget_get_used(budget) != 0)
+		test_ok = 0;
+	evbuffer_budget_free(budget);
+	EVUTIL_CLOSESOCKET(other[0]);
+	EVUTIL_CLOSESOCKET(other[1]);
+
+ out:
+	cleanup_test();
+}
+
+static int ratelim_read, ratelim_max_chunk;
+
+static void
+ratelim_readcb(struct bufferevent *bev, void *arg)
+{
+	int len = EVBUFFER_LENGTH(bev->input);
+
+	if (len > ratelim_max_chunk)
+		ratelim_max_chunk = len;
+	ratelim_read += len;
+	evbuffer_drain(bev->input, len);
+	if (ratelim_read == 4096)
+		event_loopexit(NULL);
+}
+
+static long
+ratelim_transfer(struct bufferevent *bev, const char *data, size_t len)
+{
+	struct timeval start, end;
+
+	ratelim_read = ratelim_max_chunk = 0;
+	evutil_gettimeofday(&start, NULL);
+	bufferevent_write(bev, data, len);
+	event_dispatch();
+	evutil_gettimeofday(&end, NULL);
+	evutil_timersub(&end, &start, &end);
+
+	return (end.tv_sec * 1000 + end.tv_usec / 1000);
+}
+
+static void
+test_bufferevent_rate_limit(void)
+{
+	struct ev_token_bucket_cfg *wcfg, *rcfg;
+	struct bufferevent_rate_limit_group *group;
+	struct bufferevent *bev1, *bev2;
+	struct timeval tick = { 0, 50000 };
+	char buffer[4096];
+	long msec;
+
+	setup_test("Bufferevent rate limits: ");
+
+	/* the writer sends 1024 bytes per tick, the group reads 512 */
+	wcfg = ev_token_bucket_cfg_new(0, 0, 1024, 1024, &tick);
+	rcfg = ev_token_bucket_cfg_new(512, 512, 0, 0, &tick);
+	group = bufferevent_rate_limit_group_new(current_base, rcfg);
+	bev1 = bufferevent_new(pair[0], NULL, NULL, wm_errorcb, NULL);
+	bev2 = bufferevent_new(pair[1], ratelim_readcb, NULL, wm_errorcb, NULL);
+	if (bufferevent_set_rate_limit(bev1, wcfg) == -1 ||
+	    bufferevent_add_to_rate_limit_group(bev2, group) == -1)
+		goto done;
+	ev_token_bucket_cfg_free(wcfg);
+	ev_token_bucket_cfg_free(rcfg);
+	bufferevent_enable(bev2, EV_READ);
+	memset(buffer, 'r', sizeof(buffer));
+
+	/* eight reads of 512 bytes need seven refills */
+	msec = ratelim_transfer(bev1, buffer, sizeof(buffer));
+	if (ratelim_read != 4096 || ratelim_max_chunk > 512 || msec < 300) {
+		fprintf(stderr, "group: %d bytes, %d at most, %ld ms\n",
+		    ratelim_read, ratelim_max_chunk, msec);
+		goto done;
+	}
+
+	/* four writes of 1024 bytes need three */
+	bufferevent_remove_from_rate_limit_group(bev2);
+	msec = ratelim_transfer(bev1, buffer, sizeof(buffer));
+	if (ratelim_read != 4096 || msec < 100) {
+		fprintf(stderr, "writer: %d bytes, %ld ms\n",
+		    ratelim_read, msec);
+		goto done;
+	}
+
+	test_ok = 1;
+
+ done:
+	bufferevent_free(bev1);
+	bufferevent_free(bev2);
+	bufferevent_rate_limit_group_free(group);
+
+	cleanup_test();
+}
+
+static int pair_read, pair_max_chunk, pair_eof;
+
+static void
+pair_readcb(struct bufferevent *bev, void *arg)
+{
+	int len = EVBUFFER_LENGTH(bev->input);
+
+	if (len > pair_max_chunk)
+		pair_max_chunk = len;
+	pair_read += len;
+	evbuffer_drain(bev->input, len);
+}
+
+static void
+pair_errorcb(struct bufferevent *bev, short what, void *arg)
+{
+	if (what == (EVBUFFER_READ | EVBUFFER_EOF))
+		pair_eof = 1;
+}
+
+static void
+test_bufferevent_pair(void)
+{
+	static const char data[] = "referenced, not copied";
+	struct bufferevent *bev[2];
+	char buffer[100];
+
+	setup_test("Bufferevent pair: ");
+
+	if (bufferevent_pair_new(NULL, bev) == -1 ||
+	    bufferevent_pair_get_partner(bev[0]) != bev[1])
+		goto out;
+	bufferevent_setcb(bev[1], NULL, NULL, pair_errorcb, NULL);
+	bufferevent_enable(bev[1], EV_READ);
+
+	/* the segments move over as they are */
+	evbuffer_add_reference(bev[0]->output, data, sizeof(data), NULL, NULL);
+	if (EVBUFFER_LENGTH(bev[1]->input) != 0)
+		goto done;
+	event_dispatch();
+	if (EVBUFFER_LENGTH(bev[0]->output) != 0 ||
+	    EVBUFFER_LENGTH(bev[1]->input) != sizeof(data) ||
+	    evbuffer_pullup(bev[1]->input, -1) != (u_char *)data)
+		goto done;
+	evbuffer_drain(bev[1]->input, sizeof(data));
+
+	/* the callbacks run from the loop, up to the high watermark */
+	pair_read = pair_max_chunk = pair_eof = 0;
+	bufferevent_setcb(bev[1], pair_readcb, NULL, pair_errorcb, NULL);
+	bufferevent_setwatermark(bev[1], EV_READ, 0, 16);
+	memset(buffer, 'p', sizeof(buffer));
+	bufferevent_write(bev[0], buffer, sizeof(buffer));
+	if (pair_read != 0)
+		goto done;
+	event_dispatch();
+	if (pair_read != sizeof(buffer) || pair_max_chunk > 16)
+		goto done;
+
+	/* what is left when a side goes away still arrives, then the EOF */
+	bufferevent_disable(bev[1], EV_READ);
+	bufferevent_write(bev[0], buffer, 10);
+	bufferevent_free(bev[0]);
+	bev[0] = NULL;
+	bufferevent_setcb(bev[1], NULL, NULL, pair_errorcb, NULL);
+	bufferevent_enable(bev[1], EV_READ);
+	event_dispatch();
+	if (pair_eof && EVBUFFER_LENGTH(bev[1]->input) == 10 &&
+	    bufferevent_pair_get_partner(bev[1]) == NULL)
+		test_ok = 1;
+
+ done:
+	if (bev[0] != NULL)
+		bufferevent_free(bev[0]);
+	bufferevent_free(bev[1]);
+
+ out:
+	cleanup_test();
+}
+
 struct test_pri_event {
 	struct event ev;
 	int count;
@@ -1838,16 +3256,37 @@ main (int argc, char **argv)
 	test_priorities(3);
 
 	test_evbuffer();
+	test_evbuffer_segments();
+	test_evbuffer_write();
+	test_evbuffer_reference();
+	test_evbuffer_add_file();
+	test_evbuffer_add_mmap();
+	test_evbuffer_pool();
+	test_evbuffer_search();
+	test_evbuffer_search_resume();
+	test_evbuffer_search_segments();
 	test_evbuffer_find();
 	test_evbuffer_readln();
 	
 	test_bufferevent();
 	test_bufferevent_watermarks();
+	test_bufferevent_write_error();
+	test_bufferevent_disable();
+	test_bufferevent_budget();
+	test_bufferevent_rate_limit();
+	test_bufferevent_pair();
 
 	test_free_active_base();
 
 	test_event_base_new();
 
+	test_timerwheel();
+	test_common_timeout();
+	test_precise_timer();
+#ifdef HAVE_PTHREADS
+	test_threads();
+#endif
+
 	http_suite();
 
 #ifndef WIN32
@@ -1864,8 +3303,22 @@ main (int argc, char **argv)
 
 	test_simplewrite();
 
+	test_edgetriggered();
+
+	test_fdreuse();
+
+	test_delclose();
+
+	test_dupclose();
+
 	test_multiple();
 
+	test_buffer_async();
+	test_buffer_async_cancel();
+#ifndef WIN32
+	test_buffer_async_fork();
+#endif
+
 	test_persistent();
 
 	test_combined();
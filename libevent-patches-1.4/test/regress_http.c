@@ -1223,6 +1223,303 @@ fail:
 	exit(1);
 }
 
+static void
+http_header_table_test(void)
+{
+	struct evhttp_request *req = evhttp_request_new(NULL, NULL);
+	struct evkeyval_table *table = EVKEYVAL_TABLE(req->input_headers);
+	struct evbuffer *buf = evbuffer_new();
+	struct evkeyval *header, *middle;
+	char key[32];
+	int i, n = 0;
+
+	fprintf(stdout, "Testing HTTP header table: ");
+
+	/* parse into the index, as the server does */
+	table->hashed = 1;
+
+	evbuffer_add_printf(buf,
+	    "Host: www.example.com\r\n"
+	    "X-Custom: one\r\n"
+	    " continued\r\n"
+	    "x-custom: two\r\n");
+	/* more than the arena of the table holds */
+	for (i = 0; i < 200; ++i)
+		evbuffer_add_printf(buf, "X-Filler-%d: %d\r\n", i, i);
+	evbuffer_add_printf(buf, "\r\n");
+	if (evhttp_parse_headers(req, buf) != ALL_DATA_READ)
+		goto fail;
+
+	/* the list view still has every header, in order */
+	TAILQ_FOREACH(header, req->input_headers, next)
+		++n;
+	if (n != 203 ||
+	    strcmp(TAILQ_FIRST(req->input_headers)->key, "Host") != 0)
+		goto fail;
+
+	if (validate_header(req->input_headers, "host", "www.example.com") ||
+	    validate_header(req->input_headers, "X-CUSTOM", "one continued") ||
+	    validate_header(req->input_headers, "x-filler-199", "199"))
+		goto fail;
+	if (evhttp_find_header(req->input_headers, "X-Filler-200") != NULL)
+		goto fail;
+	if (strcmp(evkeyval_table_find(table, "x-custom"), "one continued") ||
+	    strcmp(evkeyval_table_find(table, "X-Filler-100"), "100") ||
+	    evkeyval_table_find(table, "X-Filler-200") != NULL)
+		goto fail;
+
+	/* and hand it over, after which the list may be edited in place */
+	table->hashed = 0;
+	TAILQ_FOREACH(middle, req->input_headers, next) {
+		if (strcmp(middle->key, "X-Filler-100") == 0)
+			break;
+	}
+	/* the node is the table's, so it is just dropped */
+	TAILQ_REMOVE(req->input_headers, middle, next);
+	if (evhttp_find_header(req->input_headers, "X-Filler-100") != NULL ||
+	    evkeyval_table_find(table, "X-Filler-100") != NULL)
+		goto fail;
+	middle = TAILQ_NEXT(TAILQ_FIRST(req->input_headers), next);
+	header = calloc(1, sizeof(struct evkeyval));
+	header->key = strdup("X-Filler-100");
+	header->value = strdup("inserted");
+	TAILQ_INSERT_AFTER(req->input_headers, middle, header, next);
+	if (validate_header(req->input_headers, "X-Filler-100", "inserted") ||
+	    strcmp(evkeyval_table_find(table, "x-filler-100"), "inserted"))
+		goto fail;
+
+	/* removing the first of equal keys uncovers the next */
+	if (evhttp_remove_header(req->input_headers, "X-Custom") != 0 ||
+	    validate_header(req->input_headers, "X-Custom", "two") ||
+	    evhttp_remove_header(req->input_headers, "X-Custom") != 0 ||
+	    evhttp_remove_header(req->input_headers, "X-Custom") != -1)
+		goto fail;
+	for (i = 0; i < 200; ++i) {
+		evutil_snprintf(key, sizeof(key), "X-Filler-%d", i);
+		if (evhttp_remove_header(req->input_headers, key) != 0)
+			goto fail;
+	}
+
+	/* an empty table is still one */
+	evhttp_clear_headers(req->input_headers);
+	if (!TAILQ_EMPTY(req->input_headers) ||
+	    evhttp_find_header(req->input_headers, "Host") != NULL)
+		goto fail;
+	if (evhttp_add_header(req->output_headers, "Connection", "close") ||
+	    evhttp_add_header(req->output_headers, "Content-Type", "a/b") ||
+	    evhttp_remove_header(req->output_headers, "connection") != 0 ||
+	    validate_header(req->output_headers, "content-type", "a/b"))
+		goto fail;
+
+	/* nodes that the application links in itself */
+	header = calloc(1, sizeof(struct evkeyval));
+	header->key = strdup("X-Own");
+	header->value = strdup("mine");
+	TAILQ_INSERT_TAIL(req->output_headers, header, next);
+	header = calloc(1, sizeof(struct evkeyval));
+	header->key = strdup("X-Other");
+	header->value = strdup("theirs");
+	TAILQ_INSERT_HEAD(req->output_headers, header, next);
+	if (evhttp_add_header(req->output_headers, "Server", "test") ||
+	    validate_header(req->output_headers, "x-own", "mine") ||
+	    validate_header(req->output_headers, "server", "test") ||
+	    evhttp_remove_header(req->output_headers, "X-Own") != 0 ||
+	    evhttp_find_header(req->output_headers, "X-Own") != NULL ||
+	    validate_header(req->output_headers, "x-other", "theirs"))
+		goto fail;
+	/* the last one is freed along with the table */
+
+	evbuffer_free(buf);
+	evhttp_request_free(req);
+
+	fprintf(stdout, "OK\n");
+	return;
+fail:
+	fprintf(stdout, "FAILED\n");
+	exit(1);
+}
+
+static void
+http_parse_test(void)
+{
+	const char *request =
+	    "GET /parse?x=1 HTTP/1.1\r\n"
+	    "Host: somehost\r\n"
+	    "Content-Length:   5\r\n"
+	    "X-Folded: a\r\n"
+	    "\tb\n"
+	    "\r\n"
+	    "hello";
+	struct evhttp_request *req = evhttp_request_new(NULL, NULL);
+	struct evbuffer *buf = evbuffer_new();
+	int done = MORE_DATA_EXPECTED, firstline = 1;
+	size_t i;
+
+	fprintf(stdout, "Testing HTTP parser in place: ");
+
+	/* one byte at a time, as a slow client sends it */
+	req->kind = EVHTTP_REQUEST;
+	for (i = 0; i < strlen(request) && done != ALL_DATA_READ; ++i) {
+		evbuffer_add(buf, request + i, 1);
+		if (firstline) {
+			done = evhttp_parse_firstline(req, buf);
+			if (done == ALL_DATA_READ) {
+				firstline = 0;
+				done = MORE_DATA_EXPECTED;
+			}
+		} else {
+			done = evhttp_parse_headers(req, buf);
+		}
+		if (done == DATA_CORRUPTED)
+			goto fail;
+	}
+	if (done != ALL_DATA_READ || EVBUFFER_LENGTH(buf) != 0)
+		goto fail;
+
+	if (req->type != EVHTTP_REQ_GET || req->major != 1 ||
+	    req->minor != 1 || strcmp(req->uri, "/parse?x=1") != 0 ||
+	    (req->flags & EVHTTP_PROXY_REQUEST))
+		goto fail;
+	if (validate_header(req->input_headers, "Host", "somehost") ||
+	    validate_header(req->input_headers, "Content-Length", "5") ||
+	    validate_header(req->input_headers, "X-Folded", "a\tb"))
+		goto fail;
+
+	/* the uri outlives the headers it was parsed with */
+	evhttp_clear_headers(req->input_headers);
+	if (strcmp(req->uri, "/parse?x=1") != 0)
+		goto fail;
+	/* and is the application's to replace */
+	free(req->uri);
+	req->uri = strdup("/replaced");
+	evhttp_request_free(req);
+
+	/* malformed request lines */
+	req = evhttp_request_new(NULL, NULL);
+	req->kind = EVHTTP_REQUEST;
+	evbuffer_add_printf(buf, "GET  / HTTP/1.1\r\n");
+	if (evhttp_parse_firstline(req, buf) != DATA_CORRUPTED)
+		goto fail;
+	evbuffer_add_printf(buf, "GET / HTTP/1.2\r\n");
+	if (evhttp_parse_firstline(req, buf) != DATA_CORRUPTED)
+		goto fail;
+	evbuffer_add_printf(buf, "FETCH / HTTP/1.0\r\n");
+	if (evhttp_parse_firstline(req, buf) != DATA_CORRUPTED)
+		goto fail;
+	evhttp_request_free(req);
+
+	/* a status line, with and without a reason */
+	req = evhttp_request_new(NULL, NULL);
+	req->kind = EVHTTP_RESPONSE;
+	evbuffer_add_printf(buf, "HTTP/1.0 404 Not Found\r\nX-Y: z\r\n\r\n");
+	if (evhttp_parse_firstline(req, buf) != ALL_DATA_READ ||
+	    evhttp_parse_headers(req, buf) != ALL_DATA_READ)
+		goto fail;
+	if (req->response_code != 404 || req->minor != 0 ||
+	    strcmp(req->response_code_line, "Not Found") != 0 ||
+	    validate_header(req->input_headers, "X-Y", "z"))
+		goto fail;
+	/* so is the reason */
+	free(req->response_code_line);
+	req->response_code_line = strdup("Gone");
+	evhttp_response_code(req, 200, "OK");
+	evhttp_request_free(req);
+
+	req = evhttp_request_new(NULL, NULL);
+	req->kind = EVHTTP_RESPONSE;
+	evbuffer_add_printf(buf, "HTTP/1.1 204\r\n");
+	if (evhttp_parse_firstline(req, buf) != ALL_DATA_READ ||
+	    req->response_code != 204 ||
+	    strcmp(req->response_code_line, "") != 0)
+		goto fail;
+	evbuffer_add_printf(buf, "HTTP/1.1 2x0 OK\r\n");
+	if (evhttp_parse_firstline(req, buf) != DATA_CORRUPTED)
+		goto fail;
+	evhttp_request_free(req);
+
+	evbuffer_free(buf);
+
+	fprintf(stdout, "OK\n");
+	return;
+fail:
+	fprintf(stdout, "FAILED\n");
+	exit(1);
+}
+
+static int
+http_route(struct evhttp *http, const char *uri)
+{
+	struct evhttp_cb *cb = evhttp_dispatch_callback(http, uri);
+
+	return (cb != NULL ? *(int *)cb->cbarg : -1);
+}
+
+static void
+http_routing_test(void)
+{
+	static int tags[] = { 0, 1, 2, 3, 4, 5, 6 };
+	struct evhttp *http = evhttp_new(NULL);
+	char uri[64];
+	int i;
+
+	fprintf(stdout, "Testing HTTP URI routing: ");
+
+	/* enough paths to grow the table a few times */
+	for (i = 0; i < 500; ++i) {
+		evutil_snprintf(uri, sizeof(uri), "/path%d", i);
+		evhttp_set_cb(http, uri, http_basic_cb, &tags[0]);
+	}
+	evhttp_set_cb(http, "/test", http_basic_cb, &tags[1]);
+	evhttp_set_cb(http, "/test", http_basic_cb, &tags[2]);
+	evhttp_set_cb(http, "/static/*", http_basic_cb, &tags[3]);
+	evhttp_set_cb(http, "/static/img/*", http_basic_cb, &tags[4]);
+	evhttp_set_cb(http, "/static/img/logo.png", http_basic_cb, &tags[5]);
+
+	if (http_route(http, "/path499?x=1") != 0 ||
+	    http_route(http, "/path500") != -1)
+		goto fail;
+	/* the first of equal paths wins, the query does not count */
+	if (http_route(http, "/test?a=b") != 1 ||
+	    http_route(http, "/test/") != -1)
+		goto fail;
+	/* an exact path, then the longest prefix */
+	if (http_route(http, "/static/img/logo.png") != 5 ||
+	    http_route(http, "/static/img/icon.png?v=2") != 4 ||
+	    http_route(http, "/static/site.css") != 3 ||
+	    http_route(http, "/static/") != 3 ||
+	    http_route(http, "/static") != -1)
+		goto fail;
+
+	/* removing a callback uncovers the next one */
+	if (evhttp_del_cb(http, "/test") != 0 ||
+	    http_route(http, "/test") != 2)
+		goto fail;
+	evhttp_set_cb(http, "/static/img/*", http_basic_cb, &tags[6]);
+	if (evhttp_del_cb(http, "/static/img/*") != 0 ||
+	    http_route(http, "/static/img/icon.png") != 6 ||
+	    evhttp_del_cb(http, "/static/img/*") != 0 ||
+	    http_route(http, "/static/img/icon.png") != 3)
+		goto fail;
+	if (evhttp_del_cb(http, "/path250") != 0 ||
+	    http_route(http, "/path250") != -1 ||
+	    http_route(http, "/path251") != 0)
+		goto fail;
+
+	/* a lone '*' takes the rest */
+	evhttp_set_cb(http, "*", http_basic_cb, &tags[1]);
+	if (http_route(http, "/path250") != 1 ||
+	    http_route(http, "/static/site.css") != 3)
+		goto fail;
+
+	evhttp_free(http);
+
+	fprintf(stdout, "OK\n");
+	return;
+fail:
+	fprintf(stdout, "FAILED\n");
+	exit(1);
+}
+
 static void
 http_base_test(void)
 {
@@ -1719,12 +2016,340 @@ http_terminate_chunked_test(void)
 		evhttp_free(http);
 }
 
+static int pipeline_dispatched;	/* /pipe requests handed to us */
+static int pipeline_ahead;	/* of those, dispatched before the slow reply */
+
+static void
+http_pipeline_slow_reply(int fd, short what, void *arg)
+{
+	struct evhttp_request *req = arg;
+	struct evbuffer *evb = evbuffer_new();
+
+	pipeline_ahead = pipeline_dispatched - 1;
+
+	evbuffer_add_printf(evb, "slow reply");
+	evhttp_send_reply(req, HTTP_OK, "Everything is fine", evb);
+	evbuffer_free(evb);
+}
+
+static void
+http_pipeline_cb(struct evhttp_request *req, void *arg)
+{
+	struct evbuffer *evb;
+	struct timeval tv;
+
+	++pipeline_dispatched;
+	if (strcmp(req->uri, "/pipe/slow") == 0) {
+		/* the replies to later requests have to wait for this one */
+		timerclear(&tv);
+		tv.tv_usec = 100000;
+		event_once(-1, EV_TIMEOUT, http_pipeline_slow_reply, req, &tv);
+		return;
+	}
+
+	evb = evbuffer_new();
+	evbuffer_add_printf(evb, "fast reply");
+	evhttp_send_reply(req, HTTP_OK, "Everything is fine", evb);
+	evbuffer_free(evb);
+}
+
+static void
+http_pipeline_readcb(struct bufferevent *bev, void *arg)
+{
+	/* everything is checked once the server closed */
+}
+
+static void
+http_pipeline_errorcb(struct bufferevent *bev, short what, void *arg)
+{
+	if (what & EVBUFFER_EOF)
+		test_ok = 1;
+	event_loopexit(NULL);
+}
+
+/* returns the offset of what in the buffer, or -1 */
+static int
+http_pipeline_offset(struct evbuffer *buf, const char *what)
+{
+	u_char *p = evbuffer_find(buf, (const u_char *)what, strlen(what));
+
+	return (p != NULL ? p - EVBUFFER_DATA(buf) : -1);
+}
+
+static void
+http_pipeline_test(int max, int half_close)
+{
+	struct bufferevent *bev;
+	int fd, slow, funny, last_chunk, fast;
+	const char *http_request;
+	short port = -1;
+
+	test_ok = 0;
+	pipeline_dispatched = pipeline_ahead = 0;
+	fprintf(stdout, "Testing HTTP pipelining (max %d%s): ", max,
+	    half_close ? ", half-close" : "");
+
+	http = http_setup(&port, NULL);
+	evhttp_set_max_pipeline(http, max);
+	evhttp_set_cb(http, "/pipe/slow", http_pipeline_cb, NULL);
+	evhttp_set_cb(http, "/pipe/fast", http_pipeline_cb, NULL);
+
+	fd = http_connect("127.0.0.1", port);
+	bev = bufferevent_new(fd, http_pipeline_readcb, NULL,
+	    http_pipeline_errorcb, NULL);
+	bufferevent_enable(bev, EV_READ);
+
+	/* all requests at once, before any reply */
+	if (half_close) {
+		http_request =
+		    "GET /pipe/slow HTTP/1.1\r\n"
+		    "Host: somehost\r\n"
+		    "\r\n"
+		    "GET /pipe/fast HTTP/1.1\r\n"
+		    "Host: somehost\r\n"
+		    "\r\n";
+	} else {
+		http_request =
+		    "GET /pipe/slow HTTP/1.1\r\n"
+		    "Host: somehost\r\n"
+		    "\r\n"
+		    "GET /chunked HTTP/1.1\r\n"
+		    "Host: somehost\r\n"
+		    "\r\n"
+		    "GET /pipe/fast HTTP/1.1\r\n"
+		    "Host: somehost\r\n"
+		    "Connection: close\r\n"
+		    "\r\n";
+	}
+	if (write(fd, http_request, strlen(http_request)) !=
+	    (int)strlen(http_request))
+		goto fail;
+	if (half_close)
+		shutdown(fd, SHUT_WR);
+
+	event_dispatch();
+
+	if (test_ok != 1)
+		goto fail;
+
+	/* the replies come in the order of the requests */
+	evbuffer_pullup(bev->input, -1);
+	slow = http_pipeline_offset(bev->input, "slow reply");
+	fast = http_pipeline_offset(bev->input, "fast reply");
+	if (slow == -1 || fast < slow)
+		goto fail;
+	if (!half_close) {
+		funny = http_pipeline_offset(bev->input, "This is funny");
+		last_chunk = http_pipeline_offset(bev->input, "bwv 1052");
+		if (funny < slow || last_chunk < funny || fast < last_chunk)
+			goto fail;
+	}
+
+	/* later requests were dispatched while the slow one was pending */
+	if (pipeline_dispatched != 2 || pipeline_ahead != (max > 1))
+		goto fail;
+
+	bufferevent_free(bev);
+	EVUTIL_CLOSESOCKET(fd);
+	evhttp_free(http);
+
+	fprintf(stdout, "OK\n");
+	return;
+fail:
+	fprintf(stdout, "FAILED\n");
+	exit(1);
+}
+
+static int pipeline_late_sent;
+
+static void
+http_pipeline_error_reply(int fd, short what, void *arg)
+{
+	evhttp_send_error(arg, HTTP_NOTFOUND, "Not Found");
+}
+
+static void
+http_pipeline_late_reply(int fd, short what, void *arg)
+{
+	struct evbuffer *evb = evbuffer_new();
+
+	/* the connection closed after the error; this reply goes nowhere */
+	evbuffer_add_printf(evb, "late reply");
+	evhttp_send_reply(arg, HTTP_OK, "Everything is fine", evb);
+	evbuffer_free(evb);
+	pipeline_late_sent = 1;
+	event_loopexit(NULL);
+}
+
+static void
+http_pipeline_close_cb(struct evhttp_request *req, void *arg)
+{
+	struct timeval tv;
+
+	timerclear(&tv);
+	if (strcmp(req->uri, "/pipe/error") == 0) {
+		tv.tv_usec = 100000;
+		event_once(-1, EV_TIMEOUT, http_pipeline_error_reply, req, &tv);
+	} else {
+		tv.tv_usec = 300000;
+		event_once(-1, EV_TIMEOUT, http_pipeline_late_reply, req, &tv);
+	}
+}
+
+static void
+http_pipeline_close_errorcb(struct bufferevent *bev, short what, void *arg)
+{
+	if (what & EVBUFFER_EOF)
+		test_ok = 1;
+}
+
+/*
+ * A reply that closes the connection while a later pipelined request is
+ * still with its callback.
+ */
+static void
+http_pipeline_close_test(void)
+{
+	struct bufferevent *bev;
+	int fd;
+	const char *http_request =
+	    "GET /pipe/error HTTP/1.1\r\n"
+	    "Host: somehost\r\n"
+	    "\r\n"
+	    "GET /pipe/later HTTP/1.1\r\n"
+	    "Host: somehost\r\n"
+	    "\r\n";
+	short port = -1;
+
+	test_ok = 0;
+	pipeline_late_sent = 0;
+	fprintf(stdout, "Testing HTTP pipelining with a closing reply: ");
+
+	http = http_setup(&port, NULL);
+	evhttp_set_max_pipeline(http, 2);
+	evhttp_set_cb(http, "/pipe/error", http_pipeline_close_cb, NULL);
+	evhttp_set_cb(http, "/pipe/later", http_pipeline_close_cb, NULL);
+
+	fd = http_connect("127.0.0.1", port);
+	bev = bufferevent_new(fd, http_pipeline_readcb, NULL,
+	    http_pipeline_close_errorcb, NULL);
+	bufferevent_enable(bev, EV_READ);
+
+	if (write(fd, http_request, strlen(http_request)) !=
+	    (int)strlen(http_request))
+		goto fail;
+
+	event_dispatch();
+
+	if (test_ok != 1 || !pipeline_late_sent)
+		goto fail;
+	if (http_pipeline_offset(bev->input, "404 Not Found") == -1 ||
+	    http_pipeline_offset(bev->input, "late reply") != -1)
+		goto fail;
+
+	bufferevent_free(bev);
+	EVUTIL_CLOSESOCKET(fd);
+	evhttp_free(http);
+
+	fprintf(stdout, "OK\n");
+	return;
+fail:
+	fprintf(stdout, "FAILED\n");
+	exit(1);
+}
+
+static char pipeline_replies[8];	/* one letter per client reply */
+
+static void
+http_client_pipeline_cb(struct evhttp_request *req, void *arg)
+{
+	const char *what = arg;
+	char letter = '!';
+
+	if (req == NULL)
+		letter = 'x';
+	else if (req->response_code == HTTP_OK &&
+	    EVBUFFER_LENGTH(req->input_buffer) == strlen(what) &&
+	    memcmp(EVBUFFER_DATA(req->input_buffer), what, strlen(what)) == 0)
+		letter = what[0];
+	pipeline_replies[strlen(pipeline_replies)] = letter;
+
+	if (strlen(pipeline_replies) == 3)
+		event_loopexit(NULL);
+}
+
+static void
+http_client_pipeline_test(int max, int close_first)
+{
+	struct evhttp_connection *evcon;
+	struct evhttp_request *req;
+	short port = -1;
+	int i;
+	const char *uris[] = { "/pipe/slow", "/pipe/fast", "/pipe/fast" };
+
+	pipeline_dispatched = pipeline_ahead = 0;
+	memset(pipeline_replies, 0, sizeof(pipeline_replies));
+	fprintf(stdout, "Testing HTTP client pipelining (max %d%s): ", max,
+	    close_first ? ", close" : "");
+
+	http = http_setup(&port, NULL);
+	evhttp_set_max_pipeline(http, 3);
+	evhttp_set_cb(http, "/pipe/slow", http_pipeline_cb, NULL);
+	evhttp_set_cb(http, "/pipe/fast", http_pipeline_cb, NULL);
+
+	evcon = evhttp_connection_new("127.0.0.1", port);
+	if (evcon == NULL) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+	evhttp_connection_set_max_pipeline(evcon, max);
+
+	/* all requests at once, before any response */
+	for (i = 0; i < 3; ++i) {
+		req = evhttp_request_new(http_client_pipeline_cb,
+		    i == 0 ? "slow reply" : "fast reply");
+		evhttp_add_header(req->output_headers, "Host", "somehost");
+		if (i == 0 && close_first)
+			evhttp_add_header(req->output_headers,
+			    "Connection", "close");
+		if (evhttp_make_request(evcon, req, EVHTTP_REQ_GET, uris[i])) {
+			fprintf(stdout, "FAILED\n");
+			exit(1);
+		}
+	}
+
+	event_dispatch();
+
+	/* the responses are matched to the requests in order */
+	if (strcmp(pipeline_replies, close_first ? "sxx" : "sff") != 0)
+		goto fail;
+
+	/* the written requests reached the server before the slow reply */
+	if (close_first) {
+		if (pipeline_dispatched != 1)
+			goto fail;
+	} else if (pipeline_dispatched != 3 ||
+	    pipeline_ahead != (max > 2 ? 2 : max - 1))
+		goto fail;
+
+	evhttp_connection_free(evcon);
+	evhttp_free(http);
+
+	fprintf(stdout, "OK\n");
+	return;
+fail:
+	fprintf(stdout, "FAILED\n");
+	exit(1);
+}
+
 void
 http_suite(void)
 {
 	http_base_test();
 	http_bad_header_test();
 	http_parse_query_test();
+	http_header_table_test();
+	http_parse_test();
 	http_basic_test();
 	http_connection_test(0 /* not-persistent */);
 	http_connection_test(1 /* persistent */);
@@ -1735,10 +2360,19 @@ http_suite(void)
 	http_failure_test();
 	http_highport_test();
 	http_dispatcher_test();
+	http_routing_test();
 
 	http_multi_line_header_test();
 	http_negative_content_length_test();
 
 	http_chunked_test();
 	http_terminate_chunked_test();
+
+	http_pipeline_test(1, 0);
+	http_pipeline_test(3, 0);
+	http_pipeline_test(2, 1);
+	http_pipeline_close_test();
+	http_client_pipeline_test(1, 0);
+	http_client_pipeline_test(3, 0);
+	http_client_pipeline_test(3, 1);
 }
@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2010 Niels Provos <provos@citi.umich.edu>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// timeheap.c：以小根堆实现的定时器存储，这是缺省的实现；
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#else
+#include <sys/_libevent_time.h>
+#endif
+#include <sys/queue.h>
+#include <signal.h>
+#include <stdlib.h>
+
+#include "event.h"
+#include "event-internal.h"
+#include "evutil.h"
+#include "min_heap.h"
+
+static void *heap_init	(struct event_base *);
+static int heap_reserve	(void *, unsigned);
+static int heap_add	(void *, struct event *);
+static int heap_del	(void *, struct event *);
+static int heap_next	(void *, struct timeval *);
+static struct event *heap_expired	(void *, const struct timeval *);
+static struct event *heap_first	(void *);
+static void heap_adjust	(void *, const struct timeval *);
+static void heap_dealloc	(struct event_base *, void *);
+
+const struct timerop heaptimerops = {
+	"minheap",
+	heap_init,
+	heap_reserve,
+	heap_add,
+	heap_del,
+	heap_next,
+	heap_expired,
+	heap_first,
+	heap_adjust,
+	heap_dealloc
+};
+
+static void *
+heap_init(struct event_base *base)
+{
+	min_heap_t *heap;
+
+	if ((heap = malloc(sizeof(min_heap_t))) == NULL)
+		return (NULL);
+	min_heap_ctor(heap);
+
+	return (heap);
+}
+
+static int
+heap_reserve(void *arg, unsigned n)
+{
+	min_heap_t *heap = arg;
+
+	return (min_heap_reserve(heap, min_heap_size(heap) + n));
+}
+
+static int
+heap_add(void *arg, struct event *ev)
+{
+	return (min_heap_push(arg, ev));
+}
+
+static int
+heap_del(void *arg, struct event *ev)
+{
+	return (min_heap_erase(arg, ev));
+}
+
+static int
+heap_next(void *arg, struct timeval *tv)
+{
+	struct event *ev;
+
+	if ((ev = min_heap_top(arg)) == NULL)
+		return (-1);
+
+	*tv = ev->ev_timeout;
+	return (0);
+}
+
+static struct event *
+heap_expired(void *arg, const struct timeval *now)
+{
+	struct event *ev;
+
+	if ((ev = min_heap_top(arg)) == NULL)
+		return (NULL);
+	if (evutil_timercmp(&ev->ev_timeout, now, >))
+		return (NULL);
+
+	return (ev);
+}
+
+static struct event *
+heap_first(void *arg)
+{
+	return (min_heap_top(arg));
+}
+
+static void
+heap_adjust(void *arg, const struct timeval *off)
+{
+	min_heap_t *heap = arg;
+	struct event **pev;
+	unsigned int size;
+
+	/*
+	 * We can modify the key element of the node without destroying
+	 * the key, beause we apply it to all in the right order.
+	 */
+	pev = heap->p;
+	size = heap->n;
+	for (; size-- > 0; ++pev) {
+		struct timeval *ev_tv = &(**pev).ev_timeout;
+		evutil_timersub(ev_tv, off, ev_tv);
+	}
+}
+
+static void
+heap_dealloc(struct event_base *base, void *arg)
+{
+	min_heap_t *heap = arg;
+
+	min_heap_dtor(heap);
+	free(heap);
+}
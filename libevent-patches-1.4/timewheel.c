@@ -0,0 +1,394 @@
+/*
+ * Copyright (c) 2010 Niels Provos <provos@citi.umich.edu>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// timewheel.c：以分层时间轮实现的定时器存储，插入和删除都是O(1)；
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#else
+#include <sys/_libevent_time.h>
+#endif
+#include <sys/queue.h>
+#include <signal.h>
+#include <stdlib.h>
+
+#include "event.h"
+#include "event-internal.h"
+#include "evutil.h"
+
+/*
+ * A hierarchical timing wheel in the style of the classic BSD/Linux
+ * callout wheel.  Time is counted in ticks of WHEEL_TICK_USEC.  The root
+ * wheel has one slot per tick for the next 256 ticks; each of the three
+ * outer wheels has 64 slots that each cover a whole revolution of the
+ * wheel below it.  When the root wheel wraps, the current slot of the
+ * next wheel is cascaded down and its events are re-filed by their
+ * remaining time.  Timeouts further out than the outermost wheel can
+ * reach are parked in its last slot and re-filed when it comes around.
+ *
+ * An event in the wheel is linked through ev_timeout_next, and the slot
+ * it sits in is remembered in min_heap_idx, which only the heap uses.
+ */
+
+#define WHEEL_TICK_USEC		1000
+#define WHEEL_LEVELS		4
+#define WHEEL_ROOT_BITS		8
+#define WHEEL_LEVEL_BITS	6
+#define WHEEL_ROOT_SIZE		(1 << WHEEL_ROOT_BITS)
+#define WHEEL_LEVEL_SIZE	(1 << WHEEL_LEVEL_BITS)
+#define WHEEL_ROOT_MASK		(WHEEL_ROOT_SIZE - 1)
+#define WHEEL_LEVEL_MASK	(WHEEL_LEVEL_SIZE - 1)
+#define WHEEL_NSLOTS \
+	(WHEEL_ROOT_SIZE + (WHEEL_LEVELS - 1) * WHEEL_LEVEL_SIZE)
+
+/* first tick that is not covered by a wheel at all */
+#define WHEEL_SPAN \
+	((ev_uint64_t)1 << (WHEEL_ROOT_BITS + (WHEEL_LEVELS - 1) * WHEEL_LEVEL_BITS))
+
+/* bit position of the ticks that select a slot of the given level */
+#define WHEEL_SHIFT(level) \
+	(WHEEL_ROOT_BITS + ((level) - 1) * WHEEL_LEVEL_BITS)
+#define WHEEL_SLOT(level, idx) \
+	(WHEEL_ROOT_SIZE + ((level) - 1) * WHEEL_LEVEL_SIZE + (idx))
+#define WHEEL_SLOT_LEVEL(slot) \
+	((slot) < WHEEL_ROOT_SIZE ? 0 : \
+	    1 + ((slot) - WHEEL_ROOT_SIZE) / WHEEL_LEVEL_SIZE)
+
+struct timewheel {
+	struct event_list slots[WHEEL_NSLOTS];
+	unsigned count[WHEEL_LEVELS];	/* events filed on each level */
+	unsigned n;			/* events in the wheel */
+	ev_uint64_t now;		/* first tick not yet processed */
+};
+
+static void *wheel_init	(struct event_base *);
+static int wheel_reserve	(void *, unsigned);
+static int wheel_add	(void *, struct event *);
+static int wheel_del	(void *, struct event *);
+static int wheel_next	(void *, struct timeval *);
+static struct event *wheel_expired	(void *, const struct timeval *);
+static struct event *wheel_first	(void *);
+static void wheel_adjust	(void *, const struct timeval *);
+static void wheel_dealloc	(struct event_base *, void *);
+
+const struct timerop wheeltimerops = {
+	"timerwheel",
+	wheel_init,
+	wheel_reserve,
+	wheel_add,
+	wheel_del,
+	wheel_next,
+	wheel_expired,
+	wheel_first,
+	wheel_adjust,
+	wheel_dealloc
+};
+
+static ev_uint64_t
+tv_to_ticks(const struct timeval *tv, int round_up)
+{
+	ev_uint64_t usec;
+
+	usec = (ev_uint64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+	if (round_up)
+		usec += WHEEL_TICK_USEC - 1;
+
+	return (usec / WHEEL_TICK_USEC);
+}
+
+static void
+ticks_to_tv(ev_uint64_t ticks, struct timeval *tv)
+{
+	ev_uint64_t usec = ticks * WHEEL_TICK_USEC;
+
+	tv->tv_sec = (long)(usec / 1000000);
+	tv->tv_usec = (long)(usec % 1000000);
+}
+
+static void
+wheel_insert(struct timewheel *tw, struct event *ev)
+{
+	/* round up so that an event never fires before its timeout */
+	ev_uint64_t expires = tv_to_ticks(&ev->ev_timeout, 1);
+	ev_uint64_t delta;
+	unsigned slot;
+	int level;
+
+	if (expires <= tw->now) {
+		/* already due, file it under the tick we look at next */
+		expires = tw->now;
+	} else if (expires - tw->now >= WHEEL_SPAN) {
+		expires = tw->now + WHEEL_SPAN - 1;
+	}
+	delta = expires - tw->now;
+
+	if (delta < WHEEL_ROOT_SIZE) {
+		level = 0;
+		slot = (unsigned)(expires & WHEEL_ROOT_MASK);
+	} else {
+		for (level = 1; level < WHEEL_LEVELS - 1; ++level) {
+			if (delta < ((ev_uint64_t)1 <<
+				(WHEEL_SHIFT(level) + WHEEL_LEVEL_BITS)))
+				break;
+		}
+		slot = WHEEL_SLOT(level, (unsigned)
+		    ((expires >> WHEEL_SHIFT(level)) & WHEEL_LEVEL_MASK));
+	}
+
+	TAILQ_INSERT_TAIL(&tw->slots[slot], ev, ev_timeout_next);
+	ev->min_heap_idx = slot;
+	tw->count[level]++;
+	tw->n++;
+}
+
+static void
+wheel_remove(struct timewheel *tw, struct event *ev)
+{
+	unsigned slot = ev->min_heap_idx;
+
+	TAILQ_REMOVE(&tw->slots[slot], ev, ev_timeout_next);
+	ev->min_heap_idx = -1;
+	tw->count[WHEEL_SLOT_LEVEL(slot)]--;
+	tw->n--;
+}
+
+/* re-file the events of the current slot of the given level */
+static unsigned
+wheel_cascade(struct timewheel *tw, int level)
+{
+	unsigned idx = (unsigned)
+	    ((tw->now >> WHEEL_SHIFT(level)) & WHEEL_LEVEL_MASK);
+	struct event_list *list = &tw->slots[WHEEL_SLOT(level, idx)];
+	struct event *ev;
+
+	while ((ev = TAILQ_FIRST(list)) != NULL) {
+		wheel_remove(tw, ev);
+		wheel_insert(tw, ev);
+	}
+
+	return (idx);
+}
+
+/* called whenever now crosses a revolution of the root wheel */
+static void
+wheel_wrap(struct timewheel *tw)
+{
+	int level;
+
+	for (level = 1; level < WHEEL_LEVELS; ++level) {
+		if (wheel_cascade(tw, level) != 0)
+			break;
+	}
+}
+
+static void *
+wheel_init(struct event_base *base)
+{
+	struct timewheel *tw;
+	int i;
+
+	if ((tw = calloc(1, sizeof(struct timewheel))) == NULL)
+		return (NULL);
+	for (i = 0; i < WHEEL_NSLOTS; ++i)
+		TAILQ_INIT(&tw->slots[i]);
+	tw->now = tv_to_ticks(&base->event_tv, 0);
+
+	return (tw);
+}
+
+static int
+wheel_reserve(void *arg, unsigned n)
+{
+	/* list insertion cannot fail */
+	return (0);
+}
+
+static int
+wheel_add(void *arg, struct event *ev)
+{
+	wheel_insert(arg, ev);
+	return (0);
+}
+
+static int
+wheel_del(void *arg, struct event *ev)
+{
+	if (ev->min_heap_idx == (unsigned int)-1)
+		return (-1);
+
+	wheel_remove(arg, ev);
+	return (0);
+}
+
+/*
+ * Events on the root wheel are filed by their exact tick.  Events on an
+ * outer wheel are only known to the granularity of their slot, so for
+ * them we report the tick at which the slot cascades; waking up then is
+ * early but never late.
+ */
+static int
+wheel_next(void *arg, struct timeval *tv)
+{
+	struct timewheel *tw = arg;
+	ev_uint64_t next = 0, tick;
+	int found = 0, level;
+	unsigned i;
+
+	if (tw->n == 0)
+		return (-1);
+
+	if (tw->count[0]) {
+		for (i = 0; i < WHEEL_ROOT_SIZE; ++i) {
+			tick = tw->now + i;
+			if (TAILQ_FIRST(&tw->slots[tick & WHEEL_ROOT_MASK])) {
+				next = tick;
+				found = 1;
+				break;
+			}
+		}
+	}
+
+	for (level = 1; level < WHEEL_LEVELS; ++level) {
+		ev_uint64_t base = tw->now >> WHEEL_SHIFT(level);
+
+		if (!tw->count[level])
+			continue;
+		for (i = 1; i <= WHEEL_LEVEL_SIZE; ++i) {
+			unsigned idx = (unsigned)((base + i) & WHEEL_LEVEL_MASK);
+			if (TAILQ_FIRST(&tw->slots[WHEEL_SLOT(level, idx)])) {
+				tick = (base + i) << WHEEL_SHIFT(level);
+				if (!found || tick < next) {
+					next = tick;
+					found = 1;
+				}
+				break;
+			}
+		}
+	}
+
+	ticks_to_tv(next, tv);
+	return (0);
+}
+
+static struct event *
+wheel_expired(void *arg, const struct timeval *now)
+{
+	struct timewheel *tw = arg;
+	ev_uint64_t target = tv_to_ticks(now, 0);
+	struct event *ev;
+
+	if (tw->n == 0) {
+		/* nothing to hand down, just keep up with the clock */
+		if (target > tw->now)
+			tw->now = target;
+		return (NULL);
+	}
+
+	while (tw->now < target) {
+		ev = TAILQ_FIRST(&tw->slots[tw->now & WHEEL_ROOT_MASK]);
+		if (ev != NULL)
+			return (ev);
+
+		if (tw->count[0] == 0) {
+			/*
+			 * Nothing can fire before the next cascade, so
+			 * jump straight to the first wrap that has work.
+			 */
+			ev_uint64_t step = WHEEL_ROOT_SIZE, next;
+			int level;
+
+			for (level = 1; level < WHEEL_LEVELS - 1 &&
+			    tw->count[level] == 0; ++level)
+				step <<= WHEEL_LEVEL_BITS;
+			next = (tw->now | (step - 1)) + 1;
+			if (next > target) {
+				tw->now = target;
+				break;
+			}
+			tw->now = next;
+		} else
+			tw->now++;
+
+		if ((tw->now & WHEEL_ROOT_MASK) == 0)
+			wheel_wrap(tw);
+	}
+
+	return (TAILQ_FIRST(&tw->slots[tw->now & WHEEL_ROOT_MASK]));
+}
+
+static struct event *
+wheel_first(void *arg)
+{
+	struct timewheel *tw = arg;
+	struct event *ev;
+	int i;
+
+	if (tw->n == 0)
+		return (NULL);
+	for (i = 0; i < WHEEL_NSLOTS; ++i) {
+		if ((ev = TAILQ_FIRST(&tw->slots[i])) != NULL)
+			return (ev);
+	}
+
+	return (NULL);
+}
+
+static void
+wheel_adjust(void *arg, const struct timeval *off)
+{
+	struct timewheel *tw = arg;
+	struct event_list all;
+	struct event *ev;
+	ev_uint64_t back = tv_to_ticks(off, 1);
+	int i;
+
+	TAILQ_INIT(&all);
+	for (i = 0; i < WHEEL_NSLOTS; ++i) {
+		while ((ev = TAILQ_FIRST(&tw->slots[i])) != NULL) {
+			wheel_remove(tw, ev);
+			TAILQ_INSERT_TAIL(&all, ev, ev_timeout_next);
+		}
+	}
+
+	tw->now = tw->now > back ? tw->now - back : 0;
+
+	while ((ev = TAILQ_FIRST(&all)) != NULL) {
+		TAILQ_REMOVE(&all, ev, ev_timeout_next);
+		evutil_timersub(&ev->ev_timeout, off, &ev->ev_timeout);
+		wheel_insert(tw, ev);
+	}
+}
+
+static void
+wheel_dealloc(struct event_base *base, void *arg)
+{
+	free(arg);
+}
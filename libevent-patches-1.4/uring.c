@@ -0,0 +1,1111 @@
+/*
+ * Copyright (c) 2010 Niels Provos <provos@citi.umich.edu>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+// uring.c：基于io_uring的I/O多路复用机制，通过提交队列批量注册poll请求，
+// 通过完成队列收集就绪事件；内核不支持时由epoll接手。
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <sys/types.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#else
+#include <sys/_libevent_time.h>
+#endif
+#include <sys/queue.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "event.h"
+#include "event-internal.h"
+#include "evsignal.h"
+#include "evutil.h"
+#include "evbuffer-internal.h"
+#include "log.h"
+
+/*
+ * Every fd with events gets one outstanding IORING_OP_POLL_ADD.  Level
+ * triggered events use one-shot polls that are re-armed at the next
+ * dispatch; EV_ET events use a multishot poll that keeps posting
+ * completions until it is removed.
+ */
+struct evuring {
+	struct event *evread;
+	struct event *evwrite;
+	short armed;		/* poll mask of the outstanding request */
+	short multishot;	/* the outstanding request is multishot */
+	unsigned int gen;	/* tells completions of old requests apart */
+	int changed;		/* URING_CHANGE_* flags */
+};
+
+/* the fd is on the changelist */
+#define URING_CHANGE_QUEUED	0x01
+/* all events of the fd were deleted since the last flush, so the fd may
+ * have been closed and reused; the old poll still holds the old file */
+#define URING_CHANGE_DELETED	0x02
+
+/* user_data of a poll request: generation in the upper half, fd below */
+#define URING_UDATA(fd, gen)	(((__u64)(gen) << 32) | (__u32)(fd))
+#define URING_GEN_MASK		0x7fffffff
+/* user_data of buffer I/O: this bit plus the address of the request */
+#define URING_IO_TAG		((__u64)1 << 63)
+/* set as well on the poll a request of buffer I/O waits behind */
+#define URING_IO_POLL		((__u64)1)
+/* user_data of requests whose completions we do not care about */
+#define URING_IGNORE		((__u64)-1)
+
+/* the most segments that one write hands to the kernel */
+#define URING_IO_IOVEC		32
+/* the most bytes that one read asks for */
+#define URING_IO_READ_MAX	65536
+/* smaller sends do not pay for the zero-copy notification */
+#define URING_ZEROCOPY_MIN	8192
+/* how long the teardown waits for requests to finish, in 100ms steps */
+#define URING_IO_SHUTDOWN_TRIES	50
+
+#ifdef IORING_SEND_ZC_REPORT_USAGE
+#define URING_HAVE_SENDMSG_ZC
+#endif
+
+/*
+ * Completion-based evbuffer I/O.  The kernel works on the segments of the
+ * evbuffer itself.  A write sends from the segments at the front of the
+ * buffer, which stay pinned until the kernel is done with them and are
+ * drained by what was sent when the callback runs.  A read goes into a
+ * segment reserved for it, which is appended to the buffer once the data
+ * is in.
+ */
+struct uring_io {
+	struct event ev;	/* runs the callback from the event loop */
+	TAILQ_ENTRY(uring_io) next;	/* on the list of the ring */
+	struct uringop *uop;
+	struct evbuffer *buf;	/* NULL once the evbuffer went away */
+	evbuffer_iocb cb;
+	void *cbarg;
+	int fd;
+	short what;		/* EV_READ or EV_WRITE */
+	short zerocopy;		/* sent with IORING_OP_SENDMSG_ZC */
+	short notsock;		/* written with IORING_OP_WRITEV */
+	short waiting;		/* linked behind a poll for the fd */
+	short submitted;	/* the request has not completed yet */
+	short active;		/* the callback has not run yet */
+	short withdrawn;	/* cancelled before the kernel saw it */
+	unsigned sqe_pos;	/* where the request sits in the queue */
+	int notifs;		/* zero-copy notifications still to come */
+	size_t len;		/* bytes to read */
+	int result;
+	int error;
+	int nchains;
+	struct evbuffer_chain *chains[URING_IO_IOVEC];	/* pinned */
+	struct iovec iov[URING_IO_IOVEC];
+	struct msghdr msg;
+};
+
+TAILQ_HEAD(uring_ioq, uring_io);
+
+struct uringop {
+	struct evuring *fds;
+	int nfds;
+	int ring_fd;
+	int *changelist;
+	int nchanges;
+	int changes_size;
+
+	/* submission queue, shared with the kernel */
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned sq_entries;
+	struct io_uring_sqe *sqes;
+
+	/* completion queue, shared with the kernel */
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	size_t sq_ring_sz;
+	void *cq_ring;
+	size_t cq_ring_sz;
+	size_t sqes_sz;
+
+	struct uring_ioq ios;	/* buffer I/O that is not done yet */
+	struct uring_ioq free_ios;	/* for reuse */
+	int nozerocopy;		/* the kernel has no IORING_OP_SENDMSG_ZC */
+	pid_t pid;		/* the process that set up the ring */
+};
+
+static void *uring_init	(struct event_base *);
+static int uring_add	(void *, struct event *);
+static int uring_del	(void *, struct event *);
+static int uring_dispatch	(struct event_base *, void *, struct timeval *);
+static void uring_dealloc	(struct event_base *, void *);
+static int uring_buffer_io	(struct event_base *, void *, short,
+    struct evbuffer *, int, int, evbuffer_iocb, void *);
+static void uring_buffer_cancel	(struct event_base *, void *,
+    struct evbuffer *, int);
+static void uring_io_cb	(int, short, void *);
+static void uring_io_shutdown	(struct uringop *, int);
+
+const struct eventop uringops = {
+	"io_uring",
+	uring_init,
+	uring_add,
+	uring_del,
+	uring_dispatch,
+	uring_dealloc,
+	1, /* need reinit */
+	EVENTOP_FEATURE_THREADS|EVENTOP_FEATURE_ET,
+	uring_buffer_io,
+	uring_buffer_cancel
+};
+
+#define URING_ENTRIES 256
+#define URING_CQ_ENTRIES 1024
+#define INITIAL_NFILES 32
+#define INITIAL_NCHANGES 32
+
+static int
+sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int
+sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+    unsigned flags, void *arg, size_t argsz)
+{
+	return (syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		flags, arg, argsz));
+}
+
+static void
+uring_free(struct uringop *uop)
+{
+	struct uring_io *io;
+
+	if (uop->sqes != NULL)
+		munmap(uop->sqes, uop->sqes_sz);
+	if (uop->cq_ring != NULL && uop->cq_ring != uop->sq_ring)
+		munmap(uop->cq_ring, uop->cq_ring_sz);
+	if (uop->sq_ring != NULL)
+		munmap(uop->sq_ring, uop->sq_ring_sz);
+	if (uop->ring_fd >= 0)
+		close(uop->ring_fd);
+	if (uop->fds)
+		free(uop->fds);
+	if (uop->changelist)
+		free(uop->changelist);
+	while ((io = TAILQ_FIRST(&uop->free_ios)) != NULL) {
+		TAILQ_REMOVE(&uop->free_ios, io, next);
+		free(io);
+	}
+
+	memset(uop, 0, sizeof(struct uringop));
+	free(uop);
+}
+
+static void *
+uring_init(struct event_base *base)
+{
+	struct io_uring_params params;
+	struct uringop *uop;
+	void *p;
+	int fd;
+
+	/* Disable io_uring when this environment variable is set */
+	if (evutil_getenv("EVENT_NOIOURING"))
+		return (NULL);
+
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = URING_CQ_ENTRIES;
+	/* old kernels and locked down containers refuse; epoll takes over */
+	if ((fd = sys_io_uring_setup(URING_ENTRIES, &params)) == -1)
+		return (NULL);
+
+	/*
+	 * We need EXT_ARG (5.11) to pass the timeout to io_uring_enter.
+	 * Multishot poll came with 5.13, as did resource tags.
+	 */
+	if (!(params.features & IORING_FEAT_EXT_ARG)
+#ifdef IORING_FEAT_RSRC_TAGS
+	    || !(params.features & IORING_FEAT_RSRC_TAGS)
+#endif
+	    ) {
+		close(fd);
+		return (NULL);
+	}
+
+	if (!(uop = calloc(1, sizeof(struct uringop)))) {
+		close(fd);
+		return (NULL);
+	}
+	uop->ring_fd = fd;
+	uop->pid = getpid();
+	TAILQ_INIT(&uop->ios);
+	TAILQ_INIT(&uop->free_ios);
+
+	uop->sq_ring_sz = params.sq_off.array +
+	    params.sq_entries * sizeof(unsigned);
+	uop->cq_ring_sz = params.cq_off.cqes +
+	    params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (uop->cq_ring_sz > uop->sq_ring_sz)
+			uop->sq_ring_sz = uop->cq_ring_sz;
+		uop->cq_ring_sz = uop->sq_ring_sz;
+	}
+
+	p = mmap(NULL, uop->sq_ring_sz, PROT_READ|PROT_WRITE,
+	    MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (p == MAP_FAILED)
+		goto err;
+	uop->sq_ring = p;
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		uop->cq_ring = uop->sq_ring;
+	} else {
+		p = mmap(NULL, uop->cq_ring_sz, PROT_READ|PROT_WRITE,
+		    MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (p == MAP_FAILED)
+			goto err;
+		uop->cq_ring = p;
+	}
+
+	uop->sqes_sz = params.sq_entries * sizeof(struct io_uring_sqe);
+	p = mmap(NULL, uop->sqes_sz, PROT_READ|PROT_WRITE,
+	    MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (p == MAP_FAILED)
+		goto err;
+	uop->sqes = p;
+
+	p = uop->sq_ring;
+	uop->sq_head = (unsigned *)((char *)p + params.sq_off.head);
+	uop->sq_tail = (unsigned *)((char *)p + params.sq_off.tail);
+	uop->sq_mask = (unsigned *)((char *)p + params.sq_off.ring_mask);
+	uop->sq_array = (unsigned *)((char *)p + params.sq_off.array);
+	uop->sq_entries = params.sq_entries;
+
+	p = uop->cq_ring;
+	uop->cq_head = (unsigned *)((char *)p + params.cq_off.head);
+	uop->cq_tail = (unsigned *)((char *)p + params.cq_off.tail);
+	uop->cq_mask = (unsigned *)((char *)p + params.cq_off.ring_mask);
+	uop->cqes = (struct io_uring_cqe *)((char *)p + params.cq_off.cqes);
+
+	uop->fds = calloc(INITIAL_NFILES, sizeof(struct evuring));
+	if (uop->fds == NULL)
+		goto err;
+	uop->nfds = INITIAL_NFILES;
+
+	evsignal_init(base);
+
+	return (uop);
+
+ err:
+	event_warn("%s: io_uring ring setup", __func__);
+	uring_free(uop);
+	return (NULL);
+}
+
+static int
+uring_recalc(struct event_base *base, void *arg, int max)
+{
+	struct uringop *uop = arg;
+
+	if (max >= uop->nfds) {
+		struct evuring *fds;
+		int nfds;
+
+		nfds = uop->nfds;
+		while (nfds <= max)
+			nfds <<= 1;
+
+		fds = realloc(uop->fds, nfds * sizeof(struct evuring));
+		if (fds == NULL) {
+			event_warn("realloc");
+			return (-1);
+		}
+		uop->fds = fds;
+		memset(fds + uop->nfds, 0,
+		    (nfds - uop->nfds) * sizeof(struct evuring));
+		uop->nfds = nfds;
+	}
+
+	return (0);
+}
+
+static unsigned
+uring_pending(struct uringop *uop)
+{
+	return (*uop->sq_tail -
+	    __atomic_load_n(uop->sq_head, __ATOMIC_ACQUIRE));
+}
+
+/* the next entry of the submission queue, without checking for room */
+static struct io_uring_sqe *
+uring_tail_sqe(struct uringop *uop)
+{
+	struct io_uring_sqe *sqe;
+	unsigned idx;
+
+	idx = *uop->sq_tail & *uop->sq_mask;
+	sqe = &uop->sqes[idx];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	uop->sq_array[idx] = idx;
+
+	return (sqe);
+}
+
+/*
+ * Returns a cleared entry at the tail of the submission queue; the kernel
+ * sees it once uring_commit() has published it.  There is always room for
+ * a second entry, so a linked pair never gets split by a flush.
+ */
+static struct io_uring_sqe *
+uring_get_sqe(struct uringop *uop)
+{
+	if (uring_pending(uop) + 2 > uop->sq_entries) {
+		/* the queue is full, hand it to the kernel right away */
+		if (sys_io_uring_enter(uop->ring_fd, uop->sq_entries, 0, 0,
+			NULL, 0) == -1 ||
+		    uring_pending(uop) + 2 > uop->sq_entries) {
+			event_warn("%s: io_uring_enter", __func__);
+			return (NULL);
+		}
+	}
+
+	return (uring_tail_sqe(uop));
+}
+
+static void
+uring_commit(struct uringop *uop)
+{
+	__atomic_store_n(uop->sq_tail, *uop->sq_tail + 1, __ATOMIC_RELEASE);
+}
+
+static int
+uring_queue_poll(struct uringop *uop, int opcode, int fd, unsigned events,
+    __u64 addr, unsigned len, __u64 user_data)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = uring_get_sqe(uop)) == NULL)
+		return (-1);
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->poll32_events = events;
+	sqe->addr = addr;
+	sqe->len = len;
+	sqe->user_data = user_data;
+	uring_commit(uop);
+
+	return (0);
+}
+
+static int
+uring_queue_change(struct uringop *uop, int fd)
+{
+	struct evuring *evu = &uop->fds[fd];
+
+	if (evu->changed & URING_CHANGE_QUEUED)
+		return (0);
+
+	if (uop->nchanges == uop->changes_size) {
+		int size = uop->changes_size ?
+		    uop->changes_size * 2 : INITIAL_NCHANGES;
+		int *changelist;
+
+		changelist = realloc(uop->changelist, size * sizeof(int));
+		if (changelist == NULL) {
+			event_warn("realloc");
+			return (-1);
+		}
+		uop->changelist = changelist;
+		uop->changes_size = size;
+	}
+
+	uop->changelist[uop->nchanges++] = fd;
+	evu->changed |= URING_CHANGE_QUEUED;
+	return (0);
+}
+
+/*
+ * Queue the poll requests and removals that the changed fds need.  An fd
+ * whose request could not be queued stays on the changelist and is tried
+ * again at the next dispatch.
+ */
+static void
+uring_apply_changes(struct uringop *uop)
+{
+	struct evuring *evu;
+	int i, fd, events, et, nleft = 0;
+
+	for (i = 0; i < uop->nchanges; ++i) {
+		fd = uop->changelist[i];
+		evu = &uop->fds[fd];
+
+		events = 0;
+		if (evu->evread != NULL)
+			events |= POLLIN;
+		if (evu->evwrite != NULL)
+			events |= POLLOUT;
+		et = (evu->evread != NULL &&
+		    (evu->evread->ev_events & EV_ET)) ||
+		    (evu->evwrite != NULL &&
+			(evu->evwrite->ev_events & EV_ET));
+
+		if (evu->armed && (evu->armed != events ||
+			evu->multishot != et ||
+			(evu->changed & URING_CHANGE_DELETED))) {
+			if (uring_queue_poll(uop, IORING_OP_POLL_REMOVE, -1, 0,
+				URING_UDATA(fd, evu->gen), 0,
+				URING_IGNORE) == -1) {
+				uop->changelist[nleft++] = fd;
+				continue;
+			}
+			evu->armed = 0;
+		}
+		evu->changed = 0;
+
+		if (evu->armed || !events)
+			continue;
+
+		/* a new generation makes late completions of the old
+		 * request harmless */
+		evu->gen = (evu->gen + 1) & URING_GEN_MASK;
+		if (uring_queue_poll(uop, IORING_OP_POLL_ADD, fd, events, 0,
+			et ? IORING_POLL_ADD_MULTI : 0,
+			URING_UDATA(fd, evu->gen)) == -1) {
+			evu->changed = URING_CHANGE_QUEUED;
+			uop->changelist[nleft++] = fd;
+			continue;
+		}
+		evu->armed = events;
+		evu->multishot = et;
+	}
+
+	uop->nchanges = nleft;
+}
+
+static struct uring_io *
+uring_io_new(struct event_base *base, struct uringop *uop)
+{
+	struct uring_io *io;
+
+	if ((io = TAILQ_FIRST(&uop->free_ios)) != NULL)
+		TAILQ_REMOVE(&uop->free_ios, io, next);
+	else if ((io = malloc(sizeof(struct uring_io))) == NULL)
+		return (NULL);
+	memset(io, 0, offsetof(struct uring_io, chains));
+	io->uop = uop;
+	event_set(&io->ev, -1, 0, uring_io_cb, io);
+	event_base_set(base, &io->ev);
+
+	return (io);
+}
+
+/* Frees a request once neither the kernel nor its callback needs it. */
+static void
+uring_io_done(struct uringop *uop, struct uring_io *io)
+{
+	int i;
+
+	if (io->submitted || io->active || io->notifs)
+		return;
+
+	/* a read segment that was not appended goes away here */
+	for (i = 0; i < io->nchains; ++i)
+		evbuffer_chain_unpin(io->chains[i]);
+	io->nchains = 0;
+
+	TAILQ_REMOVE(&uop->ios, io, next);
+	TAILQ_INSERT_HEAD(&uop->free_ios, io, next);
+}
+
+static __u64
+uring_io_udata(struct uring_io *io)
+{
+	return (URING_IO_TAG | (__u64)(uintptr_t)io);
+}
+
+/* With wait set, the request is linked behind a poll for the fd, for
+ * non-blocking fds that had nothing to give. */
+static int
+uring_io_submit(struct uringop *uop, struct uring_io *io, int wait)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = uring_get_sqe(uop)) == NULL)
+		return (-1);
+	io->waiting = wait;
+	if (wait) {
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = io->fd;
+		sqe->poll32_events = io->what == EV_READ ? POLLIN : POLLOUT;
+		sqe->flags = IOSQE_IO_LINK;
+		sqe->user_data = uring_io_udata(io) | URING_IO_POLL;
+		uring_commit(uop);
+		sqe = uring_tail_sqe(uop);
+	}
+
+	io->sqe_pos = *uop->sq_tail;
+	sqe->fd = io->fd;
+	sqe->user_data = uring_io_udata(io);
+	if (io->what == EV_READ) {
+		sqe->opcode = IORING_OP_READ;
+		sqe->addr = (__u64)(uintptr_t)io->chains[0]->buffer;
+		sqe->len = io->len;
+		sqe->off = (__u64)-1;
+	} else if (io->notsock) {
+		sqe->opcode = IORING_OP_WRITEV;
+		sqe->addr = (__u64)(uintptr_t)io->iov;
+		sqe->len = io->nchains;
+		sqe->off = (__u64)-1;
+	} else {
+		sqe->opcode = IORING_OP_SENDMSG;
+#ifdef URING_HAVE_SENDMSG_ZC
+		if (io->zerocopy)
+			sqe->opcode = IORING_OP_SENDMSG_ZC;
+#endif
+		sqe->addr = (__u64)(uintptr_t)&io->msg;
+		sqe->len = 1;
+		sqe->msg_flags = MSG_NOSIGNAL;
+	}
+	uring_commit(uop);
+	io->submitted = 1;
+
+	return (0);
+}
+
+/*
+ * Asks the kernel to give up on a request; it completes with ECANCELED.
+ * A request still waiting in the submission queue is turned into a no-op
+ * instead, so it cannot complete after all.
+ */
+static void
+uring_io_cancel(struct uringop *uop, struct uring_io *io)
+{
+	__u64 udata = uring_io_udata(io);
+	unsigned head = __atomic_load_n(uop->sq_head, __ATOMIC_ACQUIRE);
+	struct io_uring_sqe *sqe;
+
+	if ((int)(io->sqe_pos - head) >= 0) {
+		sqe = &uop->sqes[io->sqe_pos & *uop->sq_mask];
+		memset(sqe, 0, sizeof(struct io_uring_sqe));
+		sqe->opcode = IORING_OP_NOP;
+		sqe->user_data = udata;
+		if (io->waiting && (int)(io->sqe_pos - 1 - head) >= 0) {
+			sqe = &uop->sqes[(io->sqe_pos - 1) & *uop->sq_mask];
+			sqe->opcode = IORING_OP_NOP;
+		}
+		io->withdrawn = 1;
+		return;
+	}
+
+	if (io->waiting)
+		udata |= URING_IO_POLL;
+	uring_queue_poll(uop, IORING_OP_ASYNC_CANCEL, -1, 0, udata, 0,
+	    URING_IGNORE);
+}
+
+static void
+uring_io_finish(struct uring_io *io, int result, int error)
+{
+	io->result = result;
+	io->error = error;
+	io->active = 1;
+	event_active(&io->ev, io->what, 1);
+}
+
+static void
+uring_io_complete(struct uringop *uop, struct io_uring_cqe *cqe)
+{
+	struct uring_io *io;
+	int res = cqe->res;
+
+	/* the poll a request waited behind; the request itself follows */
+	if (cqe->user_data & URING_IO_POLL)
+		return;
+	io = (struct uring_io *)(uintptr_t)(cqe->user_data & ~URING_IO_TAG);
+
+#ifdef URING_HAVE_SENDMSG_ZC
+	if (cqe->flags & IORING_CQE_F_NOTIF) {
+		/* the kernel is done with the pages of a zero-copy send */
+		--io->notifs;
+		uring_io_done(uop, io);
+		return;
+	}
+	if (cqe->flags & IORING_CQE_F_MORE)
+		++io->notifs;
+#endif
+
+	io->submitted = 0;
+	if (io->withdrawn) {
+		io->withdrawn = 0;
+		res = -ECANCELED;
+	}
+	if (io->buf == NULL) {
+		/* the evbuffer is gone, and nobody waits for the callback */
+		io->ev.ev_base->event_count--;
+		uring_io_done(uop, io);
+		return;
+	}
+
+	if (io->what == EV_WRITE) {
+		if (io->zerocopy && (res == -EINVAL || res == -EOPNOTSUPP)) {
+			/* no zero-copy here: send it the normal way */
+			if (res == -EINVAL)
+				uop->nozerocopy = 1;
+			io->zerocopy = 0;
+			if (uring_io_submit(uop, io, 0) == 0)
+				return;
+			res = -errno;
+		} else if (res == -ENOTSOCK && !io->notsock) {
+			/* a pipe or a file */
+			io->zerocopy = 0;
+			io->notsock = 1;
+			if (uring_io_submit(uop, io, 0) == 0)
+				return;
+			res = -errno;
+		}
+	}
+
+	if (res == -EAGAIN) {
+		/* a non-blocking fd: try again once it is ready */
+		if (uring_io_submit(uop, io, 1) == 0)
+			return;
+		res = -errno;
+	}
+
+	/* the request no longer keeps the loop alive, the callback does */
+	io->ev.ev_base->event_count--;
+	if (res < 0)
+		uring_io_finish(io, -1, -res);
+	else
+		uring_io_finish(io, res, 0);
+}
+
+static void
+uring_io_cb(int fd, short what, void *arg)
+{
+	struct uring_io *io = arg;
+	struct event_base *base = io->ev.ev_base;
+	struct evbuffer *buf = io->buf;
+	evbuffer_iocb cb = io->cb;
+	void *cbarg = io->cbarg;
+	int result = io->result, error = io->error;
+
+	/* only what the kernel took leaves the buffer */
+	if (result > 0 && what == EV_READ) {
+		evbuffer_chain_commit(buf, io->chains[0], result);
+		io->nchains = 0;
+	} else if (result > 0)
+		evbuffer_drain(buf, result);
+
+	EVBASE_ACQUIRE_LOCK(base);
+	io->active = 0;
+	buf->io_pending &= ~what;
+	uring_io_done(io->uop, io);
+	EVBASE_RELEASE_LOCK(base);
+
+	errno = error;
+	(*cb)(buf, result, cbarg);
+}
+
+static int
+uring_buffer_io(struct event_base *base, void *arg, short what,
+    struct evbuffer *buf, int fd, int howmuch, evbuffer_iocb cb, void *cbarg)
+{
+	struct uringop *uop = arg;
+	struct evbuffer_chain *chain;
+	struct uring_io *io;
+	size_t len = 0;
+	int i;
+
+	/* one read and one write at a time; each changes the buffer */
+	if ((buf->io_pending & what) ||
+	    (buf->io_pending && buf->io_base != base)) {
+		errno = EBUSY;
+		return (-1);
+	}
+	if ((io = uring_io_new(base, uop)) == NULL)
+		return (-1);
+	TAILQ_INSERT_TAIL(&uop->ios, io, next);
+
+	io->buf = buf;
+	io->cb = cb;
+	io->cbarg = cbarg;
+	io->fd = fd;
+	io->what = what;
+	if (what == EV_READ) {
+		len = howmuch < 0 ? EVBUFFER_CHAIN_MAX_AUTO :
+		    howmuch > URING_IO_READ_MAX ? URING_IO_READ_MAX : howmuch;
+		if ((chain = evbuffer_chain_reserve(len)) == NULL)
+			goto err;
+		io->chains[io->nchains++] = chain;
+		/* without a limit, fill what the segment has room for */
+		io->len = howmuch < 0 ? chain->buffer_len : len;
+	} else {
+		/* a segment in a file ends the write; it needs sendfile */
+		for (chain = buf->first;
+		     chain != NULL && io->nchains < URING_IO_IOVEC &&
+		     !(chain->flags & EVBUFFER_CHAIN_SENDFILE);
+		     chain = chain->next) {
+			if (chain->off == 0)
+				continue;
+			i = io->nchains++;
+			io->chains[i] = chain;
+			io->iov[i].iov_base = EVBUFFER_CHAIN_DATA(chain);
+			io->iov[i].iov_len = chain->off;
+			len += chain->off;
+		}
+		if (io->nchains == 0) {
+			errno = EOPNOTSUPP;
+			goto err;
+		}
+		for (i = 0; i < io->nchains; ++i)
+			evbuffer_chain_pin(io->chains[i]);
+		memset(&io->msg, 0, sizeof(io->msg));
+		io->msg.msg_iov = io->iov;
+		io->msg.msg_iovlen = io->nchains;
+#ifdef URING_HAVE_SENDMSG_ZC
+		io->zerocopy = !uop->nozerocopy && len >= URING_ZEROCOPY_MIN;
+#endif
+	}
+
+	if (uring_io_submit(uop, io, 0) == -1)
+		goto err;
+
+	buf->io_base = base;
+	buf->io_pending |= what;
+	/* a request in flight keeps the loop running like a pending event */
+	base->event_count++;
+	return (0);
+
+ err:
+	uring_io_done(uop, io);
+	return (-1);
+}
+
+static void
+uring_buffer_cancel(struct event_base *base, void *arg, struct evbuffer *buf,
+    int detach)
+{
+	struct uringop *uop = arg;
+	struct uring_io *io, *next;
+
+	for (io = TAILQ_FIRST(&uop->ios); io != NULL; io = next) {
+		next = TAILQ_NEXT(io, next);
+		if (io->buf != buf)
+			continue;
+		if (io->submitted)
+			uring_io_cancel(uop, io);
+		if (!detach)
+			continue;
+
+		/* the callback must not run for a buffer that is gone */
+		io->buf = NULL;
+		if (io->active) {
+			event_del(&io->ev);
+			io->active = 0;
+		}
+		uring_io_done(uop, io);
+	}
+	if (detach)
+		buf->io_pending = 0;
+}
+
+/*
+ * The kernel may still read into or send from the segments of requests
+ * in flight, so cancel them and wait for their completions before the
+ * ring goes away.  Requests that do not finish in time are leaked rather
+ * than freed under the kernel.  A forked child shares the ring with its
+ * parent, and the requests in flight are the parent's: it only forgets
+ * its copies of them.
+ */
+static void
+uring_io_shutdown(struct uringop *uop, int forked)
+{
+	struct io_uring_getevents_arg earg;
+	struct __kernel_timespec ts;
+	struct io_uring_cqe *cqe;
+	struct uring_io *io, *next;
+	unsigned head, tail;
+	int tries;
+
+	for (io = TAILQ_FIRST(&uop->ios); io != NULL; io = next) {
+		next = TAILQ_NEXT(io, next);
+		if (io->buf != NULL) {
+			io->buf->io_pending = 0;
+			io->buf = NULL;
+		}
+		if (io->active) {
+			event_del(&io->ev);
+			io->active = 0;
+		}
+		if (forked) {
+			io->submitted = 0;
+			io->notifs = 0;
+		} else if (io->submitted)
+			uring_io_cancel(uop, io);
+		uring_io_done(uop, io);
+	}
+	if (forked)
+		return;
+
+	memset(&earg, 0, sizeof(earg));
+	ts.tv_sec = 0;
+	ts.tv_nsec = 100 * 1000 * 1000;
+	earg.ts = (__u64)(uintptr_t)&ts;
+	for (tries = 0; !TAILQ_EMPTY(&uop->ios); ++tries) {
+		if (tries == URING_IO_SHUTDOWN_TRIES) {
+			event_warnx("%s: leaking requests that did not finish",
+			    __func__);
+			return;
+		}
+		if (sys_io_uring_enter(uop->ring_fd, uring_pending(uop), 1,
+			IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG,
+			&earg, sizeof(earg)) == -1 &&
+		    errno != ETIME && errno != EINTR) {
+			event_warn("%s: io_uring_enter", __func__);
+			return;
+		}
+
+		head = *uop->cq_head;
+		tail = __atomic_load_n(uop->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			cqe = &uop->cqes[head & *uop->cq_mask];
+			if (cqe->user_data != URING_IGNORE &&
+			    (cqe->user_data & URING_IO_TAG))
+				uring_io_complete(uop, cqe);
+		}
+		__atomic_store_n(uop->cq_head, head, __ATOMIC_RELEASE);
+	}
+}
+
+static void
+uring_complete(struct uringop *uop, struct io_uring_cqe *cqe)
+{
+	struct event *evread = NULL, *evwrite = NULL;
+	struct evuring *evu;
+	int fd, what = cqe->res;
+
+	if (cqe->user_data == URING_IGNORE)
+		return;
+	if (cqe->user_data & URING_IO_TAG) {
+		uring_io_complete(uop, cqe);
+		return;
+	}
+	fd = (int)(__u32)cqe->user_data;
+	if (fd < 0 || fd >= uop->nfds)
+		return;
+	evu = &uop->fds[fd];
+	/* a request we already removed or replaced */
+	if (!evu->armed || evu->gen != (unsigned int)(cqe->user_data >> 32))
+		return;
+
+	if (!(cqe->flags & IORING_CQE_F_MORE)) {
+		/* the request is finished; poll again at the next dispatch */
+		evu->armed = 0;
+		if (what >= 0 || what == -ECANCELED)
+			uring_queue_change(uop, fd);
+	}
+
+	if (what < 0) {
+		if (what != -ECANCELED)
+			event_debug(("%s: poll on %d failed: %s", __func__,
+				fd, strerror(-what)));
+		return;
+	}
+
+	if (what & (POLLHUP|POLLERR)) {
+		evread = evu->evread;
+		evwrite = evu->evwrite;
+	} else {
+		if (what & POLLIN)
+			evread = evu->evread;
+		if (what & POLLOUT)
+			evwrite = evu->evwrite;
+	}
+
+	if (evread != NULL)
+		event_active(evread, EV_READ, 1);
+	if (evwrite != NULL)
+		event_active(evwrite, EV_WRITE, 1);
+}
+
+static int
+uring_dispatch(struct event_base *base, void *arg, struct timeval *tv)
+{
+	struct uringop *uop = arg;
+	struct io_uring_getevents_arg earg;
+	struct __kernel_timespec ts;
+	unsigned head, tail, to_submit, min_complete = 1;
+	int res;
+
+	uring_apply_changes(uop);
+
+	memset(&earg, 0, sizeof(earg));
+	if (tv != NULL) {
+		if (!evutil_timerisset(tv))
+			min_complete = 0;
+		ts.tv_sec = tv->tv_sec;
+		ts.tv_nsec = tv->tv_usec * 1000;
+		earg.ts = (__u64)(uintptr_t)&ts;
+	}
+
+	to_submit = uring_pending(uop);
+	res = 0;
+	/* with nothing to submit and nothing to wait for, just reap */
+	if (to_submit || min_complete) {
+		EVBASE_RELEASE_LOCK(base);
+		res = sys_io_uring_enter(uop->ring_fd, to_submit, min_complete,
+		    IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG,
+		    &earg, sizeof(earg));
+		EVBASE_ACQUIRE_LOCK(base);
+	}
+
+	if (res == -1) {
+		switch (errno) {
+		case EINTR:
+			evsignal_process(base);
+			break;
+		case ETIME:
+		case EAGAIN:
+		case EBUSY:
+			break;
+		default:
+			event_warn("io_uring_enter");
+			return (-1);
+		}
+	} else if (base->sig.evsignal_caught) {
+		evsignal_process(base);
+	}
+
+	head = *uop->cq_head;
+	tail = __atomic_load_n(uop->cq_tail, __ATOMIC_ACQUIRE);
+	event_debug(("%s: io_uring_enter reports %u", __func__, tail - head));
+
+	for (; head != tail; head++)
+		uring_complete(uop, &uop->cqes[head & *uop->cq_mask]);
+	__atomic_store_n(uop->cq_head, head, __ATOMIC_RELEASE);
+
+	return (0);
+}
+
+static int
+uring_add(void *arg, struct event *ev)
+{
+	struct uringop *uop = arg;
+	struct evuring *evu;
+	int fd;
+
+	if (ev->ev_events & EV_SIGNAL)
+		return (evsignal_add(ev));
+
+	fd = ev->ev_fd;
+	if (fd >= uop->nfds) {
+		/* Extent the file descriptor array as necessary */
+		if (uring_recalc(ev->ev_base, uop, fd) == -1)
+			return (-1);
+	}
+	if (uring_queue_change(uop, fd) == -1)
+		return (-1);
+
+	evu = &uop->fds[fd];
+	if (ev->ev_events & EV_READ)
+		evu->evread = ev;
+	if (ev->ev_events & EV_WRITE)
+		evu->evwrite = ev;
+
+	return (0);
+}
+
+static int
+uring_del(void *arg, struct event *ev)
+{
+	struct uringop *uop = arg;
+	struct evuring *evu;
+	int fd;
+
+	if (ev->ev_events & EV_SIGNAL)
+		return (evsignal_del(ev));
+
+	fd = ev->ev_fd;
+	if (fd >= uop->nfds)
+		return (0);
+	if (uring_queue_change(uop, fd) == -1)
+		return (-1);
+
+	evu = &uop->fds[fd];
+	if (ev->ev_events & EV_READ)
+		evu->evread = NULL;
+	if (ev->ev_events & EV_WRITE)
+		evu->evwrite = NULL;
+	if (evu->evread == NULL && evu->evwrite == NULL) {
+		evu->changed |= URING_CHANGE_DELETED;
+		/*
+		 * A poll request holds a reference to the file, so the fd
+		 * would survive a close() until the next dispatch, which
+		 * may never come.  Drop it now; callers close and rebind
+		 * sockets right after a del.
+		 */
+		if (evu->armed && uring_queue_poll(uop, IORING_OP_POLL_REMOVE,
+			-1, 0, URING_UDATA(fd, evu->gen), 0, URING_IGNORE) == 0) {
+			evu->armed = 0;
+			if (sys_io_uring_enter(uop->ring_fd, uring_pending(uop),
+				0, 0, NULL, 0) == -1)
+				event_warn("%s: io_uring_enter", __func__);
+		}
+	}
+
+	return (0);
+}
+
+static void
+uring_dealloc(struct event_base *base, void *arg)
+{
+	struct uringop *uop = arg;
+
+	evsignal_dealloc(base);
+	uring_io_shutdown(uop, uop->pid != getpid());
+	uring_free(uop);
+}